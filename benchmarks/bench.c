@@ -0,0 +1,343 @@
+/* bench.c helpers shared by the usbredir benchmarks
+
+   Copyright 2026 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include "bench.h"
+
+struct bench_options bench_opts = {
+    .time = 1.0,
+};
+
+static FILE *bench_out;
+static int bench_first_result = 1;
+static int bench_first_field;
+
+#ifdef __GLIBC__
+/* Interpose the allocator, calls from the shared usbredir libraries resolve
+   to these too, since the executable comes first in the lookup order */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static uint64_t bench_allocs;
+
+void *malloc(size_t size)
+{
+    __atomic_fetch_add(&bench_allocs, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    __atomic_fetch_add(&bench_allocs, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    __atomic_fetch_add(&bench_allocs, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+
+int bench_alloc_supported(void)
+{
+    return 1;
+}
+
+uint64_t bench_alloc_count(void)
+{
+    return __atomic_load_n(&bench_allocs, __ATOMIC_RELAXED);
+}
+#else
+int bench_alloc_supported(void)
+{
+    return 0;
+}
+
+uint64_t bench_alloc_count(void)
+{
+    return 0;
+}
+#endif
+
+uint64_t bench_time_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static const struct option longopts[] = {
+    { "time", required_argument, NULL, 't' },
+    { "case", required_argument, NULL, 'c' },
+    { "output", required_argument, NULL, 'o' },
+    { "list", no_argument, NULL, 'l' },
+    { "help", no_argument, NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+};
+
+static void usage(int exit_code, char *argv0, const char *description)
+{
+    fprintf(exit_code? stderr:stdout,
+        "Usage: %s [-t|--time <secs>] [-c|--case <substr>] [-o|--output <file>]\n"
+        "       [-l|--list]\n"
+        "\n"
+        "%s\n"
+        "Results are written as JSON to stdout or to the --output file.\n",
+        argv0, description);
+    exit(exit_code);
+}
+
+static void bench_json_string(const char *s)
+{
+    fputc('"', bench_out);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            fputc('\\', bench_out);
+        }
+        fputc(*s, bench_out);
+    }
+    fputc('"', bench_out);
+}
+
+int bench_init(int argc, char *argv[], const char *suite,
+               const char *description)
+{
+    char *endptr;
+    int o;
+
+    while ((o = getopt_long(argc, argv, "t:c:o:lh", longopts, NULL)) != -1) {
+        switch (o) {
+        case 't':
+            bench_opts.time = strtod(optarg, &endptr);
+            if (*endptr != '\0' || bench_opts.time < 0) {
+                fprintf(stderr, "Invalid time: %s\n", optarg);
+                usage(1, argv[0], description);
+            }
+            break;
+        case 'c':
+            bench_opts.filter = optarg;
+            break;
+        case 'o':
+            bench_opts.output = optarg;
+            break;
+        case 'l':
+            bench_opts.list = 1;
+            break;
+        case '?':
+        case 'h':
+            usage(o == '?', argv[0], description);
+            break;
+        }
+    }
+    if (optind != argc) {
+        usage(1, argv[0], description);
+    }
+
+    if (bench_opts.list) {
+        return 0;
+    }
+
+    if (bench_opts.output) {
+        bench_out = fopen(bench_opts.output, "w");
+        if (!bench_out) {
+            fprintf(stderr, "Error opening %s: %s\n", bench_opts.output,
+                    strerror(errno));
+            return -1;
+        }
+    } else {
+        bench_out = stdout;
+    }
+
+    fprintf(bench_out, "{\n  \"suite\": ");
+    bench_json_string(suite);
+    fprintf(bench_out, ",\n  \"version\": ");
+    bench_json_string(PACKAGE_VERSION);
+    fprintf(bench_out, ",\n  \"results\": [");
+    return 0;
+}
+
+int bench_finish(void)
+{
+    int ret = 0;
+
+    if (bench_opts.list) {
+        return 0;
+    }
+
+    fprintf(bench_out, "\n  ]\n}\n");
+    if (bench_out != stdout) {
+        if (fclose(bench_out) != 0) {
+            fprintf(stderr, "Error writing %s: %s\n", bench_opts.output,
+                    strerror(errno));
+            ret = 1;
+        }
+    } else {
+        fflush(stdout);
+    }
+    return ret;
+}
+
+int bench_case_selected(const char *name)
+{
+    if (bench_opts.filter && !strstr(name, bench_opts.filter)) {
+        return 0;
+    }
+    if (bench_opts.list) {
+        printf("%s\n", name);
+        return 0;
+    }
+    /* Let the user see progress when the JSON goes to a file */
+    if (bench_opts.output) {
+        fprintf(stderr, "%s\n", name);
+    }
+    return 1;
+}
+
+void bench_result_begin(const char *name)
+{
+    fprintf(bench_out, "%s\n    {", bench_first_result ? "" : ",");
+    bench_first_result = 0;
+    bench_first_field = 1;
+    bench_result_str("name", name);
+}
+
+static void bench_result_key(const char *key)
+{
+    fprintf(bench_out, "%s", bench_first_field ? "" : ", ");
+    bench_first_field = 0;
+    bench_json_string(key);
+    fprintf(bench_out, ": ");
+}
+
+void bench_result_u64(const char *key, uint64_t value)
+{
+    bench_result_key(key);
+    fprintf(bench_out, "%" PRIu64, value);
+}
+
+void bench_result_double(const char *key, double value)
+{
+    bench_result_key(key);
+    fprintf(bench_out, "%.2f", value);
+}
+
+void bench_result_str(const char *key, const char *value)
+{
+    bench_result_key(key);
+    bench_json_string(value);
+}
+
+void bench_result_end(void)
+{
+    fprintf(bench_out, "}");
+}
+
+void bench_result_throughput(uint64_t elapsed_ns, uint64_t packets,
+                             uint64_t bytes, uint64_t allocs)
+{
+    double secs = elapsed_ns / 1e9;
+
+    bench_result_u64("elapsed_ns", elapsed_ns);
+    bench_result_u64("packets", packets);
+    bench_result_u64("bytes", bytes);
+    bench_result_double("packets_per_sec", secs ? packets / secs : 0);
+    bench_result_double("bytes_per_sec", secs ? bytes / secs : 0);
+    if (bench_alloc_supported()) {
+        bench_result_u64("allocs", allocs);
+        bench_result_double("allocs_per_packet",
+                            packets ? (double)allocs / packets : 0);
+    }
+}
+
+static int bench_cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+void bench_result_latency(uint64_t *samples_ns, size_t count)
+{
+    if (count == 0) {
+        return;
+    }
+    qsort(samples_ns, count, sizeof(*samples_ns), bench_cmp_u64);
+    bench_result_double("latency_p50_us", samples_ns[count / 2] / 1e3);
+    bench_result_double("latency_p99_us",
+                        samples_ns[(count * 99) / 100] / 1e3);
+    bench_result_double("latency_max_us", samples_ns[count - 1] / 1e3);
+}
+
+int bench_pipe_init(struct bench_pipe *pipe, size_t size)
+{
+    memset(pipe, 0, sizeof(*pipe));
+    pipe->buf = malloc(size);
+    if (!pipe->buf) {
+        return -1;
+    }
+    pipe->size = size;
+    return 0;
+}
+
+void bench_pipe_destroy(struct bench_pipe *pipe)
+{
+    free(pipe->buf);
+    pipe->buf = NULL;
+}
+
+int bench_pipe_read(struct bench_pipe *pipe, uint8_t *data, int count)
+{
+    size_t avail = pipe->wpos - pipe->rpos;
+
+    if (count > avail) {
+        count = avail;
+    }
+    memcpy(data, pipe->buf + pipe->rpos, count);
+    pipe->rpos += count;
+    if (pipe->rpos == pipe->wpos) {
+        pipe->rpos = pipe->wpos = 0;
+    }
+    return count;
+}
+
+int bench_pipe_write(struct bench_pipe *pipe, uint8_t *data, int count)
+{
+    size_t space = pipe->size - pipe->wpos;
+
+    if (count > space) {
+        count = space;
+    }
+    memcpy(pipe->buf + pipe->wpos, data, count);
+    pipe->wpos += count;
+    pipe->bytes += count;
+    return count;
+}
+
+int bench_pipe_is_empty(struct bench_pipe *pipe)
+{
+    return pipe->wpos == 0;
+}
@@ -0,0 +1,90 @@
+/* bench.h helpers shared by the usbredir benchmarks
+
+   Copyright 2026 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Every benchmark binary accepts the same options:
+   -t, --time <secs>    minimum time to run each case (default 1 s)
+   -c, --case <substr>  only run the cases whose name contains substr
+   -o, --output <file>  write the JSON results to file instead of stdout
+   -l, --list           list the cases and exit
+   Results are written as a single JSON document:
+   { "suite": ..., "version": ..., "results": [ { "name": ..., ... } ] } */
+struct bench_options {
+    double time;
+    const char *filter;
+    const char *output;
+    int list;
+};
+
+extern struct bench_options bench_opts;
+
+/* Parses the common options and starts the JSON document, returns 0 on
+   success. On --help or an invalid option this exits. */
+int bench_init(int argc, char *argv[], const char *suite,
+               const char *description);
+/* Finishes the JSON document, returns the exit code for main() */
+int bench_finish(void);
+
+/* Returns 1 if the case should be run. Also takes care of --list */
+int bench_case_selected(const char *name);
+
+uint64_t bench_time_ns(void);
+
+/* Allocation counting, this counts all malloc / calloc / realloc calls
+   made by the process, including from within libusbredirparser and
+   libusbredirhost. Only available with glibc, on other platforms
+   bench_alloc_supported() returns 0 and the count stays 0. */
+int bench_alloc_supported(void);
+uint64_t bench_alloc_count(void);
+
+/* JSON output of a single result object */
+void bench_result_begin(const char *name);
+void bench_result_u64(const char *key, uint64_t value);
+void bench_result_double(const char *key, double value);
+void bench_result_str(const char *key, const char *value);
+void bench_result_end(void);
+
+/* Adds the usual throughput fields: elapsed_ns, packets, bytes,
+   packets_per_sec, bytes_per_sec and, if supported, allocs and
+   allocs_per_packet */
+void bench_result_throughput(uint64_t elapsed_ns, uint64_t packets,
+                             uint64_t bytes, uint64_t allocs);
+
+/* Adds latency_p50_us, latency_p99_us and latency_max_us fields, this
+   sorts samples */
+void bench_result_latency(uint64_t *samples_ns, size_t count);
+
+/* One direction of an in memory transport, this behaves like a non-blocking
+   socket with a size bytes buffer, so that large packets get written / read
+   in multiple steps */
+struct bench_pipe {
+    uint8_t *buf;
+    size_t size, rpos, wpos;
+    uint64_t bytes;             /* Total bytes written */
+};
+
+int bench_pipe_init(struct bench_pipe *pipe, size_t size);
+void bench_pipe_destroy(struct bench_pipe *pipe);
+/* These return the number of bytes read / written, 0 if the pipe is
+   empty / full */
+int bench_pipe_read(struct bench_pipe *pipe, uint8_t *data, int count);
+int bench_pipe_write(struct bench_pipe *pipe, uint8_t *data, int count);
+int bench_pipe_is_empty(struct bench_pipe *pipe);
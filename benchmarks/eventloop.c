@@ -0,0 +1,704 @@
+/* eventloop.c usbredirhost driven by threads vs a single epoll loop
+
+   Copyright 2026 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#define _GNU_SOURCE
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include "usbredirhost.h"
+#include "fakeusb.h"
+#include "usbredirepoll.h"
+#ifdef HAVE_LIBURING
+#include "usbrediruring.h"
+#endif
+#include "bench.h"
+
+/* Runs the host side in the designs of usbredirect: the default one with
+   a libusb event thread, a thread reading from the connection and
+   usbredirhost with locks, and the --epoll one, where a single thread runs
+   usbredirect's loop from tools/usbredirepoll.c, which handles the
+   connection and libusb's fds from one epoll set and writes everything
+   queued once per loop iteration. When built with liburing the --io-uring
+   loop from tools/usbrediruring.c runs too. The usb-guest keeps GET_STATUS
+   control transfers and bulk IN transfers in flight on a
+   simulated (fakeusb) device with the default 125 us latency, like
+   usbredirtestclient --load control:N --load bulk:0x81:N:SIZE does.
+   GET_STATUS is used since GET_DESCRIPTOR gets answered from usbredirhost's
+   descriptor cache without reaching the device. */
+
+#define ID_SLOTS 64                 /* Power of 2, larger than the inflight */
+#define MAX_LATENCY_SAMPLES (256 * 1024)
+#define SETUP_TIMEOUT_NS 1000000000ull
+
+enum loop_type {
+    loop_threaded,
+    loop_epoll,
+    loop_uring,
+};
+
+struct bench_case {
+    const char *name;
+    enum loop_type loop;
+    int control_inflight;
+    int bulk_inflight;
+    int bulk_size;
+};
+
+static const struct bench_case cases[] = {
+    { "threaded-control-bulk-in", loop_threaded, 2, 4, 4096 },
+    { "epoll-control-bulk-in", loop_epoll, 2, 4, 4096 },
+    { "threaded-bulk-in", loop_threaded, 0, 4, 4096 },
+    { "epoll-bulk-in", loop_epoll, 0, 4, 4096 },
+#ifdef HAVE_LIBURING
+    { "uring-control-bulk-in", loop_uring, 2, 4, 4096 },
+    { "uring-bulk-in", loop_uring, 0, 4, 4096 },
+#endif
+};
+
+static const char *loop_names[] = { "threaded", "epoll", "io_uring" };
+
+struct host {
+    const struct bench_case *c;
+    libusb_context *ctx;
+    libusb_device *dev;
+    struct usbredirhost *usbredirhost;
+    int fd;
+    struct usbredirepoll *loop;
+#ifdef HAVE_LIBURING
+    struct usbrediruring *uring;
+#endif
+    int run;
+    int failed;
+    pthread_t event_thread, reader_thread;
+    int event_started, reader_started;
+    /* Summed over the host threads, between measure start and stop */
+    int measure;
+    uint64_t cpu_ns, vol_ctxsw, invol_ctxsw;
+};
+
+/* Per host thread rusage at the start of the measurement */
+struct thread_sample {
+    int measuring;
+    struct rusage start;
+};
+
+struct guest {
+    const struct bench_case *c;
+    struct usbredirparser *parser;
+    int fd;
+    int connected;
+    int errors;
+    int running;
+    uint64_t next_id;
+    uint64_t submit_time[ID_SLOTS];
+    uint64_t transfers, bytes;
+    uint64_t *latencies;
+    size_t latency_count;
+};
+
+static void bench_log(void *priv, int level, const char *msg)
+{
+    if (level <= usbredirparser_warning) {
+        fprintf(stderr, "%s\n", msg);
+    }
+}
+
+static uint64_t timeval_ns(const struct timeval *tv)
+{
+    return (uint64_t)tv->tv_sec * 1000000000 + tv->tv_usec * 1000;
+}
+
+/* Takes the calling thread's rusage when the measurement starts, and adds
+   the difference to the host's totals when it stops */
+static void thread_sample_update(struct host *h, struct thread_sample *s)
+{
+    int measure = __atomic_load_n(&h->measure, __ATOMIC_ACQUIRE);
+    struct rusage ru;
+
+    if (measure == s->measuring) {
+        return;
+    }
+    getrusage(RUSAGE_THREAD, &ru);
+    if (measure) {
+        s->start = ru;
+    } else {
+        __atomic_add_fetch(&h->cpu_ns,
+            timeval_ns(&ru.ru_utime) - timeval_ns(&s->start.ru_utime) +
+            timeval_ns(&ru.ru_stime) - timeval_ns(&s->start.ru_stime),
+            __ATOMIC_RELAXED);
+        __atomic_add_fetch(&h->vol_ctxsw, ru.ru_nvcsw - s->start.ru_nvcsw,
+                           __ATOMIC_RELAXED);
+        __atomic_add_fetch(&h->invol_ctxsw, ru.ru_nivcsw - s->start.ru_nivcsw,
+                           __ATOMIC_RELAXED);
+    }
+    s->measuring = measure;
+}
+
+/**************************************************************************/
+/* usb-host                                                                */
+/**************************************************************************/
+
+static int host_read(void *priv, uint8_t *data, int count)
+{
+    struct host *h = priv;
+    ssize_t r;
+
+#ifdef HAVE_LIBURING
+    if (h->uring) {
+        return usbrediruring_read(h->uring, data, count);
+    }
+#endif
+    r = recv(h->fd, data, count, MSG_DONTWAIT);
+
+    if (r < 0) {
+        return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    }
+    return r ? r : -1;
+}
+
+static int host_write(void *priv, uint8_t *data, int count)
+{
+    struct host *h = priv;
+    ssize_t r;
+
+#ifdef HAVE_LIBURING
+    if (h->uring) {
+        return usbrediruring_write(h->uring, data, count);
+    }
+#endif
+    r = send(h->fd, data, count, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+    if (r < 0) {
+        return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    }
+    return r;
+}
+
+static void host_flush(void *priv)
+{
+    struct host *h = priv;
+
+    /* usbredirhost_open_full() already flushes its hello */
+    if (h->usbredirhost) {
+        usbredirhost_write_guest_data(h->usbredirhost);
+    }
+}
+
+static void *host_alloc_lock(void)
+{
+    pthread_mutex_t *mutex = malloc(sizeof(*mutex));
+
+    if (mutex) {
+        pthread_mutex_init(mutex, NULL);
+    }
+    return mutex;
+}
+
+static void host_lock(void *user_data)
+{
+    pthread_mutex_lock(user_data);
+}
+
+static void host_unlock(void *user_data)
+{
+    pthread_mutex_unlock(user_data);
+}
+
+static void host_free_lock(void *user_data)
+{
+    pthread_mutex_destroy(user_data);
+    free(user_data);
+}
+
+/* Like thread_handle_libusb_events() in usbredirect */
+static void *event_thread(void *arg)
+{
+    struct host *h = arg;
+    struct thread_sample sample = { 0, };
+
+    while (__atomic_load_n(&h->run, __ATOMIC_ACQUIRE)) {
+        struct timeval tv = { 0, 10000 };
+
+        thread_sample_update(h, &sample);
+        libusb_handle_events_timeout(h->ctx, &tv);
+    }
+    return NULL;
+}
+
+/* Like the GLib main loop of usbredirect, which also waits for the
+   connection to become writable while data is queued */
+static void *reader_thread(void *arg)
+{
+    struct host *h = arg;
+    struct thread_sample sample = { 0, };
+
+    while (__atomic_load_n(&h->run, __ATOMIC_ACQUIRE)) {
+        struct pollfd pfd = { .fd = h->fd, .events = POLLIN };
+
+        thread_sample_update(h, &sample);
+        if (usbredirhost_has_data_to_write(h->usbredirhost)) {
+            pfd.events |= POLLOUT;
+        }
+        if (poll(&pfd, 1, 10) <= 0) {
+            continue;
+        }
+        if ((pfd.revents & (POLLIN | POLLHUP | POLLERR)) &&
+                usbredirhost_read_guest_data(h->usbredirhost) < 0) {
+            break;
+        }
+        if (pfd.revents & POLLOUT) {
+            usbredirhost_write_guest_data(h->usbredirhost);
+        }
+    }
+    return NULL;
+}
+
+/* The loop of usbredirect --epoll */
+static void *epoll_thread(void *arg)
+{
+    struct host *h = arg;
+    struct thread_sample sample = { 0, };
+
+    while (__atomic_load_n(&h->run, __ATOMIC_ACQUIRE)) {
+        thread_sample_update(h, &sample);
+        if (usbredirepoll_iterate(h->loop, 10) != 0) {
+            h->failed = 1;
+            break;
+        }
+    }
+    return NULL;
+}
+
+#ifdef HAVE_LIBURING
+/* The loop of usbredirect --io-uring */
+static void *uring_thread(void *arg)
+{
+    struct host *h = arg;
+    struct thread_sample sample = { 0, };
+
+    while (__atomic_load_n(&h->run, __ATOMIC_ACQUIRE)) {
+        thread_sample_update(h, &sample);
+        if (usbrediruring_iterate(h->uring, 10) != 0) {
+            h->failed = 1;
+            break;
+        }
+    }
+    return NULL;
+}
+#endif
+
+/* Returns 1 when the case can not run here, for lack of io_uring */
+static int host_start(struct host *h, int fd)
+{
+    struct fakeusb_device_config config;
+    libusb_device_handle *handle;
+    void *(*loop_thread)(void *) = event_thread;
+    int single = h->c->loop != loop_threaded;
+
+    h->fd = fd;
+    if (libusb_init(&h->ctx) != 0) {
+        fprintf(stderr, "Error initializing fakeusb\n");
+        return -1;
+    }
+
+    fakeusb_device_config_init(&config);
+    h->dev = fakeusb_device_new(h->ctx, &config);
+    if (!h->dev || libusb_open(h->dev, &handle) != 0) {
+        fprintf(stderr, "Error creating the fakeusb device\n");
+        return -1;
+    }
+
+    /* In the epoll and io_uring loops everything happens in one thread, so
+       like usbredirect --epoll there are no locks and no flush callback */
+    h->usbredirhost = usbredirhost_open_full(h->ctx, handle, bench_log,
+        host_read, host_write, single ? NULL : host_flush,
+        single ? NULL : host_alloc_lock, single ? NULL : host_lock,
+        single ? NULL : host_unlock, single ? NULL : host_free_lock,
+        h, "usbredir-bench " PACKAGE_VERSION, usbredirparser_warning, 0);
+    if (!h->usbredirhost) {
+        fprintf(stderr, "Error creating usbredirhost\n");
+        return -1;
+    }
+    if (h->c->loop == loop_epoll) {
+        if (usbredirepoll_create(h->ctx, h->usbredirhost, fd, fd,
+                                 &h->loop) != 0) {
+            fprintf(stderr, "Error setting up the epoll loop\n");
+            return -1;
+        }
+        loop_thread = epoll_thread;
+    }
+#ifdef HAVE_LIBURING
+    if (h->c->loop == loop_uring) {
+        int r = usbrediruring_create(h->ctx, h->usbredirhost, fd, &h->uring);
+
+        if (r != 0) {
+            fprintf(stderr, "Skipping %s: io_uring not available: %s\n",
+                    h->c->name, strerror(-r));
+            return 1;
+        }
+        loop_thread = uring_thread;
+    }
+#endif
+
+    h->run = 1;
+    h->event_started =
+        pthread_create(&h->event_thread, NULL, loop_thread, h) == 0;
+    if (!single) {
+        h->reader_started =
+            pthread_create(&h->reader_thread, NULL, reader_thread, h) == 0;
+    }
+    if (!h->event_started || (!single && !h->reader_started)) {
+        fprintf(stderr, "Error starting the usb-host threads\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void host_stop(struct host *h)
+{
+    __atomic_store_n(&h->run, 0, __ATOMIC_RELEASE);
+    if (h->reader_started) {
+        pthread_join(h->reader_thread, NULL);
+    }
+    if (h->event_started) {
+        libusb_interrupt_event_handler(h->ctx);
+        pthread_join(h->event_thread, NULL);
+    }
+    usbredirepoll_destroy(h->loop);
+#ifdef HAVE_LIBURING
+    usbrediruring_destroy(h->uring);
+    h->uring = NULL;
+#endif
+    if (h->usbredirhost) {
+        usbredirhost_close(h->usbredirhost);
+    }
+    if (h->dev) {
+        libusb_unref_device(h->dev);
+    }
+    if (h->ctx) {
+        libusb_exit(h->ctx);
+    }
+}
+
+/**************************************************************************/
+/* usb-guest                                                               */
+/**************************************************************************/
+
+static int guest_read(void *priv, uint8_t *data, int count)
+{
+    struct guest *g = priv;
+    ssize_t r = recv(g->fd, data, count, MSG_DONTWAIT);
+
+    if (r < 0) {
+        return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    }
+    return r ? r : -1;
+}
+
+static int guest_write(void *priv, uint8_t *data, int count)
+{
+    struct guest *g = priv;
+    ssize_t r = send(g->fd, data, count, MSG_NOSIGNAL);
+
+    if (r < 0) {
+        return errno == EINTR ? 0 : -1;
+    }
+    return r;
+}
+
+static void guest_submit_control(struct guest *g)
+{
+    struct usb_redir_control_packet_header control_header = {
+        .endpoint = 0x80,
+        .request = LIBUSB_REQUEST_GET_STATUS,
+        .requesttype = LIBUSB_ENDPOINT_IN,
+        .length = 2,
+    };
+    uint64_t id = g->next_id++;
+
+    g->submit_time[id & (ID_SLOTS - 1)] = bench_time_ns();
+    usbredirparser_send_control_packet(g->parser, id, &control_header,
+                                       NULL, 0);
+}
+
+static void guest_submit_bulk(struct guest *g)
+{
+    struct usb_redir_bulk_packet_header bulk_header = {
+        .endpoint = 0x81,
+        .length = g->c->bulk_size & 0xffff,
+        .length_high = g->c->bulk_size >> 16,
+    };
+    uint64_t id = g->next_id++;
+
+    g->submit_time[id & (ID_SLOTS - 1)] = bench_time_ns();
+    usbredirparser_send_bulk_packet(g->parser, id, &bulk_header, NULL, 0);
+}
+
+static void guest_complete(struct guest *g, uint64_t id, int status,
+                           int data_len)
+{
+    if (status != usb_redir_success) {
+        g->errors++;
+    }
+    if (g->running) {
+        g->transfers++;
+        g->bytes += data_len;
+        if (g->latency_count < MAX_LATENCY_SAMPLES) {
+            g->latencies[g->latency_count++] =
+                bench_time_ns() - g->submit_time[id & (ID_SLOTS - 1)];
+        }
+    }
+}
+
+static void guest_device_connect(void *priv,
+    struct usb_redir_device_connect_header *device_connect)
+{
+    struct guest *g = priv;
+
+    g->connected = 1;
+}
+
+static void guest_device_disconnect(void *priv)
+{
+    struct guest *g = priv;
+
+    g->errors++;
+}
+
+static void guest_interface_info(void *priv,
+    struct usb_redir_interface_info_header *interface_info)
+{
+}
+
+static void guest_ep_info(void *priv, struct usb_redir_ep_info_header *ep_info)
+{
+}
+
+static void guest_filter_reject(void *priv)
+{
+}
+
+static void guest_filter_filter(void *priv,
+    struct usbredirfilter_rule *rules, int rules_count)
+{
+    free(rules);
+}
+
+static void guest_control_packet(void *priv, uint64_t id,
+    struct usb_redir_control_packet_header *control_header,
+    uint8_t *data, int data_len)
+{
+    struct guest *g = priv;
+
+    usbredirparser_free_packet_data(g->parser, data);
+    guest_complete(g, id, control_header->status, data_len);
+    guest_submit_control(g);
+}
+
+static void guest_bulk_packet(void *priv, uint64_t id,
+    struct usb_redir_bulk_packet_header *bulk_header,
+    uint8_t *data, int data_len)
+{
+    struct guest *g = priv;
+
+    usbredirparser_free_packet_data(g->parser, data);
+    guest_complete(g, id, bulk_header->status, data_len);
+    guest_submit_bulk(g);
+}
+
+static struct usbredirparser *create_guest(struct guest *g)
+{
+    struct usbredirparser *parser = usbredirparser_create();
+    uint32_t caps[USB_REDIR_CAPS_SIZE] = { 0, };
+
+    if (!parser) {
+        return NULL;
+    }
+
+    parser->priv = g;
+    parser->log_func = bench_log;
+    parser->read_func = guest_read;
+    parser->write_func = guest_write;
+    parser->device_connect_func = guest_device_connect;
+    parser->device_disconnect_func = guest_device_disconnect;
+    parser->interface_info_func = guest_interface_info;
+    parser->ep_info_func = guest_ep_info;
+    parser->filter_reject_func = guest_filter_reject;
+    parser->filter_filter_func = guest_filter_filter;
+    parser->control_packet_func = guest_control_packet;
+    parser->bulk_packet_func = guest_bulk_packet;
+
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_connect_device_version);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_filter);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_device_disconnect_ack);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_ep_info_max_packet_size);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_64bits_ids);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_32bits_bulk_length);
+
+    usbredirparser_init(parser, "usbredir-bench " PACKAGE_VERSION, caps,
+                        USB_REDIR_CAPS_SIZE, 0);
+    return parser;
+}
+
+/* Handles the guest side once, waiting for data when there is none */
+static int guest_iterate(struct guest *g)
+{
+    struct pollfd pfd = { .fd = g->fd, .events = POLLIN };
+
+    if (usbredirparser_has_data_to_write(g->parser) &&
+            usbredirparser_do_write(g->parser) < 0) {
+        fprintf(stderr, "Error writing guest data\n");
+        return -1;
+    }
+    if (poll(&pfd, 1, 10) > 0 && usbredirparser_do_read(g->parser) < 0) {
+        fprintf(stderr, "Error reading host data\n");
+        return -1;
+    }
+    return g->errors ? -1 : 0;
+}
+
+static int run_case(const struct bench_case *c)
+{
+    struct host host = { .c = c };
+    struct guest guest = { .c = c };
+    uint64_t start, elapsed, allocs, min_ns = bench_opts.time * 1e9;
+    int fds[2] = { -1, -1 }, i, r, ret = -1;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        fprintf(stderr, "Error creating socketpair: %s\n", strerror(errno));
+        return -1;
+    }
+
+    guest.fd = fds[1];
+    guest.latencies = malloc(MAX_LATENCY_SAMPLES * sizeof(uint64_t));
+    guest.parser = create_guest(&guest);
+    if (!guest.latencies || !guest.parser) {
+        fprintf(stderr, "Out of memory\n");
+        goto leave;
+    }
+    r = host_start(&host, fds[0]);
+    if (r != 0) {
+        ret = r > 0 ? 0 : -1;
+        goto leave;
+    }
+
+    start = bench_time_ns();
+    while (!guest.connected) {
+        if (guest_iterate(&guest) != 0) {
+            goto leave;
+        }
+        if (bench_time_ns() - start > SETUP_TIMEOUT_NS) {
+            fprintf(stderr, "Error waiting for the device connect\n");
+            goto leave;
+        }
+    }
+    for (i = 0; i < c->control_inflight; i++) {
+        guest_submit_control(&guest);
+    }
+    for (i = 0; i < c->bulk_inflight; i++) {
+        guest_submit_bulk(&guest);
+    }
+
+    start = bench_time_ns();
+    while (bench_time_ns() - start < min_ns / 10) {
+        if (guest_iterate(&guest) != 0) {
+            goto leave;
+        }
+    }
+
+    __atomic_store_n(&host.measure, 1, __ATOMIC_RELEASE);
+    guest.running = 1;
+    allocs = bench_alloc_count();
+    start = bench_time_ns();
+    do {
+        if (guest_iterate(&guest) != 0 || host.failed) {
+            fprintf(stderr, "%s: transfers failed\n", c->name);
+            goto leave;
+        }
+        elapsed = bench_time_ns() - start;
+    } while (elapsed < min_ns);
+    guest.running = 0;
+    allocs = bench_alloc_count() - allocs;
+    __atomic_store_n(&host.measure, 0, __ATOMIC_RELEASE);
+    /* Let the host threads take their rusage sample */
+    libusb_interrupt_event_handler(host.ctx);
+    usleep(20000);
+
+    bench_result_begin(c->name);
+    bench_result_str("loop", loop_names[c->loop]);
+    bench_result_u64("control_inflight", c->control_inflight);
+    bench_result_u64("bulk_inflight", c->bulk_inflight);
+    bench_result_u64("bulk_size", c->bulk_size);
+    bench_result_throughput(elapsed, guest.transfers, guest.bytes, allocs);
+    bench_result_latency(guest.latencies, guest.latency_count);
+    /* Of the usb-host threads only, the usb-guest runs in the main thread */
+    bench_result_double("host_cpu_us_per_transfer", guest.transfers ?
+                        host.cpu_ns / 1e3 / guest.transfers : 0);
+    bench_result_u64("host_vol_ctxsw", host.vol_ctxsw);
+    bench_result_u64("host_invol_ctxsw", host.invol_ctxsw);
+    bench_result_end();
+    ret = 0;
+leave:
+    /* Unblock a host write, the host threads see EOF */
+    shutdown(fds[1], SHUT_RDWR);
+    host_stop(&host);
+    if (guest.parser) {
+        usbredirparser_destroy(guest.parser);
+    }
+    close(fds[0]);
+    close(fds[1]);
+    free(guest.latencies);
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    int i, ret = 0;
+
+    if (bench_init(argc, argv, "eventloop",
+            "Compares running usbredirhost with a libusb event thread, a\n"
+            "reader thread and locks, as usbredirect does by default, with a\n"
+            "single thread handling the connection and libusb's fds from one\n"
+            "epoll set, as usbredirect --epoll does, and with --io-uring's\n"
+            "loop when built with liburing. The usb-guest keeps\n"
+            "GET_STATUS control transfers and 4k bulk IN transfers in flight\n"
+            "on a simulated (fakeusb) device with 125 us latency. Next to the\n"
+            "usb-guest side latency this reports the CPU time and the context\n"
+            "switches of the usb-host threads.") != 0) {
+        return 1;
+    }
+
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        if (!bench_case_selected(cases[i].name)) {
+            continue;
+        }
+        if (run_case(&cases[i]) != 0) {
+            fprintf(stderr, "Error running %s\n", cases[i].name);
+            ret = 1;
+        }
+    }
+
+    return bench_finish() || ret;
+}
@@ -0,0 +1,277 @@
+/* filter.c usbredirfilter check benchmark
+
+   Copyright 2026 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "usbredirfilter.h"
+#include "bench.h"
+
+#define DEVICE_COUNT 64
+#define MAX_INTERFACES 4
+
+enum {
+    CASE_CHECK,
+    CASE_CHECK_COMPILED,
+    CASE_STRING_TO_RULES,
+    CASE_RULES_TO_STRING,
+};
+
+struct bench_case {
+    const char *name;
+    int type;
+    int rules_count;
+};
+
+static const struct bench_case cases[] = {
+    { "check-10", CASE_CHECK, 10 },
+    { "check-compiled-10", CASE_CHECK_COMPILED, 10 },
+    { "check-1000", CASE_CHECK, 1000 },
+    { "check-compiled-1000", CASE_CHECK_COMPILED, 1000 },
+    { "check-10000", CASE_CHECK, 10000 },
+    { "check-compiled-10000", CASE_CHECK_COMPILED, 10000 },
+    { "string-to-rules-10", CASE_STRING_TO_RULES, 10 },
+    { "string-to-rules-10000", CASE_STRING_TO_RULES, 10000 },
+    { "rules-to-string-10", CASE_RULES_TO_STRING, 10 },
+    { "rules-to-string-10000", CASE_RULES_TO_STRING, 10000 },
+};
+
+struct device {
+    uint8_t device_class;
+    uint16_t vendor_id;
+    uint16_t product_id;
+    uint16_t device_version_bcd;
+    uint8_t interface_class[MAX_INTERFACES];
+    uint8_t interface_subclass[MAX_INTERFACES];
+    uint8_t interface_protocol[MAX_INTERFACES];
+    int interface_count;
+};
+
+/* A policy like a management tool would push: block a few classes, then
+   allow a long list of specific devices, some of them only in a specific
+   version, and block everything else */
+static struct usbredirfilter_rule *create_rules(int rules_count)
+{
+    struct usbredirfilter_rule *rules;
+    int i;
+
+    rules = calloc(rules_count, sizeof(*rules));
+    if (!rules) {
+        return NULL;
+    }
+    for (i = 0; i < rules_count - 1; i++) {
+        if (i < 3) {
+            rules[i].device_class = i == 0 ? 0x08 : (i == 1 ? 0x0e : 0xe0);
+            rules[i].vendor_id = -1;
+            rules[i].product_id = -1;
+            rules[i].allow = 0;
+        } else {
+            rules[i].device_class = (i % 7 == 0) ? 0x03 : -1;
+            rules[i].vendor_id = 0x1000 + i / 8;
+            rules[i].product_id = (i % 5 == 0) ? -1 : 0x2000 + i;
+            rules[i].allow = 1;
+        }
+        rules[i].device_version_bcd = (i % 11 == 0) ? 0x0100 : -1;
+    }
+    rules[i].device_class = -1;
+    rules[i].vendor_id = -1;
+    rules[i].product_id = -1;
+    rules[i].device_version_bcd = -1;
+    rules[i].allow = 0;
+    return rules;
+}
+
+/* The devices of a typical machine: some match a rule early, some late and
+   some only the final catch-all rule */
+static void create_devices(struct device *devices, int rules_count)
+{
+    static const uint8_t classes[] = { 0x03, 0x08, 0xff, 0x0e, 0x01, 0x02 };
+    int i, j, rule;
+
+    srand(1);
+    for (i = 0; i < DEVICE_COUNT; i++) {
+        struct device *dev = &devices[i];
+
+        rule = 3 + rand() % (rules_count > 4 ? rules_count - 4 : 1);
+        dev->device_class = (i % 4 == 0) ? 0xef : 0x00;
+        dev->vendor_id = (i % 3 == 0) ? 0x8000 + i : 0x1000 + rule / 8;
+        dev->product_id = 0x2000 + rule;
+        dev->device_version_bcd = 0x0100 + (i % 2);
+        dev->interface_count = 1 + i % MAX_INTERFACES;
+        for (j = 0; j < dev->interface_count; j++) {
+            dev->interface_class[j] = classes[(i + j) % sizeof(classes)];
+            dev->interface_subclass[j] = j % 2;
+            dev->interface_protocol[j] = 0;
+        }
+    }
+}
+
+/* Parse or format the rules as a filter_filter packet would, a packet is
+   one rule and bytes are the bytes of the filter string */
+static int run_string_case(const struct bench_case *c,
+                           struct usbredirfilter_rule *rules)
+{
+    struct usbredirfilter_rule *parsed;
+    uint64_t start, elapsed, allocs, count = 0, bytes = 0;
+    uint64_t min_ns = bench_opts.time * 1e9;
+    char *str;
+    size_t len;
+    int parsed_count;
+
+    str = usbredirfilter_rules_to_string(rules, c->rules_count, ",", "|");
+    if (!str) {
+        fprintf(stderr, "Error formatting the rules\n");
+        return -1;
+    }
+    len = strlen(str);
+
+    allocs = bench_alloc_count();
+    start = bench_time_ns();
+    do {
+        if (c->type == CASE_STRING_TO_RULES) {
+            if (usbredirfilter_string_to_rules(str, ",", "|", &parsed,
+                                               &parsed_count) != 0 ||
+                    parsed_count != c->rules_count) {
+                fprintf(stderr, "Error parsing the rules\n");
+                usbredirfilter_free(str);
+                return -1;
+            }
+            usbredirfilter_free(parsed);
+        } else {
+            char *formatted = usbredirfilter_rules_to_string(rules,
+                                  c->rules_count, ",", "|");
+            if (!formatted) {
+                fprintf(stderr, "Error formatting the rules\n");
+                usbredirfilter_free(str);
+                return -1;
+            }
+            usbredirfilter_free(formatted);
+        }
+        count += c->rules_count;
+        bytes += len;
+        elapsed = bench_time_ns() - start;
+    } while (elapsed < min_ns);
+    allocs = bench_alloc_count() - allocs;
+    usbredirfilter_free(str);
+
+    bench_result_begin(c->name);
+    bench_result_u64("rules", c->rules_count);
+    bench_result_throughput(elapsed, count, bytes, allocs);
+    bench_result_end();
+    return 0;
+}
+
+static int run_case(const struct bench_case *c)
+{
+    struct usbredirfilter_compiled *compiled = NULL;
+    struct usbredirfilter_rule *rules;
+    struct device devices[DEVICE_COUNT];
+    uint64_t start, elapsed, allocs, checks = 0, compile_ns = 0;
+    uint64_t min_ns = bench_opts.time * 1e9;
+    int i, allowed = 0, ret = -1;
+
+    rules = create_rules(c->rules_count);
+    if (!rules) {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+    if (c->type == CASE_STRING_TO_RULES || c->type == CASE_RULES_TO_STRING) {
+        ret = run_string_case(c, rules);
+        free(rules);
+        return ret;
+    }
+    create_devices(devices, c->rules_count);
+
+    if (c->type == CASE_CHECK_COMPILED) {
+        start = bench_time_ns();
+        if (usbredirfilter_compile(rules, c->rules_count, &compiled) != 0) {
+            fprintf(stderr, "Error compiling the rules\n");
+            goto leave;
+        }
+        compile_ns = bench_time_ns() - start;
+    }
+
+    allocs = bench_alloc_count();
+    start = bench_time_ns();
+    do {
+        for (i = 0; i < DEVICE_COUNT; i++) {
+            struct device *dev = &devices[i];
+            int r;
+
+            if (compiled) {
+                r = usbredirfilter_check_compiled(compiled,
+                        dev->device_class, 0, 0, dev->interface_class,
+                        dev->interface_subclass, dev->interface_protocol,
+                        dev->interface_count, dev->vendor_id,
+                        dev->product_id, dev->device_version_bcd, 0);
+            } else {
+                r = usbredirfilter_check(rules, c->rules_count,
+                        dev->device_class, 0, 0, dev->interface_class,
+                        dev->interface_subclass, dev->interface_protocol,
+                        dev->interface_count, dev->vendor_id,
+                        dev->product_id, dev->device_version_bcd, 0);
+            }
+            allowed += (r == 0);
+        }
+        checks += DEVICE_COUNT;
+        elapsed = bench_time_ns() - start;
+    } while (elapsed < min_ns);
+    allocs = bench_alloc_count() - allocs;
+
+    bench_result_begin(c->name);
+    bench_result_u64("rules", c->rules_count);
+    bench_result_throughput(elapsed, checks, 0, allocs);
+    bench_result_double("ns_per_check", (double)elapsed / checks);
+    bench_result_double("allowed_ratio", (double)allowed / checks);
+    if (compiled) {
+        bench_result_u64("compile_ns", compile_ns);
+    }
+    bench_result_end();
+    ret = 0;
+leave:
+    usbredirfilter_free_compiled(compiled);
+    free(rules);
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    int i, ret = 0;
+
+    if (bench_init(argc, argv, "filter",
+            "Measures usbredirfilter_check() and\n"
+            "usbredirfilter_check_compiled() with rule sets of different\n"
+            "sizes against a set of devices with 1 - 4 interfaces, a packet\n"
+            "is the check of one device. And parsing and formatting filter\n"
+            "strings, where a packet is one rule.") != 0) {
+        return 1;
+    }
+
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        if (!bench_case_selected(cases[i].name)) {
+            continue;
+        }
+        if (run_case(&cases[i]) != 0) {
+            fprintf(stderr, "Error running %s\n", cases[i].name);
+            ret = 1;
+        }
+    }
+
+    return bench_finish() || ret;
+}
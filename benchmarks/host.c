@@ -0,0 +1,782 @@
+/* host.c usbredirhost end-to-end benchmark on a simulated device
+
+   Copyright 2026 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "usbredirhost.h"
+#include "fakeusb.h"
+#include "bench.h"
+
+#define PIPE_SIZE (256 * 1024)
+#define MAX_LATENCY_SAMPLES (1024 * 1024)
+/* Must be a power of 2 and larger then the max number of requests in
+   flight */
+#define ID_SLOTS 1024
+#define SETUP_TIMEOUT_NS 1000000000ull
+
+enum {
+    CASE_CONTROL_IN,
+    CASE_BULK_IN,
+    CASE_BULK_OUT,
+    CASE_BULK_RECEIVING,
+    CASE_INTERRUPT_IN,
+    CASE_ISO_IN,
+    CASE_FILTER,
+    CASE_FILTER_BATCH,
+};
+
+struct bench_case {
+    const char *name;
+    int type;
+    uint32_t size;
+    /* Requests in flight, or transfers for streams */
+    int inflight;
+    /* Use the default fakeusb high speed device timing instead of a device
+       which completes everything right away */
+    int realistic;
+};
+
+static const struct bench_case cases[] = {
+    { "control-in-18", CASE_CONTROL_IN, 18, 1, 0 },
+    { "bulk-in-4k", CASE_BULK_IN, 4096, 4, 0 },
+    { "bulk-in-64k", CASE_BULK_IN, 65536, 4, 0 },
+    { "bulk-in-1m", CASE_BULK_IN, 1024 * 1024, 2, 0 },
+    { "bulk-out-4k", CASE_BULK_OUT, 4096, 4, 0 },
+    { "bulk-out-64k", CASE_BULK_OUT, 65536, 4, 0 },
+    { "bulk-out-1m", CASE_BULK_OUT, 1024 * 1024, 2, 0 },
+    { "bulk-receiving-16k", CASE_BULK_RECEIVING, 16384, 16, 0 },
+    { "interrupt-in-64", CASE_INTERRUPT_IN, 64, 0, 0 },
+    { "iso-in-1k", CASE_ISO_IN, 1024, 4, 0 },
+    /* With high speed device timing these show the latency and jitter which
+       usbredirhost adds and whether it keeps up with the device */
+    { "control-in-18-hs", CASE_CONTROL_IN, 18, 1, 1 },
+    { "bulk-in-64k-hs", CASE_BULK_IN, 65536, 4, 1 },
+    { "bulk-out-64k-hs", CASE_BULK_OUT, 65536, 4, 1 },
+    { "interrupt-in-64-hs", CASE_INTERRUPT_IN, 64, 0, 1 },
+    { "iso-in-1k-hs", CASE_ISO_IN, 1024, 4, 1 },
+    /* Checking all devices of a machine against the guest's filter, as done
+       after every hotplug event, size is the number of devices */
+    { "filter-64", CASE_FILTER, 64, 0, 0 },
+    { "filter-batch-64", CASE_FILTER_BATCH, 64, 0, 0 },
+};
+
+struct bench {
+    const struct bench_case *c;
+    libusb_context *ctx;
+    libusb_device *dev;
+    struct usbredirhost *host;
+    struct usbredirparser *guest;
+    struct bench_pipe to_host, to_guest;
+    uint8_t *payload;
+
+    /* Guest state */
+    int connected;
+    int disconnected;
+    int stream_started;
+    int running;
+    int outstanding;
+    uint64_t next_id;
+    uint64_t submit_time[ID_SLOTS];
+    int errors;
+
+    /* Results */
+    uint64_t transfers;
+    uint64_t bytes;
+    uint64_t *latencies;
+    size_t latency_count;
+};
+
+static void bench_log(void *priv, int level, const char *msg)
+{
+    if (level <= usbredirparser_warning) {
+        fprintf(stderr, "%s\n", msg);
+    }
+}
+
+static int host_read(void *priv, uint8_t *data, int count)
+{
+    struct bench *bench = priv;
+
+    return bench_pipe_read(&bench->to_host, data, count);
+}
+
+static int host_write(void *priv, uint8_t *data, int count)
+{
+    struct bench *bench = priv;
+
+    return bench_pipe_write(&bench->to_guest, data, count);
+}
+
+static int guest_read(void *priv, uint8_t *data, int count)
+{
+    struct bench *bench = priv;
+
+    return bench_pipe_read(&bench->to_guest, data, count);
+}
+
+static int guest_write(void *priv, uint8_t *data, int count)
+{
+    struct bench *bench = priv;
+
+    return bench_pipe_write(&bench->to_host, data, count);
+}
+
+/**************************************************************************/
+/* usb-guest                                                               */
+/**************************************************************************/
+
+static void guest_submit(struct bench *bench)
+{
+    const struct bench_case *c = bench->c;
+    uint64_t id = bench->next_id++;
+
+    bench->submit_time[id & (ID_SLOTS - 1)] = bench_time_ns();
+    bench->outstanding++;
+
+    switch (c->type) {
+    case CASE_CONTROL_IN: {
+        struct usb_redir_control_packet_header control_header = {
+            .endpoint = 0x80,
+            .request = LIBUSB_REQUEST_GET_DESCRIPTOR,
+            .requesttype = LIBUSB_ENDPOINT_IN,
+            .value = LIBUSB_DT_DEVICE << 8,
+            .length = c->size,
+        };
+        usbredirparser_send_control_packet(bench->guest, id, &control_header,
+                                           NULL, 0);
+        break;
+    }
+    case CASE_BULK_IN:
+    case CASE_BULK_OUT: {
+        struct usb_redir_bulk_packet_header bulk_header = {
+            .endpoint = c->type == CASE_BULK_IN ? 0x81 : 0x02,
+            .length = c->size & 0xffff,
+            .length_high = c->size >> 16,
+        };
+        usbredirparser_send_bulk_packet(bench->guest, id, &bulk_header,
+            c->type == CASE_BULK_IN ? NULL : bench->payload,
+            c->type == CASE_BULK_IN ? 0 : c->size);
+        break;
+    }
+    }
+}
+
+static void guest_start_stream(struct bench *bench)
+{
+    const struct bench_case *c = bench->c;
+
+    switch (c->type) {
+    case CASE_BULK_RECEIVING: {
+        struct usb_redir_start_bulk_receiving_header start = {
+            .endpoint = 0x81,
+            .bytes_per_transfer = c->size,
+            .no_transfers = c->inflight,
+        };
+        usbredirparser_send_start_bulk_receiving(bench->guest, 0, &start);
+        break;
+    }
+    case CASE_INTERRUPT_IN: {
+        struct usb_redir_start_interrupt_receiving_header start = {
+            .endpoint = 0x83,
+        };
+        usbredirparser_send_start_interrupt_receiving(bench->guest, 0, &start);
+        break;
+    }
+    case CASE_ISO_IN: {
+        struct usb_redir_set_alt_setting_header set_alt = {
+            .interface = 1,
+            .alt = 1,
+        };
+        struct usb_redir_start_iso_stream_header start = {
+            .endpoint = 0x84,
+            .pkts_per_urb = 32,
+            .no_urbs = c->inflight,
+        };
+        usbredirparser_send_set_alt_setting(bench->guest, 0, &set_alt);
+        usbredirparser_send_start_iso_stream(bench->guest, 0, &start);
+        break;
+    }
+    }
+}
+
+static void guest_complete(struct bench *bench, uint64_t id, int status,
+                           uint32_t len, int is_request)
+{
+    if (status != usb_redir_success) {
+        bench->errors++;
+    }
+    if (!bench->running) {
+        return;
+    }
+    bench->transfers++;
+    bench->bytes += len;
+    if (!is_request) {
+        return;
+    }
+    bench->outstanding--;
+    if (bench->latency_count < MAX_LATENCY_SAMPLES) {
+        bench->latencies[bench->latency_count++] =
+            bench_time_ns() - bench->submit_time[id & (ID_SLOTS - 1)];
+    }
+    guest_submit(bench);
+}
+
+static void guest_hello(void *priv, struct usb_redir_hello_header *hello)
+{
+}
+
+static void guest_device_connect(void *priv,
+    struct usb_redir_device_connect_header *device_connect)
+{
+    struct bench *bench = priv;
+
+    bench->connected = 1;
+}
+
+static void guest_device_disconnect(void *priv)
+{
+    struct bench *bench = priv;
+
+    /* The parser sends the device_disconnect_ack for us */
+    bench->disconnected = 1;
+}
+
+static void guest_interface_info(void *priv,
+    struct usb_redir_interface_info_header *interface_info)
+{
+}
+
+static void guest_ep_info(void *priv, struct usb_redir_ep_info_header *ep_info)
+{
+}
+
+static void guest_configuration_status(void *priv, uint64_t id,
+    struct usb_redir_configuration_status_header *config_status)
+{
+}
+
+static void guest_alt_setting_status(void *priv, uint64_t id,
+    struct usb_redir_alt_setting_status_header *alt_setting_status)
+{
+    struct bench *bench = priv;
+
+    if (alt_setting_status->status != usb_redir_success) {
+        bench->errors++;
+    }
+}
+
+static void guest_stream_status(struct bench *bench, uint8_t status)
+{
+    if (status != usb_redir_success) {
+        bench->errors++;
+    } else {
+        bench->stream_started = 1;
+    }
+}
+
+static void guest_iso_stream_status(void *priv, uint64_t id,
+    struct usb_redir_iso_stream_status_header *iso_stream_status)
+{
+    guest_stream_status(priv, iso_stream_status->status);
+}
+
+static void guest_interrupt_receiving_status(void *priv, uint64_t id,
+    struct usb_redir_interrupt_receiving_status_header *status)
+{
+    guest_stream_status(priv, status->status);
+}
+
+static void guest_bulk_receiving_status(void *priv, uint64_t id,
+    struct usb_redir_bulk_receiving_status_header *status)
+{
+    guest_stream_status(priv, status->status);
+}
+
+static void guest_bulk_streams_status(void *priv, uint64_t id,
+    struct usb_redir_bulk_streams_status_header *bulk_streams_status)
+{
+}
+
+static void guest_filter_reject(void *priv)
+{
+}
+
+static void guest_filter_filter(void *priv,
+    struct usbredirfilter_rule *rules, int rules_count)
+{
+    free(rules);
+}
+
+static void guest_control_packet(void *priv, uint64_t id,
+    struct usb_redir_control_packet_header *control_header,
+    uint8_t *data, int data_len)
+{
+    struct bench *bench = priv;
+
+    guest_complete(bench, id, control_header->status, data_len, 1);
+    usbredirparser_free_packet_data(bench->guest, data);
+}
+
+static void guest_bulk_packet(void *priv, uint64_t id,
+    struct usb_redir_bulk_packet_header *bulk_header,
+    uint8_t *data, int data_len)
+{
+    struct bench *bench = priv;
+
+    guest_complete(bench, id, bulk_header->status,
+                   (uint32_t)bulk_header->length_high << 16 |
+                   bulk_header->length, 1);
+    usbredirparser_free_packet_data(bench->guest, data);
+}
+
+static void guest_iso_packet(void *priv, uint64_t id,
+    struct usb_redir_iso_packet_header *iso_header,
+    uint8_t *data, int data_len)
+{
+    struct bench *bench = priv;
+
+    guest_complete(bench, id, iso_header->status, data_len, 0);
+    usbredirparser_free_packet_data(bench->guest, data);
+}
+
+static void guest_interrupt_packet(void *priv, uint64_t id,
+    struct usb_redir_interrupt_packet_header *interrupt_header,
+    uint8_t *data, int data_len)
+{
+    struct bench *bench = priv;
+
+    guest_complete(bench, id, interrupt_header->status, data_len, 0);
+    usbredirparser_free_packet_data(bench->guest, data);
+}
+
+static void guest_buffered_bulk_packet(void *priv, uint64_t id,
+    struct usb_redir_buffered_bulk_packet_header *buffered_bulk_header,
+    uint8_t *data, int data_len)
+{
+    struct bench *bench = priv;
+
+    guest_complete(bench, id, buffered_bulk_header->status, data_len, 0);
+    usbredirparser_free_packet_data(bench->guest, data);
+}
+
+static struct usbredirparser *create_guest(struct bench *bench)
+{
+    struct usbredirparser *parser = usbredirparser_create();
+    uint32_t caps[USB_REDIR_CAPS_SIZE] = { 0, };
+
+    if (!parser) {
+        return NULL;
+    }
+
+    parser->priv = bench;
+    parser->log_func = bench_log;
+    parser->read_func = guest_read;
+    parser->write_func = guest_write;
+    parser->hello_func = guest_hello;
+    parser->device_connect_func = guest_device_connect;
+    parser->device_disconnect_func = guest_device_disconnect;
+    parser->interface_info_func = guest_interface_info;
+    parser->ep_info_func = guest_ep_info;
+    parser->configuration_status_func = guest_configuration_status;
+    parser->alt_setting_status_func = guest_alt_setting_status;
+    parser->iso_stream_status_func = guest_iso_stream_status;
+    parser->interrupt_receiving_status_func =
+        guest_interrupt_receiving_status;
+    parser->bulk_streams_status_func = guest_bulk_streams_status;
+    parser->bulk_receiving_status_func = guest_bulk_receiving_status;
+    parser->filter_reject_func = guest_filter_reject;
+    parser->filter_filter_func = guest_filter_filter;
+    parser->control_packet_func = guest_control_packet;
+    parser->bulk_packet_func = guest_bulk_packet;
+    parser->iso_packet_func = guest_iso_packet;
+    parser->interrupt_packet_func = guest_interrupt_packet;
+    parser->buffered_bulk_packet_func = guest_buffered_bulk_packet;
+
+    /* The caps of a current usb-guest such as qemu */
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_connect_device_version);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_filter);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_device_disconnect_ack);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_ep_info_max_packet_size);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_64bits_ids);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_32bits_bulk_length);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_bulk_receiving);
+
+    usbredirparser_init(parser, "usbredir-bench " PACKAGE_VERSION, caps,
+                        USB_REDIR_CAPS_SIZE, 0);
+    return parser;
+}
+
+/**************************************************************************/
+/* Main loop                                                               */
+/**************************************************************************/
+
+/* One iteration of moving data between the guest, the host and the device,
+   when nothing moved this waits for the next device completion */
+static int bench_iterate(struct bench *bench)
+{
+    uint64_t moved = bench->to_host.bytes + bench->to_guest.bytes;
+    struct timeval tv = { 0, 0 };
+    int r;
+
+    if (usbredirparser_has_data_to_write(bench->guest)) {
+        usbredirparser_do_write(bench->guest);
+    }
+    r = usbredirhost_read_guest_data(bench->host);
+    if (r < 0) {
+        fprintf(stderr, "Error reading guest data: %d\n", r);
+        return -1;
+    }
+    if (usbredirhost_has_data_to_write(bench->host)) {
+        usbredirhost_write_guest_data(bench->host);
+    }
+    r = usbredirparser_do_read(bench->guest);
+    if (r < 0) {
+        fprintf(stderr, "Error reading host data: %d\n", r);
+        return -1;
+    }
+
+    if (moved == bench->to_host.bytes + bench->to_guest.bytes) {
+        if (libusb_get_next_timeout(bench->ctx, &tv) == 0 ||
+                tv.tv_sec || tv.tv_usec > 10000) {
+            tv.tv_sec = 0;
+            tv.tv_usec = 10000;
+        }
+    }
+    libusb_handle_events_timeout(bench->ctx, &tv);
+    return 0;
+}
+
+/* Iterate until cond is set, or the timeout expires */
+static int bench_wait_for(struct bench *bench, int *cond)
+{
+    uint64_t start = bench_time_ns();
+
+    while (!*cond) {
+        if (bench_iterate(bench) != 0) {
+            return -1;
+        }
+        if (bench_time_ns() - start > SETUP_TIMEOUT_NS) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void bench_destroy(struct bench *bench)
+{
+    if (bench->host) {
+        usbredirhost_close(bench->host);
+    }
+    if (bench->guest) {
+        usbredirparser_destroy(bench->guest);
+    }
+    if (bench->dev) {
+        libusb_unref_device(bench->dev);
+    }
+    if (bench->ctx) {
+        libusb_exit(bench->ctx);
+    }
+    bench_pipe_destroy(&bench->to_host);
+    bench_pipe_destroy(&bench->to_guest);
+    free(bench->latencies);
+}
+
+static int bench_setup(struct bench *bench, const struct bench_case *c,
+                       uint8_t *payload)
+{
+    struct fakeusb_device_config config;
+    libusb_device_handle *handle;
+    int i;
+
+    memset(bench, 0, sizeof(*bench));
+    bench->c = c;
+    bench->payload = payload;
+    bench->latencies = malloc(MAX_LATENCY_SAMPLES * sizeof(uint64_t));
+    if (!bench->latencies ||
+            bench_pipe_init(&bench->to_host, PIPE_SIZE) != 0 ||
+            bench_pipe_init(&bench->to_guest, PIPE_SIZE) != 0) {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+
+    fakeusb_device_config_init(&config);
+    if (!c->realistic) {
+        config.control_latency_us = 0;
+        for (i = 0; config.endpoints[i].address; i++) {
+            config.endpoints[i].latency_us = 0;
+            config.endpoints[i].bytes_per_ms = 0;
+            config.endpoints[i].interval_us = 0;
+        }
+    }
+    if (libusb_init(&bench->ctx) != 0) {
+        fprintf(stderr, "Error initializing fakeusb\n");
+        return -1;
+    }
+    bench->dev = fakeusb_device_new(bench->ctx, &config);
+    if (!bench->dev || libusb_open(bench->dev, &handle) != 0) {
+        fprintf(stderr, "Error creating the fakeusb device\n");
+        return -1;
+    }
+
+    bench->host = usbredirhost_open_full(bench->ctx, handle, bench_log,
+                                         host_read, host_write,
+                                         NULL, NULL, NULL, NULL, NULL,
+                                         bench, "usbredir-bench " PACKAGE_VERSION,
+                                         usbredirparser_warning, 0);
+    bench->guest = create_guest(bench);
+    if (!bench->host || !bench->guest) {
+        fprintf(stderr, "Error creating usbredirhost / guest parser\n");
+        return -1;
+    }
+
+    if (bench_wait_for(bench, &bench->connected) != 0) {
+        fprintf(stderr, "Error waiting for the device connect\n");
+        return -1;
+    }
+    return 0;
+}
+
+#define FILTER_RULES 100
+
+/* A filter blocking some classes, allowing a list of devices by vendor and
+   product, and blocking everything else */
+static void create_filter_rules(struct usbredirfilter_rule *rules)
+{
+    int i;
+
+    for (i = 0; i < FILTER_RULES - 1; i++) {
+        rules[i].device_class = i < 3 ? 0x08 + i : -1;
+        rules[i].vendor_id = i < 3 ? -1 : 0x1209;
+        rules[i].product_id = i < 3 ? -1 : 0x1000 + i;
+        rules[i].device_version_bcd = -1;
+        rules[i].allow = i >= 3;
+    }
+    rules[i].device_class = -1;
+    rules[i].vendor_id = -1;
+    rules[i].product_id = -1;
+    rules[i].device_version_bcd = -1;
+    rules[i].allow = 0;
+}
+
+static int run_filter_case(const struct bench_case *c)
+{
+    struct usbredirfilter_rule rules[FILTER_RULES];
+    struct usbredirfilter_compiled *compiled = NULL;
+    struct usbredirhost_filter_cache *cache = NULL;
+    struct fakeusb_device_config config;
+    uint8_t (*device_desc)[LIBUSB_DT_DEVICE_SIZE] = NULL;
+    uint64_t start, elapsed, allocs, checks = 0, min_ns = bench_opts.time * 1e9;
+    libusb_context *ctx = NULL;
+    libusb_device **devs = NULL;
+    int *results = NULL;
+    int i, r, allowed = 0, ret = -1;
+
+    create_filter_rules(rules);
+    devs = calloc(c->size, sizeof(*devs));
+    results = calloc(c->size, sizeof(*results));
+    device_desc = calloc(c->size, sizeof(*device_desc));
+    if (!devs || !results || !device_desc || libusb_init(&ctx) != 0) {
+        fprintf(stderr, "Error initializing fakeusb\n");
+        goto leave;
+    }
+
+    fakeusb_device_config_init(&config);
+    for (i = 0; i < c->size; i++) {
+        uint16_t product_id = 0x1000 + (i * 3) % (FILTER_RULES + 20);
+
+        memcpy(device_desc[i], config.device_desc, LIBUSB_DT_DEVICE_SIZE);
+        device_desc[i][4] = 0x00;
+        device_desc[i][10] = product_id & 0xff;
+        device_desc[i][11] = product_id >> 8;
+        config.device_desc = device_desc[i];
+        config.bus_number = 1 + i / 100;
+        config.device_address = 1 + i % 100;
+        devs[i] = fakeusb_device_new(ctx, &config);
+        if (!devs[i]) {
+            fprintf(stderr, "Error creating the fakeusb devices\n");
+            goto leave;
+        }
+    }
+
+    if (c->type == CASE_FILTER_BATCH) {
+        cache = usbredirhost_filter_cache_new();
+        if (!cache ||
+                usbredirfilter_compile(rules, FILTER_RULES, &compiled) != 0) {
+            fprintf(stderr, "Error compiling the filter\n");
+            goto leave;
+        }
+    }
+
+    allocs = bench_alloc_count();
+    start = bench_time_ns();
+    do {
+        if (c->type == CASE_FILTER_BATCH) {
+            /* Like a hotplug event for one of the devices */
+            usbredirhost_filter_cache_invalidate(cache,
+                                                 devs[checks % c->size]);
+            r = usbredirhost_check_device_filter_batch(compiled, cache, devs,
+                                                       c->size, 0, results);
+            if (r < 0) {
+                fprintf(stderr, "Error checking the devices\n");
+                goto leave;
+            }
+            allowed += r;
+        } else {
+            for (i = 0; i < c->size; i++) {
+                r = usbredirhost_check_device_filter(rules, FILTER_RULES,
+                                                     devs[i], 0);
+                allowed += (r == 0);
+            }
+        }
+        checks += c->size;
+        elapsed = bench_time_ns() - start;
+    } while (elapsed < min_ns);
+    allocs = bench_alloc_count() - allocs;
+
+    bench_result_begin(c->name);
+    bench_result_u64("devices", c->size);
+    bench_result_u64("rules", FILTER_RULES);
+    bench_result_throughput(elapsed, checks, 0, allocs);
+    bench_result_double("ns_per_check", (double)elapsed / checks);
+    bench_result_double("allowed_ratio", (double)allowed / checks);
+    bench_result_end();
+    ret = 0;
+leave:
+    usbredirhost_filter_cache_free(cache);
+    usbredirfilter_free_compiled(compiled);
+    for (i = 0; devs && i < c->size; i++) {
+        if (devs[i]) {
+            libusb_unref_device(devs[i]);
+        }
+    }
+    if (ctx) {
+        libusb_exit(ctx);
+    }
+    free(device_desc);
+    free(results);
+    free(devs);
+    return ret;
+}
+
+static int run_case(const struct bench_case *c, uint8_t *payload)
+{
+    struct bench bench;
+    uint64_t start, elapsed, allocs, min_ns = bench_opts.time * 1e9;
+    int i, ret = -1;
+
+    if (c->type == CASE_FILTER || c->type == CASE_FILTER_BATCH) {
+        return run_filter_case(c);
+    }
+
+    if (bench_setup(&bench, c, payload) != 0) {
+        goto leave;
+    }
+
+    if (c->type == CASE_CONTROL_IN || c->type == CASE_BULK_IN ||
+            c->type == CASE_BULK_OUT) {
+        bench.running = 1;
+        for (i = 0; i < c->inflight; i++) {
+            guest_submit(&bench);
+        }
+    } else {
+        guest_start_stream(&bench);
+        if (bench_wait_for(&bench, &bench.stream_started) != 0) {
+            fprintf(stderr, "Error starting the stream\n");
+            goto leave;
+        }
+        bench.running = 1;
+    }
+
+    /* Warm up */
+    start = bench_time_ns();
+    while (bench_time_ns() - start < min_ns / 10) {
+        if (bench_iterate(&bench) != 0) {
+            goto leave;
+        }
+    }
+    bench.transfers = 0;
+    bench.bytes = 0;
+    bench.latency_count = 0;
+
+    allocs = bench_alloc_count();
+    start = bench_time_ns();
+    do {
+        if (bench_iterate(&bench) != 0) {
+            goto leave;
+        }
+        elapsed = bench_time_ns() - start;
+    } while (elapsed < min_ns);
+    allocs = bench_alloc_count() - allocs;
+    bench.running = 0;
+
+    if (bench.errors || bench.disconnected) {
+        fprintf(stderr, "%s: %d transfers failed\n", c->name, bench.errors);
+        goto leave;
+    }
+
+    bench_result_begin(c->name);
+    bench_result_u64("size", c->size);
+    bench_result_str("timing", c->realistic ? "high-speed" : "none");
+    bench_result_throughput(elapsed, bench.transfers, bench.bytes, allocs);
+    bench_result_latency(bench.latencies, bench.latency_count);
+    bench_result_end();
+    ret = 0;
+leave:
+    bench_destroy(&bench);
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    uint8_t *payload;
+    int i, ret = 0;
+
+    if (bench_init(argc, argv, "host",
+            "Measures usbredirhost end to end, with a usbredirparser based\n"
+            "usb-guest on one side and a simulated (fakeusb) device on the\n"
+            "other side. Request based cases keep a number of requests in\n"
+            "flight and report their latency, stream cases measure the\n"
+            "received packets. The -hs cases use high speed device timing,\n"
+            "the others a device which completes transfers right away.\n"
+            "The filter cases check a set of devices against a filter, a\n"
+            "packet is the check of one device.") != 0) {
+        return 1;
+    }
+
+    payload = calloc(1, 1024 * 1024);
+    if (!payload) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        if (!bench_case_selected(cases[i].name)) {
+            continue;
+        }
+        if (run_case(&cases[i], payload) != 0) {
+            fprintf(stderr, "Error running %s\n", cases[i].name);
+            ret = 1;
+        }
+    }
+
+    free(payload);
+    return bench_finish() || ret;
+}
@@ -0,0 +1,699 @@
+/* jitter.c usbredirhost iso stream jitter under CPU load
+
+   Copyright 2026 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "usbredirhost.h"
+#include "usbredirsched.h"
+#include "fakeusb.h"
+#include "bench.h"
+
+/* Runs the host side like usbredirect does by default, with a libusb event
+   thread and a thread reading from the connection, while the usb-guest
+   streams from the simulated iso IN endpoint of a fakeusb device, which
+   sends a 1024 byte packet every 125 us, with 8 packets per transfer and 4
+   transfers in flight. The device keeps to its schedule as long as
+   usbredirhost resubmits the transfers in time, so how regularly the
+   transfers reach the usb-guest shows how well the host threads keep up.
+
+   The load cases run a busy thread per CPU next to it, the rt cases run
+   the host threads with SCHED_FIFO, which they set for themselves through
+   usbredirsched_set_rt() like usbredirect --rt-priority, and
+   the mlock case locks the stream buffers, like usbredirect --mlock. The
+   usb-guest itself runs with a higher SCHED_FIFO priority where permitted,
+   so that the measurement is not disturbed by the load. */
+
+#define SOCKET_BUFFER_SIZE (256 * 1024)
+#define ISO_EP 0x84
+#define PKT_SIZE 1024
+#define PKTS_PER_TRANSFER 8
+#define TRANSFER_COUNT 4
+#define INTERVAL_NS 125000ull
+#define HOST_PRIORITY 50
+#define GUEST_PRIORITY 60
+#define MAX_SAMPLES (1024 * 1024)
+#define SETUP_TIMEOUT_NS 1000000000ull
+
+struct bench_case {
+    const char *name;
+    int load;
+    int rt;
+    int mlock;
+};
+
+static const struct bench_case cases[] = {
+    { "idle", 0, 0, 0 },
+    { "load", 1, 0, 0 },
+    { "load-rt", 1, 1, 0 },
+    { "load-rt-mlock", 1, 1, 1 },
+};
+
+struct host {
+    libusb_context *ctx;
+    libusb_device *dev;
+    struct usbredirhost *usbredirhost;
+    int fd;
+    int run;
+    pthread_t event_thread, reader_thread;
+    int event_started, reader_started;
+    /* With rt the threads set SCHED_FIFO themselves, sched_done counts the
+       ones which tried, sched_error is the first error */
+    int rt;
+    int sched_done;
+    int sched_error;
+};
+
+struct guest {
+    struct usbredirparser *parser;
+    int fd;
+    int connected;
+    int alt_set;
+    int errors;
+    int running;
+    uint64_t first_id, last_id;
+    uint64_t transfer_time, transfer_id;
+    uint64_t packets;
+    uint64_t *jitter;
+    size_t sample_count;
+};
+
+static int hogs_run;
+
+static void bench_log(void *priv, int level, const char *msg)
+{
+    if (level <= usbredirparser_warning) {
+        fprintf(stderr, "%s\n", msg);
+    }
+}
+
+static int sock_read(int fd, uint8_t *data, int count)
+{
+    ssize_t r = recv(fd, data, count, MSG_DONTWAIT);
+
+    if (r < 0) {
+        return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    }
+    return r ? r : -1;
+}
+
+static int sock_write(int fd, uint8_t *data, int count)
+{
+    ssize_t r = send(fd, data, count, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+    if (r < 0) {
+        return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    }
+    return r;
+}
+
+/* The usb-guest thread runs with SCHED_FIFO, so the others must not
+   inherit its policy */
+static int start_thread(pthread_t *thread, void *(*func)(void *), void *arg)
+{
+    struct sched_param param = { .sched_priority = 0 };
+    pthread_attr_t attr;
+    int r;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(&attr, SCHED_OTHER);
+    pthread_attr_setschedparam(&attr, &param);
+    r = pthread_create(thread, &attr, func, arg);
+    pthread_attr_destroy(&attr);
+    return r;
+}
+
+static void *hog_thread(void *arg)
+{
+    volatile uint64_t n = 0;
+
+    while (__atomic_load_n(&hogs_run, __ATOMIC_RELAXED)) {
+        n++;
+    }
+    return NULL;
+}
+
+/**************************************************************************/
+/* usb-host                                                                */
+/**************************************************************************/
+
+static int host_read(void *priv, uint8_t *data, int count)
+{
+    struct host *h = priv;
+
+    return sock_read(h->fd, data, count);
+}
+
+static int host_write(void *priv, uint8_t *data, int count)
+{
+    struct host *h = priv;
+
+    return sock_write(h->fd, data, count);
+}
+
+static void host_flush(void *priv)
+{
+    struct host *h = priv;
+
+    /* usbredirhost_open_full() already flushes its hello */
+    if (h->usbredirhost) {
+        usbredirhost_write_guest_data(h->usbredirhost);
+    }
+}
+
+static void *host_alloc_lock(void)
+{
+    pthread_mutex_t *mutex = malloc(sizeof(*mutex));
+
+    if (mutex) {
+        pthread_mutex_init(mutex, NULL);
+    }
+    return mutex;
+}
+
+static void host_lock(void *user_data)
+{
+    pthread_mutex_lock(user_data);
+}
+
+static void host_unlock(void *user_data)
+{
+    pthread_mutex_unlock(user_data);
+}
+
+static void host_free_lock(void *user_data)
+{
+    pthread_mutex_destroy(user_data);
+    free(user_data);
+}
+
+static void host_thread_sched(struct host *h)
+{
+    int r = h->rt ? usbredirsched_set_rt(SCHED_FIFO, HOST_PRIORITY) : 0;
+    int expected = 0;
+
+    if (r < 0) {
+        __atomic_compare_exchange_n(&h->sched_error, &expected, r, 0,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
+    __atomic_add_fetch(&h->sched_done, 1, __ATOMIC_RELEASE);
+}
+
+static void *event_thread(void *arg)
+{
+    struct host *h = arg;
+
+    host_thread_sched(h);
+    while (__atomic_load_n(&h->run, __ATOMIC_ACQUIRE)) {
+        struct timeval tv = { 0, 10000 };
+
+        libusb_handle_events_timeout(h->ctx, &tv);
+    }
+    return NULL;
+}
+
+static void *reader_thread(void *arg)
+{
+    struct host *h = arg;
+
+    host_thread_sched(h);
+    while (__atomic_load_n(&h->run, __ATOMIC_ACQUIRE)) {
+        struct pollfd pfd = { .fd = h->fd, .events = POLLIN };
+
+        if (usbredirhost_has_data_to_write(h->usbredirhost)) {
+            pfd.events |= POLLOUT;
+        }
+        if (poll(&pfd, 1, 10) <= 0) {
+            continue;
+        }
+        if ((pfd.revents & (POLLIN | POLLHUP | POLLERR)) &&
+                usbredirhost_read_guest_data(h->usbredirhost) < 0) {
+            break;
+        }
+        if (pfd.revents & POLLOUT) {
+            usbredirhost_write_guest_data(h->usbredirhost);
+        }
+    }
+    return NULL;
+}
+
+/* Returns 1 when the case can not run here, for lack of permission to use
+   SCHED_FIFO */
+static int host_start(struct host *h, const struct bench_case *c, int fd)
+{
+    struct fakeusb_device_config config;
+    libusb_device_handle *handle;
+    int i, r;
+
+    h->fd = fd;
+    h->rt = c->rt;
+    if (libusb_init(&h->ctx) != 0) {
+        fprintf(stderr, "Error initializing fakeusb\n");
+        return -1;
+    }
+
+    fakeusb_device_config_init(&config);
+    config.control_latency_us = 0;
+    for (i = 0; config.endpoints[i].address; i++) {
+        if (config.endpoints[i].address == ISO_EP) {
+            config.endpoints[i].interval_us = INTERVAL_NS / 1000;
+        }
+    }
+    h->dev = fakeusb_device_new(h->ctx, &config);
+    if (!h->dev || libusb_open(h->dev, &handle) != 0) {
+        fprintf(stderr, "Error creating the fakeusb device\n");
+        return -1;
+    }
+    h->usbredirhost = usbredirhost_open_full(h->ctx, handle, bench_log,
+        host_read, host_write, host_flush,
+        host_alloc_lock, host_lock, host_unlock, host_free_lock,
+        h, "usbredir-bench " PACKAGE_VERSION, usbredirparser_warning,
+        c->mlock ? usbredirhost_fl_lock_stream_buffers : 0);
+    if (!h->usbredirhost) {
+        fprintf(stderr, "Error creating usbredirhost\n");
+        return -1;
+    }
+
+    h->run = 1;
+    h->event_started = start_thread(&h->event_thread, event_thread, h) == 0;
+    h->reader_started = start_thread(&h->reader_thread, reader_thread, h) == 0;
+    if (!h->event_started || !h->reader_started) {
+        fprintf(stderr, "Error starting the usb-host threads\n");
+        return -1;
+    }
+    while (__atomic_load_n(&h->sched_done, __ATOMIC_ACQUIRE) < 2) {
+        usleep(1000);
+    }
+    r = __atomic_load_n(&h->sched_error, __ATOMIC_RELAXED);
+    if (r < 0) {
+        fprintf(stderr, "Skipping %s: SCHED_FIFO not available: %s\n",
+                c->name, strerror(-r));
+        return 1;
+    }
+    return 0;
+}
+
+static void host_stop(struct host *h)
+{
+    __atomic_store_n(&h->run, 0, __ATOMIC_RELEASE);
+    if (h->reader_started) {
+        pthread_join(h->reader_thread, NULL);
+    }
+    if (h->event_started) {
+        libusb_interrupt_event_handler(h->ctx);
+        pthread_join(h->event_thread, NULL);
+    }
+    if (h->usbredirhost) {
+        usbredirhost_close(h->usbredirhost);
+    }
+    if (h->dev) {
+        libusb_unref_device(h->dev);
+    }
+    if (h->ctx) {
+        libusb_exit(h->ctx);
+    }
+}
+
+/**************************************************************************/
+/* usb-guest                                                               */
+/**************************************************************************/
+
+static int guest_read(void *priv, uint8_t *data, int count)
+{
+    struct guest *g = priv;
+
+    return sock_read(g->fd, data, count);
+}
+
+static int guest_write(void *priv, uint8_t *data, int count)
+{
+    struct guest *g = priv;
+
+    return sock_write(g->fd, data, count);
+}
+
+static void guest_device_connect(void *priv,
+    struct usb_redir_device_connect_header *device_connect)
+{
+    struct guest *g = priv;
+
+    g->connected = 1;
+}
+
+static void guest_device_disconnect(void *priv)
+{
+    struct guest *g = priv;
+
+    g->errors++;
+}
+
+static void guest_interface_info(void *priv,
+    struct usb_redir_interface_info_header *interface_info)
+{
+}
+
+static void guest_ep_info(void *priv, struct usb_redir_ep_info_header *ep_info)
+{
+}
+
+static void guest_filter_reject(void *priv)
+{
+}
+
+static void guest_filter_filter(void *priv,
+    struct usbredirfilter_rule *rules, int rules_count)
+{
+    free(rules);
+}
+
+static void guest_alt_setting_status(void *priv, uint64_t id,
+    struct usb_redir_alt_setting_status_header *alt_setting_status)
+{
+    struct guest *g = priv;
+
+    if (alt_setting_status->status != usb_redir_success) {
+        g->errors++;
+    }
+    g->alt_set = 1;
+}
+
+static void guest_iso_stream_status(void *priv, uint64_t id,
+    struct usb_redir_iso_stream_status_header *iso_stream_status)
+{
+    struct guest *g = priv;
+
+    if (iso_stream_status->status != usb_redir_success) {
+        g->errors++;
+    }
+}
+
+/* The packet id counts the packets since the stream started, including
+   the ones the host dropped, so it gives the packet's place in the
+   device's schedule. Jitter is how far the time between two transfers
+   is off from what their ids say it should be, so a single late transfer
+   shows up once and not as an offset to all the ones after it. */
+static void guest_iso_packet(void *priv, uint64_t id,
+    struct usb_redir_iso_packet_header *iso_header,
+    uint8_t *data, int data_len)
+{
+    struct guest *g = priv;
+    uint64_t now = bench_time_ns();
+
+    usbredirparser_free_packet_data(g->parser, data);
+    if (iso_header->status != usb_redir_success) {
+        g->errors++;
+    }
+    if (!g->running) {
+        return;
+    }
+    if (!g->packets++) {
+        g->first_id = id;
+        g->transfer_id = id;
+        g->transfer_time = now;
+    }
+    g->last_id = id;
+
+    /* All packets of a transfer arrive together, so this compares the
+       arrival of the first packet of each transfer with that of the
+       previous transfer */
+    if ((id - g->first_id) % PKTS_PER_TRANSFER || id == g->transfer_id) {
+        return;
+    }
+    if (g->sample_count < MAX_SAMPLES) {
+        uint64_t expected = (id - g->transfer_id) * INTERVAL_NS;
+        uint64_t actual = now - g->transfer_time;
+
+        g->jitter[g->sample_count++] = actual > expected ?
+                                       actual - expected : expected - actual;
+    }
+    g->transfer_id = id;
+    g->transfer_time = now;
+}
+
+static struct usbredirparser *create_guest(struct guest *g)
+{
+    struct usbredirparser *parser = usbredirparser_create();
+    uint32_t caps[USB_REDIR_CAPS_SIZE] = { 0, };
+
+    if (!parser) {
+        return NULL;
+    }
+
+    parser->priv = g;
+    parser->log_func = bench_log;
+    parser->read_func = guest_read;
+    parser->write_func = guest_write;
+    parser->device_connect_func = guest_device_connect;
+    parser->device_disconnect_func = guest_device_disconnect;
+    parser->interface_info_func = guest_interface_info;
+    parser->ep_info_func = guest_ep_info;
+    parser->filter_reject_func = guest_filter_reject;
+    parser->filter_filter_func = guest_filter_filter;
+    parser->alt_setting_status_func = guest_alt_setting_status;
+    parser->iso_stream_status_func = guest_iso_stream_status;
+    parser->iso_packet_func = guest_iso_packet;
+
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_connect_device_version);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_filter);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_device_disconnect_ack);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_ep_info_max_packet_size);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_64bits_ids);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_32bits_bulk_length);
+
+    usbredirparser_init(parser, "usbredir-bench " PACKAGE_VERSION, caps,
+                        USB_REDIR_CAPS_SIZE, 0);
+    return parser;
+}
+
+static int guest_iterate(struct guest *g)
+{
+    struct pollfd pfd = { .fd = g->fd, .events = POLLIN };
+
+    poll(&pfd, 1, 10);
+    if (usbredirparser_do_read(g->parser) < 0) {
+        fprintf(stderr, "Error reading host data\n");
+        return -1;
+    }
+    if (usbredirparser_has_data_to_write(g->parser) &&
+            usbredirparser_do_write(g->parser) < 0) {
+        fprintf(stderr, "Error writing guest data\n");
+        return -1;
+    }
+    return g->errors ? -1 : 0;
+}
+
+static int guest_wait(struct guest *g, int *cond)
+{
+    uint64_t start = bench_time_ns();
+
+    while (!*cond) {
+        if (guest_iterate(g) != 0) {
+            return -1;
+        }
+        if (bench_time_ns() - start > SETUP_TIMEOUT_NS) {
+            fprintf(stderr, "Error setting up the iso stream\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* late_transfers counts the transfers which were off by a transfer's
+   duration or more */
+static void result_jitter(uint64_t *jitter, size_t count)
+{
+    size_t late = 0;
+
+    if (!count) {
+        return;
+    }
+    qsort(jitter, count, sizeof(uint64_t), cmp_u64);
+    while (late < count &&
+           jitter[count - 1 - late] >= PKTS_PER_TRANSFER * INTERVAL_NS) {
+        late++;
+    }
+    bench_result_double("jitter_p50_us", jitter[count / 2] / 1e3);
+    bench_result_double("jitter_p99_us", jitter[count * 99 / 100] / 1e3);
+    bench_result_double("jitter_max_us", jitter[count - 1] / 1e3);
+    bench_result_u64("late_transfers", late);
+}
+
+static int run_case(const struct bench_case *c, int rt_guest)
+{
+    struct usb_redir_set_alt_setting_header set_alt_setting = {
+        .interface = 1,
+        .alt = 1,
+    };
+    struct usb_redir_start_iso_stream_header start_iso_stream = {
+        .endpoint = ISO_EP,
+        .pkts_per_urb = PKTS_PER_TRANSFER,
+        .no_urbs = TRANSFER_COUNT,
+    };
+    struct host host = { 0, };
+    struct guest guest = { 0, };
+    pthread_t *hogs = NULL;
+    uint64_t start, elapsed, allocs, min_ns = bench_opts.time * 1e9;
+    int fds[2] = { -1, -1 }, size = SOCKET_BUFFER_SIZE, i, r, ret = -1;
+    int n_hogs = 0;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        fprintf(stderr, "Error creating socketpair: %s\n", strerror(errno));
+        return -1;
+    }
+    setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+
+    guest.fd = fds[1];
+    guest.jitter = malloc(MAX_SAMPLES * sizeof(uint64_t));
+    guest.parser = create_guest(&guest);
+    if (!guest.jitter || !guest.parser) {
+        fprintf(stderr, "Out of memory\n");
+        goto leave;
+    }
+    r = host_start(&host, c, fds[0]);
+    if (r != 0) {
+        ret = r > 0 ? 0 : -1;
+        goto leave;
+    }
+
+    if (guest_wait(&guest, &guest.connected) != 0) {
+        goto leave;
+    }
+    usbredirparser_send_set_alt_setting(guest.parser, 1, &set_alt_setting);
+    if (guest_wait(&guest, &guest.alt_set) != 0) {
+        goto leave;
+    }
+    usbredirparser_send_start_iso_stream(guest.parser, 2, &start_iso_stream);
+
+    if (c->load) {
+        n_hogs = sysconf(_SC_NPROCESSORS_ONLN);
+        if (n_hogs < 1) {
+            n_hogs = 1;
+        }
+        hogs = calloc(n_hogs, sizeof(*hogs));
+        if (!hogs) {
+            fprintf(stderr, "Out of memory\n");
+            goto leave;
+        }
+        __atomic_store_n(&hogs_run, 1, __ATOMIC_RELAXED);
+        for (i = 0; i < n_hogs; i++) {
+            if (start_thread(&hogs[i], hog_thread, NULL) != 0) {
+                fprintf(stderr, "Error starting a load thread\n");
+                n_hogs = i;
+                goto leave;
+            }
+        }
+    }
+
+    /* Warm up */
+    start = bench_time_ns();
+    while (bench_time_ns() - start < min_ns / 10) {
+        if (guest_iterate(&guest) != 0) {
+            goto leave;
+        }
+    }
+
+    guest.running = 1;
+    allocs = bench_alloc_count();
+    start = bench_time_ns();
+    do {
+        if (guest_iterate(&guest) != 0) {
+            fprintf(stderr, "%s: iso stream failed\n", c->name);
+            goto leave;
+        }
+        elapsed = bench_time_ns() - start;
+    } while (elapsed < min_ns);
+    guest.running = 0;
+    allocs = bench_alloc_count() - allocs;
+
+    bench_result_begin(c->name);
+    bench_result_u64("load_threads", n_hogs);
+    bench_result_u64("rt", c->rt);
+    bench_result_u64("rt_guest", rt_guest);
+    bench_result_u64("mlock", c->mlock);
+    bench_result_u64("cpus", sysconf(_SC_NPROCESSORS_ONLN));
+    bench_result_throughput(elapsed, guest.packets,
+                            guest.packets * PKT_SIZE, allocs);
+    /* Packets the host dropped because the connection did not keep up */
+    bench_result_u64("dropped", guest.packets ?
+                     guest.last_id - guest.first_id + 1 - guest.packets : 0);
+    result_jitter(guest.jitter, guest.sample_count);
+    bench_result_end();
+    ret = 0;
+leave:
+    __atomic_store_n(&hogs_run, 0, __ATOMIC_RELAXED);
+    for (i = 0; i < n_hogs; i++) {
+        pthread_join(hogs[i], NULL);
+    }
+    free(hogs);
+    shutdown(fds[1], SHUT_RDWR);
+    host_stop(&host);
+    if (guest.parser) {
+        usbredirparser_destroy(guest.parser);
+    }
+    close(fds[0]);
+    close(fds[1]);
+    free(guest.jitter);
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    int i, rt_guest, ret = 0;
+
+    if (bench_init(argc, argv, "jitter",
+            "Measures how late the packets of an iso IN stream from a simulated\n"
+            "(fakeusb) device reach the usb-guest compared to the device's\n"
+            "schedule, with the host threads as in usbredirect, optionally\n"
+            "under CPU load, with SCHED_FIFO host threads and with mlocked\n"
+            "stream buffers. A packet is one iso packet of 1024 bytes.") != 0) {
+        return 1;
+    }
+
+    rt_guest = usbredirsched_set_rt(SCHED_FIFO, GUEST_PRIORITY) == 0;
+    if (!rt_guest) {
+        fprintf(stderr, "SCHED_FIFO not available, the load also affects "
+                "the usb-guest\n");
+    }
+
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        if (!bench_case_selected(cases[i].name)) {
+            continue;
+        }
+        if (run_case(&cases[i], rt_guest) != 0) {
+            fprintf(stderr, "Error running %s\n", cases[i].name);
+            ret = 1;
+        }
+    }
+
+    return bench_finish() || ret;
+}
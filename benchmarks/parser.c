@@ -0,0 +1,494 @@
+/* parser.c usbredirparser throughput benchmark
+
+   Copyright 2026 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "usbredirparser.h"
+#include "bench.h"
+
+/* Size of each direction of the in memory transport, similar to a socket
+   buffer, so that large packets get written / read in multiple steps */
+#define PIPE_SIZE (256 * 1024)
+/* Maximum amount of payload queued in one go */
+#define BATCH_BYTES (32 * 1024 * 1024)
+#define MAX_BATCH 64
+#define MAX_PAYLOAD (16 * 1024 * 1024)
+
+enum {
+    CASE_CONTROL_IN,
+    CASE_BULK_IN,
+    CASE_BULK_OUT,
+    CASE_ISO_IN,
+    CASE_INTERRUPT_IN,
+    CASE_MIXED,
+};
+
+struct bench_case {
+    const char *name;
+    int type;
+    uint32_t size;
+};
+
+static const struct bench_case cases[] = {
+    { "control-in-18", CASE_CONTROL_IN, 18 },
+    { "control-in-4k", CASE_CONTROL_IN, 4096 },
+    { "bulk-in-4k", CASE_BULK_IN, 4096 },
+    { "bulk-in-64k", CASE_BULK_IN, 65536 },
+    { "bulk-in-1m", CASE_BULK_IN, 1024 * 1024 },
+    { "bulk-in-16m", CASE_BULK_IN, 16 * 1024 * 1024 },
+    { "bulk-out-4k", CASE_BULK_OUT, 4096 },
+    { "bulk-out-64k", CASE_BULK_OUT, 65536 },
+    { "bulk-out-1m", CASE_BULK_OUT, 1024 * 1024 },
+    { "bulk-out-16m", CASE_BULK_OUT, 16 * 1024 * 1024 },
+    { "iso-in-1k", CASE_ISO_IN, 1024 },
+    { "iso-in-3k", CASE_ISO_IN, 3072 },
+    { "interrupt-in-8", CASE_INTERRUPT_IN, 8 },
+    { "interrupt-in-64", CASE_INTERRUPT_IN, 64 },
+    /* 1 control, 4 bulk, 8 iso and 2 interrupt transfers per round */
+    { "mixed", CASE_MIXED, 16384 },
+};
+
+struct bench;
+
+struct side {
+    struct bench *bench;
+    struct usbredirparser *parser;
+    struct bench_pipe *in, *out;
+    int got_hello;
+};
+
+struct bench {
+    struct side host, guest;
+    struct bench_pipe to_host, to_guest;
+    uint8_t *payload;
+    uint64_t next_id;
+
+    /* Counters */
+    uint64_t transfers;
+    uint64_t bytes;
+    uint64_t parsed;
+};
+
+static void bench_log(void *priv, int level, const char *msg)
+{
+    if (level <= usbredirparser_warning) {
+        fprintf(stderr, "%s\n", msg);
+    }
+}
+
+static int pipe_read(void *priv, uint8_t *data, int count)
+{
+    struct side *side = priv;
+
+    return bench_pipe_read(side->in, data, count);
+}
+
+static int pipe_write(void *priv, uint8_t *data, int count)
+{
+    struct side *side = priv;
+
+    return bench_pipe_write(side->out, data, count);
+}
+
+static void bench_hello(void *priv, struct usb_redir_hello_header *hello)
+{
+    struct side *side = priv;
+
+    side->got_hello = 1;
+}
+
+/* usb-host side, answers the requests of the usb-guest */
+static void host_control_packet(void *priv, uint64_t id,
+    struct usb_redir_control_packet_header *control_header,
+    uint8_t *data, int data_len)
+{
+    struct side *side = priv;
+    struct bench *bench = side->bench;
+
+    bench->parsed++;
+    control_header->status = usb_redir_success;
+    if (control_header->endpoint & 0x80) {
+        usbredirparser_send_control_packet(side->parser, id, control_header,
+                                           bench->payload,
+                                           control_header->length);
+    } else {
+        usbredirparser_send_control_packet(side->parser, id, control_header,
+                                           NULL, 0);
+    }
+    usbredirparser_free_packet_data(side->parser, data);
+}
+
+static void host_bulk_packet(void *priv, uint64_t id,
+    struct usb_redir_bulk_packet_header *bulk_header,
+    uint8_t *data, int data_len)
+{
+    struct side *side = priv;
+    struct bench *bench = side->bench;
+    uint32_t len = (uint32_t)bulk_header->length_high << 16 |
+                   bulk_header->length;
+
+    bench->parsed++;
+    bulk_header->status = usb_redir_success;
+    if (bulk_header->endpoint & 0x80) {
+        usbredirparser_send_bulk_packet(side->parser, id, bulk_header,
+                                        bench->payload, len);
+    } else {
+        usbredirparser_send_bulk_packet(side->parser, id, bulk_header,
+                                        NULL, 0);
+    }
+    usbredirparser_free_packet_data(side->parser, data);
+}
+
+/* usb-guest side, counts the completed transfers */
+static void guest_complete(struct side *side, uint8_t *data, int len)
+{
+    struct bench *bench = side->bench;
+
+    bench->parsed++;
+    bench->transfers++;
+    bench->bytes += len;
+    usbredirparser_free_packet_data(side->parser, data);
+}
+
+static void guest_control_packet(void *priv, uint64_t id,
+    struct usb_redir_control_packet_header *control_header,
+    uint8_t *data, int data_len)
+{
+    guest_complete(priv, data, control_header->length);
+}
+
+static void guest_bulk_packet(void *priv, uint64_t id,
+    struct usb_redir_bulk_packet_header *bulk_header,
+    uint8_t *data, int data_len)
+{
+    guest_complete(priv, data, (uint32_t)bulk_header->length_high << 16 |
+                               bulk_header->length);
+}
+
+static void guest_iso_packet(void *priv, uint64_t id,
+    struct usb_redir_iso_packet_header *iso_header,
+    uint8_t *data, int data_len)
+{
+    guest_complete(priv, data, data_len);
+}
+
+static void guest_interrupt_packet(void *priv, uint64_t id,
+    struct usb_redir_interrupt_packet_header *interrupt_header,
+    uint8_t *data, int data_len)
+{
+    guest_complete(priv, data, data_len);
+}
+
+static struct usbredirparser *create_parser(struct side *side, int is_host)
+{
+    struct usbredirparser *parser = usbredirparser_create();
+    uint32_t caps[USB_REDIR_CAPS_SIZE] = { 0, };
+
+    if (!parser) {
+        return NULL;
+    }
+
+    parser->priv = side;
+    parser->log_func = bench_log;
+    parser->read_func = pipe_read;
+    parser->write_func = pipe_write;
+    parser->hello_func = bench_hello;
+    if (is_host) {
+        parser->control_packet_func = host_control_packet;
+        parser->bulk_packet_func = host_bulk_packet;
+    } else {
+        parser->control_packet_func = guest_control_packet;
+        parser->bulk_packet_func = guest_bulk_packet;
+        parser->iso_packet_func = guest_iso_packet;
+        parser->interrupt_packet_func = guest_interrupt_packet;
+    }
+
+    /* The caps a current usbredirhost / usb-guest would use */
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_connect_device_version);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_filter);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_device_disconnect_ack);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_ep_info_max_packet_size);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_64bits_ids);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_32bits_bulk_length);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_bulk_receiving);
+
+    usbredirparser_init(parser, "usbredir-bench " PACKAGE_VERSION, caps,
+                        USB_REDIR_CAPS_SIZE,
+                        is_host ? usbredirparser_fl_usb_host : 0);
+    return parser;
+}
+
+/* Move data back and forth until both sides are idle */
+static int bench_pump(struct bench *bench)
+{
+    struct side *sides[2] = { &bench->guest, &bench->host };
+    int i, r, busy;
+
+    do {
+        for (i = 0; i < 2; i++) {
+            struct usbredirparser *parser = sides[i]->parser;
+
+            if (usbredirparser_has_data_to_write(parser)) {
+                r = usbredirparser_do_write(parser);
+                if (r < 0) {
+                    fprintf(stderr, "Error writing: %d\n", r);
+                    return -1;
+                }
+            }
+            r = usbredirparser_do_read(sides[!i]->parser);
+            if (r < 0) {
+                fprintf(stderr, "Error reading: %d\n", r);
+                return -1;
+            }
+        }
+        busy = usbredirparser_has_data_to_write(bench->guest.parser) ||
+               usbredirparser_has_data_to_write(bench->host.parser) ||
+               !bench_pipe_is_empty(&bench->to_host) ||
+               !bench_pipe_is_empty(&bench->to_guest);
+    } while (busy);
+    return 0;
+}
+
+static void send_control_in(struct bench *bench, uint32_t size)
+{
+    struct usb_redir_control_packet_header control_header = {
+        .endpoint = 0x80,
+        .request = 6,        /* GET_DESCRIPTOR */
+        .requesttype = 0x80,
+        .value = 0x0100,
+        .length = size,
+    };
+
+    usbredirparser_send_control_packet(bench->guest.parser, bench->next_id++,
+                                       &control_header, NULL, 0);
+}
+
+static void send_bulk(struct bench *bench, uint8_t ep, uint32_t size)
+{
+    struct usb_redir_bulk_packet_header bulk_header = {
+        .endpoint = ep,
+        .length = size & 0xffff,
+        .length_high = size >> 16,
+    };
+
+    if (ep & 0x80) {
+        usbredirparser_send_bulk_packet(bench->guest.parser, bench->next_id++,
+                                        &bulk_header, NULL, 0);
+    } else {
+        usbredirparser_send_bulk_packet(bench->guest.parser, bench->next_id++,
+                                        &bulk_header, bench->payload, size);
+    }
+}
+
+static void send_iso_in(struct bench *bench, uint32_t size)
+{
+    struct usb_redir_iso_packet_header iso_header = {
+        .endpoint = 0x83,
+        .status = usb_redir_success,
+        .length = size,
+    };
+
+    usbredirparser_send_iso_packet(bench->host.parser, bench->next_id++,
+                                   &iso_header, bench->payload, size);
+}
+
+static void send_interrupt_in(struct bench *bench, uint32_t size)
+{
+    struct usb_redir_interrupt_packet_header interrupt_header = {
+        .endpoint = 0x84,
+        .status = usb_redir_success,
+        .length = size,
+    };
+
+    usbredirparser_send_interrupt_packet(bench->host.parser, bench->next_id++,
+                                         &interrupt_header, bench->payload,
+                                         size);
+}
+
+static void queue_batch(struct bench *bench, const struct bench_case *c)
+{
+    int i, j, batch = BATCH_BYTES / c->size;
+
+    if (batch < 1) {
+        batch = 1;
+    }
+    if (batch > MAX_BATCH) {
+        batch = MAX_BATCH;
+    }
+
+    for (i = 0; i < batch; i++) {
+        switch (c->type) {
+        case CASE_CONTROL_IN:
+            send_control_in(bench, c->size);
+            break;
+        case CASE_BULK_IN:
+            send_bulk(bench, 0x81, c->size);
+            break;
+        case CASE_BULK_OUT:
+            send_bulk(bench, 0x02, c->size);
+            break;
+        case CASE_ISO_IN:
+            send_iso_in(bench, c->size);
+            break;
+        case CASE_INTERRUPT_IN:
+            send_interrupt_in(bench, c->size);
+            break;
+        case CASE_MIXED:
+            send_control_in(bench, 18);
+            for (j = 0; j < 4; j++) {
+                send_bulk(bench, j & 1 ? 0x02 : 0x81, c->size);
+            }
+            for (j = 0; j < 8; j++) {
+                send_iso_in(bench, 1024);
+            }
+            for (j = 0; j < 2; j++) {
+                send_interrupt_in(bench, 8);
+            }
+            break;
+        }
+    }
+}
+
+static void bench_destroy(struct bench *bench)
+{
+    if (bench->guest.parser) {
+        usbredirparser_destroy(bench->guest.parser);
+    }
+    if (bench->host.parser) {
+        usbredirparser_destroy(bench->host.parser);
+    }
+    bench_pipe_destroy(&bench->to_host);
+    bench_pipe_destroy(&bench->to_guest);
+}
+
+static int bench_setup(struct bench *bench, uint8_t *payload)
+{
+    memset(bench, 0, sizeof(*bench));
+    bench->payload = payload;
+    bench->host.bench = bench;
+    bench->host.in = &bench->to_host;
+    bench->host.out = &bench->to_guest;
+    bench->guest.bench = bench;
+    bench->guest.in = &bench->to_guest;
+    bench->guest.out = &bench->to_host;
+
+    if (bench_pipe_init(&bench->to_host, PIPE_SIZE) != 0 ||
+            bench_pipe_init(&bench->to_guest, PIPE_SIZE) != 0) {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+    bench->host.parser = create_parser(&bench->host, 1);
+    bench->guest.parser = create_parser(&bench->guest, 0);
+    if (!bench->host.parser || !bench->guest.parser) {
+        fprintf(stderr, "Error creating parsers\n");
+        return -1;
+    }
+
+    /* Exchange the hellos, so that the caps are negotiated */
+    if (bench_pump(bench) != 0) {
+        return -1;
+    }
+    if (!bench->host.got_hello || !bench->guest.got_hello) {
+        fprintf(stderr, "Error hello exchange failed\n");
+        return -1;
+    }
+    return 0;
+}
+
+static int run_case(const struct bench_case *c, uint8_t *payload)
+{
+    struct bench bench;
+    uint64_t start, elapsed, allocs, wire_bytes, min_ns = bench_opts.time * 1e9;
+    int ret = -1;
+
+    if (bench_setup(&bench, payload) != 0) {
+        goto leave;
+    }
+
+    /* Warm up */
+    queue_batch(&bench, c);
+    if (bench_pump(&bench) != 0) {
+        goto leave;
+    }
+    bench.transfers = 0;
+    bench.bytes = 0;
+    bench.parsed = 0;
+    wire_bytes = bench.to_host.bytes + bench.to_guest.bytes;
+
+    allocs = bench_alloc_count();
+    start = bench_time_ns();
+    do {
+        queue_batch(&bench, c);
+        if (bench_pump(&bench) != 0) {
+            goto leave;
+        }
+        elapsed = bench_time_ns() - start;
+    } while (elapsed < min_ns);
+    allocs = bench_alloc_count() - allocs;
+
+    bench_result_begin(c->name);
+    bench_result_u64("size", c->size);
+    bench_result_throughput(elapsed, bench.transfers, bench.bytes, allocs);
+    bench_result_u64("parsed_packets", bench.parsed);
+    bench_result_u64("wire_bytes",
+                     bench.to_host.bytes + bench.to_guest.bytes - wire_bytes);
+    bench_result_end();
+    ret = 0;
+leave:
+    bench_destroy(&bench);
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    uint8_t *payload;
+    int i, ret = 0;
+
+    if (bench_init(argc, argv, "parser",
+            "Measures the usbredirparser throughput, by running a usb-host\n"
+            "and a usb-guest parser back to back over an in memory transport.\n"
+            "The usb-guest sends control, bulk, iso and interrupt packets or\n"
+            "requests and the usb-host answers them. Packets and bytes are\n"
+            "the completed transfers and their payload.") != 0) {
+        return 1;
+    }
+
+    payload = malloc(MAX_PAYLOAD);
+    if (!payload) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    for (i = 0; i < MAX_PAYLOAD; i++) {
+        payload[i] = i;
+    }
+
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        if (!bench_case_selected(cases[i].name)) {
+            continue;
+        }
+        if (run_case(&cases[i], payload) != 0) {
+            fprintf(stderr, "Error running %s\n", cases[i].name);
+            ret = 1;
+        }
+    }
+
+    free(payload);
+    return bench_finish() || ret;
+}
@@ -0,0 +1,580 @@
+/* scaling.c usbredirhost scaling over simulated devices and worker threads
+
+   Copyright 2026 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include "usbredirhost.h"
+#include "usbredirworker.h"
+#ifdef HAVE_SCHED_SETAFFINITY
+#include "usbredirsched.h"
+#endif
+#include "fakeusb.h"
+#include "bench.h"
+
+/* Like the usbredirect --daemon workers: each worker thread owns a libusb
+   context and the usbredirhost instances of its devices and runs them from
+   a single loop, without any locking, handling the USB events through the
+   same code, see tools/usbredirworker.h. All devices do the same bulk IN
+   transfers on a device which completes them right away, so the throughput
+   is bound by the CPU time usbredirhost, usbredirparser and the usb-guest
+   need per transfer. */
+
+#define PIPE_SIZE (256 * 1024)
+#define TRANSFER_SIZE 16384
+#define INFLIGHT 4
+#define MAX_LATENCY_SAMPLES (256 * 1024)
+#define ID_SLOTS 16                 /* Power of 2, larger than INFLIGHT */
+#define SETUP_TIMEOUT_NS 1000000000ull
+
+struct bench_case {
+    const char *name;
+    int devices;
+    int workers;
+};
+
+static const struct bench_case cases[] = {
+    { "devices-1-workers-1", 1, 1 },
+    { "devices-2-workers-1", 2, 1 },
+    { "devices-2-workers-2", 2, 2 },
+    { "devices-4-workers-1", 4, 1 },
+    { "devices-4-workers-4", 4, 4 },
+    { "devices-8-workers-1", 8, 1 },
+    { "devices-8-workers-4", 8, 4 },
+    { "devices-8-workers-8", 8, 8 },
+    { "devices-16-workers-1", 16, 1 },
+    { "devices-16-workers-4", 16, 4 },
+    { "devices-16-workers-16", 16, 16 },
+};
+
+struct device {
+    libusb_device *dev;
+    struct usbredirhost *host;
+    struct usbredirparser *guest;
+    struct bench_pipe to_host, to_guest;
+
+    int connected;
+    int disconnected;
+    int running;
+    int errors;
+    uint64_t next_id;
+    uint64_t submit_time[ID_SLOTS];
+
+    uint64_t transfers;
+    uint64_t bytes;
+    uint64_t *latencies;
+    size_t latency_count;
+};
+
+struct worker {
+    pthread_t thread;
+    int cpu;                    /* -1: not pinned */
+    libusb_context *ctx;
+    struct device *devices;
+    struct usbredirhost **hosts;
+    int n_devices;
+    pthread_barrier_t *barrier;
+    int failed;
+    uint64_t elapsed;
+};
+
+static void bench_log(void *priv, int level, const char *msg)
+{
+    if (level <= usbredirparser_warning) {
+        fprintf(stderr, "%s\n", msg);
+    }
+}
+
+static int host_read(void *priv, uint8_t *data, int count)
+{
+    struct device *d = priv;
+
+    return bench_pipe_read(&d->to_host, data, count);
+}
+
+static int host_write(void *priv, uint8_t *data, int count)
+{
+    struct device *d = priv;
+
+    return bench_pipe_write(&d->to_guest, data, count);
+}
+
+static int guest_read(void *priv, uint8_t *data, int count)
+{
+    struct device *d = priv;
+
+    return bench_pipe_read(&d->to_guest, data, count);
+}
+
+static int guest_write(void *priv, uint8_t *data, int count)
+{
+    struct device *d = priv;
+
+    return bench_pipe_write(&d->to_host, data, count);
+}
+
+/**************************************************************************/
+/* usb-guest                                                               */
+/**************************************************************************/
+
+static void guest_submit(struct device *d)
+{
+    struct usb_redir_bulk_packet_header bulk_header = {
+        .endpoint = 0x81,
+        .length = TRANSFER_SIZE,
+    };
+    uint64_t id = d->next_id++;
+
+    d->submit_time[id & (ID_SLOTS - 1)] = bench_time_ns();
+    usbredirparser_send_bulk_packet(d->guest, id, &bulk_header, NULL, 0);
+}
+
+static void guest_device_connect(void *priv,
+    struct usb_redir_device_connect_header *device_connect)
+{
+    struct device *d = priv;
+
+    d->connected = 1;
+}
+
+static void guest_device_disconnect(void *priv)
+{
+    struct device *d = priv;
+
+    d->disconnected = 1;
+}
+
+static void guest_interface_info(void *priv,
+    struct usb_redir_interface_info_header *interface_info)
+{
+}
+
+static void guest_ep_info(void *priv, struct usb_redir_ep_info_header *ep_info)
+{
+}
+
+static void guest_filter_reject(void *priv)
+{
+}
+
+static void guest_filter_filter(void *priv,
+    struct usbredirfilter_rule *rules, int rules_count)
+{
+    free(rules);
+}
+
+static void guest_bulk_packet(void *priv, uint64_t id,
+    struct usb_redir_bulk_packet_header *bulk_header,
+    uint8_t *data, int data_len)
+{
+    struct device *d = priv;
+
+    usbredirparser_free_packet_data(d->guest, data);
+    if (bulk_header->status != usb_redir_success) {
+        d->errors++;
+    }
+    if (d->running) {
+        d->transfers++;
+        d->bytes += bulk_header->length;
+        if (d->latency_count < MAX_LATENCY_SAMPLES) {
+            d->latencies[d->latency_count++] =
+                bench_time_ns() - d->submit_time[id & (ID_SLOTS - 1)];
+        }
+    }
+    guest_submit(d);
+}
+
+static struct usbredirparser *create_guest(struct device *d)
+{
+    struct usbredirparser *parser = usbredirparser_create();
+    uint32_t caps[USB_REDIR_CAPS_SIZE] = { 0, };
+
+    if (!parser) {
+        return NULL;
+    }
+
+    parser->priv = d;
+    parser->log_func = bench_log;
+    parser->read_func = guest_read;
+    parser->write_func = guest_write;
+    parser->device_connect_func = guest_device_connect;
+    parser->device_disconnect_func = guest_device_disconnect;
+    parser->interface_info_func = guest_interface_info;
+    parser->ep_info_func = guest_ep_info;
+    parser->filter_reject_func = guest_filter_reject;
+    parser->filter_filter_func = guest_filter_filter;
+    parser->bulk_packet_func = guest_bulk_packet;
+
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_connect_device_version);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_filter);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_device_disconnect_ack);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_ep_info_max_packet_size);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_64bits_ids);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_32bits_bulk_length);
+
+    usbredirparser_init(parser, "usbredir-bench " PACKAGE_VERSION, caps,
+                        USB_REDIR_CAPS_SIZE, 0);
+    return parser;
+}
+
+/**************************************************************************/
+/* Workers                                                                 */
+/**************************************************************************/
+
+static void worker_write_failed(void *priv, int index)
+{
+    struct worker *w = priv;
+
+    fprintf(stderr, "Error writing to the guest\n");
+    w->failed = 1;
+}
+
+/* Moves the data of all devices of the worker once: the usb-guests read
+   what their host wrote and answer, the hosts read that, and handling the
+   USB events then writes what the hosts queued. When no usb-guest sent
+   anything this waits for the next device completion. */
+static int worker_iterate(struct worker *w)
+{
+    int i, moved = 0;
+
+    for (i = 0; i < w->n_devices; i++) {
+        struct device *d = &w->devices[i];
+        uint64_t bytes = d->to_host.bytes;
+
+        if (usbredirparser_do_read(d->guest) < 0) {
+            fprintf(stderr, "Error reading host data\n");
+            return -1;
+        }
+        if (usbredirparser_has_data_to_write(d->guest)) {
+            usbredirparser_do_write(d->guest);
+        }
+        if (usbredirhost_read_guest_data(d->host) < 0) {
+            fprintf(stderr, "Error reading guest data\n");
+            return -1;
+        }
+        moved |= bytes != d->to_host.bytes;
+    }
+
+    if (usbredirworker_handle_usb_events(w->ctx, moved ? 0 : 10, w->hosts,
+                                         w->n_devices, worker_write_failed,
+                                         w) != 0) {
+        fprintf(stderr, "Error handling USB events\n");
+        return -1;
+    }
+    return w->failed ? -1 : 0;
+}
+
+static int worker_setup(struct worker *w)
+{
+    struct fakeusb_device_config config;
+    libusb_device_handle *handle;
+    uint64_t start;
+    int i, connected;
+
+    w->hosts = calloc(w->n_devices, sizeof(*w->hosts));
+    if (!w->hosts) {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+    if (libusb_init(&w->ctx) != 0) {
+        fprintf(stderr, "Error initializing fakeusb\n");
+        return -1;
+    }
+
+    fakeusb_device_config_init(&config);
+    config.control_latency_us = 0;
+    for (i = 0; config.endpoints[i].address; i++) {
+        config.endpoints[i].latency_us = 0;
+        config.endpoints[i].bytes_per_ms = 0;
+        config.endpoints[i].interval_us = 0;
+    }
+
+    for (i = 0; i < w->n_devices; i++) {
+        struct device *d = &w->devices[i];
+
+        d->latencies = malloc(MAX_LATENCY_SAMPLES * sizeof(uint64_t));
+        if (!d->latencies ||
+                bench_pipe_init(&d->to_host, PIPE_SIZE) != 0 ||
+                bench_pipe_init(&d->to_guest, PIPE_SIZE) != 0) {
+            fprintf(stderr, "Out of memory\n");
+            return -1;
+        }
+        config.device_address = 1 + i;
+        d->dev = fakeusb_device_new(w->ctx, &config);
+        if (!d->dev || libusb_open(d->dev, &handle) != 0) {
+            fprintf(stderr, "Error creating the fakeusb device\n");
+            return -1;
+        }
+        d->host = usbredirhost_open_full(w->ctx, handle, bench_log,
+                                         host_read, host_write,
+                                         NULL, NULL, NULL, NULL, NULL,
+                                         d, "usbredir-bench " PACKAGE_VERSION,
+                                         usbredirparser_warning, 0);
+        d->guest = create_guest(d);
+        w->hosts[i] = d->host;
+        if (!d->host || !d->guest) {
+            fprintf(stderr, "Error creating usbredirhost / guest parser\n");
+            return -1;
+        }
+    }
+
+    start = bench_time_ns();
+    do {
+        if (worker_iterate(w) != 0) {
+            return -1;
+        }
+        if (bench_time_ns() - start > SETUP_TIMEOUT_NS) {
+            fprintf(stderr, "Error waiting for the device connect\n");
+            return -1;
+        }
+        connected = 1;
+        for (i = 0; i < w->n_devices; i++) {
+            connected &= w->devices[i].connected;
+        }
+    } while (!connected);
+
+    for (i = 0; i < w->n_devices; i++) {
+        int j;
+
+        for (j = 0; j < INFLIGHT; j++) {
+            guest_submit(&w->devices[i]);
+        }
+    }
+    return 0;
+}
+
+static void worker_destroy(struct worker *w)
+{
+    int i;
+
+    for (i = 0; i < w->n_devices; i++) {
+        struct device *d = &w->devices[i];
+
+        if (d->host) {
+            usbredirhost_close(d->host);
+        }
+        if (d->guest) {
+            usbredirparser_destroy(d->guest);
+        }
+        if (d->dev) {
+            libusb_unref_device(d->dev);
+        }
+        bench_pipe_destroy(&d->to_host);
+        bench_pipe_destroy(&d->to_guest);
+        free(d->latencies);
+    }
+    if (w->ctx) {
+        libusb_exit(w->ctx);
+    }
+    free(w->hosts);
+}
+
+/* Sets up its devices, then runs them for the warm up and the measurement,
+   in step with the other workers. A worker which failed its setup still
+   waits at the barriers, so that the others do not hang. */
+static void *worker_thread(void *arg)
+{
+    struct worker *w = arg;
+    uint64_t start, min_ns = bench_opts.time * 1e9;
+    int i;
+
+#ifdef HAVE_SCHED_SETAFFINITY
+    if (w->cpu >= 0) {
+        usbredirsched_pin(w->cpu);
+    }
+#endif
+
+    w->failed = worker_setup(w) != 0;
+    pthread_barrier_wait(w->barrier);
+
+    start = bench_time_ns();
+    while (!w->failed && bench_time_ns() - start < min_ns / 10) {
+        w->failed = worker_iterate(w) != 0;
+    }
+    for (i = 0; i < w->n_devices; i++) {
+        w->devices[i].running = 1;
+    }
+    pthread_barrier_wait(w->barrier);
+
+    start = bench_time_ns();
+    while (!w->failed && bench_time_ns() - start < min_ns) {
+        w->failed = worker_iterate(w) != 0;
+    }
+    w->elapsed = bench_time_ns() - start;
+    for (i = 0; i < w->n_devices; i++) {
+        w->devices[i].running = 0;
+    }
+    return NULL;
+}
+
+/* Like usbredirect --daemon, with more than one worker */
+static void assign_cpus(struct worker *workers, int n_workers)
+{
+#ifdef HAVE_SCHED_SETAFFINITY
+    int *cpus = malloc(n_workers * sizeof(*cpus));
+    int i;
+
+    if (n_workers > 1 && cpus &&
+            usbredirsched_assign_cpus(cpus, n_workers) == 0) {
+        for (i = 0; i < n_workers; i++) {
+            workers[i].cpu = cpus[i];
+        }
+    }
+    free(cpus);
+#endif
+}
+
+static int run_case(const struct bench_case *c)
+{
+    struct worker *workers;
+    struct device *devices;
+    pthread_barrier_t barrier;
+    uint64_t allocs, elapsed = 0, transfers = 0, bytes = 0;
+    uint64_t min_transfers = UINT64_MAX, max_transfers = 0;
+    uint64_t *latencies = NULL;
+    size_t latency_count = 0;
+    int i, ret = -1;
+
+    workers = calloc(c->workers, sizeof(*workers));
+    devices = calloc(c->devices, sizeof(*devices));
+    if (!workers || !devices ||
+            pthread_barrier_init(&barrier, NULL, c->workers) != 0) {
+        fprintf(stderr, "Out of memory\n");
+        free(workers);
+        free(devices);
+        return -1;
+    }
+
+    /* Devices get assigned round robin, like with the --daemon workers,
+       which keeps a worker's devices next to each other in the array */
+    for (i = 0; i < c->workers; i++) {
+        workers[i].cpu = -1;
+        workers[i].barrier = &barrier;
+        workers[i].n_devices = c->devices / c->workers +
+                               (i < c->devices % c->workers);
+        workers[i].devices = i ? workers[i - 1].devices +
+                                 workers[i - 1].n_devices : devices;
+    }
+    assign_cpus(workers, c->workers);
+
+    allocs = bench_alloc_count();
+    for (i = 0; i < c->workers; i++) {
+        if (pthread_create(&workers[i].thread, NULL, worker_thread,
+                           &workers[i]) != 0) {
+            /* The started workers would wait at the barrier forever */
+            fprintf(stderr, "Error starting a worker\n");
+            exit(1);
+        }
+    }
+    for (i = 0; i < c->workers; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    allocs = bench_alloc_count() - allocs;
+
+    for (i = 0; i < c->workers; i++) {
+        if (workers[i].failed) {
+            goto leave;
+        }
+        if (workers[i].elapsed > elapsed) {
+            elapsed = workers[i].elapsed;
+        }
+    }
+    for (i = 0; i < c->devices; i++) {
+        struct device *d = &devices[i];
+
+        if (d->errors || d->disconnected) {
+            fprintf(stderr, "%s: %d transfers failed\n", c->name, d->errors);
+            goto leave;
+        }
+        transfers += d->transfers;
+        bytes += d->bytes;
+        latency_count += d->latency_count;
+        if (d->transfers < min_transfers) {
+            min_transfers = d->transfers;
+        }
+        if (d->transfers > max_transfers) {
+            max_transfers = d->transfers;
+        }
+    }
+
+    latencies = malloc((latency_count + 1) * sizeof(uint64_t));
+    if (!latencies) {
+        fprintf(stderr, "Out of memory\n");
+        goto leave;
+    }
+    latency_count = 0;
+    for (i = 0; i < c->devices; i++) {
+        memcpy(latencies + latency_count, devices[i].latencies,
+               devices[i].latency_count * sizeof(uint64_t));
+        latency_count += devices[i].latency_count;
+    }
+
+    bench_result_begin(c->name);
+    bench_result_u64("devices", c->devices);
+    bench_result_u64("workers", c->workers);
+    bench_result_u64("cpus", sysconf(_SC_NPROCESSORS_ONLN));
+    bench_result_u64("size", TRANSFER_SIZE);
+    bench_result_throughput(elapsed, transfers, bytes, allocs);
+    /* How evenly the devices got served, 1 is perfectly fair */
+    bench_result_double("fairness", max_transfers ?
+                        (double)min_transfers / max_transfers : 0);
+    bench_result_latency(latencies, latency_count);
+    bench_result_end();
+    ret = 0;
+leave:
+    for (i = 0; i < c->workers; i++) {
+        worker_destroy(&workers[i]);
+    }
+    pthread_barrier_destroy(&barrier);
+    free(latencies);
+    free(workers);
+    free(devices);
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    int i, ret = 0;
+
+    if (bench_init(argc, argv, "scaling",
+            "Measures how the host side scales with the number of redirected\n"
+            "devices, like usbredirect --daemon --workers N: each worker thread\n"
+            "owns a libusb context and runs its devices without any locking,\n"
+            "with more than one worker they get pinned to a CPU each. Every\n"
+            "simulated (fakeusb) device keeps 4 bulk IN transfers of 16 KiB in\n"
+            "flight and completes them right away, so this is bound by the CPU\n"
+            "time per transfer. A packet is one transfer of any device.") != 0) {
+        return 1;
+    }
+
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        if (!bench_case_selected(cases[i].name)) {
+            continue;
+        }
+        if (run_case(&cases[i]) != 0) {
+            fprintf(stderr, "Error running %s\n", cases[i].name);
+            ret = 1;
+        }
+    }
+
+    return bench_finish() || ret;
+}
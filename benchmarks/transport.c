@@ -0,0 +1,734 @@
+/* transport.c usbredir transport benchmark
+
+   Copyright 2026 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#ifdef __linux__
+#include <linux/vm_sockets.h>
+#endif
+#include "usbredirparser.h"
+#ifdef HAVE_SHM_TRANSPORT
+#include "usbredirshm.h"
+#endif
+#ifdef HAVE_ZEROCOPY
+#include "usbredirzerocopy.h"
+#endif
+#include "bench.h"
+
+#define MAX_PAYLOAD (1024 * 1024)
+/* The tcp-zerocopy cases send packets of this size or more with
+   MSG_ZEROCOPY */
+#define ZEROCOPY_THRESHOLD (16 * 1024)
+/* Must be a power of 2 */
+#define MAX_IN_FLIGHT 16
+#define MAX_SAMPLES (1024 * 1024)
+
+enum {
+    TRANSPORT_TCP,
+    TRANSPORT_UNIX,
+    TRANSPORT_PIPE,
+    TRANSPORT_VSOCK,
+    TRANSPORT_SHM,
+    TRANSPORT_TCP_ZEROCOPY,
+};
+
+static const char *transport_names[] = {
+    "tcp",
+    "unix",
+    "pipe",
+    "vsock",
+    "shm",
+    "tcp-zerocopy",
+};
+
+struct bench_case {
+    const char *name;
+    int transport;
+    int control;        /* control IN instead of bulk IN requests */
+    uint32_t size;
+    int in_flight;
+};
+
+#define TRANSPORT_CASES(t, prefix) \
+    { prefix "-control-in-18", t, 1, 18, 1 }, \
+    { prefix "-bulk-in-4k", t, 0, 4096, MAX_IN_FLIGHT }, \
+    { prefix "-bulk-in-64k", t, 0, 65536, MAX_IN_FLIGHT }
+
+static const struct bench_case cases[] = {
+    TRANSPORT_CASES(TRANSPORT_TCP, "tcp"),
+    TRANSPORT_CASES(TRANSPORT_UNIX, "unix"),
+    TRANSPORT_CASES(TRANSPORT_PIPE, "pipe"),
+    TRANSPORT_CASES(TRANSPORT_VSOCK, "vsock"),
+#ifdef HAVE_SHM_TRANSPORT
+    TRANSPORT_CASES(TRANSPORT_SHM, "shm"),
+#endif
+    { "tcp-bulk-in-1m", TRANSPORT_TCP, 0, 1024 * 1024, 4 },
+#ifdef HAVE_ZEROCOPY
+    { "tcp-zerocopy-bulk-in-64k", TRANSPORT_TCP_ZEROCOPY, 0, 65536,
+      MAX_IN_FLIGHT },
+    { "tcp-zerocopy-bulk-in-1m", TRANSPORT_TCP_ZEROCOPY, 0, 1024 * 1024, 4 },
+#endif
+};
+
+struct side {
+    struct usbredirparser *parser;
+    int in_fd, out_fd;
+#ifdef HAVE_SHM_TRANSPORT
+    /* in_fd is the Unix socket the rings were passed over */
+    struct usbredirshm *shm;
+#endif
+#ifdef HAVE_ZEROCOPY
+    /* usb-host only, for tcp-zerocopy */
+    struct usbredirzerocopy *zc;
+#endif
+    int got_hello;
+    int eof;
+    /* The CPU time of the usb-host thread so far */
+    uint64_t cpu_ns;
+
+    /* usb-guest only */
+    uint64_t sent_ns[MAX_IN_FLIGHT];
+    uint64_t *samples;
+    size_t sample_count;
+    uint64_t transfers;
+    uint64_t bytes;
+};
+
+static uint8_t payload[MAX_PAYLOAD];
+
+static void bench_log(void *priv, int level, const char *msg)
+{
+    if (level <= usbredirparser_warning) {
+        fprintf(stderr, "%s\n", msg);
+    }
+}
+
+static int fd_read(void *priv, uint8_t *data, int count)
+{
+    struct side *side = priv;
+    ssize_t r;
+
+#ifdef HAVE_SHM_TRANSPORT
+    if (side->shm) {
+        r = usbredirshm_read(side->shm, data, count);
+        if (r == -EPIPE) {
+            side->eof = 1;
+        }
+        return r < 0 ? -1 : r;
+    }
+#endif
+    r = read(side->in_fd, data, count);
+    if (r == 0) {
+        side->eof = 1;
+        return -1;
+    }
+    if (r < 0) {
+        return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    }
+    return r;
+}
+
+static int fd_write(void *priv, uint8_t *data, int count)
+{
+    struct side *side = priv;
+    ssize_t r;
+
+#ifdef HAVE_SHM_TRANSPORT
+    if (side->shm) {
+        r = usbredirshm_write(side->shm, data, count);
+        return r < 0 ? -1 : r;
+    }
+#endif
+#ifdef HAVE_ZEROCOPY
+    if (side->zc) {
+        r = usbredirzerocopy_write(side->zc, data, count);
+        return r < 0 ? -1 : r;
+    }
+#endif
+    r = write(side->out_fd, data, count);
+    if (r < 0) {
+        return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    }
+    return r;
+}
+
+static void bench_hello(void *priv, struct usb_redir_hello_header *hello)
+{
+    struct side *side = priv;
+
+    side->got_hello = 1;
+}
+
+/* usb-host side, answers the requests of the usb-guest */
+static void host_control_packet(void *priv, uint64_t id,
+    struct usb_redir_control_packet_header *control_header,
+    uint8_t *data, int data_len)
+{
+    struct side *side = priv;
+
+    control_header->status = usb_redir_success;
+    usbredirparser_send_control_packet(side->parser, id, control_header,
+                                       payload, control_header->length);
+    usbredirparser_free_packet_data(side->parser, data);
+}
+
+static void host_bulk_packet(void *priv, uint64_t id,
+    struct usb_redir_bulk_packet_header *bulk_header,
+    uint8_t *data, int data_len)
+{
+    struct side *side = priv;
+    uint32_t len = (uint32_t)bulk_header->length_high << 16 |
+                   bulk_header->length;
+
+    bulk_header->status = usb_redir_success;
+    usbredirparser_send_bulk_packet(side->parser, id, bulk_header,
+                                    payload, len);
+    usbredirparser_free_packet_data(side->parser, data);
+}
+
+/* usb-guest side, counts the completed transfers */
+static void guest_complete(struct side *side, uint64_t id, uint8_t *data,
+                           int len)
+{
+    if (side->sample_count < MAX_SAMPLES) {
+        side->samples[side->sample_count++] =
+            bench_time_ns() - side->sent_ns[id & (MAX_IN_FLIGHT - 1)];
+    }
+    side->transfers++;
+    side->bytes += len;
+    usbredirparser_free_packet_data(side->parser, data);
+}
+
+static void guest_control_packet(void *priv, uint64_t id,
+    struct usb_redir_control_packet_header *control_header,
+    uint8_t *data, int data_len)
+{
+    guest_complete(priv, id, data, data_len);
+}
+
+static void guest_bulk_packet(void *priv, uint64_t id,
+    struct usb_redir_bulk_packet_header *bulk_header,
+    uint8_t *data, int data_len)
+{
+    guest_complete(priv, id, data, data_len);
+}
+
+#ifdef HAVE_ZEROCOPY
+static void zerocopy_free_buffer(void *priv, uint8_t *data)
+{
+    struct side *side = priv;
+
+    usbredirparser_free_write_buffer(side->parser, data);
+}
+#endif
+
+static struct usbredirparser *create_parser(struct side *side, int is_host)
+{
+    struct usbredirparser *parser = usbredirparser_create();
+    uint32_t caps[USB_REDIR_CAPS_SIZE] = { 0, };
+    int flags = is_host ? usbredirparser_fl_usb_host : 0;
+
+    if (!parser) {
+        return NULL;
+    }
+
+    parser->priv = side;
+    parser->log_func = bench_log;
+    parser->read_func = fd_read;
+    parser->write_func = fd_write;
+    parser->hello_func = bench_hello;
+    if (is_host) {
+        parser->control_packet_func = host_control_packet;
+        parser->bulk_packet_func = host_bulk_packet;
+    } else {
+        parser->control_packet_func = guest_control_packet;
+        parser->bulk_packet_func = guest_bulk_packet;
+    }
+
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_connect_device_version);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_ep_info_max_packet_size);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_64bits_ids);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_32bits_bulk_length);
+
+#ifdef HAVE_ZEROCOPY
+    if (side->zc) {
+        flags |= usbredirparser_fl_write_cb_owns_buffer;
+    }
+#endif
+    usbredirparser_init(parser, "usbredir-bench " PACKAGE_VERSION, caps,
+                        USB_REDIR_CAPS_SIZE, flags);
+    return parser;
+}
+
+/* Waits until one of the side's fds is ready, then reads and writes what it
+   can. Returns -1 on errors or when the other side closed the connection */
+static int side_poll(struct side *side)
+{
+    struct pollfd pfd[2];
+    int n = 0, r;
+
+#ifdef HAVE_SHM_TRANSPORT
+    /* The doorbell only rings for new data or when a full ring has space
+       again, so write what is queued before waiting for it */
+    if (side->shm) {
+        if (usbredirparser_has_data_to_write(side->parser) &&
+                usbredirparser_do_write(side->parser) < 0) {
+            return -1;
+        }
+        pfd[0].fd = usbredirshm_get_fd(side->shm);
+        pfd[0].events = POLLIN;
+        if (poll(pfd, 1, 1000) < 0 && errno != EINTR) {
+            return -1;
+        }
+        usbredirshm_ack(side->shm);
+        goto do_io;
+    }
+#endif
+    pfd[n].fd = side->in_fd;
+    pfd[n++].events = POLLIN;
+#ifdef HAVE_ZEROCOPY
+    if (side->zc && usbredirzerocopy_get_buffered_size(side->zc)) {
+        pfd[0].events |= POLLOUT;
+    }
+#endif
+    if (usbredirparser_has_data_to_write(side->parser)) {
+        if (side->out_fd == side->in_fd) {
+            pfd[0].events |= POLLOUT;
+        } else {
+            pfd[n].fd = side->out_fd;
+            pfd[n++].events = POLLOUT;
+        }
+    }
+    if (poll(pfd, n, 1000) < 0 && errno != EINTR) {
+        return -1;
+    }
+
+#ifdef HAVE_ZEROCOPY
+    /* Completions make the socket poll POLLERR */
+    if (side->zc) {
+        if (((pfd[0].revents & POLLERR) &&
+             usbredirzerocopy_complete(side->zc) < 0) ||
+                usbredirzerocopy_flush(side->zc) < 0) {
+            return -1;
+        }
+    }
+#endif
+
+#ifdef HAVE_SHM_TRANSPORT
+do_io:
+#endif
+    r = usbredirparser_do_read(side->parser);
+    if (r < 0) {
+        return -1;
+    }
+    if (usbredirparser_has_data_to_write(side->parser) &&
+            usbredirparser_do_write(side->parser) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static uint64_t thread_cpu_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void *host_thread(void *arg)
+{
+    struct side *host = arg;
+
+    while (side_poll(host) == 0) {
+        __atomic_store_n(&host->cpu_ns, thread_cpu_ns(), __ATOMIC_RELAXED);
+    }
+    if (!host->eof) {
+        fprintf(stderr, "Error on the usb-host side\n");
+    }
+    return NULL;
+}
+
+static void set_nonblock(int fd)
+{
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+static int open_tcp(int fds[2])
+{
+    struct sockaddr_in addr = { .sin_family = AF_INET };
+    socklen_t addr_len = sizeof(addr);
+    int listen_fd, r = -1;
+
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        return -1;
+    }
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+            listen(listen_fd, 1) != 0 ||
+            getsockname(listen_fd, (struct sockaddr *)&addr, &addr_len) != 0) {
+        goto leave;
+    }
+    fds[0] = socket(AF_INET, SOCK_STREAM, 0);
+    if (fds[0] < 0) {
+        goto leave;
+    }
+    if (connect(fds[0], (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fds[0]);
+        goto leave;
+    }
+    fds[1] = accept(listen_fd, NULL, NULL);
+    if (fds[1] < 0) {
+        close(fds[0]);
+        goto leave;
+    }
+    r = 0;
+leave:
+    close(listen_fd);
+    return r;
+}
+
+#ifdef __linux__
+/* Uses the vsock loopback transport (CID 1), which needs the
+   vsock_loopback module */
+static int open_vsock(int fds[2])
+{
+    struct sockaddr_vm addr = {
+        .svm_family = AF_VSOCK,
+        .svm_cid = VMADDR_CID_ANY,
+        .svm_port = VMADDR_PORT_ANY,
+    };
+    socklen_t addr_len = sizeof(addr);
+    int listen_fd, r = -1;
+
+    listen_fd = socket(AF_VSOCK, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        return -1;
+    }
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+            listen(listen_fd, 1) != 0 ||
+            getsockname(listen_fd, (struct sockaddr *)&addr, &addr_len) != 0) {
+        goto leave;
+    }
+    addr.svm_cid = VMADDR_CID_LOCAL;
+    fds[0] = socket(AF_VSOCK, SOCK_STREAM, 0);
+    if (fds[0] < 0) {
+        goto leave;
+    }
+    if (connect(fds[0], (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fds[0]);
+        goto leave;
+    }
+    fds[1] = accept(listen_fd, NULL, NULL);
+    if (fds[1] < 0) {
+        close(fds[0]);
+        goto leave;
+    }
+    r = 0;
+leave:
+    close(listen_fd);
+    return r;
+}
+#else
+static int open_vsock(int fds[2])
+{
+    return -1;
+}
+#endif
+
+#ifdef HAVE_SHM_TRANSPORT
+/* Like usbredirect --as shm:PATH the usb-host side creates the rings */
+static int open_shm(struct side *guest, struct side *host)
+{
+    int fds[2], r;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        return -1;
+    }
+    guest->in_fd = guest->out_fd = fds[0];
+    host->in_fd = host->out_fd = fds[1];
+    r = usbredirshm_create(USBREDIRSHM_DEFAULT_RING_SIZE, &host->shm);
+    if (r == 0) {
+        r = usbredirshm_send_fds(host->shm, host->in_fd);
+    }
+    if (r == 0) {
+        r = usbredirshm_receive(guest->in_fd, &guest->shm);
+    }
+    if (r != 0) {
+        errno = -r;
+        return -1;
+    }
+    return 0;
+}
+#endif
+
+/* Sets the guest and host fds up, a pair of pipes is what usbredirect
+   gets with stdio, the other transports are a single socket per side */
+static int open_transport(int transport, struct side *guest, struct side *host)
+{
+    int fds[2], fds2[2], r;
+
+    switch (transport) {
+#ifdef HAVE_SHM_TRANSPORT
+    case TRANSPORT_SHM:
+        return open_shm(guest, host);
+#endif
+    case TRANSPORT_TCP:
+    case TRANSPORT_TCP_ZEROCOPY:
+        r = open_tcp(fds);
+        break;
+    case TRANSPORT_UNIX:
+        r = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+        break;
+    case TRANSPORT_VSOCK:
+        r = open_vsock(fds);
+        break;
+    case TRANSPORT_PIPE:
+        if (pipe(fds) != 0) {
+            return -1;
+        }
+        if (pipe(fds2) != 0) {
+            close(fds[0]);
+            close(fds[1]);
+            return -1;
+        }
+        guest->in_fd = fds[0];
+        host->out_fd = fds[1];
+        host->in_fd = fds2[0];
+        guest->out_fd = fds2[1];
+        set_nonblock(fds[0]);
+        set_nonblock(fds[1]);
+        set_nonblock(fds2[0]);
+        set_nonblock(fds2[1]);
+        return 0;
+    default:
+        return -1;
+    }
+    if (r != 0) {
+        return -1;
+    }
+    guest->in_fd = guest->out_fd = fds[0];
+    host->in_fd = host->out_fd = fds[1];
+    set_nonblock(fds[0]);
+    set_nonblock(fds[1]);
+#ifdef HAVE_ZEROCOPY
+    /* Loopback copies MSG_ZEROCOPY data on receiving it after all, keep
+       using it anyway to see what that costs */
+    if (transport == TRANSPORT_TCP_ZEROCOPY) {
+        r = usbredirzerocopy_create(host->out_fd, ZEROCOPY_THRESHOLD,
+                                    usbredirzerocopy_fl_keep_on_copy,
+                                    zerocopy_free_buffer, host, &host->zc);
+        if (r < 0) {
+            close(fds[0]);
+            close(fds[1]);
+            guest->in_fd = guest->out_fd = host->in_fd = host->out_fd = -1;
+            errno = -r;
+            return -1;
+        }
+    }
+#endif
+    return 0;
+}
+
+static void close_side(struct side *side)
+{
+#ifdef HAVE_ZEROCOPY
+    usbredirzerocopy_destroy(side->zc);
+    side->zc = NULL;
+#endif
+#ifdef HAVE_SHM_TRANSPORT
+    usbredirshm_destroy(side->shm);
+    side->shm = NULL;
+#endif
+    if (side->out_fd != side->in_fd && side->out_fd >= 0) {
+        close(side->out_fd);
+    }
+    if (side->in_fd >= 0) {
+        close(side->in_fd);
+    }
+    side->in_fd = side->out_fd = -1;
+}
+
+static void send_request(struct side *guest, const struct bench_case *c,
+                         uint64_t id)
+{
+    guest->sent_ns[id & (MAX_IN_FLIGHT - 1)] = bench_time_ns();
+    if (c->control) {
+        struct usb_redir_control_packet_header control_header = {
+            .endpoint = 0x80,
+            .request = 6,        /* GET_DESCRIPTOR */
+            .requesttype = 0x80,
+            .value = 0x0100,
+            .length = c->size,
+        };
+        usbredirparser_send_control_packet(guest->parser, id,
+                                           &control_header, NULL, 0);
+    } else {
+        struct usb_redir_bulk_packet_header bulk_header = {
+            .endpoint = 0x81,
+            .length = c->size & 0xffff,
+            .length_high = c->size >> 16,
+        };
+        usbredirparser_send_bulk_packet(guest->parser, id, &bulk_header,
+                                        NULL, 0);
+    }
+}
+
+static int run_case(const struct bench_case *c)
+{
+    struct side guest = { .in_fd = -1, .out_fd = -1 };
+    struct side host = { .in_fd = -1, .out_fd = -1 };
+    uint64_t start, elapsed, allocs, cpu_ns, next_id = 0;
+    uint64_t min_ns = bench_opts.time * 1e9;
+    pthread_t thread;
+    int thread_started = 0, ret = -1;
+
+    if (open_transport(c->transport, &guest, &host) != 0) {
+        /* vsock loopback is often not available and neither is
+           MSG_ZEROCOPY on older kernels, that is not an error */
+        fprintf(stderr, "Skipping %s: %s transport not available: %s\n",
+                c->name, transport_names[c->transport], strerror(errno));
+        return (c->transport == TRANSPORT_VSOCK ||
+                c->transport == TRANSPORT_TCP_ZEROCOPY) ? 0 : -1;
+    }
+    guest.samples = malloc(MAX_SAMPLES * sizeof(*guest.samples));
+    guest.parser = create_parser(&guest, 0);
+    host.parser = create_parser(&host, 1);
+    if (!guest.samples || !guest.parser || !host.parser) {
+        fprintf(stderr, "Out of memory\n");
+        goto leave;
+    }
+    if (pthread_create(&thread, NULL, host_thread, &host) != 0) {
+        fprintf(stderr, "Error starting the usb-host thread\n");
+        goto leave;
+    }
+    thread_started = 1;
+
+    /* Exchange the hellos, so that the caps are negotiated */
+    while (!guest.got_hello) {
+        if (side_poll(&guest) != 0) {
+            fprintf(stderr, "Error hello exchange failed\n");
+            goto leave;
+        }
+    }
+
+    allocs = bench_alloc_count();
+    cpu_ns = __atomic_load_n(&host.cpu_ns, __ATOMIC_RELAXED);
+    start = bench_time_ns();
+    do {
+        while (next_id - guest.transfers < c->in_flight) {
+            send_request(&guest, c, next_id++);
+        }
+        if (side_poll(&guest) != 0) {
+            fprintf(stderr, "Error on the usb-guest side\n");
+            goto leave;
+        }
+        elapsed = bench_time_ns() - start;
+    } while (elapsed < min_ns);
+    while (guest.transfers < next_id) {
+        if (side_poll(&guest) != 0) {
+            fprintf(stderr, "Error on the usb-guest side\n");
+            goto leave;
+        }
+    }
+    elapsed = bench_time_ns() - start;
+    allocs = bench_alloc_count() - allocs;
+    cpu_ns = __atomic_load_n(&host.cpu_ns, __ATOMIC_RELAXED) - cpu_ns;
+    ret = 0;
+leave:
+    /* Closing the guest side makes the usb-host thread see EOF and exit */
+    close_side(&guest);
+    if (thread_started) {
+        pthread_join(thread, NULL);
+    }
+    if (ret == 0) {
+        bench_result_begin(c->name);
+        bench_result_str("transport", transport_names[c->transport]);
+        bench_result_u64("size", c->size);
+        bench_result_u64("in_flight", c->in_flight);
+        bench_result_throughput(elapsed, guest.transfers, guest.bytes, allocs);
+        bench_result_latency(guest.samples, guest.sample_count);
+        /* The usb-host sends the payload, so this is the sending cost */
+        bench_result_double("host_cpu_ms_per_gb",
+                            guest.bytes ? cpu_ns / 1e6 / (guest.bytes / 1e9) : 0);
+#ifdef HAVE_ZEROCOPY
+        if (host.zc) {
+            struct usbredirzerocopy_stats stats;
+
+            usbredirzerocopy_get_stats(host.zc, &stats);
+            bench_result_u64("zerocopy_sends", stats.zerocopy_sends);
+            bench_result_u64("zerocopy_copied", stats.copied);
+        }
+#endif
+        bench_result_end();
+    }
+    close_side(&host);
+    if (guest.parser) {
+        usbredirparser_destroy(guest.parser);
+    }
+    if (host.parser) {
+        usbredirparser_destroy(host.parser);
+    }
+    free(guest.samples);
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    int i, ret = 0;
+
+    if (bench_init(argc, argv, "transport",
+            "Measures the transports usbredirect supports, by running a\n"
+            "usb-guest and a usb-host usbredirparser in two threads over\n"
+            "TCP loopback, a Unix domain socket, a pair of pipes (as with\n"
+            "stdio), vsock loopback and shared memory rings. The usb-guest\n"
+            "keeps requests in flight, which the usb-host answers. Packets\n"
+            "and bytes are the completed transfers and their payload.") != 0) {
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    for (i = 0; i < MAX_PAYLOAD; i++) {
+        payload[i] = i;
+    }
+
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        if (!bench_case_selected(cases[i].name)) {
+            continue;
+        }
+        if (run_case(&cases[i]) != 0) {
+            fprintf(stderr, "Error running %s\n", cases[i].name);
+            ret = 1;
+        }
+    }
+
+    return bench_finish() || ret;
+}
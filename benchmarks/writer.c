@@ -0,0 +1,619 @@
+/* writer.c usbredirhost write flushing from the event thread vs a writer thread
+
+   Copyright 2026 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "usbredirhost.h"
+#include "usbredirwriter.h"
+#include "fakeusb.h"
+#include "bench.h"
+
+/* Runs the host side like usbredirect does by default: a libusb event
+   thread, a thread reading from the connection and usbredirhost with locks.
+   The usb-guest reads from the connection no faster than a slow link would
+   deliver, so the host's socket buffer fills up and most writes would
+   block. In the inline cases the flush callback writes from the thread
+   which queued the data, in the writer cases it signals the writer thread
+   of usbredirect --writer-thread, see tools/usbredirwriter.h. */
+
+#define SOCKET_BUFFER_SIZE (64 * 1024)
+#define INFLIGHT 8
+#define ID_SLOTS 16                 /* Power of 2, larger than INFLIGHT */
+#define MAX_LATENCY_SAMPLES (256 * 1024)
+#define SETUP_TIMEOUT_NS 1000000000ull
+
+struct bench_case {
+    const char *name;
+    int writer_thread;
+    int size;
+    unsigned int link_bytes_per_ms;
+};
+
+static const struct bench_case cases[] = {
+    { "inline-bulk-in-4k", 0, 4096, 16384 },
+    { "writer-bulk-in-4k", 1, 4096, 16384 },
+    { "inline-bulk-in-64k", 0, 65536, 16384 },
+    { "writer-bulk-in-64k", 1, 65536, 16384 },
+};
+
+struct host {
+    const struct bench_case *c;
+    libusb_context *ctx;
+    libusb_device *dev;
+    struct usbredirhost *usbredirhost;
+    int fd;
+    struct usbredirwriter *writer;
+    int run;
+    int failed;
+    pthread_t event_thread, reader_thread;
+    int event_started, reader_started;
+    /* Event thread CPU time, between measure_start and measure_stop */
+    int measure;
+    uint64_t event_cpu_ns;
+};
+
+struct guest {
+    const struct bench_case *c;
+    struct usbredirparser *parser;
+    int fd;
+    uint64_t link_start, link_bytes;
+    int connected;
+    int errors;
+    int running;
+    uint64_t next_id;
+    uint64_t submit_time[ID_SLOTS];
+    uint64_t transfers, bytes;
+    uint64_t *latencies;
+    size_t latency_count;
+};
+
+static void bench_log(void *priv, int level, const char *msg)
+{
+    if (level <= usbredirparser_warning) {
+        fprintf(stderr, "%s\n", msg);
+    }
+}
+
+static uint64_t thread_cpu_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**************************************************************************/
+/* usb-host                                                                */
+/**************************************************************************/
+
+static int host_read(void *priv, uint8_t *data, int count)
+{
+    struct host *h = priv;
+    ssize_t r = recv(h->fd, data, count, MSG_DONTWAIT);
+
+    if (r < 0) {
+        return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    }
+    return r ? r : -1;
+}
+
+static int host_write(void *priv, uint8_t *data, int count)
+{
+    struct host *h = priv;
+    ssize_t r = send(h->fd, data, count, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+    if (r < 0) {
+        return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    }
+    return r;
+}
+
+static void host_flush_inline(void *priv)
+{
+    struct host *h = priv;
+
+    /* usbredirhost_open_full() already flushes its hello */
+    if (h->usbredirhost) {
+        usbredirhost_write_guest_data(h->usbredirhost);
+    }
+}
+
+static void host_flush_writer(void *priv)
+{
+    struct host *h = priv;
+
+    usbredirwriter_flush(h->writer);
+}
+
+static void host_writer_failed(void *priv, int error)
+{
+    struct host *h = priv;
+
+    __atomic_store_n(&h->failed, 1, __ATOMIC_RELEASE);
+}
+
+static void *host_alloc_lock(void)
+{
+    pthread_mutex_t *mutex = malloc(sizeof(*mutex));
+
+    if (mutex) {
+        pthread_mutex_init(mutex, NULL);
+    }
+    return mutex;
+}
+
+static void host_lock(void *user_data)
+{
+    pthread_mutex_lock(user_data);
+}
+
+static void host_unlock(void *user_data)
+{
+    pthread_mutex_unlock(user_data);
+}
+
+static void host_free_lock(void *user_data)
+{
+    pthread_mutex_destroy(user_data);
+    free(user_data);
+}
+
+static void *event_thread(void *arg)
+{
+    struct host *h = arg;
+    uint64_t start = 0;
+    int measuring = 0;
+
+    while (__atomic_load_n(&h->run, __ATOMIC_ACQUIRE)) {
+        struct timeval tv = { 0, 10000 };
+        int measure = __atomic_load_n(&h->measure, __ATOMIC_ACQUIRE);
+
+        if (measure && !measuring) {
+            start = thread_cpu_ns();
+        } else if (!measure && measuring) {
+            h->event_cpu_ns = thread_cpu_ns() - start;
+        }
+        measuring = measure;
+        libusb_handle_events_timeout(h->ctx, &tv);
+    }
+    return NULL;
+}
+
+/* Like the GLib main loop of usbredirect: reads, and in the inline cases
+   also waits for the connection to become writable while data is queued */
+static void *reader_thread(void *arg)
+{
+    struct host *h = arg;
+
+    while (__atomic_load_n(&h->run, __ATOMIC_ACQUIRE)) {
+        struct pollfd pfd = { .fd = h->fd, .events = POLLIN };
+
+        if (!h->c->writer_thread &&
+                usbredirhost_has_data_to_write(h->usbredirhost)) {
+            pfd.events |= POLLOUT;
+        }
+        if (poll(&pfd, 1, 10) <= 0) {
+            continue;
+        }
+        if ((pfd.revents & (POLLIN | POLLHUP | POLLERR)) &&
+                usbredirhost_read_guest_data(h->usbredirhost) < 0) {
+            break;
+        }
+        if (pfd.revents & POLLOUT) {
+            usbredirhost_write_guest_data(h->usbredirhost);
+        }
+    }
+    return NULL;
+}
+
+static int host_start(struct host *h, int fd)
+{
+    struct fakeusb_device_config config;
+    libusb_device_handle *handle;
+    int i, r = 0;
+
+    h->fd = fd;
+    if (libusb_init(&h->ctx) != 0) {
+        fprintf(stderr, "Error initializing fakeusb\n");
+        return -1;
+    }
+
+    /* A device which completes the transfers right away */
+    fakeusb_device_config_init(&config);
+    config.control_latency_us = 0;
+    for (i = 0; config.endpoints[i].address; i++) {
+        config.endpoints[i].latency_us = 0;
+        config.endpoints[i].bytes_per_ms = 0;
+        config.endpoints[i].interval_us = 0;
+    }
+    h->dev = fakeusb_device_new(h->ctx, &config);
+    if (!h->dev || libusb_open(h->dev, &handle) != 0) {
+        fprintf(stderr, "Error creating the fakeusb device\n");
+        return -1;
+    }
+
+    if (h->c->writer_thread) {
+        r = usbredirwriter_create(NULL, host_writer_failed, h, &h->writer);
+        if (r < 0) {
+            fprintf(stderr, "Error creating the writer: %s\n", strerror(-r));
+            return -1;
+        }
+    }
+    h->usbredirhost = usbredirhost_open_full(h->ctx, handle, bench_log,
+        host_read, host_write,
+        h->c->writer_thread ? host_flush_writer : host_flush_inline,
+        host_alloc_lock, host_lock, host_unlock, host_free_lock,
+        h, "usbredir-bench " PACKAGE_VERSION, usbredirparser_warning, 0);
+    if (!h->usbredirhost ||
+            usbredirhost_enable_latency_stats(h->usbredirhost) != 0) {
+        fprintf(stderr, "Error creating usbredirhost\n");
+        return -1;
+    }
+
+    h->run = 1;
+    h->event_started =
+        pthread_create(&h->event_thread, NULL, event_thread, h) == 0;
+    h->reader_started =
+        pthread_create(&h->reader_thread, NULL, reader_thread, h) == 0;
+    if (h->c->writer_thread) {
+        r = usbredirwriter_start(h->writer, h->usbredirhost, h->fd);
+    }
+    if (!h->event_started || !h->reader_started || r < 0) {
+        fprintf(stderr, "Error starting the usb-host threads\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void host_stop(struct host *h)
+{
+    __atomic_store_n(&h->run, 0, __ATOMIC_RELEASE);
+    if (h->writer) {
+        usbredirwriter_stop(h->writer);
+    }
+    if (h->reader_started) {
+        pthread_join(h->reader_thread, NULL);
+    }
+    if (h->event_started) {
+        libusb_interrupt_event_handler(h->ctx);
+        pthread_join(h->event_thread, NULL);
+    }
+    if (h->usbredirhost) {
+        usbredirhost_close(h->usbredirhost);
+    }
+    if (h->dev) {
+        libusb_unref_device(h->dev);
+    }
+    if (h->ctx) {
+        libusb_exit(h->ctx);
+    }
+    usbredirwriter_destroy(h->writer);
+}
+
+/**************************************************************************/
+/* usb-guest                                                               */
+/**************************************************************************/
+
+/* Only returns as much as the simulated link delivered so far */
+static int guest_read(void *priv, uint8_t *data, int count)
+{
+    struct guest *g = priv;
+    uint64_t allowed = (bench_time_ns() - g->link_start) / 1000000 *
+                       g->c->link_bytes_per_ms;
+    ssize_t r;
+
+    if (g->link_bytes >= allowed) {
+        return 0;
+    }
+    if (count > allowed - g->link_bytes) {
+        count = allowed - g->link_bytes;
+    }
+    r = recv(g->fd, data, count, MSG_DONTWAIT);
+    if (r < 0) {
+        return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    }
+    if (r == 0) {
+        return -1;
+    }
+    g->link_bytes += r;
+    return r;
+}
+
+static int guest_write(void *priv, uint8_t *data, int count)
+{
+    struct guest *g = priv;
+    ssize_t r = send(g->fd, data, count, MSG_NOSIGNAL);
+
+    if (r < 0) {
+        return errno == EINTR ? 0 : -1;
+    }
+    return r;
+}
+
+static void guest_submit(struct guest *g)
+{
+    struct usb_redir_bulk_packet_header bulk_header = {
+        .endpoint = 0x81,
+        .length = g->c->size & 0xffff,
+        .length_high = g->c->size >> 16,
+    };
+    uint64_t id = g->next_id++;
+
+    g->submit_time[id & (ID_SLOTS - 1)] = bench_time_ns();
+    usbredirparser_send_bulk_packet(g->parser, id, &bulk_header, NULL, 0);
+}
+
+static void guest_device_connect(void *priv,
+    struct usb_redir_device_connect_header *device_connect)
+{
+    struct guest *g = priv;
+
+    g->connected = 1;
+}
+
+static void guest_device_disconnect(void *priv)
+{
+    struct guest *g = priv;
+
+    g->errors++;
+}
+
+static void guest_interface_info(void *priv,
+    struct usb_redir_interface_info_header *interface_info)
+{
+}
+
+static void guest_ep_info(void *priv, struct usb_redir_ep_info_header *ep_info)
+{
+}
+
+static void guest_filter_reject(void *priv)
+{
+}
+
+static void guest_filter_filter(void *priv,
+    struct usbredirfilter_rule *rules, int rules_count)
+{
+    free(rules);
+}
+
+static void guest_bulk_packet(void *priv, uint64_t id,
+    struct usb_redir_bulk_packet_header *bulk_header,
+    uint8_t *data, int data_len)
+{
+    struct guest *g = priv;
+
+    usbredirparser_free_packet_data(g->parser, data);
+    if (bulk_header->status != usb_redir_success) {
+        g->errors++;
+    }
+    if (g->running) {
+        g->transfers++;
+        g->bytes += data_len;
+        if (g->latency_count < MAX_LATENCY_SAMPLES) {
+            g->latencies[g->latency_count++] =
+                bench_time_ns() - g->submit_time[id & (ID_SLOTS - 1)];
+        }
+    }
+    guest_submit(g);
+}
+
+static struct usbredirparser *create_guest(struct guest *g)
+{
+    struct usbredirparser *parser = usbredirparser_create();
+    uint32_t caps[USB_REDIR_CAPS_SIZE] = { 0, };
+
+    if (!parser) {
+        return NULL;
+    }
+
+    parser->priv = g;
+    parser->log_func = bench_log;
+    parser->read_func = guest_read;
+    parser->write_func = guest_write;
+    parser->device_connect_func = guest_device_connect;
+    parser->device_disconnect_func = guest_device_disconnect;
+    parser->interface_info_func = guest_interface_info;
+    parser->ep_info_func = guest_ep_info;
+    parser->filter_reject_func = guest_filter_reject;
+    parser->filter_filter_func = guest_filter_filter;
+    parser->bulk_packet_func = guest_bulk_packet;
+
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_connect_device_version);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_filter);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_device_disconnect_ack);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_ep_info_max_packet_size);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_64bits_ids);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_32bits_bulk_length);
+
+    usbredirparser_init(parser, "usbredir-bench " PACKAGE_VERSION, caps,
+                        USB_REDIR_CAPS_SIZE, 0);
+    return parser;
+}
+
+/* Handles the guest side once, waiting for data or link budget when
+   nothing could be read */
+static int guest_iterate(struct guest *g)
+{
+    uint64_t bytes = g->link_bytes;
+    struct pollfd pfd = { .fd = g->fd, .events = POLLIN };
+
+    if (usbredirparser_do_read(g->parser) < 0) {
+        fprintf(stderr, "Error reading host data\n");
+        return -1;
+    }
+    if (usbredirparser_has_data_to_write(g->parser) &&
+            usbredirparser_do_write(g->parser) < 0) {
+        fprintf(stderr, "Error writing guest data\n");
+        return -1;
+    }
+    if (g->link_bytes == bytes) {
+        /* Either the socket is empty, or the link budget is used up, which
+           gets refilled every ms */
+        poll(&pfd, 1, 1);
+    }
+    return g->errors ? -1 : 0;
+}
+
+static uint64_t stage_p99(struct usbredirhost *host, int stage)
+{
+    struct usbredirhost_latency_histogram hist;
+
+    if (usbredirhost_get_latency_histogram(host, usb_redir_type_bulk, stage,
+                                           &hist) != 0) {
+        return 0;
+    }
+    return usbredirhost_latency_percentile(&hist, 99.0);
+}
+
+static int run_case(const struct bench_case *c)
+{
+    struct host host = { .c = c };
+    struct guest guest = { .c = c };
+    uint64_t start, elapsed, allocs, min_ns = bench_opts.time * 1e9;
+    int fds[2] = { -1, -1 }, size = SOCKET_BUFFER_SIZE, i, ret = -1;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        fprintf(stderr, "Error creating socketpair: %s\n", strerror(errno));
+        return -1;
+    }
+    setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    setsockopt(fds[1], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+    guest.fd = fds[1];
+    guest.latencies = malloc(MAX_LATENCY_SAMPLES * sizeof(uint64_t));
+    guest.parser = create_guest(&guest);
+    if (!guest.latencies || !guest.parser) {
+        fprintf(stderr, "Out of memory\n");
+        goto leave;
+    }
+    if (host_start(&host, fds[0]) != 0) {
+        goto leave;
+    }
+
+    /* The link only gets slow once the device is connected */
+    guest.link_start = bench_time_ns() - 1000000000;
+    guest.link_bytes = 0;
+    start = bench_time_ns();
+    while (!guest.connected) {
+        if (guest_iterate(&guest) != 0) {
+            goto leave;
+        }
+        if (bench_time_ns() - start > SETUP_TIMEOUT_NS) {
+            fprintf(stderr, "Error waiting for the device connect\n");
+            goto leave;
+        }
+    }
+    guest.link_start = bench_time_ns();
+    guest.link_bytes = 0;
+    for (i = 0; i < INFLIGHT; i++) {
+        guest_submit(&guest);
+    }
+
+    start = bench_time_ns();
+    while (bench_time_ns() - start < min_ns / 10) {
+        if (guest_iterate(&guest) != 0) {
+            goto leave;
+        }
+    }
+
+    usbredirhost_reset_latency_stats(host.usbredirhost);
+    __atomic_store_n(&host.measure, 1, __ATOMIC_RELEASE);
+    guest.running = 1;
+    allocs = bench_alloc_count();
+    start = bench_time_ns();
+    do {
+        if (guest_iterate(&guest) != 0 || host.failed) {
+            fprintf(stderr, "%s: transfers failed\n", c->name);
+            goto leave;
+        }
+        elapsed = bench_time_ns() - start;
+    } while (elapsed < min_ns);
+    guest.running = 0;
+    allocs = bench_alloc_count() - allocs;
+    __atomic_store_n(&host.measure, 0, __ATOMIC_RELEASE);
+    /* Let the event thread take its CPU time sample */
+    libusb_interrupt_event_handler(host.ctx);
+    usleep(20000);
+
+    bench_result_begin(c->name);
+    bench_result_str("flush", c->writer_thread ? "writer-thread" : "inline");
+    bench_result_u64("size", c->size);
+    bench_result_u64("link_bytes_per_ms", c->link_bytes_per_ms);
+    bench_result_u64("cpus", sysconf(_SC_NPROCESSORS_ONLN));
+    bench_result_throughput(elapsed, guest.transfers, guest.bytes, allocs);
+    bench_result_latency(guest.latencies, guest.latency_count);
+    bench_result_double("device_p99_us",
+        stage_p99(host.usbredirhost, usbredirhost_latency_stage_device) / 1e3);
+    bench_result_double("queue_p99_us",
+        stage_p99(host.usbredirhost, usbredirhost_latency_stage_queue) / 1e3);
+    /* CPU time of the libusb event thread per completed transfer */
+    bench_result_double("event_thread_us_per_transfer", guest.transfers ?
+                        host.event_cpu_ns / 1e3 / guest.transfers : 0);
+    bench_result_end();
+    ret = 0;
+leave:
+    /* Unblock a host write, the host threads see EOF */
+    shutdown(fds[1], SHUT_RDWR);
+    host_stop(&host);
+    if (guest.parser) {
+        usbredirparser_destroy(guest.parser);
+    }
+    close(fds[0]);
+    close(fds[1]);
+    free(guest.latencies);
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    int i, ret = 0;
+
+    if (bench_init(argc, argv, "writer",
+            "Compares writing to the usb-guest from the thread which queued the\n"
+            "data with writing from a separate writer thread woken through an\n"
+            "eventfd, as usbredirect --writer-thread does, over a simulated\n"
+            "slow link of 16 MB/s. The usb-guest keeps 8 bulk IN transfers in\n"
+            "flight on a simulated (fakeusb) device which completes them right\n"
+            "away. Next to the usb-guest side latency this reports the p99 of\n"
+            "the host's device and queue stages and the CPU time the libusb\n"
+            "event thread spends per transfer.") != 0) {
+        return 1;
+    }
+
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        if (!bench_case_selected(cases[i].name)) {
+            continue;
+        }
+        if (run_case(&cases[i]) != 0) {
+            fprintf(stderr, "Error running %s\n", cases[i].name);
+            ret = 1;
+        }
+    }
+
+    return bench_finish() || ret;
+}
@@ -16,10 +16,13 @@
    along with this library; if not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <cerrno>
 #include <cstdio>
+#include <cstring>
 #include <limits>
 #include <memory>
 #include <string>
+#include <vector>
 
 #include <fuzzer/FuzzedDataProvider.h>
 
@@ -31,6 +34,52 @@ struct FilterDeleter {
         usbredirfilter_free(ptr);
     }
 };
+
+// Formatting the rules and parsing them again must give the same rules back,
+// with the allow value normalized to 0 or 1, unless the separators are
+// characters used in the formatted values
+void check_round_trip(const usbredirfilter_rule *rules, int rules_count,
+                      const std::string &token_sep, const std::string &rule_sep)
+{
+    std::unique_ptr<char, FilterDeleter> str;
+    std::unique_ptr<usbredirfilter_rule, FilterDeleter> parsed;
+    usbredirfilter_rule *parsed_ptr = nullptr;
+    int i, count;
+
+    str.reset(usbredirfilter_rules_to_string(rules, rules_count,
+                                             token_sep.c_str(),
+                                             rule_sep.c_str()));
+    if (str == nullptr) {
+        abort();
+    }
+
+    if (token_sep == rule_sep ||
+            strpbrk(token_sep.c_str(), "0123456789abcdefx-") != nullptr ||
+            strpbrk(rule_sep.c_str(), "0123456789abcdefx-") != nullptr) {
+        return;
+    }
+
+    if (usbredirfilter_string_to_rules(str.get(), token_sep.c_str(),
+                                       rule_sep.c_str(), &parsed_ptr,
+                                       &count) != 0) {
+        abort();
+    }
+    parsed.reset(parsed_ptr);
+    if (count != rules_count) {
+        abort();
+    }
+    for (i = 0; i < count; i++) {
+        const usbredirfilter_rule &a = rules[i], &b = parsed_ptr[i];
+
+        if (a.device_class != b.device_class ||
+                a.vendor_id != b.vendor_id ||
+                a.product_id != b.product_id ||
+                a.device_version_bcd != b.device_version_bcd ||
+                !a.allow != !b.allow) {
+            abort();
+        }
+    }
+}
 }
 
 extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
@@ -54,13 +103,41 @@ extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
         rule_sep = fdp.ConsumeBytesAsString(1);
 
     {
+        const std::string filter = fdp.ConsumeRandomLengthString();
         usbredirfilter_rule *rules_ptr = nullptr;
 
         ret = usbredirfilter_string_to_rules(
-            fdp.ConsumeRandomLengthString().c_str(),
+            filter.c_str(),
             token_sep.c_str(), rule_sep.c_str(),
             &rules_ptr, &rules_count);
 
+        // Parse the same bytes from an exactly sized, not 0 terminated,
+        // buffer, without embedded 0 bytes both parsers must agree
+        std::vector<char> buf(filter.begin(), filter.end());
+        usbredirfilter_rule *buf_rules_ptr = nullptr;
+        int buf_ret, buf_rules_count, error_pos;
+
+        buf_ret = usbredirfilter_buf_to_rules(
+            buf.data(), buf.size(), token_sep.c_str(), rule_sep.c_str(),
+            &buf_rules_ptr, &buf_rules_count, &error_pos);
+        std::unique_ptr<usbredirfilter_rule, FilterDeleter>
+            buf_rules(buf_rules_ptr);
+
+        if (buf_ret == -EINVAL && token_sep[0] != '\0' && rule_sep[0] != '\0' &&
+                (error_pos < 0 || error_pos > (int)buf.size())) {
+            abort();
+        }
+        if (filter.find('\0') == std::string::npos) {
+            if (buf_ret != ret) {
+                abort();
+            }
+            if (ret == 0 && (buf_rules_count != rules_count ||
+                    (rules_count > 0 && memcmp(buf_rules_ptr, rules_ptr,
+                           rules_count * sizeof(*rules_ptr)) != 0))) {
+                abort();
+            }
+        }
+
         if (ret != 0 || rules_ptr == nullptr) {
             return 1;
         }
@@ -71,13 +148,7 @@ extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
     usbredirfilter_verify(rules.get(), rules_count);
     usbredirfilter_print(rules.get(), rules_count, dev_null);
 
-    {
-        std::unique_ptr<char, FilterDeleter> str;
-
-        str.reset(usbredirfilter_rules_to_string(rules.get(), rules_count,
-                                                 token_sep.c_str(),
-                                                 rule_sep.c_str()));
-    }
+    check_round_trip(rules.get(), rules_count, token_sep, rule_sep);
 
     {
         const int interface_count = fdp.ConsumeIntegralInRange(1, 128);
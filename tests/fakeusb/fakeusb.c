@@ -0,0 +1,1731 @@
+/* fakeusb - a simulated libusb device backend for tests and benchmarks
+
+   Copyright 2026 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef HAVE_SYS_TIMERFD_H
+#include <sys/timerfd.h>
+#endif
+#include "fakeusb.h"
+
+/* Same index layout as usbredirhost uses */
+#define EP2I(ep_address) (((ep_address & 0x80) >> 3) | (ep_address & 0x0f))
+#define NO_EP_TYPE 0xff
+
+#define MAX_INTERFACES 32
+
+struct fakeusb_ep {
+    uint8_t type;               /* NO_EP_TYPE if the endpoint does not exist */
+    uint8_t interface;
+    uint16_t max_packet_size;
+    unsigned int interval_us;
+    struct fakeusb_ep_config config;
+    uint64_t busy_until;
+    uint64_t count;
+    int halted;
+    uint8_t fill;
+    struct fakeusb_ep_stats stats;
+};
+
+struct libusb_context {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    /* Submitted transfers sorted by the time they are due */
+    struct fakeusb_transfer *pending;
+    libusb_device **devices;
+    int device_count;
+    /* Becomes readable when there is something to handle right away,
+       for users which poll the libusb fds */
+    int wakeup_pipe[2];
+    int wakeup_signalled;
+    struct libusb_pollfd pollfd;
+    /* Becomes readable when the first pending transfer is due, like the
+       usbfs fd of a real libusb on Linux, -1 without timerfd support */
+    int timer_fd;
+    struct libusb_pollfd timer_pollfd;
+    /* Only armed once libusb_get_pollfds() was called */
+    int timer_used;
+    int interrupted;
+};
+
+struct libusb_device {
+    libusb_context *ctx;
+    int refs;
+    enum libusb_speed speed;
+    uint8_t bus_number;
+    uint8_t device_address;
+    uint8_t device_desc[LIBUSB_DT_DEVICE_SIZE];
+    uint8_t *config_desc;
+    int config_desc_len;
+    struct libusb_config_descriptor *config;
+    char *strings[3];
+    unsigned int control_latency_us;
+    int active_config;          /* bConfigurationValue, 0 if unconfigured */
+    uint8_t alt_setting[MAX_INTERFACES];
+    int disconnected;
+    size_t dev_mem_size;
+    size_t dev_mem_used;
+    struct fakeusb_ep ep[FAKEUSB_MAX_ENDPOINTS];
+};
+
+struct libusb_device_handle {
+    libusb_device *dev;
+    uint32_t claimed;
+};
+
+struct fakeusb_transfer {
+    struct fakeusb_transfer *next;
+    uint64_t due;
+    int pending;
+    int cancelled;
+    enum libusb_transfer_status status;
+    uint32_t stream_id;
+    /* IN data to fill in on completion */
+    int fill_len;
+    uint8_t fill_byte;
+    /* Must be last, because of the iso packet descriptors */
+    struct libusb_transfer pub;
+};
+
+#define FAKEUSB_TRANSFER(t) ((struct fakeusb_transfer *) \
+    ((uint8_t *)(t) - offsetof(struct fakeusb_transfer, pub)))
+
+static pthread_mutex_t default_ctx_lock = PTHREAD_MUTEX_INITIALIZER;
+static libusb_context *default_ctx;
+
+static void fakeusb_device_free(libusb_device *dev);
+
+static const uint8_t default_device_desc[LIBUSB_DT_DEVICE_SIZE] = {
+    18, LIBUSB_DT_DEVICE, 0x00, 0x02,   /* USB 2.0 */
+    0xff, 0x00, 0x00, 64,               /* vendor specific class, ep0 64 */
+    0x09, 0x12, 0x01, 0x00,             /* 1209:0001 */
+    0x00, 0x01, 1, 2,                   /* bcdDevice 1.00, strings */
+    3, 1,                               /* serial string, 1 config */
+};
+
+static const uint8_t default_config_desc[] = {
+    9, LIBUSB_DT_CONFIG, 71, 0, 2, 1, 0, 0x80, 50,
+    /* Interface 0: bulk in / out, interrupt in */
+    9, LIBUSB_DT_INTERFACE, 0, 0, 3, 0xff, 0, 0, 0,
+    7, LIBUSB_DT_ENDPOINT, 0x81, LIBUSB_TRANSFER_TYPE_BULK, 0x00, 0x02, 0,
+    7, LIBUSB_DT_ENDPOINT, 0x02, LIBUSB_TRANSFER_TYPE_BULK, 0x00, 0x02, 0,
+    7, LIBUSB_DT_ENDPOINT, 0x83, LIBUSB_TRANSFER_TYPE_INTERRUPT, 64, 0, 4,
+    /* Interface 1: alt 0 without endpoints, alt 1 iso in / out */
+    9, LIBUSB_DT_INTERFACE, 1, 0, 0, 0xff, 0, 0, 0,
+    9, LIBUSB_DT_INTERFACE, 1, 1, 2, 0xff, 0, 0, 0,
+    7, LIBUSB_DT_ENDPOINT, 0x84, LIBUSB_TRANSFER_TYPE_ISOCHRONOUS, 0x00, 0x04, 1,
+    7, LIBUSB_DT_ENDPOINT, 0x05, LIBUSB_TRANSFER_TYPE_ISOCHRONOUS, 0x00, 0x04, 1,
+};
+
+static uint64_t fakeusb_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint16_t get_le16(const uint8_t *p)
+{
+    return p[0] | p[1] << 8;
+}
+
+/**************************************************************************/
+/* Descriptor handling                                                     */
+/**************************************************************************/
+
+static void fakeusb_free_config(struct libusb_config_descriptor *config)
+{
+    int i, j;
+
+    if (!config) {
+        return;
+    }
+    for (i = 0; i < config->bNumInterfaces; i++) {
+        const struct libusb_interface *intf = &config->interface[i];
+
+        for (j = 0; j < intf->num_altsetting; j++) {
+            free((void *)intf->altsetting[j].endpoint);
+        }
+        free((void *)intf->altsetting);
+    }
+    free((void *)config->interface);
+    free(config);
+}
+
+/* Parse a raw configuration descriptor like libusb does, extra descriptors
+   following an endpoint get stored as that endpoint's extra data and point
+   into raw, so raw must outlive the result */
+static struct libusb_config_descriptor *fakeusb_parse_config(
+    const uint8_t *raw, int len)
+{
+    struct libusb_config_descriptor *config;
+    struct libusb_interface *interfaces;
+    struct libusb_interface_descriptor *alt = NULL;
+    struct libusb_endpoint_descriptor *ep = NULL;
+    int pos, i;
+
+    if (len < LIBUSB_DT_CONFIG_SIZE || raw[1] != LIBUSB_DT_CONFIG ||
+            get_le16(raw + 2) != len) {
+        return NULL;
+    }
+
+    config = calloc(1, sizeof(*config));
+    interfaces = calloc(MAX_INTERFACES, sizeof(*interfaces));
+    if (!config || !interfaces) {
+        free(config);
+        free(interfaces);
+        return NULL;
+    }
+    config->bLength = raw[0];
+    config->bDescriptorType = raw[1];
+    config->wTotalLength = len;
+    config->bConfigurationValue = raw[5];
+    config->iConfiguration = raw[6];
+    config->bmAttributes = raw[7];
+    config->MaxPower = raw[8];
+    config->interface = interfaces;
+
+    for (pos = raw[0]; pos + 2 <= len; pos += raw[pos]) {
+        const uint8_t *d = raw + pos;
+
+        if (d[0] < 2 || pos + d[0] > len) {
+            goto error;
+        }
+        switch (d[1]) {
+        case LIBUSB_DT_INTERFACE: {
+            struct libusb_interface_descriptor *alts;
+
+            if (d[0] < LIBUSB_DT_INTERFACE_SIZE) {
+                goto error;
+            }
+            for (i = 0; i < config->bNumInterfaces; i++) {
+                if (interfaces[i].altsetting[0].bInterfaceNumber == d[2]) {
+                    break;
+                }
+            }
+            if (i == config->bNumInterfaces) {
+                if (i == MAX_INTERFACES) {
+                    goto error;
+                }
+                config->bNumInterfaces++;
+            }
+            alts = realloc((void *)interfaces[i].altsetting,
+                           (interfaces[i].num_altsetting + 1) * sizeof(*alts));
+            if (!alts) {
+                goto error;
+            }
+            interfaces[i].altsetting = alts;
+            alt = &alts[interfaces[i].num_altsetting++];
+            memset(alt, 0, sizeof(*alt));
+            alt->bLength = d[0];
+            alt->bDescriptorType = d[1];
+            alt->bInterfaceNumber = d[2];
+            alt->bAlternateSetting = d[3];
+            alt->bInterfaceClass = d[5];
+            alt->bInterfaceSubClass = d[6];
+            alt->bInterfaceProtocol = d[7];
+            alt->iInterface = d[8];
+            ep = NULL;
+            break;
+        }
+        case LIBUSB_DT_ENDPOINT: {
+            struct libusb_endpoint_descriptor *eps;
+
+            if (!alt || d[0] < LIBUSB_DT_ENDPOINT_SIZE) {
+                goto error;
+            }
+            eps = realloc((void *)alt->endpoint,
+                          (alt->bNumEndpoints + 1) * sizeof(*eps));
+            if (!eps) {
+                goto error;
+            }
+            alt->endpoint = eps;
+            ep = &eps[alt->bNumEndpoints++];
+            memset(ep, 0, sizeof(*ep));
+            ep->bLength = d[0];
+            ep->bDescriptorType = d[1];
+            ep->bEndpointAddress = d[2];
+            ep->bmAttributes = d[3];
+            ep->wMaxPacketSize = get_le16(d + 4);
+            ep->bInterval = d[6];
+            if (d[0] >= LIBUSB_DT_ENDPOINT_AUDIO_SIZE) {
+                ep->bRefresh = d[7];
+                ep->bSynchAddress = d[8];
+            }
+            break;
+        }
+        default:
+            /* Class specific / companion descriptors */
+            if (ep) {
+                if (!ep->extra) {
+                    ep->extra = d;
+                }
+                ep->extra_length += d[0];
+            } else if (alt) {
+                if (!alt->extra) {
+                    alt->extra = d;
+                }
+                alt->extra_length += d[0];
+            }
+            break;
+        }
+    }
+    if (config->bNumInterfaces != raw[4]) {
+        goto error;
+    }
+    return config;
+
+error:
+    fakeusb_free_config(config);
+    return NULL;
+}
+
+static const struct libusb_interface_descriptor *fakeusb_find_alt(
+    libusb_device *dev, int interface, int alt_setting)
+{
+    int i, j;
+
+    if (!dev->active_config) {
+        return NULL;
+    }
+    for (i = 0; i < dev->config->bNumInterfaces; i++) {
+        const struct libusb_interface *intf = &dev->config->interface[i];
+
+        for (j = 0; j < intf->num_altsetting; j++) {
+            if (intf->altsetting[j].bInterfaceNumber == interface &&
+                    intf->altsetting[j].bAlternateSetting == alt_setting) {
+                return &intf->altsetting[j];
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Returns 1 if any alt setting of the config has the endpoint */
+static int fakeusb_has_endpoint(libusb_device *dev, uint8_t address)
+{
+    int i, j, k;
+
+    if (address == 0) {
+        return 1;
+    }
+    for (i = 0; i < dev->config->bNumInterfaces; i++) {
+        const struct libusb_interface *intf = &dev->config->interface[i];
+
+        for (j = 0; j < intf->num_altsetting; j++) {
+            const struct libusb_interface_descriptor *alt =
+                &intf->altsetting[j];
+
+            for (k = 0; k < alt->bNumEndpoints; k++) {
+                if (alt->endpoint[k].bEndpointAddress == address) {
+                    return 1;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+/* (Re)compute the available endpoints from the active config and alt
+   settings, called with the ctx lock held */
+static void fakeusb_update_endpoints(libusb_device *dev)
+{
+    const struct libusb_interface_descriptor *alt;
+    int i, j;
+
+    for (i = 1; i < FAKEUSB_MAX_ENDPOINTS; i++) {
+        dev->ep[i].type = NO_EP_TYPE;
+    }
+    dev->ep[0].type = LIBUSB_TRANSFER_TYPE_CONTROL;
+
+    for (i = 0; dev->active_config && i < dev->config->bNumInterfaces; i++) {
+        int n = dev->config->interface[i].altsetting[0].bInterfaceNumber;
+
+        alt = fakeusb_find_alt(dev, n, dev->alt_setting[i]);
+        if (!alt) {
+            continue;
+        }
+        for (j = 0; j < alt->bNumEndpoints; j++) {
+            const struct libusb_endpoint_descriptor *desc = &alt->endpoint[j];
+            struct fakeusb_ep *ep = &dev->ep[EP2I(desc->bEndpointAddress)];
+            unsigned int interval = desc->bInterval ? desc->bInterval : 1;
+
+            ep->type = desc->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK;
+            ep->interface = n;
+            ep->max_packet_size = desc->wMaxPacketSize & 0x7ff;
+            if (ep->type == LIBUSB_TRANSFER_TYPE_INTERRUPT &&
+                    dev->speed < LIBUSB_SPEED_HIGH) {
+                /* Full / low speed interrupt intervals are in frames */
+                ep->interval_us = interval * 1000;
+            } else {
+                if (interval > 16) {
+                    interval = 16;
+                }
+                ep->interval_us = (dev->speed >= LIBUSB_SPEED_HIGH ? 125 :
+                                   1000) << (interval - 1);
+            }
+        }
+    }
+}
+
+/**************************************************************************/
+/* Context and device management                                           */
+/**************************************************************************/
+
+static void fakeusb_wakeup(libusb_context *ctx)
+{
+    pthread_cond_broadcast(&ctx->cond);
+    if (!ctx->wakeup_signalled) {
+        ctx->wakeup_signalled = 1;
+        if (write(ctx->wakeup_pipe[1], "", 1) != 1) {
+            /* Nothing we can do, pollers will see it on the next timeout */
+        }
+    }
+}
+
+static void fakeusb_clear_wakeup(libusb_context *ctx)
+{
+    uint8_t buf[16];
+
+    if (ctx->wakeup_signalled) {
+        while (read(ctx->wakeup_pipe[0], buf, sizeof(buf)) > 0);
+        ctx->wakeup_signalled = 0;
+    }
+}
+
+/* Arm the timer for the first pending transfer, or disarm it. Transfers
+   which complete right away signal the wakeup pipe instead */
+static void fakeusb_update_timer(libusb_context *ctx)
+{
+#ifdef HAVE_SYS_TIMERFD_H
+    struct itimerspec its;
+
+    if (!ctx->timer_used) {
+        return;
+    }
+    memset(&its, 0, sizeof(its));
+    if (ctx->pending) {
+        /* An absolute time of 0 would disarm the timer */
+        uint64_t due = ctx->pending->due ? ctx->pending->due : 1;
+
+        its.it_value.tv_sec = due / 1000000000;
+        its.it_value.tv_nsec = due % 1000000000;
+    }
+    /* Setting the timer also clears a previous expiration */
+    timerfd_settime(ctx->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+#endif
+}
+
+static libusb_context *fakeusb_ctx_new(void)
+{
+    libusb_context *ctx = calloc(1, sizeof(*ctx));
+    pthread_condattr_t attr;
+
+    if (!ctx) {
+        return NULL;
+    }
+    if (pipe(ctx->wakeup_pipe) != 0) {
+        free(ctx);
+        return NULL;
+    }
+    fcntl(ctx->wakeup_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(ctx->wakeup_pipe[1], F_SETFL, O_NONBLOCK);
+    ctx->pollfd.fd = ctx->wakeup_pipe[0];
+    ctx->pollfd.events = POLLIN;
+#ifdef HAVE_SYS_TIMERFD_H
+    ctx->timer_fd = timerfd_create(CLOCK_MONOTONIC,
+                                   TFD_NONBLOCK | TFD_CLOEXEC);
+#else
+    ctx->timer_fd = -1;
+#endif
+    ctx->timer_pollfd.fd = ctx->timer_fd;
+    ctx->timer_pollfd.events = POLLIN;
+
+    pthread_mutex_init(&ctx->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&ctx->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    return ctx;
+}
+
+static libusb_context *fakeusb_get_ctx(libusb_context *ctx)
+{
+    if (ctx) {
+        return ctx;
+    }
+    pthread_mutex_lock(&default_ctx_lock);
+    if (!default_ctx) {
+        default_ctx = fakeusb_ctx_new();
+        if (!default_ctx) {
+            fprintf(stderr, "fakeusb: error creating the default context\n");
+            abort();
+        }
+    }
+    pthread_mutex_unlock(&default_ctx_lock);
+    return default_ctx;
+}
+
+int libusb_init(libusb_context **ctx)
+{
+    if (!ctx) {
+        fakeusb_get_ctx(NULL);
+        return LIBUSB_SUCCESS;
+    }
+    *ctx = fakeusb_ctx_new();
+    return *ctx ? LIBUSB_SUCCESS : LIBUSB_ERROR_NO_MEM;
+}
+
+/* All devices of the context must have been unreferenced before this */
+void libusb_exit(libusb_context *ctx)
+{
+    int i;
+
+    /* The default context lives until the process exits */
+    if (!ctx) {
+        return;
+    }
+    /* Drop the device list references, which are the last ones */
+    for (i = 0; i < ctx->device_count; i++) {
+        if (--ctx->devices[i]->refs == 0) {
+            fakeusb_device_free(ctx->devices[i]);
+        }
+    }
+    free(ctx->devices);
+    close(ctx->wakeup_pipe[0]);
+    close(ctx->wakeup_pipe[1]);
+    if (ctx->timer_fd != -1) {
+        close(ctx->timer_fd);
+    }
+    pthread_cond_destroy(&ctx->cond);
+    pthread_mutex_destroy(&ctx->lock);
+    free(ctx);
+}
+
+void libusb_set_debug(libusb_context *ctx, int level)
+{
+}
+
+int libusb_set_option(libusb_context *ctx, enum libusb_option option, ...)
+{
+    return LIBUSB_SUCCESS;
+}
+
+const char *libusb_error_name(int errcode)
+{
+    switch (errcode) {
+    case LIBUSB_SUCCESS:             return "LIBUSB_SUCCESS";
+    case LIBUSB_ERROR_IO:            return "LIBUSB_ERROR_IO";
+    case LIBUSB_ERROR_INVALID_PARAM: return "LIBUSB_ERROR_INVALID_PARAM";
+    case LIBUSB_ERROR_ACCESS:        return "LIBUSB_ERROR_ACCESS";
+    case LIBUSB_ERROR_NO_DEVICE:     return "LIBUSB_ERROR_NO_DEVICE";
+    case LIBUSB_ERROR_NOT_FOUND:     return "LIBUSB_ERROR_NOT_FOUND";
+    case LIBUSB_ERROR_BUSY:          return "LIBUSB_ERROR_BUSY";
+    case LIBUSB_ERROR_TIMEOUT:       return "LIBUSB_ERROR_TIMEOUT";
+    case LIBUSB_ERROR_OVERFLOW:      return "LIBUSB_ERROR_OVERFLOW";
+    case LIBUSB_ERROR_PIPE:          return "LIBUSB_ERROR_PIPE";
+    case LIBUSB_ERROR_INTERRUPTED:   return "LIBUSB_ERROR_INTERRUPTED";
+    case LIBUSB_ERROR_NO_MEM:        return "LIBUSB_ERROR_NO_MEM";
+    case LIBUSB_ERROR_NOT_SUPPORTED: return "LIBUSB_ERROR_NOT_SUPPORTED";
+    case LIBUSB_ERROR_OTHER:         return "LIBUSB_ERROR_OTHER";
+    default:                         return "**UNKNOWN**";
+    }
+}
+
+void fakeusb_device_config_init(struct fakeusb_device_config *config)
+{
+    static const uint8_t eps[] = { 0x81, 0x02, 0x83, 0x84, 0x05 };
+    int i;
+
+    memset(config, 0, sizeof(*config));
+    config->speed = LIBUSB_SPEED_HIGH;
+    config->bus_number = 1;
+    config->device_address = 2;
+    config->device_desc = default_device_desc;
+    config->config_desc = default_config_desc;
+    config->manufacturer = "usbredir";
+    config->product = "fakeusb device";
+    config->serial = "0001";
+    config->control_latency_us = 125;
+    for (i = 0; i < sizeof(eps); i++) {
+        config->endpoints[i].address = eps[i];
+        config->endpoints[i].latency_us = 125;
+        config->endpoints[i].bytes_per_ms = 40000;
+        config->endpoints[i].interval_us = -1;
+        config->endpoints[i].short_len = -1;
+    }
+}
+
+static void fakeusb_device_free(libusb_device *dev)
+{
+    int i;
+
+    fakeusb_free_config(dev->config);
+    free(dev->config_desc);
+    for (i = 0; i < 3; i++) {
+        free(dev->strings[i]);
+    }
+    free(dev);
+}
+
+libusb_device *fakeusb_device_new(libusb_context *ctx,
+    const struct fakeusb_device_config *config)
+{
+    libusb_device *dev, **devices;
+    const char *strings[3] = {
+        config->manufacturer, config->product, config->serial
+    };
+    int i, len;
+
+    ctx = fakeusb_get_ctx(ctx);
+    if (!config->device_desc || !config->config_desc) {
+        return NULL;
+    }
+    dev = calloc(1, sizeof(*dev));
+    if (!dev) {
+        return NULL;
+    }
+    dev->refs = 2; /* One for the caller and one for the device list */
+    dev->speed = config->speed;
+    dev->bus_number = config->bus_number;
+    dev->device_address = config->device_address;
+    dev->control_latency_us = config->control_latency_us;
+    dev->dev_mem_size = config->dev_mem_size;
+    memcpy(dev->device_desc, config->device_desc, LIBUSB_DT_DEVICE_SIZE);
+
+    len = get_le16(config->config_desc + 2);
+    dev->config_desc = malloc(len);
+    if (!dev->config_desc) {
+        goto error;
+    }
+    memcpy(dev->config_desc, config->config_desc, len);
+    dev->config_desc_len = len;
+    dev->config = fakeusb_parse_config(dev->config_desc, len);
+    if (!dev->config) {
+        fprintf(stderr, "fakeusb: invalid configuration descriptor\n");
+        goto error;
+    }
+    for (i = 0; i < 3; i++) {
+        if (strings[i]) {
+            dev->strings[i] = strdup(strings[i]);
+            if (!dev->strings[i]) {
+                goto error;
+            }
+        }
+    }
+
+    /* Defaults for endpoints without settings, then the settings */
+    for (i = 0; i < FAKEUSB_MAX_ENDPOINTS; i++) {
+        dev->ep[i].config.latency_us = 125;
+        dev->ep[i].config.interval_us = -1;
+        dev->ep[i].config.short_len = -1;
+    }
+    for (i = 0; i < FAKEUSB_MAX_ENDPOINTS && config->endpoints[i].address;
+            i++) {
+        dev->ep[EP2I(config->endpoints[i].address)].config =
+            config->endpoints[i];
+    }
+    if (!config->unconfigured) {
+        dev->active_config = dev->config->bConfigurationValue;
+    }
+    fakeusb_update_endpoints(dev);
+
+    pthread_mutex_lock(&ctx->lock);
+    devices = realloc(ctx->devices,
+                      (ctx->device_count + 1) * sizeof(*devices));
+    if (!devices) {
+        pthread_mutex_unlock(&ctx->lock);
+        goto error;
+    }
+    ctx->devices = devices;
+    ctx->devices[ctx->device_count++] = dev;
+    dev->ctx = ctx;
+    pthread_mutex_unlock(&ctx->lock);
+    return dev;
+
+error:
+    fakeusb_device_free(dev);
+    return NULL;
+}
+
+ssize_t libusb_get_device_list(libusb_context *ctx, libusb_device ***list)
+{
+    libusb_device **devs;
+    int i;
+
+    ctx = fakeusb_get_ctx(ctx);
+    pthread_mutex_lock(&ctx->lock);
+    devs = calloc(ctx->device_count + 1, sizeof(*devs));
+    if (!devs) {
+        pthread_mutex_unlock(&ctx->lock);
+        return LIBUSB_ERROR_NO_MEM;
+    }
+    for (i = 0; i < ctx->device_count; i++) {
+        devs[i] = ctx->devices[i];
+        devs[i]->refs++;
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    *list = devs;
+    return i;
+}
+
+void libusb_free_device_list(libusb_device **list, int unref_devices)
+{
+    int i;
+
+    if (!list) {
+        return;
+    }
+    for (i = 0; unref_devices && list[i]; i++) {
+        libusb_unref_device(list[i]);
+    }
+    free(list);
+}
+
+libusb_device *libusb_ref_device(libusb_device *dev)
+{
+    libusb_context *ctx = dev->ctx;
+
+    pthread_mutex_lock(&ctx->lock);
+    dev->refs++;
+    pthread_mutex_unlock(&ctx->lock);
+    return dev;
+}
+
+void libusb_unref_device(libusb_device *dev)
+{
+    libusb_context *ctx = dev->ctx;
+    int refs;
+
+    pthread_mutex_lock(&ctx->lock);
+    refs = --dev->refs;
+    pthread_mutex_unlock(&ctx->lock);
+    if (refs == 0) {
+        fakeusb_device_free(dev);
+    }
+}
+
+/* Remove the device from the device list of its ctx, like unplugging
+   does, called with the ctx lock held */
+static void fakeusb_remove_device(libusb_device *dev)
+{
+    libusb_context *ctx = dev->ctx;
+    int i;
+
+    for (i = 0; i < ctx->device_count; i++) {
+        if (ctx->devices[i] == dev) {
+            memmove(&ctx->devices[i], &ctx->devices[i + 1],
+                    (ctx->device_count - i - 1) * sizeof(*ctx->devices));
+            ctx->device_count--;
+            dev->refs--;
+            break;
+        }
+    }
+}
+
+uint8_t libusb_get_bus_number(libusb_device *dev)
+{
+    return dev->bus_number;
+}
+
+uint8_t libusb_get_device_address(libusb_device *dev)
+{
+    return dev->device_address;
+}
+
+int libusb_get_device_speed(libusb_device *dev)
+{
+    return dev->speed;
+}
+
+int libusb_get_device_descriptor(libusb_device *dev,
+    struct libusb_device_descriptor *desc)
+{
+    const uint8_t *d = dev->device_desc;
+
+    desc->bLength = d[0];
+    desc->bDescriptorType = d[1];
+    desc->bcdUSB = get_le16(d + 2);
+    desc->bDeviceClass = d[4];
+    desc->bDeviceSubClass = d[5];
+    desc->bDeviceProtocol = d[6];
+    desc->bMaxPacketSize0 = d[7];
+    desc->idVendor = get_le16(d + 8);
+    desc->idProduct = get_le16(d + 10);
+    desc->bcdDevice = get_le16(d + 12);
+    desc->iManufacturer = d[14];
+    desc->iProduct = d[15];
+    desc->iSerialNumber = d[16];
+    desc->bNumConfigurations = d[17];
+    return LIBUSB_SUCCESS;
+}
+
+static int fakeusb_copy_config(libusb_device *dev,
+    struct libusb_config_descriptor **config)
+{
+    /* The interface arrays are shared with the device, only the top level
+       struct gets copied, so that libusb_free_config_descriptor() works */
+    *config = malloc(sizeof(**config));
+    if (!*config) {
+        return LIBUSB_ERROR_NO_MEM;
+    }
+    **config = *dev->config;
+    return LIBUSB_SUCCESS;
+}
+
+int libusb_get_active_config_descriptor(libusb_device *dev,
+    struct libusb_config_descriptor **config)
+{
+    libusb_context *ctx = dev->ctx;
+    int r;
+
+    pthread_mutex_lock(&ctx->lock);
+    if (dev->disconnected) {
+        r = LIBUSB_ERROR_NO_DEVICE;
+    } else if (!dev->active_config) {
+        r = LIBUSB_ERROR_NOT_FOUND;
+    } else {
+        r = fakeusb_copy_config(dev, config);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    return r;
+}
+
+int libusb_get_config_descriptor(libusb_device *dev, uint8_t config_index,
+    struct libusb_config_descriptor **config)
+{
+    if (config_index != 0) {
+        return LIBUSB_ERROR_NOT_FOUND;
+    }
+    return fakeusb_copy_config(dev, config);
+}
+
+void libusb_free_config_descriptor(struct libusb_config_descriptor *config)
+{
+    free(config);
+}
+
+int libusb_get_ss_endpoint_companion_descriptor(libusb_context *ctx,
+    const struct libusb_endpoint_descriptor *endpoint,
+    struct libusb_ss_endpoint_companion_descriptor **ep_comp)
+{
+    const uint8_t *d = endpoint->extra;
+    int pos;
+
+    for (pos = 0; d && pos + 6 <= endpoint->extra_length; pos += d[pos]) {
+        if (d[pos + 1] == LIBUSB_DT_SS_ENDPOINT_COMPANION) {
+            *ep_comp = malloc(sizeof(**ep_comp));
+            if (!*ep_comp) {
+                return LIBUSB_ERROR_NO_MEM;
+            }
+            (*ep_comp)->bLength = d[pos];
+            (*ep_comp)->bDescriptorType = d[pos + 1];
+            (*ep_comp)->bMaxBurst = d[pos + 2];
+            (*ep_comp)->bmAttributes = d[pos + 3];
+            (*ep_comp)->wBytesPerInterval = get_le16(d + pos + 4);
+            return LIBUSB_SUCCESS;
+        }
+        if (d[pos] == 0) {
+            break;
+        }
+    }
+    return LIBUSB_ERROR_NOT_FOUND;
+}
+
+void libusb_free_ss_endpoint_companion_descriptor(
+    struct libusb_ss_endpoint_companion_descriptor *ep_comp)
+{
+    free(ep_comp);
+}
+
+/**************************************************************************/
+/* Device handles                                                          */
+/**************************************************************************/
+
+int libusb_open(libusb_device *dev, libusb_device_handle **dev_handle)
+{
+    libusb_device_handle *handle;
+
+    if (dev->disconnected) {
+        return LIBUSB_ERROR_NO_DEVICE;
+    }
+    handle = calloc(1, sizeof(*handle));
+    if (!handle) {
+        return LIBUSB_ERROR_NO_MEM;
+    }
+    handle->dev = libusb_ref_device(dev);
+    *dev_handle = handle;
+    return LIBUSB_SUCCESS;
+}
+
+int libusb_wrap_sys_device(libusb_context *ctx, intptr_t sys_dev,
+    libusb_device_handle **dev_handle)
+{
+    return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+void libusb_close(libusb_device_handle *dev_handle)
+{
+    if (!dev_handle) {
+        return;
+    }
+    libusb_unref_device(dev_handle->dev);
+    free(dev_handle);
+}
+
+libusb_device *libusb_get_device(libusb_device_handle *dev_handle)
+{
+    return dev_handle->dev;
+}
+
+int libusb_set_configuration(libusb_device_handle *dev_handle,
+    int configuration)
+{
+    libusb_device *dev = dev_handle->dev;
+    libusb_context *ctx = dev->ctx;
+    int r = LIBUSB_SUCCESS;
+
+    pthread_mutex_lock(&ctx->lock);
+    if (dev->disconnected) {
+        r = LIBUSB_ERROR_NO_DEVICE;
+    } else if (dev_handle->claimed) {
+        r = LIBUSB_ERROR_BUSY;
+    } else if (configuration == -1 || configuration == 0) {
+        dev->active_config = 0;
+    } else if (configuration == dev->config->bConfigurationValue) {
+        dev->active_config = configuration;
+    } else {
+        r = LIBUSB_ERROR_NOT_FOUND;
+    }
+    if (r == LIBUSB_SUCCESS) {
+        memset(dev->alt_setting, 0, sizeof(dev->alt_setting));
+        fakeusb_update_endpoints(dev);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    return r;
+}
+
+/* Returns the index of an interface in the active config, or -1 */
+static int fakeusb_interface_index(libusb_device *dev, int interface_number)
+{
+    int i;
+
+    for (i = 0; dev->active_config && i < dev->config->bNumInterfaces; i++) {
+        if (dev->config->interface[i].altsetting[0].bInterfaceNumber ==
+                interface_number) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int libusb_claim_interface(libusb_device_handle *dev_handle,
+    int interface_number)
+{
+    libusb_device *dev = dev_handle->dev;
+    libusb_context *ctx = dev->ctx;
+    int r = LIBUSB_SUCCESS;
+
+    pthread_mutex_lock(&ctx->lock);
+    if (dev->disconnected) {
+        r = LIBUSB_ERROR_NO_DEVICE;
+    } else if (fakeusb_interface_index(dev, interface_number) < 0) {
+        r = LIBUSB_ERROR_NOT_FOUND;
+    } else {
+        dev_handle->claimed |= 1u << interface_number;
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    return r;
+}
+
+int libusb_release_interface(libusb_device_handle *dev_handle,
+    int interface_number)
+{
+    libusb_device *dev = dev_handle->dev;
+    libusb_context *ctx = dev->ctx;
+    int r = LIBUSB_SUCCESS;
+
+    pthread_mutex_lock(&ctx->lock);
+    if (dev->disconnected) {
+        r = LIBUSB_ERROR_NO_DEVICE;
+    } else if (!(dev_handle->claimed & (1u << interface_number))) {
+        r = LIBUSB_ERROR_NOT_FOUND;
+    } else {
+        dev_handle->claimed &= ~(1u << interface_number);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    return r;
+}
+
+int libusb_set_interface_alt_setting(libusb_device_handle *dev_handle,
+    int interface_number, int alternate_setting)
+{
+    libusb_device *dev = dev_handle->dev;
+    libusb_context *ctx = dev->ctx;
+    int i, r = LIBUSB_SUCCESS;
+
+    pthread_mutex_lock(&ctx->lock);
+    i = fakeusb_interface_index(dev, interface_number);
+    if (dev->disconnected) {
+        r = LIBUSB_ERROR_NO_DEVICE;
+    } else if (!(dev_handle->claimed & (1u << interface_number))) {
+        r = LIBUSB_ERROR_NOT_FOUND;
+    } else if (!fakeusb_find_alt(dev, interface_number, alternate_setting)) {
+        r = LIBUSB_ERROR_NOT_FOUND;
+    } else {
+        dev->alt_setting[i] = alternate_setting;
+        fakeusb_update_endpoints(dev);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    return r;
+}
+
+int libusb_clear_halt(libusb_device_handle *dev_handle,
+    unsigned char endpoint)
+{
+    libusb_device *dev = dev_handle->dev;
+    libusb_context *ctx = dev->ctx;
+    int r = LIBUSB_SUCCESS;
+
+    pthread_mutex_lock(&ctx->lock);
+    if (dev->disconnected) {
+        r = LIBUSB_ERROR_NO_DEVICE;
+    } else if (dev->ep[EP2I(endpoint)].type == NO_EP_TYPE) {
+        r = LIBUSB_ERROR_NOT_FOUND;
+    } else {
+        dev->ep[EP2I(endpoint)].halted = 0;
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    return r;
+}
+
+int libusb_reset_device(libusb_device_handle *dev_handle)
+{
+    libusb_device *dev = dev_handle->dev;
+    libusb_context *ctx = dev->ctx;
+    int i, r = LIBUSB_SUCCESS;
+
+    pthread_mutex_lock(&ctx->lock);
+    if (dev->disconnected) {
+        /* What the Linux backend returns for an unplugged device */
+        r = LIBUSB_ERROR_NO_DEVICE;
+    } else {
+        memset(dev->alt_setting, 0, sizeof(dev->alt_setting));
+        for (i = 0; i < FAKEUSB_MAX_ENDPOINTS; i++) {
+            dev->ep[i].halted = 0;
+        }
+        fakeusb_update_endpoints(dev);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    return r;
+}
+
+int libusb_detach_kernel_driver(libusb_device_handle *dev_handle,
+    int interface_number)
+{
+    return LIBUSB_ERROR_NOT_FOUND;
+}
+
+int libusb_attach_kernel_driver(libusb_device_handle *dev_handle,
+    int interface_number)
+{
+    return LIBUSB_ERROR_NOT_FOUND;
+}
+
+int libusb_set_auto_detach_kernel_driver(libusb_device_handle *dev_handle,
+    int enable)
+{
+    return LIBUSB_SUCCESS;
+}
+
+int libusb_alloc_streams(libusb_device_handle *dev_handle,
+    uint32_t num_streams, unsigned char *endpoints, int num_endpoints)
+{
+    if (dev_handle->dev->speed < LIBUSB_SPEED_SUPER) {
+        return LIBUSB_ERROR_NOT_SUPPORTED;
+    }
+    return num_streams;
+}
+
+int libusb_free_streams(libusb_device_handle *dev_handle,
+    unsigned char *endpoints, int num_endpoints)
+{
+    return LIBUSB_SUCCESS;
+}
+
+/* Hands out plain memory up to the device's dev_mem_size, zeroed like the
+   usbfs memory */
+unsigned char *libusb_dev_mem_alloc(libusb_device_handle *dev_handle,
+    size_t length)
+{
+    libusb_device *dev = dev_handle->dev;
+    unsigned char *buffer = NULL;
+
+    pthread_mutex_lock(&dev->ctx->lock);
+    if (!dev->disconnected && length &&
+            dev->dev_mem_used + length <= dev->dev_mem_size) {
+        buffer = calloc(1, length);
+        if (buffer) {
+            dev->dev_mem_used += length;
+        }
+    }
+    pthread_mutex_unlock(&dev->ctx->lock);
+    return buffer;
+}
+
+int libusb_dev_mem_free(libusb_device_handle *dev_handle,
+    unsigned char *buffer, size_t length)
+{
+    libusb_device *dev = dev_handle->dev;
+
+    pthread_mutex_lock(&dev->ctx->lock);
+    if (length > dev->dev_mem_used) {
+        fprintf(stderr, "fakeusb: freeing %zu bytes device memory, but only "
+                "%zu are allocated\n", length, dev->dev_mem_used);
+        abort();
+    }
+    dev->dev_mem_used -= length;
+    pthread_mutex_unlock(&dev->ctx->lock);
+    free(buffer);
+    return LIBUSB_SUCCESS;
+}
+
+/**************************************************************************/
+/* Simulation control                                                      */
+/**************************************************************************/
+
+/* Insert a transfer into the due-time sorted pending list, with the ctx
+   lock held, returns 1 if it became the first transfer */
+static int fakeusb_insert_pending(libusb_context *ctx,
+    struct fakeusb_transfer *t)
+{
+    struct fakeusb_transfer **p = &ctx->pending;
+
+    while (*p && (*p)->due <= t->due) {
+        p = &(*p)->next;
+    }
+    t->next = *p;
+    *p = t;
+    return p == &ctx->pending;
+}
+
+static void fakeusb_remove_pending(libusb_context *ctx,
+    struct fakeusb_transfer *t)
+{
+    struct fakeusb_transfer **p = &ctx->pending;
+
+    while (*p != t) {
+        p = &(*p)->next;
+    }
+    *p = t->next;
+    t->next = NULL;
+}
+
+/* Make a pending transfer complete right away */
+static void fakeusb_expedite(libusb_context *ctx, struct fakeusb_transfer *t)
+{
+    fakeusb_remove_pending(ctx, t);
+    t->due = 0;
+    fakeusb_insert_pending(ctx, t);
+}
+
+void fakeusb_device_disconnect(libusb_device *dev)
+{
+    libusb_context *ctx = dev->ctx;
+    struct fakeusb_transfer *t, *next;
+
+    pthread_mutex_lock(&ctx->lock);
+    if (dev->disconnected) {
+        pthread_mutex_unlock(&ctx->lock);
+        return;
+    }
+    dev->disconnected = 1;
+    for (t = ctx->pending; t; t = next) {
+        next = t->next;
+        if (t->pub.dev_handle->dev == dev && t->due != 0) {
+            fakeusb_expedite(ctx, t);
+        }
+    }
+    fakeusb_remove_device(dev);
+    fakeusb_wakeup(ctx);
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+void fakeusb_device_stall(libusb_device *dev, uint8_t ep)
+{
+    libusb_context *ctx = dev->ctx;
+
+    pthread_mutex_lock(&ctx->lock);
+    dev->ep[EP2I(ep)].halted = 1;
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+int fakeusb_device_set_ep_config(libusb_device *dev,
+    const struct fakeusb_ep_config *ep_config)
+{
+    libusb_context *ctx = dev->ctx;
+
+    if (!fakeusb_has_endpoint(dev, ep_config->address)) {
+        return LIBUSB_ERROR_NOT_FOUND;
+    }
+    pthread_mutex_lock(&ctx->lock);
+    dev->ep[EP2I(ep_config->address)].config = *ep_config;
+    pthread_mutex_unlock(&ctx->lock);
+    return LIBUSB_SUCCESS;
+}
+
+int fakeusb_device_get_ep_stats(libusb_device *dev, uint8_t ep,
+    struct fakeusb_ep_stats *stats)
+{
+    libusb_context *ctx = dev->ctx;
+
+    if (!fakeusb_has_endpoint(dev, ep)) {
+        return LIBUSB_ERROR_NOT_FOUND;
+    }
+    pthread_mutex_lock(&ctx->lock);
+    *stats = dev->ep[EP2I(ep)].stats;
+    pthread_mutex_unlock(&ctx->lock);
+    return LIBUSB_SUCCESS;
+}
+
+size_t fakeusb_device_get_dev_mem_used(libusb_device *dev)
+{
+    size_t used;
+
+    pthread_mutex_lock(&dev->ctx->lock);
+    used = dev->dev_mem_used;
+    pthread_mutex_unlock(&dev->ctx->lock);
+    return used;
+}
+
+/**************************************************************************/
+/* Transfers                                                               */
+/**************************************************************************/
+
+struct libusb_transfer *libusb_alloc_transfer(int iso_packets)
+{
+    struct fakeusb_transfer *t;
+
+    t = calloc(1, sizeof(*t) +
+                  iso_packets * sizeof(struct libusb_iso_packet_descriptor));
+    if (!t) {
+        return NULL;
+    }
+    t->pub.num_iso_packets = iso_packets;
+    return &t->pub;
+}
+
+void libusb_free_transfer(struct libusb_transfer *transfer)
+{
+    if (!transfer) {
+        return;
+    }
+    if (transfer->flags & LIBUSB_TRANSFER_FREE_BUFFER) {
+        free(transfer->buffer);
+    }
+    free(FAKEUSB_TRANSFER(transfer));
+}
+
+void libusb_transfer_set_stream_id(struct libusb_transfer *transfer,
+    uint32_t stream_id)
+{
+    FAKEUSB_TRANSFER(transfer)->stream_id = stream_id;
+}
+
+uint32_t libusb_transfer_get_stream_id(struct libusb_transfer *transfer)
+{
+    return FAKEUSB_TRANSFER(transfer)->stream_id;
+}
+
+/* Compute when a transfer completes, called with the ctx lock held */
+static uint64_t fakeusb_due(libusb_device *dev, struct fakeusb_ep *ep,
+    struct libusb_transfer *transfer, uint64_t now)
+{
+    uint64_t start = ep->busy_until > now ? ep->busy_until : now;
+    uint64_t latency = (uint64_t)ep->config.latency_us * 1000;
+    uint64_t interval = ep->config.interval_us >= 0 ?
+                        ep->config.interval_us : ep->interval_us;
+    uint64_t duration = 0;
+
+    switch (transfer->type) {
+    case LIBUSB_TRANSFER_TYPE_CONTROL:
+        return now + (uint64_t)dev->control_latency_us * 1000;
+    case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
+        duration = transfer->num_iso_packets * interval * 1000;
+        break;
+    case LIBUSB_TRANSFER_TYPE_INTERRUPT:
+        duration = interval * 1000;
+        /* fall through */
+    default:
+        if (ep->config.bytes_per_ms) {
+            uint64_t data_time = (uint64_t)transfer->length * 1000000 /
+                                 ep->config.bytes_per_ms;
+            if (data_time > duration) {
+                duration = data_time;
+            }
+        }
+        break;
+    }
+    ep->busy_until = start + duration;
+    return start + duration + latency;
+}
+
+int libusb_submit_transfer(struct libusb_transfer *transfer)
+{
+    struct fakeusb_transfer *t = FAKEUSB_TRANSFER(transfer);
+    libusb_device *dev = transfer->dev_handle->dev;
+    libusb_context *ctx = dev->ctx;
+    struct fakeusb_ep *ep;
+    uint8_t type;
+    int r = LIBUSB_SUCCESS;
+
+    type = transfer->type == LIBUSB_TRANSFER_TYPE_BULK_STREAM ?
+           LIBUSB_TRANSFER_TYPE_BULK : transfer->type;
+    ep = &dev->ep[type == LIBUSB_TRANSFER_TYPE_CONTROL ? 0 :
+                  EP2I(transfer->endpoint)];
+
+    pthread_mutex_lock(&ctx->lock);
+    if (dev->disconnected) {
+        r = LIBUSB_ERROR_NO_DEVICE;
+        goto leave;
+    }
+    if (t->pending) {
+        r = LIBUSB_ERROR_BUSY;
+        goto leave;
+    }
+    if (ep->type != type ||
+            (type == LIBUSB_TRANSFER_TYPE_CONTROL &&
+             transfer->length < LIBUSB_CONTROL_SETUP_SIZE)) {
+        r = LIBUSB_ERROR_INVALID_PARAM;
+        goto leave;
+    }
+    if (type != LIBUSB_TRANSFER_TYPE_CONTROL &&
+            !(transfer->dev_handle->claimed & (1u << ep->interface))) {
+        r = LIBUSB_ERROR_NOT_FOUND;
+        goto leave;
+    }
+
+    t->status = LIBUSB_TRANSFER_COMPLETED;
+    t->cancelled = 0;
+    ep->count++;
+    if (type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+        /* Iso endpoints do not stall */
+    } else if (ep->halted) {
+        t->status = LIBUSB_TRANSFER_STALL;
+    } else if (ep->config.stall_every &&
+               ep->count % ep->config.stall_every == 0) {
+        t->status = LIBUSB_TRANSFER_STALL;
+        /* Control endpoints recover on the next setup packet */
+        if (type != LIBUSB_TRANSFER_TYPE_CONTROL) {
+            ep->halted = 1;
+        }
+    }
+
+    t->due = fakeusb_due(dev, ep, transfer, fakeusb_now());
+    t->pending = 1;
+    if (fakeusb_insert_pending(ctx, t)) {
+        pthread_cond_broadcast(&ctx->cond);
+        fakeusb_update_timer(ctx);
+    }
+leave:
+    pthread_mutex_unlock(&ctx->lock);
+    return r;
+}
+
+int libusb_cancel_transfer(struct libusb_transfer *transfer)
+{
+    struct fakeusb_transfer *t = FAKEUSB_TRANSFER(transfer);
+    libusb_context *ctx = transfer->dev_handle->dev->ctx;
+    int r = LIBUSB_SUCCESS;
+
+    pthread_mutex_lock(&ctx->lock);
+    if (!t->pending || t->cancelled) {
+        r = LIBUSB_ERROR_NOT_FOUND;
+    } else {
+        t->cancelled = 1;
+        fakeusb_expedite(ctx, t);
+        fakeusb_wakeup(ctx);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    return r;
+}
+
+static void fakeusb_string_desc(const char *str, uint8_t *buf, int *len)
+{
+    int i;
+
+    for (i = 0; str[i] && i < 126; i++) {
+        buf[2 + i * 2] = str[i];
+        buf[3 + i * 2] = 0;
+    }
+    buf[0] = *len = 2 + i * 2;
+    buf[1] = LIBUSB_DT_STRING;
+}
+
+/* Handle a control transfer, called with the ctx lock held */
+static void fakeusb_control(libusb_device *dev, struct fakeusb_transfer *t)
+{
+    struct libusb_transfer *transfer = &t->pub;
+    struct libusb_control_setup *setup =
+        libusb_control_transfer_get_setup(transfer);
+    uint8_t *data = libusb_control_transfer_get_data(transfer);
+    uint16_t value = libusb_le16_to_cpu(setup->wValue);
+    uint16_t index = libusb_le16_to_cpu(setup->wIndex);
+    int length = libusb_le16_to_cpu(setup->wLength);
+    uint8_t buf[256];
+    const uint8_t *src = NULL;
+    int i, src_len = 0;
+
+    if (length > transfer->length - (int)LIBUSB_CONTROL_SETUP_SIZE) {
+        length = transfer->length - LIBUSB_CONTROL_SETUP_SIZE;
+    }
+    transfer->actual_length = 0;
+
+    if ((setup->bmRequestType & 0x60) != LIBUSB_REQUEST_TYPE_STANDARD) {
+        /* Class / vendor requests: IN requests are a data source, OUT
+           requests a sink */
+        if (setup->bmRequestType & LIBUSB_ENDPOINT_IN) {
+            memset(data, dev->ep[0].fill++, length);
+        }
+        transfer->actual_length = length;
+        return;
+    }
+
+    switch (setup->bRequest) {
+    case LIBUSB_REQUEST_GET_DESCRIPTOR:
+        if ((setup->bmRequestType & 0x1f) == LIBUSB_RECIPIENT_INTERFACE) {
+            i = fakeusb_interface_index(dev, index & 0xff);
+            if (i >= 0) {
+                memset(buf, (index & 0xff) << 4 | dev->alt_setting[i], 8);
+                src = buf;
+                src_len = 8;
+            }
+            break;
+        }
+        switch (value >> 8) {
+        case LIBUSB_DT_DEVICE:
+            src = dev->device_desc;
+            src_len = LIBUSB_DT_DEVICE_SIZE;
+            break;
+        case LIBUSB_DT_CONFIG:
+            if ((value & 0xff) == 0) {
+                src = dev->config_desc;
+                src_len = dev->config_desc_len;
+            }
+            break;
+        case LIBUSB_DT_STRING:
+            i = value & 0xff;
+            if (i == 0) {
+                static const uint8_t langids[] = {
+                    4, LIBUSB_DT_STRING, 0x09, 0x04
+                };
+                src = langids;
+                src_len = sizeof(langids);
+            } else if (i <= 3 && dev->strings[i - 1]) {
+                fakeusb_string_desc(dev->strings[i - 1], buf, &src_len);
+                src = buf;
+            }
+            break;
+        }
+        break;
+    case LIBUSB_REQUEST_GET_STATUS:
+        memset(buf, 0, 2);
+        src = buf;
+        src_len = 2;
+        break;
+    case LIBUSB_REQUEST_GET_CONFIGURATION:
+        buf[0] = dev->active_config;
+        src = buf;
+        src_len = 1;
+        break;
+    case LIBUSB_REQUEST_GET_INTERFACE:
+        i = fakeusb_interface_index(dev, index & 0xff);
+        if (i >= 0) {
+            buf[0] = dev->alt_setting[i];
+            src = buf;
+            src_len = 1;
+        }
+        break;
+    case LIBUSB_REQUEST_CLEAR_FEATURE:
+        if ((setup->bmRequestType & 0x1f) == LIBUSB_RECIPIENT_ENDPOINT &&
+                value == 0) {
+            dev->ep[EP2I(index)].halted = 0;
+        }
+        return;
+    case LIBUSB_REQUEST_SET_FEATURE:
+    case LIBUSB_REQUEST_SET_ADDRESS:
+    case LIBUSB_REQUEST_SET_CONFIGURATION:
+    case LIBUSB_REQUEST_SET_INTERFACE:
+        return;
+    }
+
+    if (!src) {
+        t->status = LIBUSB_TRANSFER_STALL;
+        return;
+    }
+    if (src_len > length) {
+        src_len = length;
+    }
+    memcpy(data, src, src_len);
+    transfer->actual_length = src_len;
+}
+
+/* Set the results of a completed transfer, called with the ctx lock held.
+   For IN transfers this sets fill_len, the data gets filled in later
+   without holding the lock. */
+static void fakeusb_complete(struct fakeusb_transfer *t)
+{
+    struct libusb_transfer *transfer = &t->pub;
+    libusb_device *dev = transfer->dev_handle->dev;
+    struct fakeusb_ep *ep;
+    int i, len;
+
+    ep = &dev->ep[transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL ? 0 :
+                  EP2I(transfer->endpoint)];
+    t->pending = 0;
+    t->fill_len = 0;
+    transfer->actual_length = 0;
+    ep->stats.transfers++;
+
+    if (t->cancelled) {
+        transfer->status = LIBUSB_TRANSFER_CANCELLED;
+        ep->stats.cancels++;
+        return;
+    }
+    if (dev->disconnected) {
+        transfer->status = LIBUSB_TRANSFER_NO_DEVICE;
+        return;
+    }
+    if (t->status == LIBUSB_TRANSFER_STALL) {
+        transfer->status = LIBUSB_TRANSFER_STALL;
+        ep->stats.stalls++;
+        return;
+    }
+
+    switch (transfer->type) {
+    case LIBUSB_TRANSFER_TYPE_CONTROL:
+        fakeusb_control(dev, t);
+        if (t->status == LIBUSB_TRANSFER_STALL) {
+            ep->stats.stalls++;
+        }
+        break;
+    case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
+        for (i = 0; i < transfer->num_iso_packets; i++) {
+            struct libusb_iso_packet_descriptor *desc =
+                &transfer->iso_packet_desc[i];
+
+            len = desc->length;
+            if (transfer->endpoint & LIBUSB_ENDPOINT_IN) {
+                if (ep->config.short_len >= 0 && len > ep->config.short_len) {
+                    len = ep->config.short_len;
+                }
+                t->fill_len += desc->length;
+            }
+            desc->actual_length = len;
+            desc->status = LIBUSB_TRANSFER_COMPLETED;
+            transfer->actual_length += len;
+        }
+        break;
+    default:
+        len = transfer->length;
+        if (transfer->endpoint & LIBUSB_ENDPOINT_IN) {
+            if (ep->config.short_len >= 0 && len > ep->config.short_len) {
+                len = ep->config.short_len;
+            }
+            t->fill_len = len;
+        }
+        transfer->actual_length = len;
+        break;
+    }
+    transfer->status = t->status;
+    ep->stats.bytes += transfer->actual_length;
+    if (t->fill_len) {
+        t->fill_byte = ep->fill++;
+    }
+}
+
+static int fakeusb_handle_events(libusb_context *ctx, uint64_t timeout_ns,
+    int *completed)
+{
+    struct fakeusb_transfer *done = NULL, **tail = &done, *t;
+    uint64_t now, deadline, wait;
+    struct timespec ts;
+
+    ctx = fakeusb_get_ctx(ctx);
+    pthread_mutex_lock(&ctx->lock);
+    deadline = fakeusb_now() + timeout_ns;
+    for (;;) {
+        now = fakeusb_now();
+        if (ctx->pending && ctx->pending->due <= now) {
+            break;
+        }
+        if (ctx->interrupted || (completed && *completed) ||
+                now >= deadline) {
+            ctx->interrupted = 0;
+            fakeusb_clear_wakeup(ctx);
+            pthread_mutex_unlock(&ctx->lock);
+            return LIBUSB_SUCCESS;
+        }
+        wait = deadline;
+        if (ctx->pending && ctx->pending->due < wait) {
+            wait = ctx->pending->due;
+        }
+        ts.tv_sec = wait / 1000000000;
+        ts.tv_nsec = wait % 1000000000;
+        pthread_cond_timedwait(&ctx->cond, &ctx->lock, &ts);
+    }
+
+    /* Take all transfers which are due, in order */
+    while (ctx->pending && ctx->pending->due <= now) {
+        t = ctx->pending;
+        ctx->pending = t->next;
+        t->next = NULL;
+        *tail = t;
+        tail = &t->next;
+    }
+    fakeusb_clear_wakeup(ctx);
+    fakeusb_update_timer(ctx);
+
+    /* Complete them, the results are set with the lock held, the data
+       gets filled in and the callbacks called without it */
+    for (t = done; t; t = t->next) {
+        fakeusb_complete(t);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+
+    while (done) {
+        struct libusb_transfer *transfer;
+        uint8_t flags;
+
+        t = done;
+        done = t->next;
+        t->next = NULL;
+        transfer = &t->pub;
+        if (t->fill_len) {
+            memset(transfer->buffer, t->fill_byte, t->fill_len);
+        }
+        /* The callback may free the transfer, like libusb take the flags
+           before calling it */
+        flags = transfer->flags;
+        transfer->callback(transfer);
+        if (flags & LIBUSB_TRANSFER_FREE_TRANSFER) {
+            libusb_free_transfer(transfer);
+        }
+    }
+    return LIBUSB_SUCCESS;
+}
+
+int libusb_handle_events(libusb_context *ctx)
+{
+    return fakeusb_handle_events(ctx, 60ull * 1000000000, NULL);
+}
+
+int libusb_handle_events_timeout(libusb_context *ctx, struct timeval *tv)
+{
+    return fakeusb_handle_events(ctx, (uint64_t)tv->tv_sec * 1000000000 +
+                                      (uint64_t)tv->tv_usec * 1000, NULL);
+}
+
+int libusb_handle_events_timeout_completed(libusb_context *ctx,
+    struct timeval *tv, int *completed)
+{
+    return fakeusb_handle_events(ctx, (uint64_t)tv->tv_sec * 1000000000 +
+                                      (uint64_t)tv->tv_usec * 1000, completed);
+}
+
+int libusb_get_next_timeout(libusb_context *ctx, struct timeval *tv)
+{
+    uint64_t now, due;
+
+    ctx = fakeusb_get_ctx(ctx);
+    pthread_mutex_lock(&ctx->lock);
+    if (!ctx->pending) {
+        pthread_mutex_unlock(&ctx->lock);
+        return 0;
+    }
+    due = ctx->pending->due;
+    pthread_mutex_unlock(&ctx->lock);
+
+    now = fakeusb_now();
+    due = due > now ? due - now : 0;
+    /* Round up, so that the caller does not wake up too early */
+    due = (due + 999) / 1000;
+    tv->tv_sec = due / 1000000;
+    tv->tv_usec = due % 1000000;
+    return 1;
+}
+
+void libusb_interrupt_event_handler(libusb_context *ctx)
+{
+    ctx = fakeusb_get_ctx(ctx);
+    pthread_mutex_lock(&ctx->lock);
+    ctx->interrupted = 1;
+    fakeusb_wakeup(ctx);
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+/* Without timerfd pollers must use libusb_get_next_timeout() */
+int libusb_pollfds_handle_timeouts(libusb_context *ctx)
+{
+    return fakeusb_get_ctx(ctx)->timer_fd != -1;
+}
+
+const struct libusb_pollfd **libusb_get_pollfds(libusb_context *ctx)
+{
+    const struct libusb_pollfd **pollfds = calloc(3, sizeof(*pollfds));
+
+    if (!pollfds) {
+        return NULL;
+    }
+    ctx = fakeusb_get_ctx(ctx);
+    pollfds[0] = &ctx->pollfd;
+    if (ctx->timer_fd != -1) {
+        pthread_mutex_lock(&ctx->lock);
+        if (!ctx->timer_used) {
+            ctx->timer_used = 1;
+            fakeusb_update_timer(ctx);
+        }
+        pthread_mutex_unlock(&ctx->lock);
+        pollfds[1] = &ctx->timer_pollfd;
+    }
+    return pollfds;
+}
+
+void libusb_free_pollfds(const struct libusb_pollfd **pollfds)
+{
+    free(pollfds);
+}
+
+/* The fds are there for the lifetime of the context, so the notifiers
+   never get called */
+void libusb_set_pollfd_notifiers(libusb_context *ctx,
+    libusb_pollfd_added_cb added_cb, libusb_pollfd_removed_cb removed_cb,
+    void *user_data)
+{
+}
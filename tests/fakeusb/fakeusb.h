@@ -0,0 +1,136 @@
+/* fakeusb - a simulated libusb device backend for tests and benchmarks
+
+   Copyright 2026 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+/* fakeusb implements the subset of the libusb API used by usbredirhost on
+   top of simulated devices, so that usbredirhost can be tested and
+   benchmarked without real hardware. usbredirhost.c gets compiled against
+   the libusb.h in this directory, see tests/fakeusb/meson.build.
+
+   A simulated device is described by raw device and configuration
+   descriptors, which are parsed the same way libusb parses them and which
+   are also returned for GET_DESCRIPTOR control requests, and by the timing
+   and behavior of its endpoints. GET_DESCRIPTOR requests to an interface
+   return an 8 byte class descriptor of any type, filled with
+   bInterfaceNumber << 4 | the interface's current alt setting, like a HID
+   report descriptor which depends on the alt setting.
+   The endpoints behave like this:
+   - bulk and interrupt IN endpoints are data sources, OUT endpoints sinks
+   - transfers on an endpoint are processed one after the other, each takes
+     latency_us plus the time to move the data at bytes_per_ms
+   - interrupt transfers take at least the endpoint's interval
+   - iso transfers complete at the rate given by the endpoint's interval,
+     one packet per interval, when the guest does not keep enough transfers
+     queued the stream restarts when the next transfer is submitted
+   - an endpoint can be made to stall, after which it stays halted until it
+     gets cleared
+   - a device can be disconnected at any time, after which all pending
+     transfers complete with LIBUSB_TRANSFER_NO_DEVICE
+
+   Transfers complete from libusb_handle_events*() like with real libusb.
+   Everything is thread-safe, so the usual usbredirhost setup of an event
+   thread plus a thread reading from the usb-guest works too. */
+
+#include <stdint.h>
+#include "libusb.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FAKEUSB_MAX_ENDPOINTS 32
+
+struct fakeusb_ep_config {
+    uint8_t address;            /* Endpoint address, 0 terminates the list */
+    unsigned int latency_us;    /* Time between submission and completion */
+    unsigned int bytes_per_ms;  /* Bulk / interrupt data rate, 0: unlimited */
+    int interval_us;            /* Time per iso packet / interrupt poll,
+                                   -1: from the descriptor's bInterval */
+    unsigned int stall_every;   /* Stall every nth transfer, 0: never */
+    int short_len;              /* IN transfers return at most this much
+                                   data (per packet for iso), -1: no limit */
+};
+
+struct fakeusb_device_config {
+    enum libusb_speed speed;
+    uint8_t bus_number;
+    uint8_t device_address;
+    /* Raw descriptors, the configuration descriptor includes all interface,
+       endpoint and other descriptors and must be wTotalLength long */
+    const uint8_t *device_desc;
+    const uint8_t *config_desc;
+    /* String descriptors 1 - 3 */
+    const char *manufacturer;
+    const char *product;
+    const char *serial;
+    int unconfigured;           /* Start in the unconfigured state */
+    unsigned int control_latency_us;
+    /* How much memory libusb_dev_mem_alloc() hands out, 0: none, as
+       without usbfs mmap support */
+    size_t dev_mem_size;
+    /* Per endpoint settings, endpoints which are not listed here use the
+       defaults from fakeusb_device_config_init() */
+    struct fakeusb_ep_config endpoints[FAKEUSB_MAX_ENDPOINTS];
+};
+
+struct fakeusb_ep_stats {
+    uint64_t transfers;         /* Completed transfers, including errors */
+    uint64_t bytes;             /* Data transferred */
+    uint64_t stalls;
+    uint64_t cancels;
+};
+
+/* Fills config with a high speed vendor specific device with these
+   endpoints:
+   interface 0: 0x81 bulk in, 0x02 bulk out (512 bytes), 0x83 interrupt in
+                (64 bytes, every 1 ms)
+   interface 1: alt 0 no endpoints, alt 1 0x84 iso in and 0x05 iso out
+                (1024 bytes every 125 us microframe)
+   Bulk endpoints move 40 MB/s, all endpoints have a latency of 125 us. */
+void fakeusb_device_config_init(struct fakeusb_device_config *config);
+
+/* Create a simulated device, which is returned by libusb_get_device_list()
+   for ctx (NULL for the default context) and can be opened with
+   libusb_open(). The config and the descriptors it points to get copied.
+   Release the returned reference with libusb_unref_device(). */
+libusb_device *fakeusb_device_new(libusb_context *ctx,
+    const struct fakeusb_device_config *config);
+
+/* Simulate unplugging the device */
+void fakeusb_device_disconnect(libusb_device *dev);
+
+/* Halt an endpoint, as if it stalled */
+void fakeusb_device_stall(libusb_device *dev, uint8_t ep);
+
+/* Change the settings of an endpoint at runtime, returns 0 on success,
+   or LIBUSB_ERROR_NOT_FOUND if the device has no such endpoint */
+int fakeusb_device_set_ep_config(libusb_device *dev,
+    const struct fakeusb_ep_config *ep_config);
+
+/* Get the statistics of an endpoint, returns 0 on success, or
+   LIBUSB_ERROR_NOT_FOUND if the device has no such endpoint */
+int fakeusb_device_get_ep_stats(libusb_device *dev, uint8_t ep,
+    struct fakeusb_ep_stats *stats);
+
+/* The number of bytes allocated with libusb_dev_mem_alloc() and not freed
+   yet */
+size_t fakeusb_device_get_dev_mem_used(libusb_device *dev);
+
+#ifdef __cplusplus
+}
+#endif
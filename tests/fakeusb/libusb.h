@@ -0,0 +1,506 @@
+/* fakeusb - a simulated libusb device backend for tests and benchmarks
+
+   Copyright 2026 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* This header stands in for the real <libusb.h> when usbredirhost.c gets
+   compiled against the fake device backend. It only declares the subset of
+   the libusb API which usbredirhost and the tools use, with the same names,
+   values and semantics as libusb 1.0.26. The backend itself lives in
+   fakeusb.c and is configured through fakeusb.h. */
+#ifndef __FAKEUSB_LIBUSB_H
+#define __FAKEUSB_LIBUSB_H
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define LIBUSB_API_VERSION 0x01000109
+#define LIBUSBX_API_VERSION LIBUSB_API_VERSION
+#define LIBUSB_CALL
+
+#define libusb_cpu_to_le16(x) ((uint16_t)(x))
+#define libusb_le16_to_cpu libusb_cpu_to_le16
+
+enum libusb_class_code {
+    LIBUSB_CLASS_PER_INTERFACE = 0x00,
+    LIBUSB_CLASS_AUDIO = 0x01,
+    LIBUSB_CLASS_HID = 0x03,
+    LIBUSB_CLASS_MASS_STORAGE = 0x08,
+    LIBUSB_CLASS_HUB = 0x09,
+    LIBUSB_CLASS_VENDOR_SPEC = 0xff,
+};
+
+enum libusb_descriptor_type {
+    LIBUSB_DT_DEVICE = 0x01,
+    LIBUSB_DT_CONFIG = 0x02,
+    LIBUSB_DT_STRING = 0x03,
+    LIBUSB_DT_INTERFACE = 0x04,
+    LIBUSB_DT_ENDPOINT = 0x05,
+    LIBUSB_DT_BOS = 0x0f,
+    LIBUSB_DT_HID = 0x21,
+    LIBUSB_DT_REPORT = 0x22,
+    LIBUSB_DT_SS_ENDPOINT_COMPANION = 0x30,
+};
+
+#define LIBUSB_DT_DEVICE_SIZE 18
+#define LIBUSB_DT_CONFIG_SIZE 9
+#define LIBUSB_DT_INTERFACE_SIZE 9
+#define LIBUSB_DT_ENDPOINT_SIZE 7
+#define LIBUSB_DT_ENDPOINT_AUDIO_SIZE 9
+
+#define LIBUSB_ENDPOINT_ADDRESS_MASK 0x0f
+#define LIBUSB_ENDPOINT_DIR_MASK 0x80
+#define LIBUSB_TRANSFER_TYPE_MASK 0x03
+
+enum libusb_endpoint_direction {
+    LIBUSB_ENDPOINT_OUT = 0x00,
+    LIBUSB_ENDPOINT_IN = 0x80,
+};
+
+enum libusb_endpoint_transfer_type {
+    LIBUSB_ENDPOINT_TRANSFER_TYPE_CONTROL = 0x0,
+    LIBUSB_ENDPOINT_TRANSFER_TYPE_ISOCHRONOUS = 0x1,
+    LIBUSB_ENDPOINT_TRANSFER_TYPE_BULK = 0x2,
+    LIBUSB_ENDPOINT_TRANSFER_TYPE_INTERRUPT = 0x3,
+};
+
+enum libusb_standard_request {
+    LIBUSB_REQUEST_GET_STATUS = 0x00,
+    LIBUSB_REQUEST_CLEAR_FEATURE = 0x01,
+    LIBUSB_REQUEST_SET_FEATURE = 0x03,
+    LIBUSB_REQUEST_SET_ADDRESS = 0x05,
+    LIBUSB_REQUEST_GET_DESCRIPTOR = 0x06,
+    LIBUSB_REQUEST_SET_DESCRIPTOR = 0x07,
+    LIBUSB_REQUEST_GET_CONFIGURATION = 0x08,
+    LIBUSB_REQUEST_SET_CONFIGURATION = 0x09,
+    LIBUSB_REQUEST_GET_INTERFACE = 0x0a,
+    LIBUSB_REQUEST_SET_INTERFACE = 0x0b,
+};
+
+enum libusb_request_type {
+    LIBUSB_REQUEST_TYPE_STANDARD = (0x00 << 5),
+    LIBUSB_REQUEST_TYPE_CLASS = (0x01 << 5),
+    LIBUSB_REQUEST_TYPE_VENDOR = (0x02 << 5),
+};
+
+enum libusb_request_recipient {
+    LIBUSB_RECIPIENT_DEVICE = 0x00,
+    LIBUSB_RECIPIENT_INTERFACE = 0x01,
+    LIBUSB_RECIPIENT_ENDPOINT = 0x02,
+};
+
+enum libusb_speed {
+    LIBUSB_SPEED_UNKNOWN = 0,
+    LIBUSB_SPEED_LOW = 1,
+    LIBUSB_SPEED_FULL = 2,
+    LIBUSB_SPEED_HIGH = 3,
+    LIBUSB_SPEED_SUPER = 4,
+    LIBUSB_SPEED_SUPER_PLUS = 5,
+};
+
+enum libusb_error {
+    LIBUSB_SUCCESS = 0,
+    LIBUSB_ERROR_IO = -1,
+    LIBUSB_ERROR_INVALID_PARAM = -2,
+    LIBUSB_ERROR_ACCESS = -3,
+    LIBUSB_ERROR_NO_DEVICE = -4,
+    LIBUSB_ERROR_NOT_FOUND = -5,
+    LIBUSB_ERROR_BUSY = -6,
+    LIBUSB_ERROR_TIMEOUT = -7,
+    LIBUSB_ERROR_OVERFLOW = -8,
+    LIBUSB_ERROR_PIPE = -9,
+    LIBUSB_ERROR_INTERRUPTED = -10,
+    LIBUSB_ERROR_NO_MEM = -11,
+    LIBUSB_ERROR_NOT_SUPPORTED = -12,
+    LIBUSB_ERROR_OTHER = -99,
+};
+
+enum libusb_transfer_type {
+    LIBUSB_TRANSFER_TYPE_CONTROL = 0,
+    LIBUSB_TRANSFER_TYPE_ISOCHRONOUS = 1,
+    LIBUSB_TRANSFER_TYPE_BULK = 2,
+    LIBUSB_TRANSFER_TYPE_INTERRUPT = 3,
+    LIBUSB_TRANSFER_TYPE_BULK_STREAM = 4,
+};
+
+enum libusb_transfer_status {
+    LIBUSB_TRANSFER_COMPLETED,
+    LIBUSB_TRANSFER_ERROR,
+    LIBUSB_TRANSFER_TIMED_OUT,
+    LIBUSB_TRANSFER_CANCELLED,
+    LIBUSB_TRANSFER_STALL,
+    LIBUSB_TRANSFER_NO_DEVICE,
+    LIBUSB_TRANSFER_OVERFLOW,
+};
+
+enum libusb_transfer_flags {
+    LIBUSB_TRANSFER_SHORT_NOT_OK = 1U << 0,
+    LIBUSB_TRANSFER_FREE_BUFFER = 1U << 1,
+    LIBUSB_TRANSFER_FREE_TRANSFER = 1U << 2,
+    LIBUSB_TRANSFER_ADD_ZERO_PACKET = 1U << 3,
+};
+
+enum libusb_log_level {
+    LIBUSB_LOG_LEVEL_NONE = 0,
+    LIBUSB_LOG_LEVEL_ERROR = 1,
+    LIBUSB_LOG_LEVEL_WARNING = 2,
+    LIBUSB_LOG_LEVEL_INFO = 3,
+    LIBUSB_LOG_LEVEL_DEBUG = 4,
+};
+
+enum libusb_option {
+    LIBUSB_OPTION_LOG_LEVEL = 0,
+    LIBUSB_OPTION_USE_USBDK = 1,
+    LIBUSB_OPTION_NO_DEVICE_DISCOVERY = 2,
+    LIBUSB_OPTION_WEAK_AUTHORITY = LIBUSB_OPTION_NO_DEVICE_DISCOVERY,
+};
+
+struct libusb_device_descriptor {
+    uint8_t  bLength;
+    uint8_t  bDescriptorType;
+    uint16_t bcdUSB;
+    uint8_t  bDeviceClass;
+    uint8_t  bDeviceSubClass;
+    uint8_t  bDeviceProtocol;
+    uint8_t  bMaxPacketSize0;
+    uint16_t idVendor;
+    uint16_t idProduct;
+    uint16_t bcdDevice;
+    uint8_t  iManufacturer;
+    uint8_t  iProduct;
+    uint8_t  iSerialNumber;
+    uint8_t  bNumConfigurations;
+};
+
+struct libusb_endpoint_descriptor {
+    uint8_t  bLength;
+    uint8_t  bDescriptorType;
+    uint8_t  bEndpointAddress;
+    uint8_t  bmAttributes;
+    uint16_t wMaxPacketSize;
+    uint8_t  bInterval;
+    uint8_t  bRefresh;
+    uint8_t  bSynchAddress;
+    const unsigned char *extra;
+    int extra_length;
+};
+
+struct libusb_interface_descriptor {
+    uint8_t  bLength;
+    uint8_t  bDescriptorType;
+    uint8_t  bInterfaceNumber;
+    uint8_t  bAlternateSetting;
+    uint8_t  bNumEndpoints;
+    uint8_t  bInterfaceClass;
+    uint8_t  bInterfaceSubClass;
+    uint8_t  bInterfaceProtocol;
+    uint8_t  iInterface;
+    const struct libusb_endpoint_descriptor *endpoint;
+    const unsigned char *extra;
+    int extra_length;
+};
+
+struct libusb_interface {
+    const struct libusb_interface_descriptor *altsetting;
+    int num_altsetting;
+};
+
+struct libusb_config_descriptor {
+    uint8_t  bLength;
+    uint8_t  bDescriptorType;
+    uint16_t wTotalLength;
+    uint8_t  bNumInterfaces;
+    uint8_t  bConfigurationValue;
+    uint8_t  iConfiguration;
+    uint8_t  bmAttributes;
+    uint8_t  MaxPower;
+    const struct libusb_interface *interface;
+    const unsigned char *extra;
+    int extra_length;
+};
+
+struct libusb_ss_endpoint_companion_descriptor {
+    uint8_t  bLength;
+    uint8_t  bDescriptorType;
+    uint8_t  bMaxBurst;
+    uint8_t  bmAttributes;
+    uint16_t wBytesPerInterval;
+};
+
+struct libusb_control_setup {
+    uint8_t  bmRequestType;
+    uint8_t  bRequest;
+    uint16_t wValue;
+    uint16_t wIndex;
+    uint16_t wLength;
+};
+
+#define LIBUSB_CONTROL_SETUP_SIZE (sizeof(struct libusb_control_setup))
+
+typedef struct libusb_context libusb_context;
+typedef struct libusb_device libusb_device;
+typedef struct libusb_device_handle libusb_device_handle;
+
+struct libusb_iso_packet_descriptor {
+    unsigned int length;
+    unsigned int actual_length;
+    enum libusb_transfer_status status;
+};
+
+struct libusb_transfer;
+
+typedef void (LIBUSB_CALL *libusb_transfer_cb_fn)(struct libusb_transfer *transfer);
+
+struct libusb_transfer {
+    libusb_device_handle *dev_handle;
+    uint8_t flags;
+    unsigned char endpoint;
+    unsigned char type;
+    unsigned int timeout;
+    enum libusb_transfer_status status;
+    int length;
+    int actual_length;
+    libusb_transfer_cb_fn callback;
+    void *user_data;
+    unsigned char *buffer;
+    int num_iso_packets;
+    struct libusb_iso_packet_descriptor iso_packet_desc[];
+};
+
+struct libusb_pollfd {
+    int fd;
+    short events;
+};
+
+typedef void (LIBUSB_CALL *libusb_pollfd_added_cb)(int fd, short events,
+    void *user_data);
+typedef void (LIBUSB_CALL *libusb_pollfd_removed_cb)(int fd, void *user_data);
+
+int libusb_init(libusb_context **ctx);
+void libusb_exit(libusb_context *ctx);
+void libusb_set_debug(libusb_context *ctx, int level);
+int libusb_set_option(libusb_context *ctx, enum libusb_option option, ...);
+const char *libusb_error_name(int errcode);
+
+ssize_t libusb_get_device_list(libusb_context *ctx, libusb_device ***list);
+void libusb_free_device_list(libusb_device **list, int unref_devices);
+libusb_device *libusb_ref_device(libusb_device *dev);
+void libusb_unref_device(libusb_device *dev);
+uint8_t libusb_get_bus_number(libusb_device *dev);
+uint8_t libusb_get_device_address(libusb_device *dev);
+int libusb_get_device_speed(libusb_device *dev);
+int libusb_get_device_descriptor(libusb_device *dev,
+    struct libusb_device_descriptor *desc);
+int libusb_get_active_config_descriptor(libusb_device *dev,
+    struct libusb_config_descriptor **config);
+int libusb_get_config_descriptor(libusb_device *dev, uint8_t config_index,
+    struct libusb_config_descriptor **config);
+void libusb_free_config_descriptor(struct libusb_config_descriptor *config);
+int libusb_get_ss_endpoint_companion_descriptor(libusb_context *ctx,
+    const struct libusb_endpoint_descriptor *endpoint,
+    struct libusb_ss_endpoint_companion_descriptor **ep_comp);
+void libusb_free_ss_endpoint_companion_descriptor(
+    struct libusb_ss_endpoint_companion_descriptor *ep_comp);
+
+int libusb_open(libusb_device *dev, libusb_device_handle **dev_handle);
+int libusb_wrap_sys_device(libusb_context *ctx, intptr_t sys_dev,
+    libusb_device_handle **dev_handle);
+void libusb_close(libusb_device_handle *dev_handle);
+libusb_device *libusb_get_device(libusb_device_handle *dev_handle);
+int libusb_set_configuration(libusb_device_handle *dev_handle,
+    int configuration);
+int libusb_claim_interface(libusb_device_handle *dev_handle,
+    int interface_number);
+int libusb_release_interface(libusb_device_handle *dev_handle,
+    int interface_number);
+int libusb_set_interface_alt_setting(libusb_device_handle *dev_handle,
+    int interface_number, int alternate_setting);
+int libusb_clear_halt(libusb_device_handle *dev_handle,
+    unsigned char endpoint);
+int libusb_reset_device(libusb_device_handle *dev_handle);
+int libusb_detach_kernel_driver(libusb_device_handle *dev_handle,
+    int interface_number);
+int libusb_attach_kernel_driver(libusb_device_handle *dev_handle,
+    int interface_number);
+int libusb_set_auto_detach_kernel_driver(libusb_device_handle *dev_handle,
+    int enable);
+int libusb_alloc_streams(libusb_device_handle *dev_handle,
+    uint32_t num_streams, unsigned char *endpoints, int num_endpoints);
+int libusb_free_streams(libusb_device_handle *dev_handle,
+    unsigned char *endpoints, int num_endpoints);
+unsigned char *libusb_dev_mem_alloc(libusb_device_handle *dev_handle,
+    size_t length);
+int libusb_dev_mem_free(libusb_device_handle *dev_handle,
+    unsigned char *buffer, size_t length);
+
+struct libusb_transfer *libusb_alloc_transfer(int iso_packets);
+int libusb_submit_transfer(struct libusb_transfer *transfer);
+int libusb_cancel_transfer(struct libusb_transfer *transfer);
+void libusb_free_transfer(struct libusb_transfer *transfer);
+void libusb_transfer_set_stream_id(struct libusb_transfer *transfer,
+    uint32_t stream_id);
+uint32_t libusb_transfer_get_stream_id(struct libusb_transfer *transfer);
+
+int libusb_handle_events(libusb_context *ctx);
+int libusb_handle_events_timeout(libusb_context *ctx, struct timeval *tv);
+int libusb_handle_events_timeout_completed(libusb_context *ctx,
+    struct timeval *tv, int *completed);
+int libusb_get_next_timeout(libusb_context *ctx, struct timeval *tv);
+void libusb_interrupt_event_handler(libusb_context *ctx);
+int libusb_pollfds_handle_timeouts(libusb_context *ctx);
+const struct libusb_pollfd **libusb_get_pollfds(libusb_context *ctx);
+void libusb_free_pollfds(const struct libusb_pollfd **pollfds);
+void libusb_set_pollfd_notifiers(libusb_context *ctx,
+    libusb_pollfd_added_cb added_cb, libusb_pollfd_removed_cb removed_cb,
+    void *user_data);
+
+static inline unsigned char *libusb_control_transfer_get_data(
+    struct libusb_transfer *transfer)
+{
+    return transfer->buffer + LIBUSB_CONTROL_SETUP_SIZE;
+}
+
+static inline struct libusb_control_setup *libusb_control_transfer_get_setup(
+    struct libusb_transfer *transfer)
+{
+    return (struct libusb_control_setup *)(void *)transfer->buffer;
+}
+
+static inline void libusb_fill_control_setup(unsigned char *buffer,
+    uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+    uint16_t wLength)
+{
+    struct libusb_control_setup *setup =
+        (struct libusb_control_setup *)(void *)buffer;
+    setup->bmRequestType = bmRequestType;
+    setup->bRequest = bRequest;
+    setup->wValue = libusb_cpu_to_le16(wValue);
+    setup->wIndex = libusb_cpu_to_le16(wIndex);
+    setup->wLength = libusb_cpu_to_le16(wLength);
+}
+
+static inline void libusb_fill_control_transfer(
+    struct libusb_transfer *transfer, libusb_device_handle *dev_handle,
+    unsigned char *buffer, libusb_transfer_cb_fn callback, void *user_data,
+    unsigned int timeout)
+{
+    struct libusb_control_setup *setup =
+        (struct libusb_control_setup *)(void *)buffer;
+    transfer->dev_handle = dev_handle;
+    transfer->endpoint = 0;
+    transfer->type = LIBUSB_TRANSFER_TYPE_CONTROL;
+    transfer->timeout = timeout;
+    transfer->buffer = buffer;
+    if (setup)
+        transfer->length = (int)(LIBUSB_CONTROL_SETUP_SIZE
+            + libusb_le16_to_cpu(setup->wLength));
+    transfer->user_data = user_data;
+    transfer->callback = callback;
+}
+
+static inline void libusb_fill_bulk_transfer(struct libusb_transfer *transfer,
+    libusb_device_handle *dev_handle, unsigned char endpoint,
+    unsigned char *buffer, int length, libusb_transfer_cb_fn callback,
+    void *user_data, unsigned int timeout)
+{
+    transfer->dev_handle = dev_handle;
+    transfer->endpoint = endpoint;
+    transfer->type = LIBUSB_TRANSFER_TYPE_BULK;
+    transfer->timeout = timeout;
+    transfer->buffer = buffer;
+    transfer->length = length;
+    transfer->user_data = user_data;
+    transfer->callback = callback;
+}
+
+static inline void libusb_fill_bulk_stream_transfer(
+    struct libusb_transfer *transfer, libusb_device_handle *dev_handle,
+    unsigned char endpoint, uint32_t stream_id, unsigned char *buffer,
+    int length, libusb_transfer_cb_fn callback, void *user_data,
+    unsigned int timeout)
+{
+    libusb_fill_bulk_transfer(transfer, dev_handle, endpoint, buffer,
+                              length, callback, user_data, timeout);
+    transfer->type = LIBUSB_TRANSFER_TYPE_BULK_STREAM;
+    libusb_transfer_set_stream_id(transfer, stream_id);
+}
+
+static inline void libusb_fill_interrupt_transfer(
+    struct libusb_transfer *transfer, libusb_device_handle *dev_handle,
+    unsigned char endpoint, unsigned char *buffer, int length,
+    libusb_transfer_cb_fn callback, void *user_data, unsigned int timeout)
+{
+    transfer->dev_handle = dev_handle;
+    transfer->endpoint = endpoint;
+    transfer->type = LIBUSB_TRANSFER_TYPE_INTERRUPT;
+    transfer->timeout = timeout;
+    transfer->buffer = buffer;
+    transfer->length = length;
+    transfer->user_data = user_data;
+    transfer->callback = callback;
+}
+
+static inline void libusb_fill_iso_transfer(struct libusb_transfer *transfer,
+    libusb_device_handle *dev_handle, unsigned char endpoint,
+    unsigned char *buffer, int length, int num_iso_packets,
+    libusb_transfer_cb_fn callback, void *user_data, unsigned int timeout)
+{
+    transfer->dev_handle = dev_handle;
+    transfer->endpoint = endpoint;
+    transfer->type = LIBUSB_TRANSFER_TYPE_ISOCHRONOUS;
+    transfer->timeout = timeout;
+    transfer->buffer = buffer;
+    transfer->length = length;
+    transfer->num_iso_packets = num_iso_packets;
+    transfer->user_data = user_data;
+    transfer->callback = callback;
+}
+
+static inline void libusb_set_iso_packet_lengths(
+    struct libusb_transfer *transfer, unsigned int length)
+{
+    int i;
+
+    for (i = 0; i < transfer->num_iso_packets; i++)
+        transfer->iso_packet_desc[i].length = length;
+}
+
+static inline unsigned char *libusb_get_iso_packet_buffer(
+    struct libusb_transfer *transfer, unsigned int packet)
+{
+    int i;
+    size_t offset = 0;
+
+    if (packet >= (unsigned int)transfer->num_iso_packets)
+        return NULL;
+
+    for (i = 0; i < (int)packet; i++)
+        offset += transfer->iso_packet_desc[i].length;
+
+    return transfer->buffer + offset;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -19,6 +19,7 @@
 #include <locale.h>
 #include <glib.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "usbredirfilter.h"
 
@@ -228,6 +229,232 @@ test_check(gconstpointer private)
     usbredirfilter_free(rules);
 }
 
+static void
+test_buf_error_pos(void)
+{
+    static const struct {
+        const char *filter;
+        int want_pos;
+    } cases[] = {
+        { "0x03,-1,-1,-1,0", -1 },
+        { "0x100,-1,-1,-1,0", 0 },
+        { "0x03,-1,-1,-1,0|0x03,-2,-1,-1,0", 21 },
+        { "0x03,-1,-1,0x10000,0", 11 },
+        { "0x03,-1,-1,-1,0,1", 16 },
+        { "0x03,-1,-1,-1|-1,-1,-1,-1,1", 13 },
+        { "0x03,-1,-1,-1", 13 },
+        { "0x03,-1,-1,a,-1", 11 },
+        { "0x03,-1,-1,08,-1", 11 },
+        { "0x03,0x,-1,-1,1", 5 },
+    };
+    struct usbredirfilter_rule *rules;
+    int i, count, pos;
+
+    for (i = 0; i < G_N_ELEMENTS(cases); i++) {
+        int r = usbredirfilter_buf_to_rules(cases[i].filter,
+                                            strlen(cases[i].filter), ",", "|",
+                                            &rules, &count, &pos);
+
+        g_test_message("Filter: %s", cases[i].filter);
+        g_assert_cmpint(r, ==, cases[i].want_pos == -1 ? 0 : -EINVAL);
+        g_assert_cmpint(pos, ==, cases[i].want_pos);
+        usbredirfilter_free(rules);
+    }
+
+    g_assert_cmpint(usbredirfilter_buf_to_rules("", -1, ",", "|", &rules,
+                                                &count, NULL), ==, -EINVAL);
+}
+
+static void
+test_buf_not_terminated(void)
+{
+    /* Only the first rule is part of the buffer */
+    const char buf[] = "0x03,-1,-1,-1,0|0x100,-1,-1,-1,0";
+    struct usbredirfilter_rule *rules;
+    int count, pos;
+
+    g_assert_cmpint(usbredirfilter_buf_to_rules(buf, 15, ",", "|", &rules,
+                                                &count, &pos), ==, 0);
+    g_assert_cmpint(count, ==, 1);
+    g_assert_cmpint(rules[0].device_class, ==, 3);
+    g_assert_cmpint(rules[0].allow, ==, 0);
+    usbredirfilter_free(rules);
+
+    /* A rule cut short by the end of the buffer */
+    g_assert_cmpint(usbredirfilter_buf_to_rules(buf, 11, ",", "|", &rules,
+                                                &count, &pos), ==, -EINVAL);
+    g_assert_cmpint(pos, ==, 11);
+    g_assert_null(rules);
+    g_assert_cmpint(count, ==, 0);
+}
+
+/* The numbers must be parsed exactly like strtol(..., 0) would */
+static void
+test_buf_numbers(void)
+{
+    static const char *const numbers[] = {
+        "0", "00", "010", "0x0", "0X1f", "0xFF", "+5", "-0", "-1", "--1",
+        "+-1", "0x", "0xg", "09", "0b1", "1e3", "\v7", " 3", "0x-1",
+        "99999999999999999999", "-99999999999999999999",
+        "0xffffffffffffffffff", "4294967297", "2147483648", "-2147483649",
+        "4294967295", "0777777777777777777777777",
+    };
+    struct usbredirfilter_rule *rules;
+    int i, count;
+
+    for (i = 0; i < G_N_ELEMENTS(numbers); i++) {
+        char *filter = g_strdup_printf("-1,-1,-1,-1,%s", numbers[i]);
+        char *ep;
+        long want = strtol(numbers[i], &ep, 0);
+        int r;
+
+        g_test_message("Number: %s", numbers[i]);
+        r = usbredirfilter_string_to_rules(filter, ",", "|", &rules, &count);
+        if (*ep || ep == numbers[i]) {
+            g_assert_cmpint(r, ==, -EINVAL);
+        } else {
+            g_assert_cmpint(r, ==, 0);
+            g_assert_cmpint(rules[0].allow, ==, (int)want);
+        }
+        usbredirfilter_free(rules);
+        g_free(filter);
+    }
+}
+
+/* A device as passed to usbredirfilter_check() */
+struct test_device {
+    uint8_t device_class;
+    uint16_t vendor_id;
+    uint16_t product_id;
+    uint16_t device_version_bcd;
+    uint8_t interface_class[4];
+    uint8_t interface_subclass[4];
+    uint8_t interface_protocol[4];
+    int interface_count;
+};
+
+static int
+check_device(const struct usbredirfilter_rule *rules, int rules_count,
+             const struct usbredirfilter_compiled *compiled,
+             struct test_device *dev, int flags)
+{
+    if (compiled) {
+        return usbredirfilter_check_compiled(compiled,
+            dev->device_class, 0, 0, dev->interface_class,
+            dev->interface_subclass, dev->interface_protocol,
+            dev->interface_count, dev->vendor_id, dev->product_id,
+            dev->device_version_bcd, flags);
+    }
+    return usbredirfilter_check(rules, rules_count,
+        dev->device_class, 0, 0, dev->interface_class,
+        dev->interface_subclass, dev->interface_protocol,
+        dev->interface_count, dev->vendor_id, dev->product_id,
+        dev->device_version_bcd, flags);
+}
+
+static void
+test_compiled_first_match(void)
+{
+    /* Later, more specific rules must not win over earlier generic ones */
+    const struct usbredirfilter_rule rules[] = {
+        { 0x08, -1,     -1,     -1,     0 },
+        { -1,   0x1234, 0x5678, -1,     1 },
+        { 0x03, 0x1234, -1,     0x0100, 0 },
+        { -1,   0x1234, -1,     -1,     1 },
+    };
+    struct test_device storage = {
+        .device_class = 0x00, .vendor_id = 0x1234, .product_id = 0x5678,
+        .interface_class = { 0x08 }, .interface_count = 1,
+    };
+    struct test_device hid = {
+        .device_class = 0x00, .vendor_id = 0x1234, .product_id = 0x0001,
+        .device_version_bcd = 0x0100,
+        .interface_class = { 0x03 }, .interface_subclass = { 0x01 },
+        .interface_count = 1,
+    };
+    struct test_device other = {
+        .device_class = 0xff, .vendor_id = 0x4321, .product_id = 0x0001,
+    };
+    struct usbredirfilter_compiled *compiled;
+
+    g_assert_cmpint(usbredirfilter_compile(rules, G_N_ELEMENTS(rules),
+                                           &compiled), ==, 0);
+    g_assert_cmpint(check_device(NULL, 0, compiled, &storage, 0), ==, -EPERM);
+    g_assert_cmpint(check_device(NULL, 0, compiled, &hid, 0), ==, -EPERM);
+    hid.device_version_bcd = 0x0200;
+    g_assert_cmpint(check_device(NULL, 0, compiled, &hid, 0), ==, 0);
+    g_assert_cmpint(check_device(NULL, 0, compiled, &other, 0), ==, -ENOENT);
+    g_assert_cmpint(check_device(NULL, 0, compiled, &other,
+                                 usbredirfilter_fl_default_allow), ==, 0);
+    usbredirfilter_free_compiled(compiled);
+}
+
+static void
+test_compiled_invalid(void)
+{
+    const struct usbredirfilter_rule rules[] = {
+        { 0x100, -1, -1, -1, 0 },
+    };
+    struct usbredirfilter_compiled *compiled = (void *)rules;
+
+    g_assert_cmpint(usbredirfilter_compile(rules, 1, &compiled), ==, -EINVAL);
+    g_assert_null(compiled);
+    g_assert_cmpint(usbredirfilter_compile(rules, 0, &compiled), ==, 0);
+    g_assert_nonnull(compiled);
+    usbredirfilter_free_compiled(compiled);
+    usbredirfilter_free_compiled(NULL);
+}
+
+/* Pick values from a small set, so that random rules and devices match */
+static int
+random_value(int any_ok, int count, int base)
+{
+    int v = g_test_rand_int_range(any_ok ? -1 : 0, count);
+    return v == -1 ? -1 : base + v;
+}
+
+static void
+test_compiled_random(void)
+{
+    struct usbredirfilter_rule rules[200];
+    struct usbredirfilter_compiled *compiled;
+    int round, i, j;
+
+    for (round = 0; round < 50; round++) {
+        int rules_count = g_test_rand_int_range(0, G_N_ELEMENTS(rules));
+
+        for (i = 0; i < rules_count; i++) {
+            rules[i].device_class = random_value(TRUE, 4, 0x01);
+            rules[i].vendor_id = random_value(TRUE, 4, 0x1000);
+            rules[i].product_id = random_value(TRUE, 4, 0x2000);
+            rules[i].device_version_bcd = random_value(TRUE, 3, 0x0100);
+            rules[i].allow = g_test_rand_bit();
+        }
+        g_assert_cmpint(usbredirfilter_compile(rules, rules_count,
+                                               &compiled), ==, 0);
+
+        for (i = 0; i < 200; i++) {
+            struct test_device dev = {
+                .device_class = random_value(FALSE, 5, 0x00),
+                .vendor_id = random_value(FALSE, 5, 0x1000),
+                .product_id = random_value(FALSE, 5, 0x2000),
+                .device_version_bcd = random_value(FALSE, 4, 0x0100),
+                .interface_count = g_test_rand_int_range(0, 5),
+            };
+            int flags = g_test_rand_int_range(0, 4);
+
+            for (j = 0; j < dev.interface_count; j++) {
+                dev.interface_class[j] = random_value(FALSE, 5, 0x01);
+                dev.interface_subclass[j] = g_test_rand_bit();
+                dev.interface_protocol[j] = g_test_rand_bit();
+            }
+            g_assert_cmpint(check_device(NULL, 0, compiled, &dev, flags), ==,
+                            check_device(rules, rules_count, NULL, &dev, flags));
+        }
+        usbredirfilter_free_compiled(compiled);
+    }
+}
+
 static void
 add_tests(const char *prefix, const struct test items[], int count)
 {
@@ -246,6 +473,12 @@ main(int argc, char **argv)
     g_test_init(&argc, &argv, NULL);
 
     add_tests("/filter/rules", test_cases, G_N_ELEMENTS(test_cases));
+    g_test_add_func("/filter/buf/error-pos", test_buf_error_pos);
+    g_test_add_func("/filter/buf/not-terminated", test_buf_not_terminated);
+    g_test_add_func("/filter/buf/numbers", test_buf_numbers);
+    g_test_add_func("/filter/compiled/first-match", test_compiled_first_match);
+    g_test_add_func("/filter/compiled/invalid", test_compiled_invalid);
+    g_test_add_func("/filter/compiled/random", test_compiled_random);
 
     return g_test_run();
 }
@@ -0,0 +1,1065 @@
+/*
+ * Copyright 2026 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#define G_LOG_DOMAIN "host"
+#define G_LOG_USE_STRUCTURED
+
+#include "usbredirhost.h"
+#include "fakeusb.h"
+#ifdef HAVE_ZEROCOPY
+#include "usbredirzerocopy.h"
+#endif
+
+#include <errno.h>
+#include <locale.h>
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#ifdef HAVE_ZEROCOPY
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+/* usbredirhost talking to a usbredirparser based usb-guest through in
+   memory buffers, with a simulated device underneath */
+typedef struct {
+    libusb_context *ctx;
+    libusb_device *dev;
+    struct usbredirhost *host;
+    struct usbredirparser *guest;
+    GByteArray *to_host;
+    GByteArray *to_guest;
+    int host_write_limit;   /* Writes the host may do, -1: no limit */
+    /* With usbredirhost_fl_write_cb_owns_buffer, the write buffers not
+       given back yet, as if they were still being sent */
+    GPtrArray *write_buffers;
+#ifdef HAVE_ZEROCOPY
+    /* Takes the host's writes instead, see test_zerocopy_close */
+    struct usbredirzerocopy *zc;
+    struct usbredirhost *zc_host;
+#endif
+
+    /* What the guest received */
+    gboolean connected;
+    gboolean disconnected;
+    struct usb_redir_device_connect_header device_connect;
+    struct usb_redir_interface_info_header interface_info;
+    gboolean got_alt_setting_status;
+    gboolean got_packet;
+    uint64_t packet_id;
+    uint8_t packet_status;
+    uint32_t packet_length;
+    GByteArray *packet_data;
+    /* The transfers from send_pending_bulk, which may arrive together */
+    gboolean got_pending[2];
+    uint8_t pending_status[2];
+    uint32_t pending_length[2];
+} Fixture;
+
+#define PENDING_ID 100000
+
+static void
+log_cb(void *priv, int level, const char *msg)
+{
+    GLogLevelFlags glog_level;
+
+    switch(level) {
+    case usbredirparser_error:
+        glog_level = G_LOG_LEVEL_CRITICAL;
+        break;
+    case usbredirparser_warning:
+        glog_level = G_LOG_LEVEL_WARNING;
+        break;
+    case usbredirparser_info:
+        glog_level = G_LOG_LEVEL_INFO;
+        break;
+    case usbredirparser_debug:
+    case usbredirparser_debug_data:
+        glog_level = G_LOG_LEVEL_DEBUG;
+        break;
+    default:
+        g_warn_if_reached();
+        return;
+    }
+    g_log_structured(G_LOG_DOMAIN, glog_level, "MESSAGE", msg);
+}
+
+static int
+buf_read(GByteArray *buf, uint8_t *data, int count)
+{
+    count = MIN(count, (int)buf->len);
+    memcpy(data, buf->data, count);
+    g_byte_array_remove_range(buf, 0, count);
+    return count;
+}
+
+static int
+host_read(void *priv, uint8_t *data, int count)
+{
+    Fixture *f = priv;
+    return buf_read(f->to_host, data, count);
+}
+
+static int
+host_write(void *priv, uint8_t *data, int count)
+{
+    Fixture *f = priv;
+
+#ifdef HAVE_ZEROCOPY
+    if (f->zc) {
+        return usbredirzerocopy_write(f->zc, data, count);
+    }
+#endif
+    if (f->host_write_limit == 0) {
+        return 0;
+    }
+    if (f->host_write_limit > 0) {
+        f->host_write_limit--;
+    }
+    g_byte_array_append(f->to_guest, data, count);
+    if (f->write_buffers) {
+        g_ptr_array_add(f->write_buffers, data);
+    }
+    return count;
+}
+
+static int
+guest_read(void *priv, uint8_t *data, int count)
+{
+    Fixture *f = priv;
+    return buf_read(f->to_guest, data, count);
+}
+
+static int
+guest_write(void *priv, uint8_t *data, int count)
+{
+    Fixture *f = priv;
+    g_byte_array_append(f->to_host, data, count);
+    return count;
+}
+
+static void
+guest_hello(void *priv, struct usb_redir_hello_header *hello)
+{
+}
+
+static void
+guest_device_connect(void *priv,
+                     struct usb_redir_device_connect_header *device_connect)
+{
+    Fixture *f = priv;
+    f->device_connect = *device_connect;
+    f->connected = TRUE;
+}
+
+static void
+guest_device_disconnect(void *priv)
+{
+    Fixture *f = priv;
+    /* The parser sends the device_disconnect_ack */
+    f->disconnected = TRUE;
+}
+
+static void
+guest_interface_info(void *priv,
+                     struct usb_redir_interface_info_header *interface_info)
+{
+    Fixture *f = priv;
+    f->interface_info = *interface_info;
+}
+
+static void
+guest_ep_info(void *priv, struct usb_redir_ep_info_header *ep_info)
+{
+}
+
+static void
+guest_filter_filter(void *priv, struct usbredirfilter_rule *rules,
+                    int rules_count)
+{
+    free(rules);
+}
+
+static void
+guest_packet(Fixture *f, uint64_t id, uint8_t status, uint32_t length,
+             uint8_t *data, int data_len)
+{
+    f->got_packet = TRUE;
+    f->packet_id = id;
+    if (id - PENDING_ID < 2) {
+        g_assert_false(f->got_pending[id - PENDING_ID]);
+        f->got_pending[id - PENDING_ID] = TRUE;
+        f->pending_status[id - PENDING_ID] = status;
+        f->pending_length[id - PENDING_ID] = length;
+    }
+    f->packet_status = status;
+    f->packet_length = length;
+    g_byte_array_set_size(f->packet_data, 0);
+    g_byte_array_append(f->packet_data, data, data_len);
+    usbredirparser_free_packet_data(f->guest, data);
+}
+
+static void
+guest_control_packet(void *priv, uint64_t id,
+                     struct usb_redir_control_packet_header *control_header,
+                     uint8_t *data, int data_len)
+{
+    guest_packet(priv, id, control_header->status, control_header->length,
+                 data, data_len);
+}
+
+static void
+guest_bulk_packet(void *priv, uint64_t id,
+                  struct usb_redir_bulk_packet_header *bulk_header,
+                  uint8_t *data, int data_len)
+{
+    guest_packet(priv, id, bulk_header->status,
+                 (uint32_t)bulk_header->length_high << 16 |
+                 bulk_header->length, data, data_len);
+}
+
+static void
+guest_alt_setting_status(void *priv, uint64_t id,
+    struct usb_redir_alt_setting_status_header *alt_setting_status)
+{
+    Fixture *f = priv;
+    g_assert_cmpint(alt_setting_status->status, ==, usb_redir_success);
+    f->got_alt_setting_status = TRUE;
+}
+
+static void
+guest_iso_stream_status(void *priv, uint64_t id,
+    struct usb_redir_iso_stream_status_header *iso_stream_status)
+{
+    g_assert_cmpint(iso_stream_status->status, ==, usb_redir_success);
+}
+
+static void
+guest_iso_packet(void *priv, uint64_t id,
+                 struct usb_redir_iso_packet_header *iso_header,
+                 uint8_t *data, int data_len)
+{
+    guest_packet(priv, id, iso_header->status, iso_header->length,
+                 data, data_len);
+}
+
+static struct usbredirparser *
+get_guest(Fixture *f)
+{
+    struct usbredirparser *parser = usbredirparser_create();
+    g_assert_nonnull(parser);
+
+    parser->priv = f;
+    parser->log_func = log_cb;
+    parser->read_func = guest_read;
+    parser->write_func = guest_write;
+    parser->hello_func = guest_hello;
+    parser->device_connect_func = guest_device_connect;
+    parser->device_disconnect_func = guest_device_disconnect;
+    parser->interface_info_func = guest_interface_info;
+    parser->ep_info_func = guest_ep_info;
+    parser->filter_filter_func = guest_filter_filter;
+    parser->control_packet_func = guest_control_packet;
+    parser->bulk_packet_func = guest_bulk_packet;
+    parser->alt_setting_status_func = guest_alt_setting_status;
+    parser->iso_stream_status_func = guest_iso_stream_status;
+    parser->iso_packet_func = guest_iso_packet;
+
+    uint32_t caps[USB_REDIR_CAPS_SIZE] = { 0, };
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_connect_device_version);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_filter);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_device_disconnect_ack);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_ep_info_max_packet_size);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_64bits_ids);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_32bits_bulk_length);
+
+    usbredirparser_init(parser, PACKAGE_STRING, caps, USB_REDIR_CAPS_SIZE, 0);
+    return parser;
+}
+
+/* Moves data between the guest, the host and the device until cond is set */
+static void
+pump_until(Fixture *f, gboolean *cond)
+{
+    gint64 deadline = g_get_monotonic_time() + 5 * G_USEC_PER_SEC;
+
+    while (!*cond) {
+        struct timeval tv = { 0, 1000 };
+
+        g_assert_cmpint(g_get_monotonic_time(), <, deadline);
+        while (usbredirparser_has_data_to_write(f->guest)) {
+            usbredirparser_do_write(f->guest);
+        }
+        g_assert_cmpint(usbredirhost_read_guest_data(f->host), ==, 0);
+        while (usbredirhost_has_data_to_write(f->host)) {
+            usbredirhost_write_guest_data(f->host);
+        }
+        g_assert_cmpint(usbredirparser_do_read(f->guest), ==, 0);
+        if (!*cond) {
+            libusb_handle_events_timeout(f->ctx, &tv);
+        }
+    }
+}
+
+static void
+fixture_setup_full(Fixture *f, int flags, size_t dev_mem_size)
+{
+    struct fakeusb_device_config config;
+    libusb_device_handle *handle;
+
+    f->to_host = g_byte_array_new();
+    f->to_guest = g_byte_array_new();
+    f->packet_data = g_byte_array_new();
+    f->host_write_limit = -1;
+    if (flags & usbredirhost_fl_write_cb_owns_buffer) {
+        f->write_buffers = g_ptr_array_new();
+    }
+
+    fakeusb_device_config_init(&config);
+    config.dev_mem_size = dev_mem_size;
+    g_assert_cmpint(libusb_init(&f->ctx), ==, 0);
+    f->dev = fakeusb_device_new(f->ctx, &config);
+    g_assert_nonnull(f->dev);
+    g_assert_cmpint(libusb_open(f->dev, &handle), ==, 0);
+
+    f->host = usbredirhost_open_full(f->ctx, handle, log_cb,
+                                     host_read, host_write,
+                                     NULL, NULL, NULL, NULL, NULL,
+                                     f, PACKAGE_STRING,
+                                     usbredirparser_warning, flags);
+    g_assert_nonnull(f->host);
+    f->guest = get_guest(f);
+
+    pump_until(f, &f->connected);
+}
+
+static void
+fixture_setup(Fixture *f, gconstpointer user_data)
+{
+    fixture_setup_full(f, GPOINTER_TO_INT(user_data), 0);
+}
+
+static void
+fixture_setup_dev_mem(Fixture *f, gconstpointer user_data)
+{
+    fixture_setup_full(f, GPOINTER_TO_INT(user_data), 1024 * 1024);
+}
+
+static void
+fixture_teardown(Fixture *f, gconstpointer user_data)
+{
+    if (f->host) {
+        usbredirhost_close(f->host);
+    }
+    /* Including the buffers usbredirhost keeps around for re-use */
+    g_assert_cmpuint(fakeusb_device_get_dev_mem_used(f->dev), ==, 0);
+    usbredirparser_destroy(f->guest);
+    libusb_unref_device(f->dev);
+    libusb_exit(f->ctx);
+    g_byte_array_unref(f->to_host);
+    g_byte_array_unref(f->to_guest);
+    g_byte_array_unref(f->packet_data);
+    if (f->write_buffers) {
+        g_assert_cmpuint(f->write_buffers->len, ==, 0);
+        g_ptr_array_unref(f->write_buffers);
+    }
+}
+
+static void
+send_bulk(Fixture *f, uint64_t id, uint8_t ep, uint8_t *data, uint32_t len)
+{
+    struct usb_redir_bulk_packet_header bulk_header = {
+        .endpoint = ep,
+        .length = len & 0xffff,
+        .length_high = len >> 16,
+    };
+
+    f->got_packet = FALSE;
+    usbredirparser_send_bulk_packet(f->guest, id, &bulk_header,
+                                    data, data ? len : 0);
+}
+
+static void
+test_connect(Fixture *f, gconstpointer user_data)
+{
+    g_assert_cmpint(f->device_connect.speed, ==, usb_redir_speed_high);
+    g_assert_cmpint(f->device_connect.vendor_id, ==, 0x1209);
+    g_assert_cmpint(f->device_connect.product_id, ==, 0x0001);
+    g_assert_cmpint(f->interface_info.interface_count, ==, 2);
+    g_assert_cmpint(f->interface_info.interface_class[0], ==, 0xff);
+}
+
+static void
+test_control_get_descriptor(Fixture *f, gconstpointer user_data)
+{
+    struct usb_redir_control_packet_header control_header = {
+        .endpoint = 0x80,
+        .request = LIBUSB_REQUEST_GET_DESCRIPTOR,
+        .requesttype = LIBUSB_ENDPOINT_IN,
+        .value = LIBUSB_DT_DEVICE << 8,
+        .length = 18,
+    };
+
+    usbredirparser_send_control_packet(f->guest, 1, &control_header,
+                                       NULL, 0);
+    pump_until(f, &f->got_packet);
+
+    g_assert_cmpuint(f->packet_id, ==, 1);
+    g_assert_cmpint(f->packet_status, ==, usb_redir_success);
+    g_assert_cmpuint(f->packet_data->len, ==, 18);
+    g_assert_cmpint(f->packet_data->data[0], ==, 18);
+    g_assert_cmpint(f->packet_data->data[1], ==, LIBUSB_DT_DEVICE);
+}
+
+static uint64_t
+get_descriptor_from(Fixture *f, uint64_t id, uint8_t recipient,
+                    uint16_t value, uint16_t index, uint16_t length)
+{
+    struct usb_redir_control_packet_header control_header = {
+        .endpoint = 0x80,
+        .request = LIBUSB_REQUEST_GET_DESCRIPTOR,
+        .requesttype = LIBUSB_ENDPOINT_IN | recipient,
+        .value = value,
+        .index = index,
+        .length = length,
+    };
+    struct fakeusb_ep_stats stats;
+
+    f->got_packet = FALSE;
+    usbredirparser_send_control_packet(f->guest, id, &control_header,
+                                       NULL, 0);
+    pump_until(f, &f->got_packet);
+
+    g_assert_cmpuint(f->packet_id, ==, id);
+    g_assert_cmpint(f->packet_status, ==, usb_redir_success);
+    g_assert_cmpint(fakeusb_device_get_ep_stats(f->dev, 0, &stats), ==, 0);
+    return stats.transfers;
+}
+
+/* Returns the number of control transfers the device saw so far */
+static uint64_t
+get_descriptor(Fixture *f, uint64_t id, uint16_t value, uint16_t length)
+{
+    return get_descriptor_from(f, id, LIBUSB_RECIPIENT_DEVICE, value, 0,
+                               length);
+}
+
+static void
+test_descriptor_cache(Fixture *f, gconstpointer user_data)
+{
+    uint8_t config[255];
+    uint64_t transfers;
+    uint32_t config_len;
+
+    /* The device descriptor is known from the start */
+    transfers = get_descriptor(f, 1, LIBUSB_DT_DEVICE << 8, 18);
+    g_assert_cmpuint(f->packet_data->len, ==, 18);
+    g_assert_cmpint(f->packet_data->data[1], ==, LIBUSB_DT_DEVICE);
+    g_assert_cmpuint(get_descriptor(f, 2, LIBUSB_DT_DEVICE << 8, 8),
+                     ==, transfers);
+    g_assert_cmpuint(f->packet_data->len, ==, 8);
+
+    /* The start of the configuration descriptor does not answer the
+       request for all of it */
+    g_assert_cmpuint(get_descriptor(f, 3, LIBUSB_DT_CONFIG << 8, 9),
+                     ==, transfers + 1);
+    g_assert_cmpuint(get_descriptor(f, 4, LIBUSB_DT_CONFIG << 8, 255),
+                     ==, transfers + 2);
+    config_len = f->packet_data->len;
+    g_assert_cmpuint(config_len, ==,
+                     f->packet_data->data[2] | f->packet_data->data[3] << 8);
+    memcpy(config, f->packet_data->data, config_len);
+
+    g_assert_cmpuint(get_descriptor(f, 5, LIBUSB_DT_CONFIG << 8, 9),
+                     ==, transfers + 2);
+    g_assert_cmpmem(f->packet_data->data, f->packet_data->len, config, 9);
+    g_assert_cmpuint(get_descriptor(f, 6, LIBUSB_DT_CONFIG << 8, 255),
+                     ==, transfers + 2);
+    g_assert_cmpmem(f->packet_data->data, f->packet_data->len,
+                    config, config_len);
+
+    /* A reset drops all but the device descriptor */
+    usbredirparser_send_reset(f->guest);
+    g_assert_cmpuint(get_descriptor(f, 7, LIBUSB_DT_DEVICE << 8, 18),
+                     ==, transfers + 2);
+    g_assert_cmpuint(get_descriptor(f, 8, LIBUSB_DT_CONFIG << 8, 255),
+                     ==, transfers + 3);
+    g_assert_cmpmem(f->packet_data->data, f->packet_data->len,
+                    config, config_len);
+}
+
+/* fakeusb's interface class descriptors depend on the alt setting, so they
+   must not be answered from the cache after a SET_INTERFACE */
+static void
+test_descriptor_cache_alt_setting(Fixture *f, gconstpointer user_data)
+{
+    struct usb_redir_set_alt_setting_header set_alt_setting = {
+        .interface = 1,
+        .alt = 1,
+    };
+    uint64_t transfers;
+
+    transfers = get_descriptor_from(f, 1, LIBUSB_RECIPIENT_INTERFACE,
+                                    0x22 << 8, 1, 8);
+    g_assert_cmpuint(f->packet_data->len, ==, 8);
+    g_assert_cmpint(f->packet_data->data[0], ==, 0x10);
+    g_assert_cmpuint(get_descriptor_from(f, 2, LIBUSB_RECIPIENT_INTERFACE,
+                                         0x22 << 8, 1, 8), ==, transfers);
+    /* The other interface's one is not the same descriptor */
+    g_assert_cmpuint(get_descriptor_from(f, 3, LIBUSB_RECIPIENT_INTERFACE,
+                                         0x22 << 8, 0, 8), ==, transfers + 1);
+    g_assert_cmpint(f->packet_data->data[0], ==, 0x00);
+
+    usbredirparser_send_set_alt_setting(f->guest, 4, &set_alt_setting);
+    pump_until(f, &f->got_alt_setting_status);
+
+    g_assert_cmpuint(get_descriptor_from(f, 5, LIBUSB_RECIPIENT_INTERFACE,
+                                         0x22 << 8, 1, 8), ==, transfers + 2);
+    g_assert_cmpint(f->packet_data->data[0], ==, 0x11);
+    /* Only the descriptors of the changed interface got dropped */
+    g_assert_cmpuint(get_descriptor_from(f, 6, LIBUSB_RECIPIENT_INTERFACE,
+                                         0x22 << 8, 0, 8), ==, transfers + 2);
+    g_assert_cmpint(f->packet_data->data[0], ==, 0x00);
+    g_assert_cmpuint(get_descriptor(f, 7, LIBUSB_DT_DEVICE << 8, 18),
+                     ==, transfers + 2);
+}
+
+static void
+test_bulk_in(Fixture *f, gconstpointer user_data)
+{
+    send_bulk(f, 2, 0x81, NULL, 65536);
+    pump_until(f, &f->got_packet);
+
+    g_assert_cmpuint(f->packet_id, ==, 2);
+    g_assert_cmpint(f->packet_status, ==, usb_redir_success);
+    g_assert_cmpuint(f->packet_length, ==, 65536);
+    g_assert_cmpuint(f->packet_data->len, ==, 65536);
+}
+
+/* The write callback keeps the buffers it gets, like a MSG_ZEROCOPY sender,
+   and gives the ones still in use back after closing the usbredirhost */
+static void
+test_write_cb_owns_buffer_close(Fixture *f, gconstpointer user_data)
+{
+    struct usbredirhost *host = f->host;
+    guint i;
+
+    send_bulk(f, 2, 0x81, NULL, 65536);
+    pump_until(f, &f->got_packet);
+    g_assert_cmpuint(f->packet_length, ==, 65536);
+    g_assert_cmpuint(f->write_buffers->len, >, 1);
+
+    /* One of them completes before closing */
+    usbredirhost_free_write_buffer(host, g_ptr_array_index(f->write_buffers, 0));
+    g_ptr_array_remove_index(f->write_buffers, 0);
+
+    usbredirhost_close(f->host);
+    f->host = NULL;
+    for (i = 0; i < f->write_buffers->len; i++) {
+        usbredirhost_free_write_buffer(host,
+                                       g_ptr_array_index(f->write_buffers, i));
+    }
+    g_ptr_array_set_size(f->write_buffers, 0);
+}
+
+#ifdef HAVE_ZEROCOPY
+static void
+zerocopy_free_buffer(void *priv, uint8_t *data)
+{
+    Fixture *f = priv;
+    usbredirhost_free_write_buffer(f->zc_host, data);
+}
+
+/* usbredirect --zerocopy going away with writes still queued in its
+   sender: they get given back after closing the usbredirhost */
+static void
+test_zerocopy_close(Fixture *f, gconstpointer user_data)
+{
+    gint64 deadline = g_get_monotonic_time() + 5 * G_USEC_PER_SEC;
+    uint64_t id = 1;
+    int sv[2];
+    guint i;
+
+    /* What the guest got so far has been sent */
+    for (i = 0; i < f->write_buffers->len; i++) {
+        usbredirhost_free_write_buffer(f->host,
+                                       g_ptr_array_index(f->write_buffers, i));
+    }
+    g_ptr_array_set_size(f->write_buffers, 0);
+
+    /* The other end never reads, so the sender's queue fills up */
+    g_assert_cmpint(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), ==, 0);
+    f->zc_host = f->host;
+    g_assert_cmpint(usbredirzerocopy_create(sv[0], 0, 0, zerocopy_free_buffer,
+                                            f, &f->zc), ==, 0);
+    while (usbredirzerocopy_get_buffered_size(f->zc) == 0) {
+        struct timeval tv = { 0, 1000 };
+
+        g_assert_cmpint(g_get_monotonic_time(), <, deadline);
+        send_bulk(f, id++, 0x81, NULL, 65536);
+        while (usbredirparser_has_data_to_write(f->guest)) {
+            usbredirparser_do_write(f->guest);
+        }
+        g_assert_cmpint(usbredirhost_read_guest_data(f->host), ==, 0);
+        libusb_handle_events_timeout(f->ctx, &tv);
+        while (usbredirhost_has_data_to_write(f->host)) {
+            usbredirhost_write_guest_data(f->host);
+        }
+    }
+
+    usbredirhost_close(f->host);
+    f->host = NULL;
+    g_clear_pointer(&f->zc, usbredirzerocopy_destroy);
+    close(sv[0]);
+    close(sv[1]);
+}
+#endif
+
+static void
+test_latency_write(Fixture *f, gconstpointer user_data)
+{
+    gint64 deadline = g_get_monotonic_time() + 5 * G_USEC_PER_SEC;
+    struct usbredirhost_latency_histogram hist;
+
+    g_assert_cmpint(usbredirhost_enable_latency_stats(f->host), ==, 0);
+
+    /* Get 2 replies queued */
+    send_bulk(f, 20, 0x81, NULL, 512);
+    send_bulk(f, 21, 0x81, NULL, 512);
+    while (usbredirparser_has_data_to_write(f->guest)) {
+        usbredirparser_do_write(f->guest);
+    }
+    g_assert_cmpint(usbredirhost_read_guest_data(f->host), ==, 0);
+    while (usbredirhost_has_data_to_write(f->host) < 2) {
+        struct timeval tv = { 0, 1000 };
+
+        g_assert_cmpint(g_get_monotonic_time(), <, deadline);
+        libusb_handle_events_timeout(f->ctx, &tv);
+    }
+
+    /* The write of the first one gets accounted, without the write queue
+       ever becoming empty */
+    f->host_write_limit = 1;
+    usbredirhost_write_guest_data(f->host);
+    g_assert_cmpint(usbredirhost_has_data_to_write(f->host), ==, 1);
+    g_assert_cmpint(usbredirhost_get_latency_histogram(f->host,
+                        usb_redir_type_bulk, usbredirhost_latency_stage_write,
+                        &hist), ==, 0);
+    g_assert_cmpuint(hist.count, ==, 1);
+
+    f->host_write_limit = -1;
+    usbredirhost_write_guest_data(f->host);
+    g_assert_cmpint(usbredirhost_get_latency_histogram(f->host,
+                        usb_redir_type_bulk, usbredirhost_latency_stage_write,
+                        &hist), ==, 0);
+    g_assert_cmpuint(hist.count, ==, 2);
+}
+
+static void
+test_bulk_out(Fixture *f, gconstpointer user_data)
+{
+    struct fakeusb_ep_stats stats;
+    uint8_t data[512] = { 0, };
+
+    send_bulk(f, 3, 0x02, data, sizeof(data));
+    pump_until(f, &f->got_packet);
+
+    g_assert_cmpuint(f->packet_id, ==, 3);
+    g_assert_cmpint(f->packet_status, ==, usb_redir_success);
+    g_assert_cmpuint(f->packet_length, ==, sizeof(data));
+    g_assert_cmpuint(f->packet_data->len, ==, 0);
+
+    g_assert_cmpint(fakeusb_device_get_ep_stats(f->dev, 0x02, &stats), ==, 0);
+    g_assert_cmpuint(stats.transfers, ==, 1);
+    g_assert_cmpuint(stats.bytes, ==, sizeof(data));
+}
+
+static void
+test_stall(Fixture *f, gconstpointer user_data)
+{
+    struct fakeusb_ep_config ep_config = {
+        .address = 0x81,
+        .latency_us = 125,
+        .interval_us = -1,
+        .stall_every = 1,
+        .short_len = -1,
+    };
+
+    g_assert_cmpint(fakeusb_device_set_ep_config(f->dev, &ep_config), ==, 0);
+    send_bulk(f, 4, 0x81, NULL, 512);
+    pump_until(f, &f->got_packet);
+
+    g_assert_cmpuint(f->packet_id, ==, 4);
+    g_assert_cmpint(f->packet_status, ==, usb_redir_stall);
+}
+
+static void
+test_disconnect(Fixture *f, gconstpointer user_data)
+{
+    /* Let usbredirhost submit a transfer and unplug the device before it
+       completes, usbredirhost notices the disconnect through the failing
+       transfer */
+    send_bulk(f, 5, 0x81, NULL, 512);
+    while (usbredirparser_has_data_to_write(f->guest)) {
+        usbredirparser_do_write(f->guest);
+    }
+    g_assert_cmpint(usbredirhost_read_guest_data(f->host), ==, 0);
+    fakeusb_device_disconnect(f->dev);
+
+    pump_until(f, &f->disconnected);
+}
+
+static void
+test_suspend_resume(Fixture *f, gconstpointer user_data)
+{
+    gint64 deadline = g_get_monotonic_time() + 5 * G_USEC_PER_SEC;
+    struct timeval tv = { 0, 1000 };
+
+    /* Lose the connection while a transfer is in flight */
+    send_bulk(f, 9, 0x81, NULL, 512);
+    while (usbredirparser_has_data_to_write(f->guest)) {
+        usbredirparser_do_write(f->guest);
+    }
+    g_assert_cmpint(usbredirhost_read_guest_data(f->host), ==, 0);
+    usbredirhost_suspend(f->host);
+
+    /* Its completion gets queued, but not written */
+    while (!usbredirhost_has_data_to_write(f->host)) {
+        g_assert_cmpint(g_get_monotonic_time(), <, deadline);
+        libusb_handle_events_timeout(f->ctx, &tv);
+    }
+    g_assert_cmpint(usbredirhost_write_guest_data(f->host), ==, 0);
+    g_assert_cmpuint(f->to_guest->len, ==, 0);
+
+    /* Neither does anything get read */
+    send_bulk(f, 10, 0x81, NULL, 512);
+    while (usbredirparser_has_data_to_write(f->guest)) {
+        usbredirparser_do_write(f->guest);
+    }
+    g_assert_cmpuint(f->to_host->len, >, 0);
+    g_assert_cmpint(usbredirhost_read_guest_data(f->host), ==, 0);
+    g_assert_cmpuint(f->to_host->len, >, 0);
+
+    /* Both continue after resuming */
+    usbredirhost_resume(f->host);
+    pump_until(f, &f->got_packet);
+    g_assert_cmpuint(f->packet_id, ==, 9);
+    g_assert_cmpint(f->packet_status, ==, usb_redir_success);
+
+    f->got_packet = FALSE;
+    pump_until(f, &f->got_packet);
+    g_assert_cmpuint(f->packet_id, ==, 10);
+    g_assert_cmpint(f->packet_status, ==, usb_redir_success);
+}
+
+static void
+test_iso_in(Fixture *f, gconstpointer user_data)
+{
+    struct usb_redir_set_alt_setting_header set_alt_setting = {
+        .interface = 1,
+        .alt = 1,
+    };
+    struct usb_redir_start_iso_stream_header start_iso_stream = {
+        .endpoint = 0x84,
+        .pkts_per_urb = 8,
+        .no_urbs = 3,
+    };
+
+    usbredirparser_send_set_alt_setting(f->guest, 6, &set_alt_setting);
+    pump_until(f, &f->got_alt_setting_status);
+
+    f->got_packet = FALSE;
+    usbredirparser_send_start_iso_stream(f->guest, 7, &start_iso_stream);
+    pump_until(f, &f->got_packet);
+
+    g_assert_cmpint(f->packet_status, ==, usb_redir_success);
+    g_assert_cmpuint(f->packet_length, ==, 1024);
+    g_assert_cmpuint(f->packet_data->len, ==, 1024);
+}
+
+/* Sends a bulk IN and a bulk OUT transfer to the host, which stay pending
+   until the device gets to them */
+static void
+send_pending_bulk(Fixture *f)
+{
+    uint8_t data[512];
+
+    memset(data, 0x5a, sizeof(data));
+    send_bulk(f, PENDING_ID, 0x81, NULL, 512);
+    send_bulk(f, PENDING_ID + 1, 0x02, data, sizeof(data));
+    while (usbredirparser_has_data_to_write(f->guest)) {
+        usbredirparser_do_write(f->guest);
+    }
+    g_assert_cmpint(usbredirhost_read_guest_data(f->host), ==, 0);
+}
+
+/* Both transfers from send_pending_bulk complete, each once, and the OUT
+   data reaches the device once */
+static void
+check_pending_bulk(Fixture *f)
+{
+    struct fakeusb_ep_stats stats;
+
+    pump_until(f, &f->got_pending[0]);
+    pump_until(f, &f->got_pending[1]);
+    g_assert_cmpint(f->pending_status[0], ==, usb_redir_success);
+    g_assert_cmpuint(f->pending_length[0], ==, 512);
+    g_assert_cmpint(f->pending_status[1], ==, usb_redir_success);
+    g_assert_cmpuint(f->pending_length[1], ==, 512);
+    g_assert_cmpint(fakeusb_device_get_ep_stats(f->dev, 0x02, &stats), ==, 0);
+    g_assert_cmpuint(stats.bytes, ==, 512);
+}
+
+static void
+test_serialize(Fixture *f, gconstpointer user_data)
+{
+    libusb_device_handle *handle;
+    uint8_t *state;
+    int len;
+
+    /* Serialize with a running iso stream and pending transfers */
+    test_iso_in(f, user_data);
+    send_pending_bulk(f);
+
+    usbredirhost_suspend(f->host);
+    g_assert_cmpint(usbredirhost_serialize(f->host, &state, &len), ==, 0);
+    usbredirhost_close(f->host);
+
+    /* Continue with a new usbredirhost, without the guest noticing */
+    f->host = usbredirhost_open_full(f->ctx, NULL, log_cb,
+                                     host_read, host_write,
+                                     NULL, NULL, NULL, NULL, NULL,
+                                     f, PACKAGE_STRING,
+                                     usbredirparser_warning, 0);
+    g_assert_nonnull(f->host);
+    g_assert_cmpint(libusb_open(f->dev, &handle), ==, 0);
+    g_assert_cmpint(usbredirhost_unserialize(f->host, handle, state, len),
+                    ==, 0);
+    free(state);
+    f->connected = FALSE;
+
+    /* The pending transfers survived the hand over */
+    check_pending_bulk(f);
+
+    /* The iso stream continues in alt setting 1 */
+    f->got_packet = FALSE;
+    pump_until(f, &f->got_packet);
+    g_assert_cmpint(f->packet_status, ==, usb_redir_success);
+    g_assert_cmpuint(f->packet_length, ==, 1024);
+    g_assert_false(f->connected);
+    g_assert_false(f->disconnected);
+}
+
+/* When the hand over does not happen after all, the pending transfers
+   taken back by usbredirhost_serialize get submitted again on resume */
+static void
+test_serialize_resume(Fixture *f, gconstpointer user_data)
+{
+    uint8_t *state;
+    int len;
+
+    send_pending_bulk(f);
+
+    usbredirhost_suspend(f->host);
+    g_assert_cmpint(usbredirhost_serialize(f->host, &state, &len), ==, 0);
+    free(state);
+    usbredirhost_resume(f->host);
+
+    check_pending_bulk(f);
+}
+
+static void
+test_dev_mem(Fixture *f, gconstpointer user_data)
+{
+    test_bulk_in(f, user_data);
+    g_assert_cmpuint(fakeusb_device_get_dev_mem_used(f->dev), >=, 65536);
+    f->got_packet = FALSE;
+    test_control_get_descriptor(f, user_data);
+    test_iso_in(f, user_data);
+    /* The 3 iso buffers of 8 KiB, plus what was kept for re-use */
+    g_assert_cmpuint(fakeusb_device_get_dev_mem_used(f->dev), >=,
+                     65536 + 3 * 8192);
+}
+
+static void
+test_dev_mem_exhausted(Fixture *f, gconstpointer user_data)
+{
+    size_t used;
+
+    test_bulk_in(f, user_data);
+    used = fakeusb_device_get_dev_mem_used(f->dev);
+    g_assert_cmpuint(used, >=, 65536);
+
+    /* Larger than all the device memory, this falls back to malloc */
+    send_bulk(f, 8, 0x81, NULL, 2 * 1024 * 1024);
+    pump_until(f, &f->got_packet);
+
+    g_assert_cmpint(f->packet_status, ==, usb_redir_success);
+    g_assert_cmpuint(f->packet_data->len, ==, 2 * 1024 * 1024);
+    g_assert_cmpuint(fakeusb_device_get_dev_mem_used(f->dev), ==, used);
+}
+
+static libusb_device *
+new_filter_device(libusb_context *ctx, uint8_t address, uint8_t *device_desc,
+                  uint16_t product_id)
+{
+    struct fakeusb_device_config config;
+    libusb_device *dev;
+
+    fakeusb_device_config_init(&config);
+    memcpy(device_desc, config.device_desc, LIBUSB_DT_DEVICE_SIZE);
+    device_desc[4] = 0x00; /* Class info at the interface level */
+    device_desc[10] = product_id & 0xff;
+    device_desc[11] = product_id >> 8;
+    config.device_desc = device_desc;
+    config.device_address = address;
+    dev = fakeusb_device_new(ctx, &config);
+    g_assert_nonnull(dev);
+    return dev;
+}
+
+static void
+test_filter_batch(void)
+{
+    /* Allow 1209:0002, block vendor specific interfaces, allow the rest */
+    const struct usbredirfilter_rule rules[] = {
+        { -1,   0x1209, 0x0002, -1, 1 },
+        { 0xff, -1,     -1,     -1, 0 },
+        { -1,   -1,     -1,     -1, 1 },
+    };
+    uint8_t device_desc[3][LIBUSB_DT_DEVICE_SIZE];
+    struct usbredirfilter_compiled *compiled;
+    struct usbredirhost_filter_cache *cache;
+    libusb_device_handle *handle;
+    libusb_context *ctx;
+    libusb_device *devs[2];
+    int i, results[2];
+
+    g_assert_cmpint(libusb_init(&ctx), ==, 0);
+    devs[0] = new_filter_device(ctx, 2, device_desc[0], 0x0001);
+    devs[1] = new_filter_device(ctx, 3, device_desc[1], 0x0002);
+    g_assert_cmpint(usbredirfilter_compile(rules, G_N_ELEMENTS(rules),
+                                           &compiled), ==, 0);
+    cache = usbredirhost_filter_cache_new();
+    g_assert_nonnull(cache);
+
+    g_assert_cmpint(usbredirhost_check_device_filter_batch(compiled, cache,
+                        devs, 2, 0, results), ==, 1);
+    g_assert_cmpint(results[0], ==, -EPERM);
+    g_assert_cmpint(results[1], ==, 0);
+    for (i = 0; i < 2; i++) {
+        g_assert_cmpint(results[i], ==, usbredirhost_check_device_filter(
+                            rules, G_N_ELEMENTS(rules), devs[i], 0));
+    }
+
+    /* Without a config there are no interfaces to block, this is only
+       noticed once the cache entry is invalidated */
+    g_assert_cmpint(libusb_open(devs[0], &handle), ==, 0);
+    g_assert_cmpint(libusb_set_configuration(handle, 0), ==, 0);
+    libusb_close(handle);
+    g_assert_cmpint(usbredirhost_check_device_filter_batch(compiled, cache,
+                        devs, 2, 0, results), ==, 1);
+    g_assert_cmpint(results[0], ==, -EPERM);
+    usbredirhost_filter_cache_invalidate(cache, devs[0]);
+    g_assert_cmpint(usbredirhost_check_device_filter_batch(compiled, cache,
+                        devs, 2, 0, results), ==, 2);
+    g_assert_cmpint(results[0], ==, 0);
+
+    /* A different device at a re-used address is noticed without
+       invalidating the cache */
+    fakeusb_device_disconnect(devs[1]);
+    libusb_unref_device(devs[1]);
+    devs[1] = new_filter_device(ctx, 3, device_desc[2], 0x0003);
+    g_assert_cmpint(usbredirhost_check_device_filter_batch(compiled, cache,
+                        devs, 2, 0, results), ==, 1);
+    g_assert_cmpint(results[1], ==, -EPERM);
+
+    /* A disconnected device has no active config to read */
+    usbredirhost_filter_cache_invalidate(cache, NULL);
+    fakeusb_device_disconnect(devs[1]);
+    g_assert_cmpint(usbredirhost_check_device_filter_batch(compiled, cache,
+                        devs, 2, 0, results), ==, 1);
+    g_assert_cmpint(results[1], ==, -EIO);
+
+    g_assert_cmpint(usbredirhost_check_device_filter_batch(NULL, cache,
+                        devs, 2, 0, results), ==, -EINVAL);
+
+    usbredirhost_filter_cache_free(cache);
+    usbredirfilter_free_compiled(compiled);
+    for (i = 0; i < 2; i++) {
+        libusb_unref_device(devs[i]);
+    }
+    libusb_exit(ctx);
+}
+
+int
+main(int argc, char **argv)
+{
+    setlocale(LC_ALL, "");
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add("/host/connect", Fixture, NULL,
+               fixture_setup, test_connect, fixture_teardown);
+    g_test_add("/host/control-get-descriptor", Fixture, NULL,
+               fixture_setup, test_control_get_descriptor, fixture_teardown);
+    g_test_add("/host/descriptor-cache", Fixture, NULL,
+               fixture_setup, test_descriptor_cache, fixture_teardown);
+    g_test_add("/host/descriptor-cache-alt-setting", Fixture, NULL,
+               fixture_setup, test_descriptor_cache_alt_setting,
+               fixture_teardown);
+    g_test_add("/host/bulk-in", Fixture, NULL,
+               fixture_setup, test_bulk_in, fixture_teardown);
+    g_test_add("/host/write-cb-owns-buffer-close", Fixture,
+               GINT_TO_POINTER(usbredirhost_fl_write_cb_owns_buffer),
+               fixture_setup, test_write_cb_owns_buffer_close,
+               fixture_teardown);
+#ifdef HAVE_ZEROCOPY
+    g_test_add("/host/zerocopy-close", Fixture,
+               GINT_TO_POINTER(usbredirhost_fl_write_cb_owns_buffer),
+               fixture_setup, test_zerocopy_close, fixture_teardown);
+#endif
+    g_test_add("/host/latency-write", Fixture, NULL,
+               fixture_setup, test_latency_write, fixture_teardown);
+    g_test_add("/host/bulk-out", Fixture, NULL,
+               fixture_setup, test_bulk_out, fixture_teardown);
+    g_test_add("/host/stall", Fixture, NULL,
+               fixture_setup, test_stall, fixture_teardown);
+    g_test_add("/host/disconnect", Fixture, NULL,
+               fixture_setup, test_disconnect, fixture_teardown);
+    g_test_add("/host/suspend-resume", Fixture, NULL,
+               fixture_setup, test_suspend_resume, fixture_teardown);
+    g_test_add("/host/serialize", Fixture, NULL,
+               fixture_setup, test_serialize, fixture_teardown);
+    g_test_add("/host/serialize-resume", Fixture, NULL,
+               fixture_setup, test_serialize_resume, fixture_teardown);
+    g_test_add("/host/iso-in", Fixture, NULL,
+               fixture_setup, test_iso_in, fixture_teardown);
+    /* The 3 buffers of 8 KiB stay well within the default RLIMIT_MEMLOCK */
+    g_test_add("/host/iso-in-lock-stream-buffers", Fixture,
+               GINT_TO_POINTER(usbredirhost_fl_lock_stream_buffers),
+               fixture_setup, test_iso_in, fixture_teardown);
+    g_test_add("/host/dev-mem", Fixture, NULL,
+               fixture_setup_dev_mem, test_dev_mem, fixture_teardown);
+    g_test_add("/host/dev-mem-exhausted", Fixture, NULL,
+               fixture_setup_dev_mem, test_dev_mem_exhausted,
+               fixture_teardown);
+    g_test_add_func("/host/filter-batch", test_filter_batch);
+
+    return g_test_run();
+}
@@ -25,6 +25,7 @@
 #include <locale.h>
 #include <glib.h>
 #include <stdlib.h>
+#include <string.h>
 
 
 static void
@@ -101,6 +102,73 @@ simple (gconstpointer user_data)
     usbredirparser_destroy(target);
 }
 
+static int
+collect_cb(void *priv, const uint8_t *data, int len)
+{
+    g_byte_array_append(priv, data, len);
+    return 0;
+}
+
+static int
+write_cb(void *priv, uint8_t *data, int count)
+{
+    g_byte_array_append(priv, data, count);
+    return count;
+}
+
+static void
+sink_and_adopt (gconstpointer user_data)
+{
+    struct usb_redir_bulk_packet_header bulk_header = {
+        .endpoint = 0x81,
+        .status = usb_redir_success,
+    };
+    GByteArray *sunk = g_byte_array_new();
+    GByteArray *written = g_byte_array_new();
+    GByteArray *expected = g_byte_array_new();
+    uint8_t data[4096], *state = NULL;
+    int i, ret, len = -1;
+
+    struct usbredirparser *source = get_usbredirparser();
+    source->write_func = write_cb;
+    source->priv = expected;
+    /* Queue small and large write buffers behind the hello */
+    for (i = 0; i < 8; i++) {
+        memset(data, i, sizeof(data));
+        bulk_header.length = (i % 2) ? sizeof(data) : 16;
+        usbredirparser_send_bulk_packet(source, i, &bulk_header,
+                                        data, bulk_header.length);
+    }
+
+    /* Both serialize the same */
+    ret = usbredirparser_serialize(source, &state, &len);
+    g_assert_cmpint(ret, ==, 0);
+    ret = usbredirparser_serialize_to_sink(source, collect_cb, sunk);
+    g_assert_cmpint(ret, ==, 0);
+    g_assert_cmpmem(sunk->data, sunk->len, state, len);
+
+    /* The target writes out the adopted buffers like the source would */
+    struct usbredirparser *target = get_usbredirparser();
+    target->write_func = write_cb;
+    target->priv = written;
+    ret = usbredirparser_unserialize_adopt(target, state, len);
+    g_assert_cmpint(ret, ==, 0);
+    g_assert_cmpint(usbredirparser_has_data_to_write(target), ==,
+                    usbredirparser_has_data_to_write(source));
+
+    g_assert_cmpint(usbredirparser_do_write(source), ==, 0);
+    g_assert_cmpint(usbredirparser_do_write(target), ==, 0);
+    g_assert_cmpint(usbredirparser_has_data_to_write(target), ==, 0);
+    g_assert_cmpmem(written->data, written->len,
+                    expected->data, expected->len);
+
+    usbredirparser_destroy(source);
+    usbredirparser_destroy(target);
+    g_byte_array_unref(sunk);
+    g_byte_array_unref(written);
+    g_byte_array_unref(expected);
+}
+
 int
 main(int argc, char **argv)
 {
@@ -108,6 +176,7 @@ main(int argc, char **argv)
     g_test_init(&argc, &argv, NULL);
 
     g_test_add_data_func("/serializer/serialize-and-unserialize", NULL, simple);
+    g_test_add_data_func("/serializer/sink-and-adopt", NULL, sink_and_adopt);
 
     return g_test_run();
 }
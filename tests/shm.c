@@ -0,0 +1,181 @@
+/*
+ * Copyright 2026 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include "usbredirshm.h"
+
+#include <errno.h>
+#include <locale.h>
+#include <glib.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#define RING_SIZE 4096
+
+/* The indexes at the start of each ring page, see usbredirshm.c */
+#define RING_HEAD 0
+#define RING_TAIL 64
+
+/* A creator and the other side, plus a mapping of their memfd to play a
+   misbehaving peer with */
+typedef struct {
+    struct usbredirshm *creator;
+    struct usbredirshm *peer;
+    uint8_t *map;
+    size_t map_size;
+} Fixture;
+
+/* Receives the fds the way usbredirshm_receive() does, but only keeps the
+   memfd */
+static int receive_memfd(int sock)
+{
+    int fds[3];
+    char control[CMSG_SPACE(sizeof(fds))];
+    uint8_t version;
+    struct iovec iov = { &version, sizeof(version) };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    struct cmsghdr *cmsg;
+
+    g_assert_cmpint(recvmsg(sock, &msg, MSG_CMSG_CLOEXEC), ==, 1);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    g_assert_nonnull(cmsg);
+    g_assert_cmpint(cmsg->cmsg_len, ==, CMSG_LEN(sizeof(fds)));
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    close(fds[1]);
+    close(fds[2]);
+    return fds[0];
+}
+
+static void fixture_setup(Fixture *f, gconstpointer user_data)
+{
+    struct stat st;
+    int sv[2], mem_fd;
+
+    g_assert_cmpint(usbredirshm_create(RING_SIZE, &f->creator), ==, 0);
+    g_assert_cmpint(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), ==, 0);
+    g_assert_cmpint(usbredirshm_send_fds(f->creator, sv[0]), ==, 0);
+    g_assert_cmpint(usbredirshm_receive(sv[1], &f->peer), ==, 0);
+    g_assert_cmpint(usbredirshm_send_fds(f->creator, sv[0]), ==, 0);
+    mem_fd = receive_memfd(sv[1]);
+    close(sv[0]);
+    close(sv[1]);
+
+    g_assert_cmpint(fstat(mem_fd, &st), ==, 0);
+    f->map_size = st.st_size;
+    f->map = mmap(NULL, f->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                  mem_fd, 0);
+    g_assert_true(f->map != MAP_FAILED);
+    close(mem_fd);
+}
+
+static void fixture_teardown(Fixture *f, gconstpointer user_data)
+{
+    usbredirshm_destroy(f->peer);
+    usbredirshm_destroy(f->creator);
+    munmap(f->map, f->map_size);
+}
+
+/* The index of the ring side produces, as seen by a peer */
+static atomic_uint *ring_index(Fixture *f, int side, int index)
+{
+    const struct usbredirshm_header *header =
+        (const struct usbredirshm_header *)f->map;
+
+    return (atomic_uint *)(f->map + header->ring_offset[side] + index);
+}
+
+static void test_transfer(Fixture *f, gconstpointer user_data)
+{
+    static const uint8_t msg[] = "hello";
+    uint8_t buf[RING_SIZE];
+
+    g_assert_cmpint(usbredirshm_write(f->creator, msg, sizeof(msg)), ==,
+                    sizeof(msg));
+    g_assert_cmpint(usbredirshm_read(f->peer, buf, sizeof(buf)), ==,
+                    sizeof(msg));
+    g_assert_cmpmem(buf, sizeof(msg), msg, sizeof(msg));
+    g_assert_cmpint(usbredirshm_read(f->peer, buf, sizeof(buf)), ==, 0);
+}
+
+/* A head more than the ring size ahead of the tail must not make the
+   consumer read outside of the ring */
+static void test_corrupt_head(Fixture *f, gconstpointer user_data)
+{
+    atomic_uint *head = ring_index(f, 0, RING_HEAD);
+    uint8_t buf[2 * RING_SIZE];
+
+    /* A full ring is fine */
+    atomic_store(head, RING_SIZE);
+    g_assert_cmpint(usbredirshm_read(f->peer, buf, sizeof(buf)), ==,
+                    RING_SIZE);
+
+    atomic_store(head, 2 * RING_SIZE + 1);
+    g_assert_cmpint(usbredirshm_read(f->peer, buf, sizeof(buf)), ==,
+                    -EPROTO);
+    atomic_store(head, 0x80000000);
+    g_assert_cmpint(usbredirshm_read(f->peer, buf, sizeof(buf)), ==,
+                    -EPROTO);
+}
+
+/* A tail which is ahead of the head, or far behind it, must not make the
+   producer write outside of the ring, nor the consumer read outside of it */
+static void test_corrupt_tail(Fixture *f, gconstpointer user_data)
+{
+    static const uint8_t msg[] = "hello";
+    atomic_uint *tail = ring_index(f, 0, RING_TAIL);
+    uint8_t buf[RING_SIZE];
+
+    g_assert_cmpint(usbredirshm_write(f->creator, msg, sizeof(msg)), ==,
+                    sizeof(msg));
+
+    atomic_store(tail, sizeof(msg) + 1);
+    g_assert_cmpint(usbredirshm_write(f->creator, msg, sizeof(msg)), ==,
+                    -EPROTO);
+    g_assert_cmpint(usbredirshm_read(f->peer, buf, sizeof(buf)), ==,
+                    -EPROTO);
+
+    atomic_store(tail, (uint32_t)sizeof(msg) - RING_SIZE - 1);
+    g_assert_cmpint(usbredirshm_write(f->creator, msg, sizeof(msg)), ==,
+                    -EPROTO);
+    g_assert_cmpint(usbredirshm_read(f->peer, buf, sizeof(buf)), ==,
+                    -EPROTO);
+}
+
+int
+main(int argc, char **argv)
+{
+    setlocale(LC_ALL, "");
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add("/shm/transfer", Fixture, NULL,
+               fixture_setup, test_transfer, fixture_teardown);
+    g_test_add("/shm/corrupt-head", Fixture, NULL,
+               fixture_setup, test_corrupt_head, fixture_teardown);
+    g_test_add("/shm/corrupt-tail", Fixture, NULL,
+               fixture_setup, test_corrupt_tail, fixture_teardown);
+
+    return g_test_run();
+}
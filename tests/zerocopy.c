@@ -0,0 +1,199 @@
+/*
+ * Copyright 2026 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include "usbredirzerocopy.h"
+
+#include <errno.h>
+#include <locale.h>
+#include <glib.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#define BUFFERS 64
+#define BUFFER_SIZE 65536
+
+/* A sender on one end of a TCP loopback connection, and the buffers it
+   got, each of which it must give back exactly once */
+typedef struct {
+    int sender_fd;
+    int peer_fd;
+    struct usbredirzerocopy *zc;
+    uint8_t *buffers[BUFFERS];
+    gboolean freed[BUFFERS];
+    int count;
+    int freed_count;
+} Fixture;
+
+static void
+tcp_pair(int *sender_fd, int *peer_fd)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    socklen_t addr_len = sizeof(addr);
+    int listen_fd, size = 64 * 1024;
+
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    g_assert_cmpint(listen_fd, >=, 0);
+    g_assert_cmpint(bind(listen_fd, (struct sockaddr *)&addr, addr_len), ==, 0);
+    g_assert_cmpint(getsockname(listen_fd, (struct sockaddr *)&addr,
+                                &addr_len), ==, 0);
+    g_assert_cmpint(listen(listen_fd, 1), ==, 0);
+
+    *sender_fd = socket(AF_INET, SOCK_STREAM, 0);
+    g_assert_cmpint(*sender_fd, >=, 0);
+    /* Small buffers, so that the socket fills up quickly */
+    setsockopt(*sender_fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    g_assert_cmpint(connect(*sender_fd, (struct sockaddr *)&addr, addr_len),
+                    ==, 0);
+    *peer_fd = accept(listen_fd, NULL, NULL);
+    g_assert_cmpint(*peer_fd, >=, 0);
+    setsockopt(*peer_fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    close(listen_fd);
+}
+
+static void
+free_buffer(void *priv, uint8_t *data)
+{
+    Fixture *f = priv;
+    int i;
+
+    for (i = 0; i < f->count; i++) {
+        if (f->buffers[i] == data) {
+            break;
+        }
+    }
+    g_assert_cmpint(i, <, f->count);
+    g_assert_false(f->freed[i]);
+    f->freed[i] = TRUE;
+    f->freed_count++;
+    free(data);
+}
+
+static void
+fixture_setup(Fixture *f, gconstpointer user_data)
+{
+    int r;
+
+    tcp_pair(&f->sender_fd, &f->peer_fd);
+    r = usbredirzerocopy_create(f->sender_fd, 1,
+                                usbredirzerocopy_fl_keep_on_copy,
+                                free_buffer, f, &f->zc);
+    if (r == -ENOPROTOOPT) {
+        /* Sends copies, the buffers still get queued */
+        r = usbredirzerocopy_create(f->sender_fd, 0, 0, free_buffer, f,
+                                    &f->zc);
+    }
+    g_assert_cmpint(r, ==, 0);
+}
+
+static void
+fixture_teardown(Fixture *f, gconstpointer user_data)
+{
+    usbredirzerocopy_destroy(f->zc);
+    g_assert_cmpint(f->freed_count, ==, f->count);
+    close(f->sender_fd);
+    close(f->peer_fd);
+}
+
+static void
+write_buffer(Fixture *f)
+{
+    uint8_t *data = malloc(BUFFER_SIZE);
+
+    g_assert_nonnull(data);
+    g_assert_cmpint(f->count, <, BUFFERS);
+    memset(data, f->count, BUFFER_SIZE);
+    f->buffers[f->count++] = data;
+    g_assert_cmpint(usbredirzerocopy_write(f->zc, data, BUFFER_SIZE), ==,
+                    BUFFER_SIZE);
+}
+
+/* Reads what the sender sent, checking it is every buffer in order */
+static void
+read_all(Fixture *f, size_t *pos)
+{
+    uint8_t buf[BUFFER_SIZE];
+    ssize_t i, r;
+
+    while ((r = recv(f->peer_fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+        for (i = 0; i < r; i++) {
+            g_assert_cmpint(buf[i], ==, (*pos + i) / BUFFER_SIZE);
+        }
+        *pos += r;
+    }
+}
+
+/* Every buffer comes back once it is sent, for MSG_ZEROCOPY once its
+   completion arrived */
+static void
+test_complete(Fixture *f, gconstpointer user_data)
+{
+    gint64 deadline = g_get_monotonic_time() + 5 * G_USEC_PER_SEC;
+    size_t pos = 0;
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        write_buffer(f);
+    }
+    while (f->freed_count < f->count) {
+        struct pollfd pfd = { f->sender_fd, POLLOUT, 0 };
+
+        g_assert_cmpint(g_get_monotonic_time(), <, deadline);
+        read_all(f, &pos);
+        poll(&pfd, 1, 1);
+        if (pfd.revents & POLLERR) {
+            g_assert_cmpint(usbredirzerocopy_complete(f->zc), >=, 0);
+        }
+        g_assert_cmpint(usbredirzerocopy_flush(f->zc), ==, 0);
+    }
+    read_all(f, &pos);
+    g_assert_cmpuint(pos, ==, (size_t)f->count * BUFFER_SIZE);
+    g_assert_cmpuint(usbredirzerocopy_get_buffered_size(f->zc), ==, 0);
+}
+
+/* Destroying the sender gives back the queued buffers and the ones still
+   waiting for their completion */
+static void
+test_destroy_outstanding(Fixture *f, gconstpointer user_data)
+{
+    while (usbredirzerocopy_get_buffered_size(f->zc) == 0) {
+        write_buffer(f);
+    }
+    write_buffer(f);
+    g_assert_cmpint(f->freed_count, <, f->count);
+}
+
+int
+main(int argc, char **argv)
+{
+    setlocale(LC_ALL, "");
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add("/zerocopy/complete", Fixture, NULL,
+               fixture_setup, test_complete, fixture_teardown);
+    g_test_add("/zerocopy/destroy-outstanding", Fixture, NULL,
+               fixture_setup, test_destroy_outstanding, fixture_teardown);
+
+    return g_test_run();
+}
@@ -0,0 +1,812 @@
+/* usbredirect-daemon.c the --daemon mode of usbredirect
+
+   Copyright 2026 Red Hat, Inc.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include "usbredirect.h"
+#include <poll.h>
+#include <glib-unix.h>
+#include <glib/gstdio.h>
+#include "usbredirect-daemon.h"
+#include "usbredirect-transport.h"
+#include "usbredirworker.h"
+
+#ifdef HAVE_SHM_TRANSPORT
+#include "usbredirect-shm.h"
+#include "usbredirshm.h"
+#endif
+
+#ifdef HAVE_SCHED_SETAFFINITY
+#include "usbredirsched.h"
+#endif
+
+/* The --daemon mode: every device listed in the key file gets its own
+ * connection and usbredirhost, and the devices get sharded over --workers
+ * threads, one by default. A worker owns a libusb context and a GLib main
+ * context, which polls the libusb fds as well as the connections of the
+ * worker's devices, so there is no event thread and no locking, and a
+ * device costs a few fds and its buffers instead of a process with 2
+ * threads. Nothing is shared between the workers, with more than one they
+ * get pinned to a CPU each, so that busy devices spread over the CPUs
+ * instead of all waiting for the same thread.
+ *
+ * The first worker runs on the main thread with the default main context,
+ * which also handles the signals.
+ *
+ * The USB device only gets opened while its connection is up. When the
+ * connection goes away the device gets closed again, and a server waits for
+ * the next client while a client connects again after a while. */
+
+#define DAEMON_RETRY_SECONDS 5
+
+struct daemon_loop {
+    GMainContext *context;      /* NULL for the first worker */
+    GMainLoop *main_loop;
+    GThread *thread;
+    int cpu;                    /* -1: not pinned */
+    int verbosity;
+    bool failed;
+    /* The first worker, whose main loop ends the daemon */
+    daemon_loop *main_worker;
+    libusb_context *usb_ctx;
+    /* libusb fd -> GSource id */
+    GHashTable *usb_sources;
+    guint usb_timeout_id;
+    GPtrArray *devices;
+};
+
+/* Attaches source to the worker's main context, the thread default one */
+static guint
+daemon_add_source(GSource *source, GSourceFunc func, gpointer user_data)
+{
+    guint id;
+
+    g_source_set_callback(source, func, user_data, NULL);
+    id = g_source_attach(source, g_main_context_get_thread_default());
+    g_source_unref(source);
+    return id;
+}
+
+static void
+daemon_write_failed(void *priv, int index)
+{
+    daemon_loop *loop = priv;
+    redirect *self = g_ptr_array_index(loop->devices, index);
+
+    g_critical("%s: Failed to write to guest", self->name);
+    daemon_session_end_later(self);
+}
+
+static void
+daemon_handle_usb_events(daemon_loop *loop)
+{
+    struct usbredirhost **hosts = g_newa(struct usbredirhost *,
+                                         loop->devices->len);
+    int res;
+    guint i;
+
+    for (i = 0; i < loop->devices->len; i++) {
+        redirect *self = g_ptr_array_index(loop->devices, i);
+
+        hosts[i] = self->end_id ? NULL : self->usbredirhost;
+    }
+    res = usbredirworker_handle_usb_events(loop->usb_ctx, 0, hosts,
+                                           loop->devices->len,
+                                           daemon_write_failed, loop);
+    if (res) {
+        g_warning("Error handling USB events: %s [%i]",
+                  libusb_strerror(res), res);
+    }
+    for (i = 0; i < loop->devices->len; i++) {
+        redirect *self = g_ptr_array_index(loop->devices, i);
+
+        if (self->usbredirhost && !self->end_id) {
+            update_watch(self);
+        }
+    }
+    daemon_update_usb_timeout(loop);
+}
+
+static gboolean
+daemon_usb_fd_cb(gint fd, GIOCondition condition, gpointer user_data)
+{
+    daemon_handle_usb_events(user_data);
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean
+daemon_usb_timeout_cb(gpointer user_data)
+{
+    daemon_loop *loop = user_data;
+
+    loop->usb_timeout_id = 0;
+    daemon_handle_usb_events(loop);
+    return G_SOURCE_REMOVE;
+}
+
+/* Only needed when libusb can not handle its timeouts through its fds */
+void
+daemon_update_usb_timeout(daemon_loop *loop)
+{
+    struct timeval tv;
+
+    if (libusb_pollfds_handle_timeouts(loop->usb_ctx)) {
+        return;
+    }
+    remove_source(loop->usb_timeout_id);
+    loop->usb_timeout_id = 0;
+    if (libusb_get_next_timeout(loop->usb_ctx, &tv) == 1) {
+        loop->usb_timeout_id = daemon_add_source(
+            g_timeout_source_new(tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000),
+            daemon_usb_timeout_cb, loop);
+    }
+}
+
+static void LIBUSB_CALL
+daemon_pollfd_added_cb(int fd, short events, void *user_data)
+{
+    daemon_loop *loop = user_data;
+    guint id;
+
+    id = daemon_add_source(
+        g_unix_fd_source_new(fd, ((events & POLLIN) ? G_IO_IN : 0) |
+                                 ((events & POLLOUT) ? G_IO_OUT : 0)),
+        (GSourceFunc) daemon_usb_fd_cb, loop);
+    g_hash_table_insert(loop->usb_sources, GINT_TO_POINTER(fd),
+                        GUINT_TO_POINTER(id));
+}
+
+static void LIBUSB_CALL
+daemon_pollfd_removed_cb(int fd, void *user_data)
+{
+    daemon_loop *loop = user_data;
+    gpointer id;
+
+    if (g_hash_table_lookup_extended(loop->usb_sources, GINT_TO_POINTER(fd),
+                                     NULL, &id)) {
+        remove_source(GPOINTER_TO_UINT(id));
+        g_hash_table_remove(loop->usb_sources, GINT_TO_POINTER(fd));
+    }
+}
+
+static bool
+daemon_watch_usb(daemon_loop *loop)
+{
+    const struct libusb_pollfd **pollfds;
+    int i;
+
+    pollfds = libusb_get_pollfds(loop->usb_ctx);
+    if (!pollfds) {
+        return false;
+    }
+    for (i = 0; pollfds[i]; i++) {
+        daemon_pollfd_added_cb(pollfds[i]->fd, pollfds[i]->events, loop);
+    }
+    libusb_free_pollfds(pollfds);
+    libusb_set_pollfd_notifiers(loop->usb_ctx, daemon_pollfd_added_cb,
+                                daemon_pollfd_removed_cb, loop);
+    return true;
+}
+
+static gboolean daemon_connect_cb(gpointer user_data);
+
+static void
+daemon_session_end(redirect *self)
+{
+    remove_source(self->watch_server_id);
+    self->watch_server_id = 0;
+    remove_source(self->watch_out_id);
+    self->watch_out_id = 0;
+    g_clear_pointer(&self->io_channel, g_io_channel_unref);
+    g_clear_pointer(&self->out_channel, g_io_channel_unref);
+
+    if (self->usbredirhost) {
+        if (self->latency_stats) {
+            g_printerr("%s:\n", self->name);
+            print_latency_stats(self);
+        }
+        g_message("%s: connection closed", self->name);
+    }
+    /* This closes the USB device too */
+    g_clear_pointer(&self->usbredirhost, usbredirhost_close);
+#ifdef HAVE_SHM_TRANSPORT
+    g_clear_pointer(&self->shm, usbredirshm_destroy);
+#endif
+    g_clear_object(&self->stream);
+    if (self->connection) {
+        g_io_stream_close(G_IO_STREAM(self->connection), NULL, NULL);
+        g_clear_object(&self->connection);
+    }
+    self->watch_inout = true;
+
+    if (self->is_client && !self->retry_id) {
+        self->retry_id = daemon_add_source(
+            g_timeout_source_new_seconds(DAEMON_RETRY_SECONDS),
+            daemon_connect_cb, self);
+    }
+}
+
+static gboolean
+daemon_session_end_cb(gpointer user_data)
+{
+    redirect *self = user_data;
+
+    self->end_id = 0;
+    daemon_session_end(self);
+    return G_SOURCE_REMOVE;
+}
+
+/* This gets called from within usbredirhost's callbacks, so close it from
+ * the main loop instead */
+void
+daemon_session_end_later(redirect *self)
+{
+    if (!self->end_id) {
+        self->end_id = daemon_add_source(g_idle_source_new(),
+                                         daemon_session_end_cb, self);
+    }
+}
+
+static bool
+daemon_session_start(redirect *self, GError **err)
+{
+    libusb_device_handle *handle = NULL;
+
+    if (self->usb_fd >= 0) {
+        int ret = libusb_wrap_sys_device(self->loop->usb_ctx,
+                                         (intptr_t)self->usb_fd, &handle);
+        if (ret != 0) {
+            handle = NULL;
+        }
+    } else {
+        handle = open_usb_device(self, self->loop->usb_ctx);
+    }
+    if (!handle) {
+        g_set_error(err, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                    "Failed to open the USB device");
+        return false;
+    }
+
+    /* The device only gets used from its worker's thread, so no locking is
+     * needed, and the data gets written after handling the USB events */
+    self->usbredirhost = usbredirhost_open_full(self->loop->usb_ctx,
+            handle,
+            usbredir_log_cb,
+            usbredir_read_cb,
+            usbredir_write_cb,
+            NULL, NULL, NULL, NULL, NULL,
+            self,
+            PACKAGE_STRING,
+            self->verbosity,
+            self->mlock ? usbredirhost_fl_lock_stream_buffers : 0);
+    if (!self->usbredirhost) {
+        g_set_error(err, G_IO_ERROR, G_IO_ERROR_FAILED,
+                    "Error starting usbredirhost");
+        return false;
+    }
+    if (self->latency_stats &&
+        usbredirhost_enable_latency_stats(self->usbredirhost) != 0) {
+        g_set_error(err, G_IO_ERROR, G_IO_ERROR_FAILED,
+                    "Error enabling latency stats");
+        return false;
+    }
+#ifdef HAVE_SHM_TRANSPORT
+    if (self->transport == TRANSPORT_SHM && !shm_setup(self, err)) {
+        return false;
+    }
+#endif
+
+    g_message("%s: connected", self->name);
+    create_watch(self);
+    return true;
+}
+
+static gboolean
+daemon_connect_cb(gpointer user_data)
+{
+    redirect *self = user_data;
+    GError *err = NULL;
+
+    self->retry_id = 0;
+    if (!connect_transport(self, &err) || !daemon_session_start(self, &err)) {
+        g_warning("%s: %s, retrying in %d seconds", self->name, err->message,
+                  DAEMON_RETRY_SECONDS);
+        g_error_free(err);
+        daemon_session_end(self);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean
+daemon_incoming_cb(GSocketService    *service,
+                   GSocketConnection *client_connection,
+                   GObject           *source_object,
+                   gpointer           user_data)
+{
+    redirect *self = (redirect *) user_data;
+    GError *err = NULL;
+
+    /* Returning TRUE without taking a reference closes the connection */
+    if (self->connection || self->end_id) {
+        g_warning("%s: already connected, rejecting another client",
+                  self->name);
+        return TRUE;
+    }
+
+    set_connection(self, g_object_ref(client_connection));
+    if (!daemon_session_start(self, &err)) {
+        g_warning("%s: %s", self->name, err->message);
+        g_error_free(err);
+        daemon_session_end(self);
+    }
+    return TRUE;
+}
+
+static void
+daemon_device_free(redirect *self)
+{
+    g_clear_pointer(&self->usbredirhost, usbredirhost_close);
+    if (self->socket_service) {
+        g_socket_service_stop(self->socket_service);
+        g_socket_listener_close(G_SOCKET_LISTENER(self->socket_service));
+        g_clear_object(&self->socket_service);
+    }
+    if (self->unlink_path) {
+        g_unlink(self->addr);
+    }
+    g_mutex_clear(&self->record_lock);
+    g_free(self->addr);
+    g_free(self->name);
+    g_free(self);
+}
+
+/* Each group of the key file is a device:
+ *
+ *   [name]
+ *   device=vendor:product or bus-device
+ *   usbfd=N         instead of device, an fd as passed by termux-usb
+ *   to=URI or as=URI
+ *   keepalive=true  optional, defaults to --keepalive
+ */
+static redirect *
+daemon_device_new(redirect *options, GKeyFile *keyfile, const char *group,
+                  GError **err)
+{
+    redirect *self = g_new0(redirect, 1);
+    char *device = g_key_file_get_string(keyfile, group, "device", NULL);
+    char *to = g_key_file_get_string(keyfile, group, "to", NULL);
+    char *as = g_key_file_get_string(keyfile, group, "as", NULL);
+    GError *local_err = NULL;
+    bool ok = false;
+
+    g_mutex_init(&self->record_lock);
+    self->name = g_strdup(group);
+    self->watch_inout = true;
+    self->verbosity = options->verbosity;
+    self->latency_stats = options->latency_stats;
+    self->mlock = options->mlock;
+    self->keepalive = g_key_file_get_boolean(keyfile, group, "keepalive",
+                                             &local_err);
+    if (local_err) {
+        self->keepalive = options->keepalive;
+        g_clear_error(&local_err);
+    }
+    self->usb_fd = -1;
+    if (g_key_file_has_key(keyfile, group, "usbfd", NULL)) {
+        self->usb_fd = g_key_file_get_integer(keyfile, group, "usbfd", err);
+        if (self->usb_fd < 0) {
+            goto end;
+        }
+    } else if (!device || !parse_opt_device(self, device)) {
+        g_set_error(err, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_INVALID_VALUE,
+                    "%s: expected device=vendor:product or busnum-devnum, or usbfd=N",
+                    group);
+        goto end;
+    }
+
+    if (!to == !as) {
+        g_set_error(err, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_INVALID_VALUE,
+                    "%s: expected either to=URI or as=URI", group);
+        goto end;
+    }
+    self->is_client = to != NULL;
+    if (!parse_opt_transport(self, to ? to : as)) {
+        g_set_error(err, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_INVALID_VALUE,
+                    "%s: failed to parse uri '%s'", group, to ? to : as);
+        goto end;
+    }
+    if (self->transport == TRANSPORT_FD || self->transport == TRANSPORT_STDIO ||
+        self->transport == TRANSPORT_SOCKET_ACTIVATION) {
+        g_set_error(err, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_INVALID_VALUE,
+                    "%s: fd:N, stdio and socket-activation can not be used with --daemon",
+                    group);
+        goto end;
+    }
+    ok = true;
+
+end:
+    g_free(device);
+    g_free(to);
+    g_free(as);
+    if (!ok) {
+        g_clear_pointer(&self, daemon_device_free);
+    }
+    return self;
+}
+
+/* Devices go to the worker given with worker=N, or round robin */
+static bool
+daemon_load(daemon_loop **workers, guint n_workers, redirect *options,
+            GError **err)
+{
+    GKeyFile *keyfile = g_key_file_new();
+    char **groups = NULL;
+    bool ok = false;
+    gsize i;
+
+    if (!g_key_file_load_from_file(keyfile, options->daemon_path,
+                                   G_KEY_FILE_NONE, err)) {
+        goto end;
+    }
+    groups = g_key_file_get_groups(keyfile, NULL);
+    if (!groups[0]) {
+        g_set_error(err, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_NOT_FOUND,
+                    "No devices in %s", options->daemon_path);
+        goto end;
+    }
+    for (i = 0; groups[i]; i++) {
+        gint worker = i % n_workers;
+        redirect *self;
+
+        if (g_key_file_has_key(keyfile, groups[i], "worker", NULL)) {
+            worker = g_key_file_get_integer(keyfile, groups[i], "worker", NULL);
+            if (worker < 0 || worker >= n_workers) {
+                g_set_error(err, G_KEY_FILE_ERROR,
+                            G_KEY_FILE_ERROR_INVALID_VALUE,
+                            "%s: worker must be between 0 and %u", groups[i],
+                            n_workers - 1);
+                goto end;
+            }
+        }
+        self = daemon_device_new(options, keyfile, groups[i], err);
+        if (!self) {
+            goto end;
+        }
+        self->loop = workers[worker];
+        g_ptr_array_add(workers[worker]->devices, self);
+    }
+    ok = true;
+
+end:
+    g_strfreev(groups);
+    g_key_file_free(keyfile);
+    return ok;
+}
+
+static daemon_loop *
+daemon_loop_new(int verbosity)
+{
+    daemon_loop *loop = g_new0(daemon_loop, 1);
+
+    loop->cpu = -1;
+    loop->verbosity = verbosity;
+    loop->devices = g_ptr_array_new_with_free_func((GDestroyNotify) daemon_device_free);
+    loop->usb_sources = g_hash_table_new(NULL, NULL);
+    return loop;
+}
+
+static void
+daemon_loop_free(daemon_loop *loop)
+{
+    g_ptr_array_free(loop->devices, TRUE);
+    g_hash_table_destroy(loop->usb_sources);
+    g_clear_pointer(&loop->main_loop, g_main_loop_unref);
+    g_clear_pointer(&loop->context, g_main_context_unref);
+    g_free(loop);
+}
+
+/* Unlike g_main_context_invoke() this never calls func right away, so a
+ * worker which did not get to its main loop yet calls it once it gets there */
+static void
+daemon_invoke(GMainContext *context, GSourceFunc func, gpointer user_data)
+{
+    GSource *source = g_idle_source_new();
+
+    g_source_set_callback(source, func, user_data, NULL);
+    g_source_attach(source, context);
+    g_source_unref(source);
+}
+
+static gboolean
+daemon_quit_cb(gpointer user_data)
+{
+    daemon_loop *loop = user_data;
+
+    g_main_loop_quit(loop->main_loop);
+    return G_SOURCE_REMOVE;
+}
+
+/* This must be called from the main thread, which runs the first worker */
+static void
+daemon_quit_workers(GPtrArray *workers)
+{
+    guint i;
+
+    for (i = 0; i < workers->len; i++) {
+        daemon_loop *loop = g_ptr_array_index(workers, i);
+
+        if (loop == loop->main_worker) {
+            g_main_loop_quit(loop->main_loop);
+        } else {
+            daemon_invoke(loop->context, daemon_quit_cb, loop);
+        }
+    }
+}
+
+static gboolean
+daemon_signal_cb(gpointer user_data)
+{
+    daemon_quit_workers(user_data);
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean
+daemon_print_latency_stats_cb(gpointer user_data)
+{
+    daemon_loop *loop = user_data;
+    guint i;
+
+    for (i = 0; i < loop->devices->len; i++) {
+        redirect *self = g_ptr_array_index(loop->devices, i);
+
+        if (self->latency_stats && self->usbredirhost) {
+            g_printerr("%s:\n", self->name);
+            print_latency_stats(self);
+        }
+    }
+    return G_SOURCE_REMOVE;
+}
+
+/* The stats get printed by the workers, which own them */
+static gboolean
+daemon_latency_stats_cb(gpointer user_data)
+{
+    GPtrArray *workers = user_data;
+    guint i;
+
+    for (i = 0; i < workers->len; i++) {
+        daemon_loop *loop = g_ptr_array_index(workers, i);
+
+        daemon_invoke(loop->context, daemon_print_latency_stats_cb, loop);
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+static bool
+daemon_worker_start(daemon_loop *loop)
+{
+    GError *err = NULL;
+    guint i;
+
+#ifdef HAVE_SCHED_SETAFFINITY
+    if (loop->cpu >= 0) {
+        int r = usbredirsched_pin(loop->cpu);
+
+        if (r < 0) {
+            g_warning("Failed to pin a worker to CPU %d: %s", loop->cpu,
+                      g_strerror(-r));
+        }
+    }
+#endif
+
+    if (libusb_init(&loop->usb_ctx) != 0) {
+        g_warning("Could not init libusb");
+        loop->usb_ctx = NULL;
+        return false;
+    }
+    if (loop->verbosity < usbredirparser_debug_data) {
+        libusb_set_option(loop->usb_ctx, LIBUSB_OPTION_LOG_LEVEL,
+                          LIBUSB_LOG_LEVEL_NONE);
+    }
+    if (!daemon_watch_usb(loop)) {
+        g_warning("Failed to get the libusb fds");
+        return false;
+    }
+
+    for (i = 0; i < loop->devices->len; i++) {
+        redirect *self = g_ptr_array_index(loop->devices, i);
+
+        if (self->is_client) {
+            daemon_connect_cb(self);
+            continue;
+        }
+        /* The service accepts from the thread default main context */
+        self->socket_service = g_socket_service_new();
+        if (!listen_transport(self, G_SOCKET_LISTENER(self->socket_service),
+                              &err)) {
+            g_warning("%s: Failed to run as server: %s", self->name,
+                      err->message);
+            g_clear_error(&err);
+            return false;
+        }
+        g_signal_connect(self->socket_service, "incoming",
+                         G_CALLBACK(daemon_incoming_cb), self);
+    }
+    return true;
+}
+
+static void
+daemon_worker_stop(daemon_loop *loop)
+{
+    guint i;
+
+    for (i = 0; i < loop->devices->len; i++) {
+        redirect *self = g_ptr_array_index(loop->devices, i);
+
+        remove_source(self->end_id);
+        self->end_id = 0;
+        remove_source(self->retry_id);
+        self->retry_id = 0;
+        self->is_client = false; /* no retry */
+        daemon_session_end(self);
+    }
+    /* Stop the services from the thread they accept in */
+    g_ptr_array_set_size(loop->devices, 0);
+    if (loop->usb_ctx) {
+        libusb_set_pollfd_notifiers(loop->usb_ctx, NULL, NULL, NULL);
+        g_hash_table_remove_all(loop->usb_sources);
+        remove_source(loop->usb_timeout_id);
+        loop->usb_timeout_id = 0;
+        libusb_exit(loop->usb_ctx);
+        loop->usb_ctx = NULL;
+    }
+}
+
+static void
+daemon_worker_run(daemon_loop *loop)
+{
+    if (daemon_worker_start(loop)) {
+        g_main_loop_run(loop->main_loop);
+    } else {
+        loop->failed = true;
+        if (loop != loop->main_worker) {
+            daemon_invoke(NULL, daemon_quit_cb, loop->main_worker);
+        }
+    }
+    daemon_worker_stop(loop);
+}
+
+static gpointer
+daemon_worker_thread(gpointer user_data)
+{
+    daemon_loop *loop = user_data;
+
+    g_main_context_push_thread_default(loop->context);
+    daemon_worker_run(loop);
+    g_main_context_pop_thread_default(loop->context);
+    return NULL;
+}
+
+#ifdef HAVE_SCHED_SETAFFINITY
+static void
+daemon_assign_cpus(GPtrArray *workers)
+{
+    int *cpus = g_new(int, workers->len);
+    int r;
+    guint i;
+
+    r = usbredirsched_assign_cpus(cpus, workers->len);
+    if (r < 0) {
+        g_warning("Failed to get the CPU affinity: %s", g_strerror(-r));
+    } else {
+        for (i = 0; i < workers->len; i++) {
+            daemon_loop *loop = g_ptr_array_index(workers, i);
+            loop->cpu = cpus[i];
+        }
+    }
+    g_free(cpus);
+}
+#endif
+
+int
+run_daemon(redirect *options)
+{
+    guint n_workers = options->workers > 0 ? options->workers : 1;
+    GPtrArray *workers = g_ptr_array_new_with_free_func((GDestroyNotify) daemon_loop_free);
+    GError *err = NULL;
+    bool use_usb_fd = false;
+    guint i, j, n_devices = 0;
+    int ret = 0;
+
+    for (i = 0; i < n_workers; i++) {
+        daemon_loop *loop = daemon_loop_new(options->verbosity);
+
+        if (i > 0) {
+            loop->context = g_main_context_new();
+        }
+        loop->main_loop = g_main_loop_new(loop->context, FALSE);
+        g_ptr_array_add(workers, loop);
+    }
+    for (i = 0; i < n_workers; i++) {
+        daemon_loop *loop = g_ptr_array_index(workers, i);
+        loop->main_worker = g_ptr_array_index(workers, 0);
+    }
+    if (!daemon_load((daemon_loop **) workers->pdata, n_workers, options,
+                     &err)) {
+        g_warning("%s", err->message);
+        g_error_free(err);
+        g_ptr_array_free(workers, TRUE);
+        return 1;
+    }
+
+    for (i = 0; i < n_workers; i++) {
+        daemon_loop *loop = g_ptr_array_index(workers, i);
+
+        for (j = 0; j < loop->devices->len; j++) {
+            redirect *self = g_ptr_array_index(loop->devices, j);
+            use_usb_fd |= self->usb_fd >= 0;
+        }
+        n_devices += loop->devices->len;
+    }
+    /* On Android the devices can only be used through the fds termux-usb
+     * passes, and libusb must not look for devices itself */
+    if (use_usb_fd) {
+        libusb_set_option(NULL, LIBUSB_OPTION_WEAK_AUTHORITY);
+    }
+#ifdef HAVE_SCHED_SETAFFINITY
+    if (n_workers > 1) {
+        daemon_assign_cpus(workers);
+    }
+#endif
+
+    g_unix_signal_add(SIGINT, daemon_signal_cb, workers);
+    g_unix_signal_add(SIGHUP, daemon_signal_cb, workers);
+    g_unix_signal_add(SIGTERM, daemon_signal_cb, workers);
+    g_unix_signal_add(SIGUSR1, daemon_latency_stats_cb, workers);
+
+    for (i = 1; i < n_workers; i++) {
+        daemon_loop *loop = g_ptr_array_index(workers, i);
+
+        loop->thread = g_thread_try_new("usbredirect-worker",
+                                        daemon_worker_thread, loop, &err);
+        if (!loop->thread) {
+            g_warning("Error starting worker thread: %s", err->message);
+            g_clear_error(&err);
+            ret = 1;
+            break;
+        }
+    }
+    if (ret == 0) {
+        g_message("Redirecting %u devices with %u workers", n_devices,
+                  n_workers);
+        daemon_worker_run(g_ptr_array_index(workers, 0));
+    }
+
+    daemon_quit_workers(workers);
+    for (i = 0; i < n_workers; i++) {
+        daemon_loop *loop = g_ptr_array_index(workers, i);
+
+        if (loop->thread) {
+            g_thread_join(loop->thread);
+        }
+        if (loop->failed) {
+            ret = 1;
+        }
+    }
+    g_ptr_array_free(workers, TRUE);
+    return ret;
+}
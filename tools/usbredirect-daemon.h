@@ -0,0 +1,32 @@
+/* usbredirect-daemon.h the --daemon mode of usbredirect
+
+   Copyright 2026 Red Hat, Inc.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include "usbredirect.h"
+
+/* Runs every device of options->daemon_path until a signal ends it, returns
+ * the exit status */
+int run_daemon(redirect *options);
+
+/* Ends the session of a device of the daemon from its worker's main loop,
+ * for when usbredirhost's callbacks find it broken */
+void daemon_session_end_later(redirect *self);
+
+/* Re-arms the timeout of the worker's libusb context, after submitting
+ * transfers */
+void daemon_update_usb_timeout(daemon_loop *loop);
@@ -0,0 +1,202 @@
+/* usbredirect-epoll.c the --epoll mode of usbredirect
+
+   Copyright 2026 Red Hat, Inc.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+
+#include "usbredirect.h"
+#include "usbredirect-epoll.h"
+#include "usbredirepoll.h"
+#ifdef HAVE_SHM_TRANSPORT
+#include "usbredirshm.h"
+#endif
+
+/* The --epoll mode: the connection's socket, libusb's fds and a signalfd all
+ * go into one epoll set, and reading, writing and handling USB events are all
+ * done from the main thread, see usbredirepoll.h. */
+
+static const int epoll_signals[] = { SIGINT, SIGHUP, SIGTERM, SIGUSR1, SIGUSR2 };
+
+/* Must be called before libusb_init() and before any threads get started:
+ * libusb on Linux starts a hotplug monitor thread from libusb_init(), and
+ * only threads created after the signals got blocked inherit the mask, which
+ * makes sure that the signals can only be read from the signalfd */
+bool
+epoll_setup(redirect *self, GError **err)
+{
+    sigset_t mask;
+    int i;
+
+    sigemptyset(&mask);
+    for (i = 0; i < G_N_ELEMENTS(epoll_signals); i++) {
+        sigaddset(&mask, epoll_signals[i]);
+    }
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) != 0) {
+        goto error;
+    }
+
+    self->signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (self->signal_fd < 0) {
+        goto error;
+    }
+    return true;
+
+error:
+    {
+        int errsv = errno;
+        g_set_error(err, G_FILE_ERROR, g_file_error_from_errno(errsv),
+                    "Failed to set up the epoll loop: %s", g_strerror(errsv));
+    }
+    return false;
+}
+
+void
+epoll_cleanup(redirect *self)
+{
+    if (self->signal_fd >= 0) {
+        close(self->signal_fd);
+    }
+}
+
+void
+epoll_handle_signals(redirect *self)
+{
+    struct signalfd_siginfo info;
+
+    while (read(self->signal_fd, &info, sizeof(info)) == sizeof(info)) {
+        switch (info.ssi_signo) {
+        case SIGUSR1:
+            print_latency_stats(self);
+            break;
+        case SIGUSR2:
+            capture_signal_handler(self);
+            break;
+        default:
+            redirect_quit(self);
+            break;
+        }
+    }
+}
+
+/* While waiting for the incoming connection the GLib main loop runs */
+gboolean
+epoll_signal_fd_cb(gint fd, GIOCondition condition, gpointer user_data)
+{
+    epoll_handle_signals(user_data);
+    return G_SOURCE_CONTINUE;
+}
+
+static int
+epoll_signal_cb(void *priv, int fd, uint32_t events)
+{
+    redirect *self = (redirect *) priv;
+
+    epoll_handle_signals(self);
+    return self->quit;
+}
+
+#ifdef HAVE_SHM_TRANSPORT
+/* The doorbell of the rings, it gets acked before reading from them */
+static int
+epoll_shm_doorbell_cb(void *priv, int fd, uint32_t events)
+{
+    redirect *self = (redirect *) priv;
+
+    usbredirshm_ack(self->shm);
+    if (usbredirhost_read_guest_data(self->usbredirhost) < 0) {
+        return -EPROTO;
+    }
+    return self->quit;
+}
+
+/* Nothing gets sent over the socket after the fds, it only tells us when
+ * the other side goes away */
+static int
+epoll_shm_socket_cb(void *priv, int fd, uint32_t events)
+{
+    return -ECONNRESET;
+}
+#endif
+
+/* For what the epoll and io_uring loops return, 1 from the callbacks
+ * above means that the main loop got asked to quit */
+void
+report_loop_error(const char *name, int r)
+{
+    switch (r) {
+    case 0:
+    case 1:
+        break;
+    case -ECONNRESET:
+        g_warning("Connection closed - exiting");
+        break;
+    case -EPROTO:
+        g_critical("Failed to read from or write to guest");
+        break;
+    case -EIO:
+        g_warning("Error handling USB events");
+        break;
+    default:
+        g_warning("%s loop failed: %s", name, g_strerror(-r));
+        break;
+    }
+}
+
+void
+run_epoll_loop(redirect *self)
+{
+    struct usbredirepoll *loop = NULL;
+    int in_fd = self->in_fd, out_fd = self->out_fd;
+    int r;
+
+#ifdef HAVE_SHM_TRANSPORT
+    /* The doorbell also rings when a full ring has space again */
+    if (self->shm) {
+        in_fd = out_fd = -1;
+    }
+#endif
+    r = usbredirepoll_create(NULL, self->usbredirhost, in_fd, out_fd, &loop);
+    if (r == 0) {
+        r = usbredirepoll_add_fd(loop, self->signal_fd, EPOLLIN,
+                                 epoll_signal_cb, self);
+    }
+#ifdef HAVE_SHM_TRANSPORT
+    if (r == 0 && self->shm) {
+        r = usbredirepoll_add_fd(loop, self->in_fd, EPOLLIN,
+                                 epoll_shm_doorbell_cb, self);
+        if (r == 0) {
+            r = usbredirepoll_add_fd(loop, self->shm_socket_fd, EPOLLIN,
+                                     epoll_shm_socket_cb, self);
+        }
+    }
+#endif
+    if (r < 0) {
+        g_warning("Failed to set up the epoll loop: %s", g_strerror(-r));
+        usbredirepoll_destroy(loop);
+        return;
+    }
+
+    while (!self->quit && (r = usbredirepoll_iterate(loop, -1)) == 0) {
+    }
+    report_loop_error("epoll", r);
+    usbredirepoll_destroy(loop);
+}
@@ -0,0 +1,39 @@
+/* usbredirect-epoll.h the --epoll mode of usbredirect
+
+   Copyright 2026 Red Hat, Inc.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include "usbredirect.h"
+
+/* Blocks the signals and reads them from self->signal_fd instead, must be
+ * called before libusb_init() and before any threads get started */
+bool epoll_setup(redirect *self, GError **err);
+void epoll_cleanup(redirect *self);
+
+/* Handles what arrived on self->signal_fd, the io_uring loop reads the
+ * signals the same way */
+void epoll_handle_signals(redirect *self);
+
+/* Reads the signalfd while the GLib main loop waits for the connection */
+gboolean epoll_signal_fd_cb(gint fd, GIOCondition condition,
+                            gpointer user_data);
+
+/* Runs the session until it ends */
+void run_epoll_loop(redirect *self);
+
+/* Logs why the epoll or io_uring loop ended, named name */
+void report_loop_error(const char *name, int r);
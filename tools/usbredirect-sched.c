@@ -0,0 +1,137 @@
+/* usbredirect-sched.c the --pin and --rt-priority options of usbredirect
+
+   Copyright 2026 Red Hat, Inc.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/* For CPU_SETSIZE */
+#define _GNU_SOURCE
+
+#include "config.h"
+
+#include "usbredirect.h"
+#include <sched.h>
+#include <string.h>
+#include "usbredirect-sched.h"
+#include "usbredirsched.h"
+
+static const char *thread_names[THREAD_COUNT] = {
+    "event", "reader", "writer",
+};
+
+/* Parses THREAD=N[,THREAD=N...] into values, indexed by THREAD_* */
+static bool
+parse_opt_thread_values(const char *option, const char *str, int min, int max,
+                        int *values)
+{
+    char **items = g_strsplit(str, ",", -1);
+    bool ok = items[0] != NULL;
+    int i, t;
+
+    for (i = 0; ok && items[i]; i++) {
+        char *value = strchr(items[i], '=');
+        char *end;
+        gint64 n;
+
+        ok = false;
+        if (!value) {
+            break;
+        }
+        *value++ = '\0';
+        for (t = 0; t < THREAD_COUNT; t++) {
+            if (g_str_equal(items[i], thread_names[t])) {
+                break;
+            }
+        }
+        n = g_ascii_strtoll(value, &end, 10);
+        if (t == THREAD_COUNT || end == value || *end != '\0' ||
+            n < min || n > max) {
+            break;
+        }
+        values[t] = n;
+        ok = true;
+    }
+    if (!ok) {
+        g_printerr("Failed to parse %s '%s' - expected THREAD=N,... with THREAD one of event, reader or writer and N between %d and %d\n",
+                   option, str, min, max);
+    }
+    g_strfreev(items);
+    return ok;
+}
+
+bool
+parse_opt_sched(redirect *self, const char *pin, const char *rt_priority,
+                const char *rt_policy)
+{
+    if (pin && !parse_opt_thread_values("--pin", pin, 0, CPU_SETSIZE - 1,
+                                        self->thread_cpu)) {
+        return false;
+    }
+    if (rt_priority &&
+        !parse_opt_thread_values("--rt-priority", rt_priority,
+                                 sched_get_priority_min(SCHED_FIFO),
+                                 sched_get_priority_max(SCHED_FIFO),
+                                 self->thread_priority)) {
+        return false;
+    }
+    if (!rt_policy || g_str_equal(rt_policy, "fifo")) {
+        self->rt_policy = SCHED_FIFO;
+    } else if (g_str_equal(rt_policy, "rr")) {
+        self->rt_policy = SCHED_RR;
+    } else {
+        g_printerr("Unknown --rt-policy '%s' - expected fifo or rr\n", rt_policy);
+        return false;
+    }
+
+    /* --epoll and --io-uring do everything in the main thread */
+    if (self->use_epoll &&
+        (self->thread_cpu[THREAD_EVENT] >= 0 ||
+         self->thread_cpu[THREAD_WRITER] >= 0 ||
+         self->thread_priority[THREAD_EVENT] ||
+         self->thread_priority[THREAD_WRITER])) {
+        g_printerr("With --epoll and --io-uring there only is the reader thread\n");
+        return false;
+    }
+    if (!self->use_writer_thread &&
+        (self->thread_cpu[THREAD_WRITER] >= 0 ||
+         self->thread_priority[THREAD_WRITER])) {
+        g_printerr("There only is a writer thread with --writer-thread\n");
+        return false;
+    }
+    return true;
+}
+/* Applies the --pin and --rt-priority settings of thread to the calling
+ * thread, on Linux both only affect the calling thread */
+void
+apply_thread_sched(redirect *self, int thread)
+{
+    int r;
+
+    if (self->thread_cpu[thread] >= 0) {
+        r = usbredirsched_pin(self->thread_cpu[thread]);
+        if (r < 0) {
+            g_warning("Failed to pin the %s thread to CPU %d: %s",
+                      thread_names[thread], self->thread_cpu[thread],
+                      g_strerror(-r));
+        }
+    }
+    if (self->thread_priority[thread]) {
+        r = usbredirsched_set_rt(self->rt_policy,
+                                 self->thread_priority[thread]);
+        if (r < 0) {
+            g_warning("Failed to set the real-time priority of the %s thread: %s",
+                      thread_names[thread], g_strerror(-r));
+        }
+    }
+}
@@ -0,0 +1,35 @@
+/* usbredirect-sched.h the --pin and --rt-priority options of usbredirect
+
+   Copyright 2026 Red Hat, Inc.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include "usbredirect.h"
+
+#ifdef HAVE_SCHED_SETAFFINITY
+/* Parses --pin, --rt-priority and --rt-policy into self, any of them can be
+ * NULL */
+bool parse_opt_sched(redirect *self, const char *pin, const char *rt_priority,
+                     const char *rt_policy);
+
+/* Applies the settings of thread, one of THREAD_*, to the calling thread */
+void apply_thread_sched(redirect *self, int thread);
+#else
+static inline void
+apply_thread_sched(redirect *self, int thread)
+{
+}
+#endif
@@ -0,0 +1,101 @@
+/* usbredirect-shm.c the shm: transport of usbredirect
+
+   Copyright 2026 Red Hat, Inc.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include "usbredirect.h"
+#include <errno.h>
+#include "usbredirect-shm.h"
+#include "usbredirshm.h"
+
+/* With shm the server creates the rings and passes them to the client over
+ * the Unix socket, from then on only the rings get used */
+bool
+shm_setup(redirect *self, GError **err)
+{
+    int fd = self->in_fd;
+    int ret;
+
+    if (self->is_client) {
+        ret = usbredirshm_receive(fd, &self->shm);
+    } else {
+        ret = usbredirshm_create(USBREDIRSHM_DEFAULT_RING_SIZE, &self->shm);
+        if (ret == 0) {
+            ret = usbredirshm_send_fds(self->shm, fd);
+            if (ret != 0) {
+                g_clear_pointer(&self->shm, usbredirshm_destroy);
+            }
+        }
+    }
+    if (ret != 0) {
+        g_set_error(err, G_IO_ERROR, g_io_error_from_errno(-ret),
+                    "Failed to set up the shared memory: %s",
+                    g_strerror(-ret));
+        return false;
+    }
+
+    self->shm_socket_fd = fd;
+    self->in_fd = self->out_fd = usbredirshm_get_fd(self->shm);
+    /* The doorbell is always writable, never watch it for output */
+    self->watch_inout = false;
+    return true;
+}
+
+int
+shm_read(redirect *self, uint8_t *data, int count)
+{
+    int r = usbredirshm_read(self->shm, data, count);
+
+    if (r < 0) {
+        /* The other side is gone, or broke the ring */
+        if (r == -EPROTO) {
+            g_warning("Shared memory ring corrupted - exiting");
+        }
+        redirect_quit(self);
+        return 0;
+    }
+    if (r > 0 && self->record_path) {
+        record_data(self, usbredirrecord_from_guest, data, r);
+    }
+    return r;
+}
+
+int
+shm_write(redirect *self, uint8_t *data, int count)
+{
+    int r = usbredirshm_write(self->shm, data, count);
+
+    if (r < 0) {
+        if (r == -EPROTO) {
+            g_warning("Shared memory ring corrupted - exiting");
+        }
+        redirect_quit(self);
+        return -1;
+    }
+    if (r > 0 && self->record_path) {
+        record_data(self, usbredirrecord_to_guest, data, r);
+    }
+    return r;
+}
+
+gboolean
+shm_socket_cb(GIOChannel *source, GIOCondition condition, gpointer user_data)
+{
+    g_warning("Connection closed - exiting");
+    redirect_quit(user_data);
+    return G_SOURCE_REMOVE;
+}
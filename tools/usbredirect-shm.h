@@ -0,0 +1,32 @@
+/* usbredirect-shm.h the shm: transport of usbredirect
+
+   Copyright 2026 Red Hat, Inc.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include "usbredirect.h"
+
+/* Sets up the rings over the Unix socket once it is connected, from then on
+ * in_fd and out_fd are the doorbell */
+bool shm_setup(redirect *self, GError **err);
+
+/* The usbredirhost read and write callbacks with shm */
+int shm_read(redirect *self, uint8_t *data, int count);
+int shm_write(redirect *self, uint8_t *data, int count);
+
+/* Watches the Unix socket, which only tells when the other side is gone */
+gboolean shm_socket_cb(GIOChannel *source, GIOCondition condition,
+                       gpointer user_data);
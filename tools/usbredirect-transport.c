@@ -0,0 +1,416 @@
+/* usbredirect-transport.c the transports of usbredirect
+
+   Copyright 2026 Red Hat, Inc.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include "usbredirect.h"
+#include <errno.h>
+#include <string.h>
+#include "usbredirect-transport.h"
+
+#ifdef HAVE_ZEROCOPY
+#include "usbredirect-zerocopy.h"
+#endif
+
+#ifdef G_OS_UNIX
+#include <gio/gunixinputstream.h>
+#include <gio/gunixoutputstream.h>
+#include <gio/gunixsocketaddress.h>
+#include <glib-unix.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_VSOCK
+#include <sys/socket.h>
+#include <linux/vm_sockets.h>
+#endif
+
+static bool
+parse_opt_uri(const char *uri, char **adr, int *port)
+{
+    if (uri == NULL) {
+        return false;
+    }
+
+    char **parts = g_strsplit(uri, ":", 2);
+    if (parts == NULL || parts[0] == NULL || parts[1] == NULL || parts[2] != NULL) {
+        g_printerr("Failed to parse '%s' - expected simplified uri scheme: host:port", uri);
+        g_strfreev(parts);
+        return false;
+    }
+
+    *adr = g_strdup(parts[0]);
+    *port = g_ascii_strtoll(parts[1], NULL, 10);
+    g_strfreev(parts);
+
+    return true;
+}
+
+#ifdef HAVE_VSOCK
+static bool
+parse_opt_u32(const char *str, guint64 *value)
+{
+    char *end;
+
+    *value = g_ascii_strtoull(str, &end, 10);
+    return end != str && *end == '\0' && *value <= G_MAXUINT32;
+}
+#endif
+
+#ifdef G_OS_UNIX
+static bool
+parse_opt_unix_path(redirect *self, const char *path)
+{
+    if (*path == '@') {
+        if (!g_unix_socket_address_abstract_names_supported()) {
+            g_printerr("Abstract socket names are not supported\n");
+            return false;
+        }
+        self->abstract = true;
+        path++;
+    }
+    if (*path == '\0') {
+        return false;
+    }
+    self->addr = g_strdup(path);
+    return true;
+}
+#endif
+
+/* Besides host:port for TCP --to and --as take:
+ *   unix:PATH, unix:@NAME  a Unix domain socket, @ for an abstract name
+ *   shm:PATH, shm:@NAME    shared memory rings, set up over a Unix socket
+ *   vsock:CID:PORT         AF_VSOCK, for --as CID can be "any"
+ *   fd:N                   an already connected socket, e.g. a socketpair
+ *   socket-activation      --as only, the socket passed with LISTEN_FDS
+ *   stdio                  stdin and stdout, e.g. a pair of pipes */
+bool
+parse_opt_transport(redirect *self, const char *uri)
+{
+#ifdef G_OS_UNIX
+    if (g_str_has_prefix(uri, "unix:")) {
+        self->transport = TRANSPORT_UNIX;
+        return parse_opt_unix_path(self, uri + strlen("unix:"));
+    }
+#ifdef HAVE_SHM_TRANSPORT
+    if (g_str_has_prefix(uri, "shm:")) {
+        self->transport = TRANSPORT_SHM;
+        return parse_opt_unix_path(self, uri + strlen("shm:"));
+    }
+#endif
+    if (g_str_has_prefix(uri, "fd:")) {
+        const char *str = uri + strlen("fd:");
+        char *end;
+        gint64 fd = g_ascii_strtoll(str, &end, 10);
+
+        if (end == str || *end != '\0' || fd < 0 || fd > G_MAXINT) {
+            return false;
+        }
+        self->transport = TRANSPORT_FD;
+        self->fd = fd;
+        return true;
+    }
+    if (g_str_equal(uri, "socket-activation")) {
+        if (self->is_client) {
+            g_printerr("socket-activation can only be used with --as\n");
+            return false;
+        }
+        self->transport = TRANSPORT_SOCKET_ACTIVATION;
+        return true;
+    }
+    if (g_str_equal(uri, "stdio")) {
+        self->transport = TRANSPORT_STDIO;
+        return true;
+    }
+#endif
+#ifdef HAVE_VSOCK
+    if (g_str_has_prefix(uri, "vsock:")) {
+        char **parts = g_strsplit(uri + strlen("vsock:"), ":", 2);
+        bool ok = parts[0] != NULL && parts[1] != NULL;
+        guint64 port = 0;
+
+        if (ok && g_str_equal(parts[0], "any") && !self->is_client) {
+            self->cid = VMADDR_CID_ANY;
+        } else if (ok) {
+            guint64 cid = 0;
+            ok = parse_opt_u32(parts[0], &cid);
+            self->cid = cid;
+        }
+        ok = ok && parse_opt_u32(parts[1], &port);
+        self->port = port;
+        g_strfreev(parts);
+        self->transport = TRANSPORT_VSOCK;
+        return ok;
+    }
+#endif
+    self->transport = TRANSPORT_TCP;
+    return parse_opt_uri(uri, &self->addr, &self->port);
+}
+
+void
+set_connection(redirect *self, GSocketConnection *connection)
+{
+    GSocket *socket = g_socket_connection_get_socket(connection);
+
+    self->connection = connection;
+    self->stream = g_object_ref(G_IO_STREAM(connection));
+    self->in_fd = self->out_fd = g_socket_get_fd(socket);
+    if (self->transport == TRANSPORT_TCP) {
+        g_socket_set_keepalive(socket, self->keepalive);
+    }
+#ifdef HAVE_ZEROCOPY
+    if (self->zerocopy) {
+        zerocopy_setup(self);
+    }
+#endif
+}
+
+#ifdef G_OS_UNIX
+static GSocketAddress *
+unix_socket_address_new(redirect *self)
+{
+    if (self->abstract) {
+        return g_unix_socket_address_new_with_type(self->addr, -1,
+                G_UNIX_SOCKET_ADDRESS_ABSTRACT);
+    }
+    return g_unix_socket_address_new(self->addr);
+}
+
+/* The socket passed with the sd_listen_fds() protocol, when there is more
+ * than one only the first one is used */
+static GSocket *
+activation_socket_new(GError **err)
+{
+    const char *pid = g_getenv("LISTEN_PID");
+    const char *fds = g_getenv("LISTEN_FDS");
+
+    if (!pid || !fds || g_ascii_strtoll(pid, NULL, 10) != getpid() ||
+        g_ascii_strtoll(fds, NULL, 10) < 1) {
+        g_set_error(err, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                    "No socket passed through socket activation");
+        return NULL;
+    }
+    g_unsetenv("LISTEN_PID");
+    g_unsetenv("LISTEN_FDS");
+    g_unsetenv("LISTEN_FDNAMES");
+    fcntl(3, F_SETFD, FD_CLOEXEC);
+    return g_socket_new_from_fd(3, err);
+}
+
+/* The protocol goes over stdin and stdout, so that nothing else which
+ * prints to stdout ends up in the stream, move stdout to another fd and
+ * point fd 1 to stderr */
+static bool
+open_stdio(redirect *self, GError **err)
+{
+    int out_fd = dup(STDOUT_FILENO);
+
+    if (out_fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+        int errsv = errno;
+        g_set_error(err, G_IO_ERROR, g_io_error_from_errno(errsv),
+                    "Failed to set up stdio: %s", g_strerror(errsv));
+        if (out_fd >= 0) {
+            close(out_fd);
+        }
+        return false;
+    }
+    fcntl(out_fd, F_SETFD, FD_CLOEXEC);
+    if (!g_unix_set_fd_nonblocking(STDIN_FILENO, TRUE, err) ||
+        !g_unix_set_fd_nonblocking(out_fd, TRUE, err)) {
+        close(out_fd);
+        return false;
+    }
+
+    GInputStream *in = g_unix_input_stream_new(STDIN_FILENO, FALSE);
+    GOutputStream *out = g_unix_output_stream_new(out_fd, TRUE);
+    self->stream = g_simple_io_stream_new(in, out);
+    g_object_unref(in);
+    g_object_unref(out);
+    self->in_fd = STDIN_FILENO;
+    self->out_fd = out_fd;
+    return true;
+}
+#endif
+
+#ifdef HAVE_VSOCK
+/* GLib has no vsock addresses, but it can use vsock sockets */
+static GSocket *
+vsock_socket_new(redirect *self, GError **err)
+{
+    struct sockaddr_vm addr = {
+        .svm_family = AF_VSOCK,
+        .svm_cid = self->cid,
+        .svm_port = self->port,
+    };
+    GSocket *gsocket;
+    int fd, errsv;
+
+    fd = socket(AF_VSOCK, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        goto error;
+    }
+    if (self->is_client) {
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+            goto error;
+        }
+    } else if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+               listen(fd, 1) != 0) {
+        goto error;
+    }
+
+    gsocket = g_socket_new_from_fd(fd, err);
+    if (!gsocket) {
+        close(fd);
+    }
+    return gsocket;
+
+error:
+    errsv = errno;
+    if (fd >= 0) {
+        close(fd);
+    }
+    g_set_error(err, G_IO_ERROR, g_io_error_from_errno(errsv),
+                "vsock %u:%u: %s", self->cid, (guint32)self->port,
+                g_strerror(errsv));
+    return NULL;
+}
+#endif
+
+/* Connects to the server, or uses the already connected fds */
+bool
+connect_transport(redirect *self, GError **err)
+{
+    GSocketConnection *connection = NULL;
+    GSocketClient *client;
+    GSocket *socket;
+
+    switch (self->transport) {
+    case TRANSPORT_TCP:
+        client = g_socket_client_new();
+        connection = g_socket_client_connect_to_host(client,
+                self->addr,
+                self->port, /* your port goes here */
+                NULL,
+                err);
+        g_object_unref(client);
+        break;
+#ifdef G_OS_UNIX
+    case TRANSPORT_UNIX:
+    case TRANSPORT_SHM: {
+        GSocketAddress *addr = unix_socket_address_new(self);
+
+        client = g_socket_client_new();
+        connection = g_socket_client_connect(client,
+                G_SOCKET_CONNECTABLE(addr), NULL, err);
+        g_object_unref(client);
+        g_object_unref(addr);
+        break;
+    }
+    case TRANSPORT_FD:
+        socket = g_socket_new_from_fd(self->fd, err);
+        if (socket) {
+            connection = g_socket_connection_factory_create_connection(socket);
+            g_object_unref(socket);
+        }
+        break;
+    case TRANSPORT_STDIO:
+        return open_stdio(self, err);
+#endif
+#ifdef HAVE_VSOCK
+    case TRANSPORT_VSOCK:
+        socket = vsock_socket_new(self, err);
+        if (socket) {
+            connection = g_socket_connection_factory_create_connection(socket);
+            g_object_unref(socket);
+        }
+        break;
+#endif
+    default:
+        g_assert_not_reached();
+    }
+
+    if (!connection) {
+        return false;
+    }
+    set_connection(self, connection);
+    return true;
+}
+
+bool
+listen_transport(redirect *self, GSocketListener *listener, GError **err)
+{
+    GSocketAddress *saddr = NULL;
+    GSocket *socket = NULL;
+    bool ret = false;
+
+    switch (self->transport) {
+    case TRANSPORT_TCP: {
+        GInetAddress *iaddr = g_inet_address_new_from_string(self->addr);
+        if (iaddr == NULL) {
+            g_set_error(err, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                        "Failed to parse IP: %s", self->addr);
+            return false;
+        }
+
+        saddr = g_inet_socket_address_new(iaddr, self->port);
+        g_object_unref(iaddr);
+
+        ret = g_socket_listener_add_address(listener,
+                saddr,
+                G_SOCKET_TYPE_STREAM,
+                G_SOCKET_PROTOCOL_TCP,
+                NULL,
+                NULL,
+                err);
+        break;
+    }
+#ifdef G_OS_UNIX
+    case TRANSPORT_UNIX:
+    case TRANSPORT_SHM:
+        saddr = unix_socket_address_new(self);
+        ret = g_socket_listener_add_address(listener,
+                saddr,
+                G_SOCKET_TYPE_STREAM,
+                G_SOCKET_PROTOCOL_DEFAULT,
+                NULL,
+                NULL,
+                err);
+        /* Remove the socket file again on exit */
+        self->unlink_path = ret && !self->abstract;
+        break;
+    case TRANSPORT_SOCKET_ACTIVATION:
+        socket = activation_socket_new(err);
+        ret = socket && g_socket_listener_add_socket(listener, socket, NULL,
+                                                     err);
+        break;
+#endif
+#ifdef HAVE_VSOCK
+    case TRANSPORT_VSOCK:
+        socket = vsock_socket_new(self, err);
+        ret = socket && g_socket_listener_add_socket(listener, socket, NULL,
+                                                     err);
+        break;
+#endif
+    default:
+        g_assert_not_reached();
+    }
+
+    g_clear_object(&saddr);
+    g_clear_object(&socket);
+    return ret;
+}
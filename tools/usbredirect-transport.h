@@ -0,0 +1,33 @@
+/* usbredirect-transport.h the transports of usbredirect
+
+   Copyright 2026 Red Hat, Inc.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include "usbredirect.h"
+
+/* Parses the address of --to or --as, see the comment on the function for
+ * the transports there are */
+bool parse_opt_transport(redirect *self, const char *uri);
+
+/* Takes over the connection, and sets the fds usbredirect reads and writes */
+void set_connection(redirect *self, GSocketConnection *connection);
+
+/* --to: connects, resp. takes the already connected fds or stdio */
+bool connect_transport(redirect *self, GError **err);
+
+/* --as: adds the address, resp. the passed socket, to listener */
+bool listen_transport(redirect *self, GSocketListener *listener, GError **err);
@@ -0,0 +1,97 @@
+/* usbredirect-uring.c the --io-uring mode of usbredirect
+
+   Copyright 2026 Red Hat, Inc.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include "usbredirect.h"
+#include "usbredirect-epoll.h"
+#include "usbredirect-uring.h"
+#include "usbrediruring.h"
+
+/* The --io-uring mode: like --epoll everything runs on the main thread, but
+ * the connection's IO goes through io_uring, see usbrediruring.h */
+
+static int
+uring_signal_cb(void *priv, int fd, uint32_t events)
+{
+    redirect *self = (redirect *) priv;
+
+    epoll_handle_signals(self);
+    return self->quit;
+}
+
+bool
+uring_setup(redirect *self, GError **err)
+{
+    int ret;
+
+    ret = usbrediruring_create(NULL, self->usbredirhost, self->in_fd,
+                               &self->uring);
+    if (ret == 0) {
+        ret = usbrediruring_add_fd(self->uring, self->signal_fd,
+                                   uring_signal_cb, self);
+        if (ret < 0) {
+            g_clear_pointer(&self->uring, usbrediruring_destroy);
+        }
+    }
+    if (ret < 0) {
+        g_set_error(err, G_FILE_ERROR, g_file_error_from_errno(-ret),
+                    "Failed to set up io_uring: %s", g_strerror(-ret));
+        return false;
+    }
+    return true;
+}
+
+void
+uring_cleanup(redirect *self)
+{
+    g_clear_pointer(&self->uring, usbrediruring_destroy);
+}
+
+/* The usbredirhost read callback: copy from the received buffers */
+int
+uring_read(redirect *self, uint8_t *data, int count)
+{
+    int nbytes = usbrediruring_read(self->uring, data, count);
+
+    if (nbytes > 0 && self->record_path) {
+        record_data(self, usbredirrecord_from_guest, data, nbytes);
+    }
+    return nbytes;
+}
+
+/* The usbredirhost write callback: gather into the send buffer */
+int
+uring_write(redirect *self, uint8_t *data, int count)
+{
+    int nbytes = usbrediruring_write(self->uring, data, count);
+
+    if (nbytes > 0 && self->record_path) {
+        record_data(self, usbredirrecord_to_guest, data, nbytes);
+    }
+    return nbytes;
+}
+
+void
+run_uring_loop(redirect *self)
+{
+    int r = 0;
+
+    while (!self->quit && (r = usbrediruring_iterate(self->uring, -1)) == 0) {
+    }
+    report_loop_error("io_uring", r);
+}
@@ -0,0 +1,31 @@
+/* usbredirect-uring.h the --io-uring mode of usbredirect
+
+   Copyright 2026 Red Hat, Inc.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include "usbredirect.h"
+
+/* Sets up the loop for the connection once it is up, after epoll_setup() */
+bool uring_setup(redirect *self, GError **err);
+void uring_cleanup(redirect *self);
+
+/* The usbredirhost read and write callbacks while the loop runs */
+int uring_read(redirect *self, uint8_t *data, int count);
+int uring_write(redirect *self, uint8_t *data, int count);
+
+/* Runs the session until it ends */
+void run_uring_loop(redirect *self);
@@ -0,0 +1,107 @@
+/* usbredirect-writer.c the --writer-thread mode of usbredirect
+
+   Copyright 2026 Red Hat, Inc.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include "usbredirect.h"
+#include <errno.h>
+#include "usbredirect-sched.h"
+#include "usbredirect-writer.h"
+#include "usbredirwriter.h"
+
+/* The --writer-thread mode, see usbredirwriter.h: the main loop then only
+ * watches for input */
+static gboolean
+writer_failed_cb(gpointer user_data)
+{
+    redirect *self = (redirect *) user_data;
+
+    self->writer_failed_id = 0;
+    redirect_quit(self);
+    return G_SOURCE_REMOVE;
+}
+
+static void
+writer_started(void *priv)
+{
+    apply_thread_sched(priv, THREAD_WRITER);
+}
+
+/* On the writer thread, the main loop tears everything down, the thread
+ * must not touch its sources */
+static void
+writer_failed(void *priv, int error)
+{
+    redirect *self = (redirect *) priv;
+
+    if (error == -EPROTO) {
+        g_critical("Writer thread: Failed to write to guest");
+    } else {
+        g_warning("Writer thread: %s", g_strerror(-error));
+    }
+    self->writer_failed_id = g_idle_add(writer_failed_cb, self);
+}
+
+bool
+create_writer_thread(redirect *self, GError **err)
+{
+    int r = usbredirwriter_create(writer_started, writer_failed, self,
+                                  &self->writer);
+
+    if (r < 0) {
+        g_set_error(err, G_IO_ERROR, g_io_error_from_errno(-r),
+                    "%s", g_strerror(-r));
+        return false;
+    }
+    /* The writer thread waits for the connection to become writable */
+    self->watch_inout = false;
+    return true;
+}
+
+/* Started once the connection is up, whatever got queued before then gets
+ * written right away */
+bool
+start_writer_thread(redirect *self, GError **err)
+{
+    int r = usbredirwriter_start(self->writer, self->usbredirhost,
+                                 self->out_fd);
+
+    if (r < 0) {
+        g_set_error(err, G_IO_ERROR, g_io_error_from_errno(-r),
+                    "%s", g_strerror(-r));
+        return false;
+    }
+    return true;
+}
+
+void
+destroy_writer_thread(redirect *self)
+{
+    if (!self->writer) {
+        return;
+    }
+    usbredirwriter_stop(self->writer);
+    remove_source(self->writer_failed_id);
+    self->writer_failed_id = 0;
+    g_clear_pointer(&self->writer, usbredirwriter_destroy);
+}
+
+void
+flush_writer_thread(redirect *self)
+{
+    usbredirwriter_flush(self->writer);
+}
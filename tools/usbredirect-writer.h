@@ -0,0 +1,31 @@
+/* usbredirect-writer.h the --writer-thread mode of usbredirect
+
+   Copyright 2026 Red Hat, Inc.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include "usbredirect.h"
+
+/* Creates the thread before usbredirhost gets opened, it only starts
+ * writing once start_writer_thread() gave it the connection */
+bool create_writer_thread(redirect *self, GError **err);
+bool start_writer_thread(redirect *self, GError **err);
+
+/* Stops and frees the thread, does nothing without one */
+void destroy_writer_thread(redirect *self);
+
+/* The usbredirhost write flush callback, wakes up the thread */
+void flush_writer_thread(redirect *self);
@@ -0,0 +1,142 @@
+/* usbredirect-zerocopy.c the --zerocopy glue of usbredirect
+
+   Copyright 2026 Red Hat, Inc.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include "usbredirect.h"
+#include <errno.h>
+#include <inttypes.h>
+#include "usbredirect-zerocopy.h"
+#include "usbredirzerocopy.h"
+
+static void
+zerocopy_free_buffer(void *priv, uint8_t *data)
+{
+    redirect *self = (redirect *) priv;
+
+    usbredirhost_free_write_buffer(self->usbredirhost, data);
+}
+
+/* Called on connecting, until then the write buffers stay queued in the
+ * usbredirparser */
+void
+zerocopy_setup(redirect *self)
+{
+    struct usbredirzerocopy *zc;
+    int r;
+
+    r = usbredirzerocopy_create(self->out_fd, self->zerocopy, 0,
+                                zerocopy_free_buffer, self, &zc);
+    if (r < 0 && r != -ENOMEM) {
+        g_warning("MSG_ZEROCOPY is not available: %s, sending copies",
+                  g_strerror(-r));
+        r = usbredirzerocopy_create(self->out_fd, 0, 0,
+                                    zerocopy_free_buffer, self, &zc);
+    }
+    if (r < 0) {
+        g_critical("%s: %s", __func__, g_strerror(-r));
+        redirect_quit(self);
+        return;
+    }
+    g_mutex_lock(&self->zerocopy_lock);
+    self->zc = zc;
+    g_mutex_unlock(&self->zerocopy_lock);
+}
+
+int
+zerocopy_write(redirect *self, uint8_t *data, int count)
+{
+    bool pending = false;
+    int r = 0;
+
+    g_mutex_lock(&self->zerocopy_lock);
+    if (self->zc) {
+        r = usbredirzerocopy_write(self->zc, data, count);
+        pending = usbredirzerocopy_get_buffered_size(self->zc) != 0;
+    }
+    g_mutex_unlock(&self->zerocopy_lock);
+
+    if (r < 0) {
+        g_warning("Failure at %s: %s", __func__, g_strerror(-r));
+        redirect_quit(self);
+        return -1;
+    }
+    if (r > 0 && self->record_path) {
+        record_data(self, usbredirrecord_to_guest, data, r);
+    }
+    if (pending) {
+        update_watch(self);
+    }
+    return r;
+}
+
+int
+zerocopy_flush(redirect *self)
+{
+    int r = 0;
+
+    g_mutex_lock(&self->zerocopy_lock);
+    if (self->zc) {
+        r = usbredirzerocopy_flush(self->zc);
+    }
+    g_mutex_unlock(&self->zerocopy_lock);
+    return r;
+}
+
+int
+zerocopy_complete(redirect *self)
+{
+    int r = 0;
+
+    g_mutex_lock(&self->zerocopy_lock);
+    if (self->zc) {
+        r = usbredirzerocopy_complete(self->zc);
+    }
+    g_mutex_unlock(&self->zerocopy_lock);
+    return r;
+}
+
+void
+zerocopy_cleanup(redirect *self)
+{
+    struct usbredirzerocopy_stats stats;
+
+    if (!self->zc) {
+        return;
+    }
+    usbredirzerocopy_get_stats(self->zc, &stats);
+    g_debug("zerocopy: %" PRIu64 " MSG_ZEROCOPY sends, %" PRIu64
+            " of them copied, %" PRIu64 " other sends",
+            stats.zerocopy_sends, stats.copied, stats.copy_sends);
+    g_clear_pointer(&self->zc, usbredirzerocopy_destroy);
+}
+
+/* Data the zerocopy sender has not sent yet, with it the usbredirparser has
+ * no queue and this is what usbredirhost drops iso packets for */
+uint64_t
+zerocopy_buffered_output_size_cb(void *priv)
+{
+    redirect *self = (redirect *) priv;
+    uint64_t size = 0;
+
+    g_mutex_lock(&self->zerocopy_lock);
+    if (self->zc) {
+        size = usbredirzerocopy_get_buffered_size(self->zc);
+    }
+    g_mutex_unlock(&self->zerocopy_lock);
+    return size;
+}
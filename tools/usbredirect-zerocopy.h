@@ -0,0 +1,35 @@
+/* usbredirect-zerocopy.h the --zerocopy glue of usbredirect
+
+   Copyright 2026 Red Hat, Inc.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include "usbredirect.h"
+
+/* Creates the sender once the connection is up, see usbredirzerocopy.h */
+void zerocopy_setup(redirect *self);
+void zerocopy_cleanup(redirect *self);
+
+/* The usbredirhost write callback with --zerocopy */
+int zerocopy_write(redirect *self, uint8_t *data, int count);
+
+/* Sends what is queued, resp. gives back the buffers whose completions
+ * arrived, for when the connection is writable resp. has an error */
+int zerocopy_flush(redirect *self);
+int zerocopy_complete(redirect *self);
+
+/* The usbredirhost buffered output size callback */
+uint64_t zerocopy_buffered_output_size_cb(void *priv);
@@ -72,21 +72,24 @@ int main(int argc, char **argv) {
 #endif
 
 #include "config.h"
-#include <stdio.h>
-#include <stdbool.h>
-
-#define G_LOG_DOMAIN "usbredirect"
-#define G_LOG_USE_STRUCTURED
-
-#include <glib.h>
-#include <gio/gio.h>
-#include <libusb.h>
-#include <usbredirhost.h>
+#include <errno.h>
+#include <inttypes.h>
+
+#include "usbredirect.h"
+#include <glib/gstdio.h>
+#include "usbredirect-sched.h"
+#include "usbredirect-transport.h"
+#ifdef HAVE_SHM_TRANSPORT
+#include "usbredirect-shm.h"
+#include "usbredirshm.h"
+#endif
+#ifdef HAVE_ZEROCOPY
+#include "usbredirect-zerocopy.h"
+#endif
 
 #ifdef G_OS_UNIX
 #include <glib-unix.h>
-#include <gio/gunixinputstream.h>
-#include <gio/gunixoutputstream.h>
+#include <unistd.h>
 #endif
 
 #ifdef G_OS_WIN32
@@ -95,36 +98,40 @@ int main(int argc, char **argv) {
 #include <gio/gwin32outputstream.h>
 #endif
 
-typedef struct redirect {
-    struct {
-        /* vendor:product */
-        int vendor;
-        int product;
-        /* bus-device */
-        int bus;
-        int device_number;
-    } device;
-    bool by_bus;
-    bool is_client;
-    bool keepalive;
-    bool watch_inout;
-    char *addr;
-    int port;
-    int verbosity;
-
-    struct usbredirhost *usbredirhost;
-    GSocketConnection *connection;
-    GThread *event_thread;
-    int event_thread_run;
-    int watch_server_id;
-    GIOChannel *io_channel;
-
-    GMainLoop *main_loop;
-} redirect;
-
-static void create_watch(redirect *self);
+#ifdef HAVE_EPOLL_LOOP
+#include "usbredirect-epoll.h"
+#endif
 
-static bool
+#ifdef HAVE_WRITER_THREAD
+#include "usbredirect-writer.h"
+#endif
+
+#ifdef HAVE_URING_LOOP
+#include "usbredirect-uring.h"
+#endif
+
+#ifdef G_OS_UNIX
+#include "usbredirect-daemon.h"
+#endif
+
+
+void
+redirect_quit(redirect *self)
+{
+#ifdef G_OS_UNIX
+    /* In daemon mode only this device's session ends */
+    if (self->loop) {
+        daemon_session_end_later(self);
+        return;
+    }
+#endif
+    self->quit = true;
+    if (self->main_loop) {
+        g_main_loop_quit(self->main_loop);
+    }
+}
+
+bool
 parse_opt_device(redirect *self, const char *device)
 {
     if (!device) {
@@ -172,27 +179,6 @@ parse_opt_device(redirect *self, const char *device)
     return true;
 }
 
-static bool
-parse_opt_uri(const char *uri, char **adr, int *port)
-{
-    if (uri == NULL) {
-        return false;
-    }
-
-    char **parts = g_strsplit(uri, ":", 2);
-    if (parts == NULL || parts[0] == NULL || parts[1] == NULL || parts[2] != NULL) {
-        g_printerr("Failed to parse '%s' - expected simplified uri scheme: host:port", uri);
-        g_strfreev(parts);
-        return false;
-    }
-
-    *adr = g_strdup(parts[0]);
-    *port = g_ascii_strtoll(parts[1], NULL, 10);
-    g_strfreev(parts);
-
-    return true;
-}
-
 static redirect *
 parse_opts(int *argc, char ***argv)
 {
@@ -204,17 +190,58 @@ parse_opts(int *argc, char ***argv)
     char *remoteaddr = NULL;
     char *localaddr = NULL;
     gboolean keepalive = FALSE;
+    gboolean latency_stats = FALSE;
+    char *capture_path = NULL;
+    gint capture_snaplen = 1024;
+    char *record_path = NULL;
+    gboolean use_epoll = FALSE;
+    gboolean use_io_uring = FALSE;
+    gboolean use_writer_thread = FALSE;
+    gboolean mlock = FALSE;
+    char *pin = NULL;
+    char *rt_priority = NULL;
+    char *rt_policy = NULL;
+    gint zerocopy = 0;
+    char *daemon_path = NULL;
+    gint workers = 0;
     gint verbosity = 0; /* none */
     redirect *self = NULL;
+    int i;
 
 
 
     GOptionEntry entries[] = {
         { "device", 0, 0, G_OPTION_ARG_STRING, &device, "Local USB device to be redirected identified as either VENDOR:PRODUCT \"0123:4567\" or BUS-DEVICE \"5-2\"", NULL },
-        { "to", 0, 0, G_OPTION_ARG_STRING, &remoteaddr, "Client URI to connect to", NULL },
-        { "as", 0, 0, G_OPTION_ARG_STRING, &localaddr, "Server URI to be run", NULL },
+        { "to", 0, 0, G_OPTION_ARG_STRING, &remoteaddr, "Client URI to connect to: addr:port, unix:PATH, shm:PATH, vsock:CID:PORT, fd:N or stdio", NULL },
+        { "as", 0, 0, G_OPTION_ARG_STRING, &localaddr, "Server URI to be run: addr:port, unix:PATH, shm:PATH, vsock:CID:PORT or socket-activation", NULL },
         { "keepalive", 'k', 0, G_OPTION_ARG_NONE, &keepalive, "If we should set SO_KEEPALIVE flag on underlying socket", NULL },
         { "verbose", 'v', 0, G_OPTION_ARG_INT, &verbosity, "Set log level between 1-5 where 5 being the most verbose", NULL },
+        { "latency-stats", 0, 0, G_OPTION_ARG_NONE, &latency_stats, "Collect packet latency histograms, these are printed on SIGUSR1 and on exit", NULL },
+        { "capture", 0, 0, G_OPTION_ARG_FILENAME, &capture_path, "Capture the USB traffic to FILE in usbmon pcap format, SIGUSR2 pauses / resumes the capture", "FILE" },
+        { "capture-snaplen", 0, 0, G_OPTION_ARG_INT, &capture_snaplen, "Capture at most N bytes of data per packet (default 1024)", "N" },
+        { "record", 0, 0, G_OPTION_ARG_FILENAME, &record_path, "Record the usbredir session to FILE, for replaying with usbredirreplay", "FILE" },
+#ifdef HAVE_EPOLL_LOOP
+        { "epoll", 0, 0, G_OPTION_ARG_NONE, &use_epoll, "Handle the connection and the USB events in a single epoll based thread", NULL },
+#endif
+#ifdef HAVE_URING_LOOP
+        { "io-uring", 0, 0, G_OPTION_ARG_NONE, &use_io_uring, "Like --epoll, but do the connection's IO through io_uring", NULL },
+#endif
+#ifdef HAVE_WRITER_THREAD
+        { "writer-thread", 0, 0, G_OPTION_ARG_NONE, &use_writer_thread, "Write to the connection from a separate thread, so that USB completions do not wait for the writes", NULL },
+#endif
+        { "mlock", 0, 0, G_OPTION_ARG_NONE, &mlock, "Prefault and lock the buffers of iso, bulk and interrupt streams in memory", NULL },
+#ifdef HAVE_SCHED_SETAFFINITY
+        { "pin", 0, 0, G_OPTION_ARG_STRING, &pin, "Pin the event, reader and writer threads to a CPU each", "THREAD=CPU,..." },
+        { "rt-priority", 0, 0, G_OPTION_ARG_STRING, &rt_priority, "Run the event, reader and writer threads with a real-time priority", "THREAD=PRIO,..." },
+        { "rt-policy", 0, 0, G_OPTION_ARG_STRING, &rt_policy, "The real-time scheduling policy for --rt-priority: fifo (default) or rr", "POLICY" },
+#endif
+#ifdef HAVE_ZEROCOPY
+        { "zerocopy", 0, 0, G_OPTION_ARG_INT, &zerocopy, "Send writes of at least BYTES to a TCP connection with MSG_ZEROCOPY", "BYTES" },
+#endif
+#ifdef G_OS_UNIX
+        { "daemon", 0, 0, G_OPTION_ARG_FILENAME, &daemon_path, "Redirect all devices listed in FILE from a single process", "FILE" },
+        { "workers", 0, 0, G_OPTION_ARG_INT, &workers, "With --daemon, spread the devices over N threads pinned to a CPU each (default 1)", "N" },
+#endif
         { NULL }
     };
 
@@ -232,6 +259,35 @@ parse_opts(int *argc, char ***argv)
 
     /* check options */
 
+#ifdef G_OS_UNIX
+    if (daemon_path) {
+        if (remoteaddr || localaddr || device || capture_path || record_path ||
+            use_epoll || use_io_uring || use_writer_thread || pin ||
+            rt_priority || rt_policy || zerocopy) {
+            g_printerr("--daemon takes the devices from FILE and can not be used with --device, --to, --as, --capture, --record, --epoll, --io-uring, --writer-thread, --pin, --rt-priority, --rt-policy or --zerocopy\n");
+            goto end;
+        }
+        if (workers < 0) {
+            g_printerr("Invalid number of workers: %d\n", workers);
+            goto end;
+        }
+        self = g_new0(redirect, 1);
+        g_mutex_init(&self->record_lock);
+        self->daemon_path = g_steal_pointer(&daemon_path);
+        self->workers = workers;
+        self->keepalive = keepalive;
+        self->latency_stats = latency_stats;
+        self->mlock = mlock;
+        self->verbosity = verbosity;
+        goto end;
+    }
+#endif
+
+    if (workers) {
+        g_printerr("--workers can only be used together with --daemon\n");
+        goto end;
+    }
+
     if (!remoteaddr && !localaddr) {
         g_printerr("%s need to act either as client (-to) or as server (-as)\n", *argv[0]);
         g_printerr("%s", g_option_context_get_help(ctx, TRUE, NULL));
@@ -240,6 +296,10 @@ parse_opts(int *argc, char ***argv)
 
     self = g_new0(redirect, 1);
     self->watch_inout = true;
+    g_mutex_init(&self->record_lock);
+#ifdef HAVE_ZEROCOPY
+    g_mutex_init(&self->zerocopy_lock);
+#endif
     if (!parse_opt_device(self, device)) {
         g_printerr("Failed to parse device: '%s' - expected: vendor:product or busnum-devnum\n", device);
         g_clear_pointer(&self, g_free);
@@ -247,15 +307,57 @@ parse_opts(int *argc, char ***argv)
     }
 
 
-    if (parse_opt_uri(remoteaddr, &self->addr, &self->port)) {
-        self->is_client = true;
-    } else if (!parse_opt_uri(localaddr, &self->addr, &self->port)) {
-        g_printerr("Failed to parse uri '%s' - expected: addr:port", remoteaddr ? remoteaddr : localaddr);
+    self->is_client = remoteaddr != NULL;
+    if (!parse_opt_transport(self, remoteaddr ? remoteaddr : localaddr)) {
+        g_printerr("Failed to parse uri '%s' - expected: addr:port, unix:PATH, shm:PATH, vsock:CID:PORT, fd:N, socket-activation or stdio\n", remoteaddr ? remoteaddr : localaddr);
+        g_clear_pointer(&self->addr, g_free);
         g_clear_pointer(&self, g_free);
         goto end;
     }
 
     self->keepalive = keepalive;
+    self->latency_stats = latency_stats;
+    if (capture_snaplen < 0) {
+        g_printerr("Invalid capture snaplen: %d\n", capture_snaplen);
+        g_clear_pointer(&self, g_free);
+        goto end;
+    }
+    self->capture_path = g_steal_pointer(&capture_path);
+    self->capture_snaplen = capture_snaplen;
+    self->record_path = g_steal_pointer(&record_path);
+    /* io_uring mode is the epoll mode with another loop, which it falls
+     * back to when io_uring is not available */
+    self->use_epoll = use_epoll || use_io_uring;
+    self->use_io_uring = use_io_uring;
+    if (use_writer_thread && (self->use_epoll ||
+                              self->transport == TRANSPORT_SHM)) {
+        g_printerr("--writer-thread can not be used with --epoll, --io-uring or shm:\n");
+        g_clear_pointer(&self->addr, g_free);
+        g_clear_pointer(&self, g_free);
+        goto end;
+    }
+    self->use_writer_thread = use_writer_thread;
+    /* The zerocopy sender takes over the write buffers, which only the
+     * GLib loop without writer thread knows to flush */
+    if (zerocopy < 0 || (zerocopy && (self->transport != TRANSPORT_TCP ||
+                                      self->use_epoll || use_writer_thread))) {
+        g_printerr("--zerocopy needs a positive size and a TCP connection and can not be used with --epoll, --io-uring or --writer-thread\n");
+        g_clear_pointer(&self->addr, g_free);
+        g_clear_pointer(&self, g_free);
+        goto end;
+    }
+    self->zerocopy = zerocopy;
+    self->mlock = mlock;
+    for (i = 0; i < THREAD_COUNT; i++) {
+        self->thread_cpu[i] = -1;
+    }
+#ifdef HAVE_SCHED_SETAFFINITY
+    if (!parse_opt_sched(self, pin, rt_priority, rt_policy)) {
+        g_clear_pointer(&self->addr, g_free);
+        g_clear_pointer(&self, g_free);
+        goto end;
+    }
+#endif
     self->verbosity = verbosity;
     g_debug("options: keepalive=%s, verbosity=%d",
             self->keepalive ? "ON":"OFF",
@@ -273,6 +375,12 @@ end:
     g_free(localaddr);
     g_free(remoteaddr);
     g_free(device);
+    g_free(capture_path);
+    g_free(record_path);
+    g_free(pin);
+    g_free(rt_priority);
+    g_free(rt_policy);
+    g_free(daemon_path);
     g_option_context_free(ctx);
     return self;
 }
@@ -282,6 +390,8 @@ thread_handle_libusb_events(gpointer user_data)
 {
     redirect *self = (redirect *) user_data;
 
+    apply_thread_sched(self, THREAD_EVENT);
+
     int res = 0;
     const char *desc = "";
     while (g_atomic_int_get(&self->event_thread_run)) {
@@ -329,7 +439,7 @@ debug_libusb_cb(libusb_context *ctx, enum libusb_log_level level, const char *ms
 }
 #endif
 
-static void
+void
 usbredir_log_cb(void *priv, int level, const char *msg)
 {
     GLogLevelFlags glog_level;
@@ -355,26 +465,151 @@ usbredir_log_cb(void *priv, int level, const char *msg)
     g_log_structured(G_LOG_DOMAIN, glog_level, "MESSAGE", msg);
 }
 
-static void
+/* Like g_io_add_watch(), but for the thread default main context, so that
+ * the watches of a --daemon worker belong to the worker's main loop */
+static int
+add_watch(redirect *self, GIOChannel *channel, GIOCondition condition,
+          GIOFunc func)
+{
+    GSource *source = g_io_create_watch(channel, condition);
+    int id;
+
+    g_source_set_callback(source, (GSourceFunc) func, self, NULL);
+    id = g_source_attach(source, g_main_context_get_thread_default());
+    g_source_unref(source);
+    return id;
+}
+
+/* Like g_source_remove(), for the thread default main context. A source
+ * whose callback returned G_SOURCE_REMOVE may be gone already. */
+void
+remove_source(guint id)
+{
+    GSource *source;
+
+    if (id && (source = g_main_context_find_source_by_id(
+                   g_main_context_get_thread_default(), id))) {
+        g_source_destroy(source);
+    }
+}
+
+void
 update_watch(redirect *self)
 {
-    const bool watch_inout = usbredirhost_has_data_to_write(self->usbredirhost) != 0;
+    /* The writer thread waits for the connection to become writable, this
+     * may get called from it */
+    if (self->use_writer_thread) {
+        return;
+    }
+    /* The epoll loop watches the connection itself */
+    if (self->use_epoll) {
+        return;
+    }
+    bool watch_inout = usbredirhost_has_data_to_write(self->usbredirhost) != 0;
+#ifdef HAVE_ZEROCOPY
+    if (self->zerocopy && !watch_inout) {
+        watch_inout = zerocopy_buffered_output_size_cb(self) != 0;
+    }
+#endif
     if (watch_inout == self->watch_inout) {
         return;
     }
+#ifdef HAVE_SHM_TRANSPORT
+    /* The doorbell also rings when a full ring has space again */
+    if (self->shm) {
+        return;
+    }
+#endif
     g_clear_pointer(&self->io_channel, g_io_channel_unref);
-    g_source_remove(self->watch_server_id);
+    remove_source(self->watch_server_id);
     self->watch_server_id = 0;
+    remove_source(self->watch_out_id);
+    self->watch_out_id = 0;
+    g_clear_pointer(&self->out_channel, g_io_channel_unref);
     self->watch_inout = watch_inout;
 
     create_watch(self);
 }
 
-static int
+void
+record_data(redirect *self, guint32 dir, const uint8_t *data, int count)
+{
+    uint8_t chunk[USBREDIRRECORD_CHUNK_SIZE];
+    guint64 timestamp;
+    guint32 dir_len;
+
+    g_mutex_lock(&self->record_lock);
+    if (!self->record_file) {
+        g_mutex_unlock(&self->record_lock);
+        return;
+    }
+
+    timestamp = GUINT64_TO_LE(g_get_monotonic_time() - self->record_start);
+    dir_len = GUINT32_TO_LE(dir << USBREDIRRECORD_DIR_SHIFT | count);
+    memcpy(chunk, &timestamp, sizeof(timestamp));
+    memcpy(chunk + sizeof(timestamp), &dir_len, sizeof(dir_len));
+    if (fwrite(chunk, 1, sizeof(chunk), self->record_file) != sizeof(chunk) ||
+        fwrite(data, 1, count, self->record_file) != count) {
+        g_warning("Error writing recording %s, stopping recording",
+                  self->record_path);
+        g_clear_pointer(&self->record_file, fclose);
+    }
+    g_mutex_unlock(&self->record_lock);
+}
+
+static bool
+start_record(redirect *self, GError **err)
+{
+    struct usbredirrecord_header header = {
+        .version = GUINT32_TO_LE(USBREDIRRECORD_VERSION),
+        .start_time = GUINT64_TO_LE(g_get_real_time()),
+    };
+
+    memcpy(header.magic, USBREDIRRECORD_MAGIC, USBREDIRRECORD_MAGIC_SIZE);
+    self->record_start = g_get_monotonic_time();
+    self->record_file = g_fopen(self->record_path, "wb");
+    if (!self->record_file) {
+        int errsv = errno;
+        g_set_error(err, G_FILE_ERROR, g_file_error_from_errno(errsv),
+                    "Failed to open %s: %s", self->record_path,
+                    g_strerror(errsv));
+        return false;
+    }
+    if (fwrite(&header, 1, sizeof(header), self->record_file) != sizeof(header)) {
+        g_set_error(err, G_FILE_ERROR, G_FILE_ERROR_IO,
+                    "Failed to write %s", self->record_path);
+        g_clear_pointer(&self->record_file, fclose);
+        return false;
+    }
+    return true;
+}
+
+static void
+stop_record(redirect *self)
+{
+    g_mutex_lock(&self->record_lock);
+    if (self->record_file && fclose(self->record_file) != 0) {
+        g_warning("Error writing recording %s", self->record_path);
+    }
+    self->record_file = NULL;
+    g_mutex_unlock(&self->record_lock);
+}
+
+int
 usbredir_read_cb(void *priv, uint8_t *data, int count)
 {
     redirect *self = (redirect *) priv;
-    GIOStream *iostream = G_IO_STREAM(self->connection);
+#ifdef HAVE_URING_LOOP
+    if (self->uring) {
+        return uring_read(self, data, count);
+    }
+#endif
+#ifdef HAVE_SHM_TRANSPORT
+    if (self->shm) {
+        return shm_read(self, data, count);
+    }
+#endif
+    GIOStream *iostream = self->stream;
     GError *err = NULL;
 
     GPollableInputStream *instream = G_POLLABLE_INPUT_STREAM(g_io_stream_get_input_stream(iostream));
@@ -391,18 +626,35 @@ usbredir_read_cb(void *priv, uint8_t *data, int count)
             if (err != NULL) {
                 g_warning("Failure at %s: %s", __func__, err->message);
             }
-            g_main_loop_quit(self->main_loop);
+            redirect_quit(self);
         }
         g_clear_error(&err);
+    } else if (self->record_path) {
+        record_data(self, usbredirrecord_from_guest, data, nbytes);
     }
     return nbytes;
 }
 
-static int
+int
 usbredir_write_cb(void *priv, uint8_t *data, int count)
 {
     redirect *self = (redirect *) priv;
-    GIOStream *iostream = G_IO_STREAM(self->connection);
+#ifdef HAVE_URING_LOOP
+    if (self->uring) {
+        return uring_write(self, data, count);
+    }
+#endif
+#ifdef HAVE_SHM_TRANSPORT
+    if (self->shm) {
+        return shm_write(self, data, count);
+    }
+#endif
+#ifdef HAVE_ZEROCOPY
+    if (self->zerocopy) {
+        return zerocopy_write(self, data, count);
+    }
+#endif
+    GIOStream *iostream = self->stream;
     GError *err = NULL;
 
     GPollableOutputStream *outstream = G_POLLABLE_OUTPUT_STREAM(g_io_stream_get_output_stream(iostream));
@@ -420,9 +672,14 @@ usbredir_write_cb(void *priv, uint8_t *data, int count)
             if (err != NULL) {
                 g_warning("Failure at %s: %s", __func__, err->message);
             }
-            g_main_loop_quit(self->main_loop);
+            /* The writer thread leaves this to the main loop */
+            if (!self->use_writer_thread) {
+                redirect_quit(self);
+            }
         }
         g_clear_error(&err);
+    } else if (self->record_path) {
+        record_data(self, usbredirrecord_to_guest, data, nbytes);
     }
     return nbytes;
 }
@@ -431,6 +688,12 @@ static void
 usbredir_write_flush_cb(void *user_data)
 {
     redirect *self = (redirect *) user_data;
+#ifdef HAVE_WRITER_THREAD
+    if (self && self->use_writer_thread) {
+        flush_writer_thread(self);
+        return;
+    }
+#endif
     if (!self || !self->usbredirhost) {
         return;
     }
@@ -438,7 +701,7 @@ usbredir_write_flush_cb(void *user_data)
     int ret = usbredirhost_write_guest_data(self->usbredirhost);
     if (ret < 0) {
         g_critical("%s: Failed to write to guest", __func__);
-        g_main_loop_quit(self->main_loop);
+        redirect_quit(self);
     }
 }
 
@@ -483,12 +746,25 @@ connection_handle_io_cb(GIOChannel *source, GIOCondition condition, gpointer use
 {
     redirect *self = (redirect *) user_data;
 
+#ifdef HAVE_ZEROCOPY
+    /* The completions of MSG_ZEROCOPY sends also make the socket poll
+     * G_IO_ERR, a real error does so again on the next iteration */
+    if (self->zerocopy && (condition & G_IO_ERR) &&
+        zerocopy_complete(self) > 0) {
+        condition &= ~G_IO_ERR;
+    }
+#endif
     if (condition & G_IO_ERR || condition & G_IO_HUP) {
         g_warning("Connection: err=%d, hup=%d - exiting", (condition & G_IO_ERR), (condition & G_IO_HUP));
         goto end;
     }
 
     if (condition & G_IO_IN) {
+#ifdef HAVE_SHM_TRANSPORT
+        if (self->shm) {
+            usbredirshm_ack(self->shm);
+        }
+#endif
         int ret = usbredirhost_read_guest_data(self->usbredirhost);
         if (ret < 0) {
             g_critical("%s: Failed to read guest", __func__);
@@ -497,7 +773,14 @@ connection_handle_io_cb(GIOChannel *source, GIOCondition condition, gpointer use
     }
     // try to write data in any case, to avoid having another iteration and
     // creation of another watch if there is space in output buffer
-    if (usbredirhost_has_data_to_write(self->usbredirhost) != 0) {
+#ifdef HAVE_ZEROCOPY
+    if (self->zerocopy && zerocopy_flush(self) < 0) {
+        g_critical("%s: Failed to write to guest", __func__);
+        goto end;
+    }
+#endif
+    if (!self->use_writer_thread &&
+        usbredirhost_has_data_to_write(self->usbredirhost) != 0) {
         int ret = usbredirhost_write_guest_data(self->usbredirhost);
         if (ret < 0) {
             g_critical("%s: Failed to write to guest", __func__);
@@ -507,32 +790,191 @@ connection_handle_io_cb(GIOChannel *source, GIOCondition condition, gpointer use
 
     // update the watch if needed
     update_watch(self);
+#ifdef G_OS_UNIX
+    /* Reading may have submitted transfers with a timeout */
+    if (self->loop) {
+        daemon_update_usb_timeout(self->loop);
+    }
+#endif
     return G_SOURCE_CONTINUE;
 
 end:
-    g_main_loop_quit(self->main_loop);
+    redirect_quit(self);
     return G_SOURCE_REMOVE;
 }
 
-static void
+void
 create_watch(redirect *self)
 {
-    GSocket *socket = g_socket_connection_get_socket(self->connection);
-    int socket_fd = g_socket_get_fd(socket);
+    bool split = self->out_fd != self->in_fd;
 
     g_assert_null(self->io_channel);
     self->io_channel =
 #ifdef G_OS_UNIX
-        g_io_channel_unix_new(socket_fd);
+        g_io_channel_unix_new(self->in_fd);
 #else
-        g_io_channel_win32_new_socket(socket_fd);
+        g_io_channel_win32_new_socket(self->in_fd);
 #endif
 
     g_assert_cmpint(self->watch_server_id, ==, 0);
-    self->watch_server_id = g_io_add_watch(self->io_channel,
-            G_IO_IN | G_IO_HUP | G_IO_ERR | (self->watch_inout ? G_IO_OUT : 0),
-            connection_handle_io_cb,
-            self);
+    self->watch_server_id = add_watch(self, self->io_channel,
+            G_IO_IN | G_IO_HUP | G_IO_ERR |
+            (self->watch_inout && !split ? G_IO_OUT : 0),
+            connection_handle_io_cb);
+
+#ifdef G_OS_UNIX
+    /* With stdio we write to another fd, watch it while there is data to
+     * write */
+    if (split && self->watch_inout) {
+        g_assert_null(self->out_channel);
+        self->out_channel = g_io_channel_unix_new(self->out_fd);
+        self->watch_out_id = add_watch(self, self->out_channel,
+                G_IO_OUT | G_IO_ERR,
+                connection_handle_io_cb);
+    }
+#endif
+#ifdef HAVE_SHM_TRANSPORT
+    /* Nothing gets sent over the socket after the fds, it only tells us when
+     * the other side goes away */
+    if (self->shm) {
+        g_assert_null(self->out_channel);
+        self->out_channel = g_io_channel_unix_new(self->shm_socket_fd);
+        self->watch_out_id = add_watch(self, self->out_channel,
+                G_IO_IN | G_IO_HUP | G_IO_ERR,
+                shm_socket_cb);
+    }
+#endif
+}
+
+static int
+capture_write_cb(void *priv, const uint8_t *data, int count)
+{
+    redirect *self = (redirect *) priv;
+
+    if (fwrite(data, 1, count, self->capture_file) != count) {
+        return -1;
+    }
+    return count;
+}
+
+static gpointer
+thread_capture_writer(gpointer user_data)
+{
+    redirect *self = (redirect *) user_data;
+    int ret;
+
+    for (;;) {
+        /* Check this before draining, so that everything captured before
+         * we were asked to stop gets written */
+        bool run = g_atomic_int_get(&self->capture_thread_run);
+
+        ret = usbredirhost_drain_capture(self->usbredirhost,
+                                         capture_write_cb, self);
+        if (ret < 0) {
+            break;
+        }
+        if (ret == 0) {
+            if (!run) {
+                break;
+            }
+            fflush(self->capture_file);
+            g_usleep(10 * 1000);
+        }
+    }
+    if (ret < 0 || fflush(self->capture_file) != 0) {
+        g_warning("Error writing capture file %s, stopping capture",
+                  self->capture_path);
+        usbredirhost_stop_capture(self->usbredirhost);
+        g_atomic_int_set(&self->capture_thread_failed, TRUE);
+    }
+    return NULL;
+}
+
+static bool
+start_capture(redirect *self, GError **err)
+{
+    /* Each ring slot holds a maximum size record, aim for a ring of about
+     * 32 MiB but keep it between 256 and 8192 records */
+    unsigned int ring_size = 32 * 1024 * 1024 / (self->capture_snaplen + 640);
+    ring_size = CLAMP(ring_size, 256, 8192);
+
+    self->capture_file = g_fopen(self->capture_path, "wb");
+    if (!self->capture_file) {
+        int errsv = errno;
+        g_set_error(err, G_FILE_ERROR, g_file_error_from_errno(errsv),
+                    "Failed to open %s: %s", self->capture_path,
+                    g_strerror(errsv));
+        return false;
+    }
+
+    int ret = usbredirhost_start_capture(self->usbredirhost, ring_size,
+                                         self->capture_snaplen);
+    if (ret != 0) {
+        g_set_error(err, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                    "Failed to start capture: %s", g_strerror(-ret));
+        return false;
+    }
+
+    self->capture_paused = false;
+    g_atomic_int_set(&self->capture_thread_failed, FALSE);
+    g_atomic_int_set(&self->capture_thread_run, TRUE);
+    self->capture_thread = g_thread_try_new("usbredirect-capture-thread",
+            thread_capture_writer,
+            self,
+            err);
+    return self->capture_thread != NULL;
+}
+
+static void
+stop_capture(redirect *self)
+{
+    if (self->capture_thread) {
+        usbredirhost_stop_capture(self->usbredirhost);
+        g_atomic_int_set(&self->capture_thread_run, FALSE);
+        g_thread_join(self->capture_thread);
+        self->capture_thread = NULL;
+
+        uint64_t drops = usbredirhost_get_capture_drops(self->usbredirhost);
+        if (drops) {
+            g_warning("capture: %" PRIu64 " records dropped, writing the "
+                      "capture file could not keep up", drops);
+        }
+    }
+    g_clear_pointer(&self->capture_file, fclose);
+}
+
+void
+print_latency_stats(redirect *self)
+{
+    static const char *type_names[] = { "control", "iso", "bulk", "interrupt" };
+    static const char *stage_names[] = { "submit", "device", "queue", "write" };
+    struct usbredirhost_latency_histogram hist;
+    int type, stage;
+
+    if (!self->latency_stats || !self->usbredirhost) {
+        return;
+    }
+
+    g_printerr("%-10s %-7s %10s %10s %10s %10s %10s %10s %10s\n",
+               "type", "stage", "count", "min(us)", "p50(us)", "p90(us)",
+               "p99(us)", "p99.9(us)", "max(us)");
+    for (type = 0; type < G_N_ELEMENTS(type_names); type++) {
+        for (stage = 0; stage < usbredirhost_latency_stage_count; stage++) {
+            if (usbredirhost_get_latency_histogram(self->usbredirhost,
+                    type, stage, &hist) != 0 || hist.count == 0) {
+                continue;
+            }
+            g_printerr("%-10s %-7s %10" G_GUINT64_FORMAT
+                       " %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+                       type_names[type], stage_names[stage], hist.count,
+                       hist.min_ns / 1000.0,
+                       usbredirhost_latency_percentile(&hist, 50.0) / 1000.0,
+                       usbredirhost_latency_percentile(&hist, 90.0) / 1000.0,
+                       usbredirhost_latency_percentile(&hist, 99.0) / 1000.0,
+                       usbredirhost_latency_percentile(&hist, 99.9) / 1000.0,
+                       hist.max_ns / 1000.0);
+        }
+    }
 }
 
 #ifdef G_OS_UNIX
@@ -540,9 +982,41 @@ static gboolean
 signal_handler(gpointer user_data)
 {
     redirect *self = (redirect *) user_data;
-    g_main_loop_quit(self->main_loop);
+    redirect_quit(self);
     return G_SOURCE_REMOVE;
 }
+
+static gboolean
+latency_stats_signal_handler(gpointer user_data)
+{
+    redirect *self = (redirect *) user_data;
+    print_latency_stats(self);
+    return G_SOURCE_CONTINUE;
+}
+
+gboolean
+capture_signal_handler(gpointer user_data)
+{
+    redirect *self = (redirect *) user_data;
+
+    if (!self->capture_thread) {
+        return G_SOURCE_CONTINUE;
+    }
+    /* Nothing would drain the capture ring anymore */
+    if (g_atomic_int_get(&self->capture_thread_failed)) {
+        g_warning("capture stopped after a write error, not resuming it");
+        return G_SOURCE_CONTINUE;
+    }
+
+    self->capture_paused = !self->capture_paused;
+    if (self->capture_paused) {
+        usbredirhost_stop_capture(self->usbredirhost);
+    } else {
+        usbredirhost_start_capture(self->usbredirhost, 0, 0);
+    }
+    g_message("capture %s", self->capture_paused ? "paused" : "resumed");
+    return G_SOURCE_CONTINUE;
+}
 #endif
 
 static bool
@@ -601,14 +1075,14 @@ fail:
     return false;
 }
 
-static libusb_device_handle *
-open_usb_device(redirect *self)
+libusb_device_handle *
+open_usb_device(redirect *self, libusb_context *ctx)
 {
     struct libusb_device **devs;
     struct libusb_device_handle *dev_handle = NULL;
     size_t i, ndevices;
 
-    ndevices = libusb_get_device_list(NULL, &devs);
+    ndevices = libusb_get_device_list(ctx, &devs);
     for (i = 0; i < ndevices; i++) {
         struct libusb_device_descriptor desc;
         if (libusb_get_device_descriptor(devs[i], &desc) != 0) {
@@ -645,11 +1119,40 @@ connection_incoming_cb(GSocketService    *service,
                        gpointer           user_data)
 {
     redirect *self = (redirect *) user_data;
-    self->connection = g_object_ref(client_connection);
+    set_connection(self, g_object_ref(client_connection));
+#ifdef HAVE_SHM_TRANSPORT
+    if (self->transport == TRANSPORT_SHM) {
+        GError *err = NULL;
+
+        if (!shm_setup(self, &err)) {
+            g_warning("%s", err->message);
+            g_error_free(err);
+            redirect_quit(self);
+            return G_SOURCE_REMOVE;
+        }
+    }
+#endif
+
+    if (self->use_epoll) {
+        /* Continue in run_epoll_loop() */
+        g_main_loop_quit(self->main_loop);
+        return G_SOURCE_REMOVE;
+    }
+
+#ifdef HAVE_WRITER_THREAD
+    if (self->use_writer_thread) {
+        GError *err = NULL;
+
+        if (!start_writer_thread(self, &err)) {
+            g_warning("Error starting writer thread: %s", err->message);
+            g_error_free(err);
+            redirect_quit(self);
+            return G_SOURCE_REMOVE;
+        }
+    }
+#endif
 
     /* Add a GSource watch to handle polling for us and handle IO in the callback */
-    GSocket *connection_socket = g_socket_connection_get_socket(self->connection);
-    g_socket_set_keepalive(connection_socket, self->keepalive);
     create_watch(self);
     return G_SOURCE_REMOVE;
 }
@@ -661,14 +1164,6 @@ main(int argc, char *argv[])
     
 
 
-#ifdef THIS_IS_A_COMMENT
-    if (libusb_init(NULL)) {
-        g_warning("Could not init libusb\n");
-        goto err_init;
-    }
-#endif
-
-
 
 
 #ifdef FOR_TERMUX
@@ -691,6 +1186,22 @@ printf("\n\nIN-MAIN-BEFORE-parse_opts argv[5] = %s\n\n", argv[5]) ;
         return 1;
     }
 
+#ifdef HAVE_EPOLL_LOOP
+    self->signal_fd = -1;
+    if (self->use_epoll && !epoll_setup(self, &err)) {
+        g_warning("%s", err->message);
+        goto end;
+    }
+#endif
+
+    /* Only after epoll_setup(), libusb may start threads of its own */
+#ifdef THIS_IS_A_COMMENT
+    if (libusb_init(NULL)) {
+        g_warning("Could not init libusb\n");
+        goto err_init;
+    }
+#endif
+
 
 
 
@@ -708,9 +1219,25 @@ printf("\n\nIN-MAIN-BEFORE-parse_opts argv[5] = %s\n\n", argv[5]) ;
 #endif
 
 #ifdef G_OS_UNIX
-    g_unix_signal_add(SIGINT, signal_handler, self);
-    g_unix_signal_add(SIGHUP, signal_handler, self);
-    g_unix_signal_add(SIGTERM, signal_handler, self);
+    if (self->daemon_path) {
+        int ret = run_daemon(self);
+
+        g_free(self->daemon_path);
+        g_mutex_clear(&self->record_lock);
+        g_free(self);
+        return ret;
+    }
+#endif
+
+#ifdef G_OS_UNIX
+    /* In epoll mode the signals are read from a signalfd */
+    if (!self->use_epoll) {
+        g_unix_signal_add(SIGINT, signal_handler, self);
+        g_unix_signal_add(SIGHUP, signal_handler, self);
+        g_unix_signal_add(SIGTERM, signal_handler, self);
+        g_unix_signal_add(SIGUSR1, latency_stats_signal_handler, self);
+        g_unix_signal_add(SIGUSR2, capture_signal_handler, self);
+    }
 #endif
 
 
@@ -718,7 +1245,7 @@ printf("\n\nIN-MAIN-BEFORE-parse_opts argv[5] = %s\n\n", argv[5]) ;
 
 
 #ifdef THIS_IS_A_COMMENT
-    libusb_device_handle *device_handle = open_usb_device(self);
+    libusb_device_handle *device_handle = open_usb_device(self, NULL);
     if (!device_handle) {
         g_printerr("Failed to open device!\n");
         goto err_init;
@@ -771,36 +1298,76 @@ printf("\n\nIN-MAIN-BEFORE sscanf argv[5] = %s\n\n", argv[5]) ;
      *      http://libusb.sourceforge.net/api-1.0/group__libusb__asyncio.html#eventthread
      *
      * The event thread is a must for Windows while on Unix we would ge okay
-     * getting the fds and polling oursevelves. */
-    g_atomic_int_set(&self->event_thread_run, TRUE);
-    self->event_thread = g_thread_try_new("usbredirect-libusb-event-thread",
-            thread_handle_libusb_events,
-            self,
-            &err);
-    if (!self->event_thread) {
-        g_warning("Error starting event thread: %s", err->message);
-        libusb_close(device_handle);
-        goto err_init;
+     * getting the fds and polling oursevelves, which is what --epoll does.
+     *
+     * The reader thread is this one, so the other threads inherit its
+     * settings unless they have their own. */
+    apply_thread_sched(self, THREAD_READER);
+    if (!self->use_epoll) {
+        g_atomic_int_set(&self->event_thread_run, TRUE);
+        self->event_thread = g_thread_try_new("usbredirect-libusb-event-thread",
+                thread_handle_libusb_events,
+                self,
+                &err);
+        if (!self->event_thread) {
+            g_warning("Error starting event thread: %s", err->message);
+            libusb_close(device_handle);
+            goto err_init;
+        }
+    }
+
+#ifdef HAVE_WRITER_THREAD
+    if (self->use_writer_thread) {
+        if (!create_writer_thread(self, &err)) {
+            g_warning("Error creating the writer thread: %s", err->message);
+            goto end;
+        }
     }
+#endif
 
+    /* With everything on one thread usbredirhost needs no locking, and data
+     * gets written at the end of each epoll loop iteration */
     self->usbredirhost = usbredirhost_open_full(NULL,
             device_handle,
             usbredir_log_cb,
             usbredir_read_cb,
             usbredir_write_cb,
-            usbredir_write_flush_cb,
-            usbredir_alloc_lock,
-            usbredir_lock_lock,
-            usbredir_unlock_lock,
-            usbredir_free_lock,
+            self->use_epoll ? NULL : usbredir_write_flush_cb,
+            self->use_epoll ? NULL : usbredir_alloc_lock,
+            self->use_epoll ? NULL : usbredir_lock_lock,
+            self->use_epoll ? NULL : usbredir_unlock_lock,
+            self->use_epoll ? NULL : usbredir_free_lock,
             self,
             PACKAGE_STRING,
             self->verbosity,
-            0);
+            (self->mlock ? usbredirhost_fl_lock_stream_buffers : 0) |
+            (self->zerocopy ? usbredirhost_fl_write_cb_owns_buffer : 0));
     if (!self->usbredirhost) {
         g_warning("Error starting usbredirhost");
         goto err_init;
     }
+#ifdef HAVE_ZEROCOPY
+    if (self->zerocopy) {
+        usbredirhost_set_buffered_output_size_cb(self->usbredirhost,
+                zerocopy_buffered_output_size_cb);
+    }
+#endif
+
+    if (self->latency_stats &&
+        usbredirhost_enable_latency_stats(self->usbredirhost) != 0) {
+        g_warning("Error enabling latency stats");
+        goto end;
+    }
+
+    if (self->capture_path && !start_capture(self, &err)) {
+        g_warning("%s", err->message);
+        goto end;
+    }
+
+    if (self->record_path && !start_record(self, &err)) {
+        g_warning("%s", err->message);
+        goto end;
+    }
 
     /* Only allow libusb logging if log verbosity is uredirparser_debug_data
      * (or higher), otherwise we disable it here while keeping usbredir's logs enable. */
@@ -816,45 +1383,35 @@ printf("\n\nIN-MAIN-BEFORE sscanf argv[5] = %s\n\n", argv[5]) ;
 #endif
     }
 
-    if (self->is_client) {
+    if (self->is_client || self->transport == TRANSPORT_FD ||
+        self->transport == TRANSPORT_STDIO) {
         /* Connect to a remote sever using usbredir to redirect the usb device */
-        GSocketClient *client = g_socket_client_new();
-        self->connection = g_socket_client_connect_to_host(client,
-                self->addr,
-                self->port, /* your port goes here */
-                NULL,
-                &err);
-        g_object_unref(client);
-        if (err != NULL) {
+        if (!connect_transport(self, &err)) {
             g_warning("Failed to connect to the server: %s", err->message);
             goto end;
         }
+#ifdef HAVE_SHM_TRANSPORT
+        if (self->transport == TRANSPORT_SHM && !shm_setup(self, &err)) {
+            g_warning("%s", err->message);
+            goto end;
+        }
+#endif
 
-        GSocket *connection_socket = g_socket_connection_get_socket(self->connection);
-        g_socket_set_keepalive(connection_socket, self->keepalive);
-        create_watch(self);
+#ifdef HAVE_WRITER_THREAD
+        if (self->use_writer_thread && !start_writer_thread(self, &err)) {
+            g_warning("Error starting writer thread: %s", err->message);
+            goto end;
+        }
+#endif
+        if (!self->use_epoll) {
+            create_watch(self);
+        }
     } else {
         GSocketService *socket_service;
 
         socket_service = g_socket_service_new ();
-        GInetAddress *iaddr = g_inet_address_new_from_string(self->addr);
-        if (iaddr == NULL) {
-            g_warning("Failed to parse IP: %s", self->addr);
-            goto end;
-        }
-
-        GSocketAddress *saddr = g_inet_socket_address_new(iaddr, self->port);
-        g_object_unref(iaddr);
-
-        g_socket_listener_add_address(G_SOCKET_LISTENER (socket_service),
-                saddr,
-                G_SOCKET_TYPE_STREAM,
-                G_SOCKET_PROTOCOL_TCP,
-                NULL,
-                NULL,
-                &err);
-        if (err != NULL) {
-            g_warning("Failed to run as TCP server: %s", err->message);
+        if (!listen_transport(self, G_SOCKET_LISTENER (socket_service), &err)) {
+            g_warning("Failed to run as server: %s", err->message);
             goto end;
         }
 
@@ -864,7 +1421,38 @@ printf("\n\nIN-MAIN-BEFORE sscanf argv[5] = %s\n\n", argv[5]) ;
     }
 
     self->main_loop = g_main_loop_new(NULL, FALSE);
-    g_main_loop_run(self->main_loop);
+#ifdef HAVE_EPOLL_LOOP
+    if (self->use_epoll) {
+        /* The GLib main loop only runs to accept the incoming connection */
+        if (!self->stream) {
+            guint signal_watch = g_unix_fd_add(self->signal_fd, G_IO_IN,
+                                               epoll_signal_fd_cb, self);
+            g_main_loop_run(self->main_loop);
+            g_source_remove(signal_watch);
+        }
+        if (self->stream && !self->quit) {
+#ifdef HAVE_URING_LOOP
+            if (self->use_io_uring &&
+                (!self->connection || self->transport == TRANSPORT_SHM)) {
+                g_warning("io_uring needs a socket, using epoll instead");
+            } else if (self->use_io_uring && !uring_setup(self, &err)) {
+                g_warning("%s, using epoll instead", err->message);
+                g_clear_error(&err);
+            }
+            if (self->uring) {
+                run_uring_loop(self);
+                uring_cleanup(self);
+            } else
+#endif
+            {
+                run_epoll_loop(self);
+            }
+        }
+    } else
+#endif
+    {
+        g_main_loop_run(self->main_loop);
+    }
     g_clear_pointer(&self->main_loop, g_main_loop_unref);
 
     g_atomic_int_set(&self->event_thread_run, FALSE);
@@ -875,9 +1463,33 @@ printf("\n\nIN-MAIN-BEFORE sscanf argv[5] = %s\n\n", argv[5]) ;
     }
 
 end:
+#ifdef HAVE_WRITER_THREAD
+    destroy_writer_thread(self);
+#endif
+    print_latency_stats(self);
+    stop_capture(self);
+#ifdef HAVE_ZEROCOPY
+    /* It hands the buffers back to usbredirhost */
+    zerocopy_cleanup(self);
+    g_mutex_clear(&self->zerocopy_lock);
+#endif
     g_clear_pointer(&self->usbredirhost, usbredirhost_close);
+    stop_record(self);
+    g_clear_pointer(&self->record_path, g_free);
+    g_mutex_clear(&self->record_lock);
+    if (self->unlink_path) {
+        g_unlink(self->addr);
+    }
     g_clear_pointer(&self->addr, g_free);
+    g_clear_pointer(&self->capture_path, g_free);
+#ifdef HAVE_SHM_TRANSPORT
+    g_clear_pointer(&self->shm, usbredirshm_destroy);
+#endif
+    g_clear_object(&self->stream);
     g_clear_object(&self->connection);
+#ifdef HAVE_EPOLL_LOOP
+    epoll_cleanup(self);
+#endif
     g_free(self);
 err_init:
     libusb_exit(NULL);
@@ -0,0 +1,206 @@
+/* usbredirect.h the parts of usbredirect which its modes share
+
+   Copyright 2026 Red Hat, Inc.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define G_LOG_DOMAIN "usbredirect"
+#define G_LOG_USE_STRUCTURED
+
+#include <glib.h>
+#include <gio/gio.h>
+#include <libusb.h>
+#include <usbredirhost.h>
+
+#include "usbredirrecord.h"
+
+#ifdef HAVE_LINUX_VM_SOCKETS_H
+#define HAVE_VSOCK 1
+#endif
+
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_SYS_SIGNALFD_H)
+#define HAVE_EPOLL_LOOP 1
+#endif
+
+#if defined(G_OS_UNIX) && defined(HAVE_SYS_EVENTFD_H)
+#define HAVE_WRITER_THREAD 1
+#endif
+
+#if defined(HAVE_EPOLL_LOOP) && defined(HAVE_LIBURING)
+#define HAVE_URING_LOOP 1
+#endif
+
+#ifdef G_OS_UNIX
+typedef struct daemon_loop daemon_loop;
+#endif
+
+/* The threads --pin and --rt-priority apply to */
+enum {
+    THREAD_EVENT,
+    THREAD_READER,
+    THREAD_WRITER,
+    THREAD_COUNT,
+};
+
+typedef enum {
+    TRANSPORT_TCP,
+    TRANSPORT_UNIX,
+    TRANSPORT_VSOCK,
+    TRANSPORT_FD,
+    TRANSPORT_SOCKET_ACTIVATION,
+    TRANSPORT_STDIO,
+    TRANSPORT_SHM,
+} transport_type;
+
+typedef struct redirect {
+    struct {
+        /* vendor:product */
+        int vendor;
+        int product;
+        /* bus-device */
+        int bus;
+        int device_number;
+    } device;
+    bool by_bus;
+    bool is_client;
+    bool keepalive;
+    bool watch_inout;
+    bool latency_stats;
+    char *capture_path;
+    int capture_snaplen;
+    char *record_path;
+    bool use_epoll;
+    bool use_io_uring;
+    bool use_writer_thread;
+    bool mlock;
+    /* -1 for not pinned, resp. 0 for the normal scheduling policy */
+    int thread_cpu[THREAD_COUNT];
+    int thread_priority[THREAD_COUNT];
+    int rt_policy;
+    /* Send writes of at least this size with MSG_ZEROCOPY, 0 for off */
+    int zerocopy;
+    transport_type transport;
+    /* host for TCP, the path or abstract name for Unix sockets and shm */
+    char *addr;
+    /* TCP or vsock port */
+    int port;
+    bool abstract;
+    bool unlink_path;
+    guint32 cid;
+    int fd;
+    int verbosity;
+
+    struct usbredirhost *usbredirhost;
+    /* NULL for stdio */
+    GSocketConnection *connection;
+    GIOStream *stream;
+    int in_fd;
+    int out_fd;
+    GThread *event_thread;
+    int event_thread_run;
+#ifdef HAVE_WRITER_THREAD
+    struct usbredirwriter *writer;
+    /* The idle source through which the writer thread ends the session */
+    guint writer_failed_id;
+#endif
+    FILE *capture_file;
+    GThread *capture_thread;
+    int capture_thread_run;
+    int capture_thread_failed; /* The writer gave up after an error */
+    bool capture_paused;
+    GMutex record_lock;
+    FILE *record_file;
+    gint64 record_start;
+    int watch_server_id;
+    GIOChannel *io_channel;
+    /* Only used when writing to another fd than reading from, and for the
+     * socket of shm */
+    int watch_out_id;
+    GIOChannel *out_channel;
+#ifdef HAVE_SHM_TRANSPORT
+    /* in_fd and out_fd are its doorbell */
+    struct usbredirshm *shm;
+    int shm_socket_fd;
+#endif
+#ifdef HAVE_EPOLL_LOOP
+    int signal_fd;
+#endif
+#ifdef HAVE_URING_LOOP
+    struct usbrediruring *uring;
+#endif
+#ifdef HAVE_ZEROCOPY
+    /* With --zerocopy usbredirhost hands its write buffers over to this,
+     * zerocopy_lock serializes the event thread and the main loop */
+    struct usbredirzerocopy *zc;
+    GMutex zerocopy_lock;
+#endif
+
+    GMainLoop *main_loop;
+    bool quit;
+
+#ifdef G_OS_UNIX
+    /* --daemon, the options of the command line only hold the path and
+     * the number of workers */
+    char *daemon_path;
+    int workers;
+    /* Set for the devices of the daemon */
+    daemon_loop *loop;
+    char *name;
+    /* An fd from termux-usb to wrap instead of looking for the device */
+    int usb_fd;
+    GSocketService *socket_service;
+    guint end_id;
+    guint retry_id;
+#endif
+} redirect;
+
+/* Ends the session, resp. in daemon mode only the session of this device */
+void redirect_quit(redirect *self);
+
+/* Parses --device, vendor:product or bus-device */
+bool parse_opt_device(redirect *self, const char *device);
+
+/* Opens the device of --device, through ctx, NULL for the default context */
+libusb_device_handle *open_usb_device(redirect *self, libusb_context *ctx);
+
+/* The usbredirhost log, read and write callbacks, priv is the redirect */
+void usbredir_log_cb(void *priv, int level, const char *msg);
+int usbredir_read_cb(void *priv, uint8_t *data, int count);
+int usbredir_write_cb(void *priv, uint8_t *data, int count);
+
+/* Like g_source_remove(), for the thread default main context */
+void remove_source(guint id);
+
+/* Watches the connection on the thread default main context */
+void create_watch(redirect *self);
+
+/* Watches the connection for output too while there is data to write */
+void update_watch(redirect *self);
+
+/* Appends what went over the connection in direction dir to --record */
+void record_data(redirect *self, guint32 dir, const uint8_t *data, int count);
+
+/* The --latency-stats report, for SIGUSR1 and when the session ends */
+void print_latency_stats(redirect *self);
+
+#ifdef G_OS_UNIX
+/* SIGUSR2: pauses resp. resumes --capture */
+gboolean capture_signal_handler(gpointer user_data);
+#endif
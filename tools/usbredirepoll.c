@@ -0,0 +1,275 @@
+/* usbredirepoll.c usbredirhost single threaded epoll loop
+
+   Copyright 2026 Red Hat, Inc.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include "usbredirepoll.h"
+
+#define MAX_EVENTS 16
+
+struct usbredirepoll_fd {
+    int fd;
+    usbredirepoll_fd_func func;
+    void *priv;
+};
+
+struct usbredirepoll {
+    libusb_context *ctx;
+    struct usbredirhost *host;
+    int epoll_fd;
+    int in_fd;
+    int out_fd;
+    bool watch_out;
+    /* A libusb fd which could not be added, reported by the next iteration */
+    int error;
+    struct usbredirepoll_fd *fds;
+    int fd_count;
+};
+
+static uint32_t connection_events(struct usbredirepoll *loop, int fd)
+{
+    return (fd == loop->in_fd ? EPOLLIN : 0) |
+           (fd == loop->out_fd && loop->watch_out ? EPOLLOUT : 0);
+}
+
+static int watch_connection(struct usbredirepoll *loop, int op)
+{
+    struct epoll_event ev = { 0, };
+
+    ev.events = connection_events(loop, loop->in_fd);
+    ev.data.fd = loop->in_fd;
+    if (loop->in_fd >= 0 &&
+            epoll_ctl(loop->epoll_fd, op, loop->in_fd, &ev) != 0) {
+        return -errno;
+    }
+    /* With stdio the output fd only gets watched for EPOLLOUT */
+    if (loop->out_fd != loop->in_fd) {
+        ev.events = connection_events(loop, loop->out_fd);
+        ev.data.fd = loop->out_fd;
+        if (loop->out_fd >= 0 &&
+                epoll_ctl(loop->epoll_fd, op, loop->out_fd, &ev) != 0) {
+            return -errno;
+        }
+    }
+    return 0;
+}
+
+static void LIBUSB_CALL pollfd_added_cb(int fd, short events, void *user_data)
+{
+    struct usbredirepoll *loop = user_data;
+    struct epoll_event ev = {
+        .events = ((events & POLLIN) ? EPOLLIN : 0) |
+                  ((events & POLLOUT) ? EPOLLOUT : 0),
+        .data.fd = fd,
+    };
+
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0 &&
+            !loop->error) {
+        loop->error = -errno;
+    }
+}
+
+static void LIBUSB_CALL pollfd_removed_cb(int fd, void *user_data)
+{
+    struct usbredirepoll *loop = user_data;
+
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+int usbredirepoll_create(libusb_context *ctx, struct usbredirhost *host,
+    int in_fd, int out_fd, struct usbredirepoll **loop_ret)
+{
+    const struct libusb_pollfd **pollfds;
+    struct usbredirepoll *loop;
+    int i, r;
+
+    loop = calloc(1, sizeof(*loop));
+    if (!loop) {
+        return -ENOMEM;
+    }
+    loop->ctx = ctx;
+    loop->host = host;
+    loop->in_fd = in_fd;
+    loop->out_fd = out_fd;
+    loop->watch_out = out_fd >= 0 && usbredirhost_has_data_to_write(host);
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd < 0) {
+        free(loop);
+        return -errno;
+    }
+    r = watch_connection(loop, EPOLL_CTL_ADD);
+    if (r < 0) {
+        goto error;
+    }
+
+    pollfds = libusb_get_pollfds(ctx);
+    if (!pollfds) {
+        r = -ENOMEM;
+        goto error;
+    }
+    for (i = 0; pollfds[i]; i++) {
+        pollfd_added_cb(pollfds[i]->fd, pollfds[i]->events, loop);
+    }
+    libusb_free_pollfds(pollfds);
+    if (loop->error) {
+        r = loop->error;
+        goto error;
+    }
+    libusb_set_pollfd_notifiers(ctx, pollfd_added_cb, pollfd_removed_cb,
+                                loop);
+    *loop_ret = loop;
+    return 0;
+
+error:
+    close(loop->epoll_fd);
+    free(loop);
+    return r;
+}
+
+void usbredirepoll_destroy(struct usbredirepoll *loop)
+{
+    if (!loop) {
+        return;
+    }
+    libusb_set_pollfd_notifiers(loop->ctx, NULL, NULL, NULL);
+    close(loop->epoll_fd);
+    free(loop->fds);
+    free(loop);
+}
+
+int usbredirepoll_add_fd(struct usbredirepoll *loop, int fd, uint32_t events,
+    usbredirepoll_fd_func func, void *priv)
+{
+    struct epoll_event ev = { .events = events, .data.fd = fd };
+    struct usbredirepoll_fd *fds;
+
+    fds = realloc(loop->fds, (loop->fd_count + 1) * sizeof(*fds));
+    if (!fds) {
+        return -ENOMEM;
+    }
+    loop->fds = fds;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        return -errno;
+    }
+    fds[loop->fd_count].fd = fd;
+    fds[loop->fd_count].func = func;
+    fds[loop->fd_count].priv = priv;
+    loop->fd_count++;
+    return 0;
+}
+
+int usbredirepoll_get_usb_timeout(libusb_context *ctx)
+{
+    struct timeval tv;
+
+    if (libusb_pollfds_handle_timeouts(ctx)) {
+        return -1;
+    }
+    if (libusb_get_next_timeout(ctx, &tv) != 1) {
+        return -1;
+    }
+    /* Round up, so that we do not wake up before the timeout expired */
+    return tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+}
+
+static struct usbredirepoll_fd *find_fd(struct usbredirepoll *loop, int fd)
+{
+    int i;
+
+    for (i = 0; i < loop->fd_count; i++) {
+        if (loop->fds[i].fd == fd) {
+            return &loop->fds[i];
+        }
+    }
+    return NULL;
+}
+
+int usbredirepoll_iterate(struct usbredirepoll *loop, int timeout)
+{
+    struct epoll_event events[MAX_EVENTS];
+    bool usb_ready = false, watch_out;
+    int i, n, r, usb_timeout;
+
+    if (loop->error) {
+        return loop->error;
+    }
+    usb_timeout = usbredirepoll_get_usb_timeout(loop->ctx);
+    if (usb_timeout >= 0 && (timeout < 0 || usb_timeout < timeout)) {
+        timeout = usb_timeout;
+    }
+    n = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, timeout);
+    if (n < 0) {
+        return errno == EINTR ? 0 : -errno;
+    }
+    /* Nothing ready can mean that a libusb timeout expired */
+    if (n == 0) {
+        usb_ready = true;
+    }
+
+    for (i = 0; i < n; i++) {
+        int fd = events[i].data.fd;
+        struct usbredirepoll_fd *watch = find_fd(loop, fd);
+
+        if (watch) {
+            r = watch->func(watch->priv, fd, events[i].events);
+            if (r) {
+                return r;
+            }
+        } else if (fd == loop->in_fd || fd == loop->out_fd) {
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                return -ECONNRESET;
+            }
+            if ((events[i].events & EPOLLIN) &&
+                    usbredirhost_read_guest_data(loop->host) < 0) {
+                return -EPROTO;
+            }
+        } else {
+            usb_ready = true;
+        }
+    }
+
+    if (usb_ready) {
+        struct timeval tv = { 0, 0 };
+
+        r = libusb_handle_events_timeout_completed(loop->ctx, &tv, NULL);
+        if (r && r != LIBUSB_ERROR_INTERRUPTED) {
+            return -EIO;
+        }
+    }
+
+    /* Write everything the read and the completions above queued */
+    if (usbredirhost_has_data_to_write(loop->host) != 0 &&
+            usbredirhost_write_guest_data(loop->host) < 0) {
+        return -EPROTO;
+    }
+
+    watch_out = usbredirhost_has_data_to_write(loop->host) != 0;
+    if (loop->out_fd >= 0 && watch_out != loop->watch_out) {
+        loop->watch_out = watch_out;
+        r = watch_connection(loop, EPOLL_CTL_MOD);
+        if (r < 0) {
+            return r;
+        }
+    }
+    return loop->error;
+}
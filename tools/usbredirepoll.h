@@ -0,0 +1,70 @@
+/* usbredirepoll.h usbredirhost single threaded epoll loop
+
+   Copyright 2026 Red Hat, Inc.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <stdint.h>
+#include <libusb.h>
+#include "usbredirhost.h"
+
+/* The loop of usbredirect --epoll: the connection, the fds of a libusb
+   context and any fds the caller adds go into one epoll set, and reading
+   from the connection, handling the USB events and writing what got queued
+   all happen in usbredirepoll_iterate(), on the calling thread. This avoids
+   the libusb event thread, and with it the locking in usbredirhost and the
+   cross thread wake ups for every completed transfer.
+
+   So usbredirhost gets opened without locks and without a write flush
+   callback: everything it queued gets written at the end of each iteration,
+   and while the connection does not take all of it the loop also waits for
+   out_fd to become writable. usbredirhost reads and writes through its own
+   callbacks, the loop calls usbredirhost_read_guest_data() once in_fd is
+   readable. With an in_fd and out_fd of -1 the caller watches the
+   connection itself, through usbredirepoll_add_fd().
+
+   The loop sets the pollfd notifiers of the libusb context, so there can
+   only be one loop per context. None of these functions lock, they must
+   all be called from the same thread. */
+
+struct usbredirepoll;
+
+/* Called from usbredirepoll_iterate() with the epoll events of an fd added
+   with usbredirepoll_add_fd(). Returns 0 to go on, anything else ends the
+   iteration and gets returned by usbredirepoll_iterate(). */
+typedef int (*usbredirepoll_fd_func)(void *priv, int fd, uint32_t events);
+
+/* Returns 0 on success or -errno */
+int usbredirepoll_create(libusb_context *ctx, struct usbredirhost *host,
+    int in_fd, int out_fd, struct usbredirepoll **loop);
+
+/* Does not close the connection */
+void usbredirepoll_destroy(struct usbredirepoll *loop);
+
+/* Watches fd for events, e.g. EPOLLIN. Returns 0 on success or -errno. */
+int usbredirepoll_add_fd(struct usbredirepoll *loop, int fd, uint32_t events,
+    usbredirepoll_fd_func func, void *priv);
+
+/* Waits at most timeout ms, -1 for no limit, for the connection or the USB
+   device, handles what is ready and writes what got queued. Returns 0, what
+   an fd callback returned, or -ECONNRESET when the connection got closed or
+   failed, -EPROTO when usbredirhost failed to read or write, -EIO when
+   handling the USB events failed and -errno when epoll failed. */
+int usbredirepoll_iterate(struct usbredirepoll *loop, int timeout);
+
+/* Returns the poll timeout in ms for the next timeout of the libusb context,
+   -1 when there is none or libusb handles its timeouts through its fds */
+int usbredirepoll_get_usb_timeout(libusb_context *ctx);
@@ -0,0 +1,60 @@
+/* usbredirrecord.h usbredir session recording file format
+
+   Copyright 2026 Red Hat, Inc.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <stdint.h>
+
+/* A recording made by usbredirect --record consists of a file header,
+   followed by a chunk for each successful read from, or write to, the
+   usbredir-guest connection. Each chunk is a chunk header followed by
+   the raw usbredir protocol bytes which were read / written, so replaying
+   all chunks of one direction in order gives the exact byte stream one
+   side of the connection parsed.
+
+   All fields are little endian. */
+
+/* The magic is 8 bytes without a terminating 0, compare it with
+   memcmp(magic, USBREDIRRECORD_MAGIC, USBREDIRRECORD_MAGIC_SIZE) and
+   never use it as a string */
+#define USBREDIRRECORD_MAGIC      "URRECORD"
+#define USBREDIRRECORD_MAGIC_SIZE 8
+#define USBREDIRRECORD_VERSION    1
+
+struct usbredirrecord_header {
+    uint8_t magic[USBREDIRRECORD_MAGIC_SIZE];
+    uint32_t version;
+    uint32_t flags;      /* Reserved, 0 */
+    uint64_t start_time; /* Start of the recording in us since the epoch */
+};
+
+enum {
+    usbredirrecord_from_guest = 0, /* Read from the usbredir-guest */
+    usbredirrecord_to_guest   = 1, /* Written to the usbredir-guest */
+};
+
+#define USBREDIRRECORD_DIR_SHIFT  31
+#define USBREDIRRECORD_LEN_MASK   0x7fffffff
+
+/* Note this is 12 bytes on disk, use USBREDIRRECORD_CHUNK_SIZE rather then
+   sizeof */
+struct usbredirrecord_chunk {
+    uint64_t timestamp;  /* us since start_time */
+    uint32_t dir_len;    /* direction << 31 | length of the data */
+};
+
+#define USBREDIRRECORD_CHUNK_SIZE 12
@@ -0,0 +1,1002 @@
+/* usbredirreplay.c replay usbredirect session recordings for benchmarking
+
+   Copyright 2026 Red Hat, Inc.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+#include "usbredirparser.h"
+#include "usbredirfilter.h"
+#include "usbredirhost.h"
+#include "usbredirrecord.h"
+#include "fakeusb.h"
+
+#define REPLAY_VERSION "usbredirreplay " PACKAGE_VERSION
+
+/* The hello is always sent before the peer's caps are known, so it always
+   uses a header with a 32 bits id: type, length and id */
+#define HELLO_HEADER_LEN 12
+
+/* How long to wait for the replies to the last replayed packets of a host
+   replay, iso streams which are never stopped reply for ever */
+#define HOST_DRAIN_TIMEOUT_NS 1000000000ull
+#define HOST_IDLE_TIMEOUT_US  10000
+
+struct replay_chunk {
+    uint64_t timestamp;
+    int dir;
+    uint32_t len;
+    const uint8_t *data;
+};
+
+struct replay {
+    /* The recording */
+    uint8_t *file_data;
+    struct replay_chunk *chunks;
+    int chunk_count;
+
+    /* Settings */
+    int realtime;
+    int repeat;
+    int json;
+    int verbose;
+    int host;       /* Replay the host side into usbredirhost */
+
+    /* The device as the usbredir-guest saw it, from the recorded
+       device_connect, interface_info and all ep_info packets */
+    int have_device_connect;
+    struct usb_redir_device_connect_header device_connect;
+    int have_interface_info;
+    struct usb_redir_interface_info_header interface_info;
+    struct usb_redir_ep_info_header ep_info;
+
+    /* State of the current run */
+    struct usbredirparser *parser;
+    const uint8_t *read_data;
+    uint32_t read_left;
+    libusb_context *ctx;
+    libusb_device *dev;
+    struct usbredirhost *usbhost;
+    uint64_t written_bytes;
+
+    /* Results of the current side */
+    uint64_t bytes;
+    uint64_t packets;
+    uint64_t data_packets;
+    uint64_t data_bytes;
+    uint64_t parse_errors;
+    uint64_t max_lag_us;
+    uint64_t elapsed_ns;
+};
+
+static const char *side_names[] = { "host", "guest" };
+
+static uint64_t get_time_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+           (uint32_t)p[3] << 24;
+}
+
+static uint64_t get_le64(const uint8_t *p)
+{
+    return (uint64_t)get_le32(p) | (uint64_t)get_le32(p + 4) << 32;
+}
+
+static int load_recording(struct replay *replay, const char *filename)
+{
+    uint8_t *data = NULL;
+    size_t size = 0, alloc = 0, n, pos;
+    int count = 0, ret = -1;
+    FILE *f;
+
+    f = fopen(filename, "rb");
+    if (!f) {
+        fprintf(stderr, "Error opening %s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+
+    /* Read it all into memory, so that file I/O does not influence the
+       measurements */
+    do {
+        if (size == alloc) {
+            uint8_t *new_data;
+
+            alloc = alloc ? alloc * 2 : 1024 * 1024;
+            new_data = realloc(data, alloc);
+            if (!new_data) {
+                fprintf(stderr, "Out of memory reading %s\n", filename);
+                goto leave;
+            }
+            data = new_data;
+        }
+        n = fread(data + size, 1, alloc - size, f);
+        size += n;
+    } while (n);
+    if (ferror(f)) {
+        fprintf(stderr, "Error reading %s\n", filename);
+        goto leave;
+    }
+
+    if (size < sizeof(struct usbredirrecord_header) ||
+            memcmp(data, USBREDIRRECORD_MAGIC, USBREDIRRECORD_MAGIC_SIZE) ||
+            get_le32(data + USBREDIRRECORD_MAGIC_SIZE) != USBREDIRRECORD_VERSION) {
+        fprintf(stderr, "%s is not a usbredir recording\n", filename);
+        goto leave;
+    }
+
+    /* Count the chunks, then fill in the chunk array */
+    for (pos = sizeof(struct usbredirrecord_header); pos < size; count++) {
+        if (size - pos < USBREDIRRECORD_CHUNK_SIZE ||
+                size - pos - USBREDIRRECORD_CHUNK_SIZE <
+                (get_le32(data + pos + 8) & USBREDIRRECORD_LEN_MASK)) {
+            fprintf(stderr, "%s is truncated, ignoring the last chunk\n",
+                    filename);
+            size = pos;
+            break;
+        }
+        pos += USBREDIRRECORD_CHUNK_SIZE +
+               (get_le32(data + pos + 8) & USBREDIRRECORD_LEN_MASK);
+    }
+
+    replay->chunks = calloc(count, sizeof(struct replay_chunk));
+    if (count && !replay->chunks) {
+        fprintf(stderr, "Out of memory reading %s\n", filename);
+        goto leave;
+    }
+    pos = sizeof(struct usbredirrecord_header);
+    for (count = 0; pos < size; count++) {
+        struct replay_chunk *chunk = &replay->chunks[count];
+        uint32_t dir_len = get_le32(data + pos + 8);
+
+        chunk->timestamp = get_le64(data + pos);
+        chunk->dir = dir_len >> USBREDIRRECORD_DIR_SHIFT;
+        chunk->len = dir_len & USBREDIRRECORD_LEN_MASK;
+        chunk->data = data + pos + USBREDIRRECORD_CHUNK_SIZE;
+        pos += USBREDIRRECORD_CHUNK_SIZE + chunk->len;
+    }
+
+    replay->file_data = data;
+    replay->chunk_count = count;
+    data = NULL;
+    ret = 0;
+leave:
+    free(data);
+    fclose(f);
+    return ret;
+}
+
+/* Get the caps from the hello the side of the connection we are replaying
+   sent, which is the first packet in the other direction's byte stream */
+static int get_hello_caps(struct replay *replay, int dir, uint32_t *caps)
+{
+    uint8_t buf[HELLO_HEADER_LEN + sizeof(struct usb_redir_hello_header) +
+                USB_REDIR_CAPS_SIZE * sizeof(uint32_t)];
+    size_t len = 0, n, caps_offset;
+    uint32_t length;
+    int i;
+
+    for (i = 0; i < replay->chunk_count && len < sizeof(buf); i++) {
+        if (replay->chunks[i].dir != dir) {
+            continue;
+        }
+        n = replay->chunks[i].len;
+        if (n > sizeof(buf) - len) {
+            n = sizeof(buf) - len;
+        }
+        memcpy(buf + len, replay->chunks[i].data, n);
+        len += n;
+    }
+
+    caps_offset = HELLO_HEADER_LEN + sizeof(struct usb_redir_hello_header);
+    if (len < caps_offset || get_le32(buf) != usb_redir_hello) {
+        return -1;
+    }
+    length = get_le32(buf + 4);
+    memset(caps, 0, USB_REDIR_CAPS_SIZE * sizeof(uint32_t));
+    for (i = 0; i < USB_REDIR_CAPS_SIZE &&
+                caps_offset + (i + 1) * sizeof(uint32_t) <= len &&
+                sizeof(struct usb_redir_hello_header) +
+                    (i + 1) * sizeof(uint32_t) <= length; i++) {
+        caps[i] = get_le32(buf + caps_offset + i * sizeof(uint32_t));
+    }
+    return 0;
+}
+
+/* Parser callbacks, these only count what got parsed */
+
+static void replay_log(void *priv, int level, const char *msg)
+{
+    struct replay *replay = priv;
+
+    if (level <= replay->verbose) {
+        fprintf(stderr, "%s\n", msg);
+    }
+}
+
+static int replay_read(void *priv, uint8_t *data, int count)
+{
+    struct replay *replay = priv;
+
+    if (count > replay->read_left) {
+        count = replay->read_left;
+    }
+    memcpy(data, replay->read_data, count);
+    replay->read_data += count;
+    replay->read_left -= count;
+    return count;
+}
+
+static int replay_write(void *priv, uint8_t *data, int count)
+{
+    /* Replies to the peer are not part of the recording, drop them */
+    return count;
+}
+
+#define REPLAY_COUNT_PACKET(name, ...) \
+    static void replay_##name(void *priv, ##__VA_ARGS__) \
+    { \
+        struct replay *replay = priv; \
+        replay->packets++; \
+    }
+
+REPLAY_COUNT_PACKET(hello, struct usb_redir_hello_header *h)
+REPLAY_COUNT_PACKET(device_disconnect)
+REPLAY_COUNT_PACKET(reset)
+REPLAY_COUNT_PACKET(set_configuration, uint64_t id,
+                    struct usb_redir_set_configuration_header *h)
+REPLAY_COUNT_PACKET(get_configuration, uint64_t id)
+REPLAY_COUNT_PACKET(configuration_status, uint64_t id,
+                    struct usb_redir_configuration_status_header *h)
+REPLAY_COUNT_PACKET(set_alt_setting, uint64_t id,
+                    struct usb_redir_set_alt_setting_header *h)
+REPLAY_COUNT_PACKET(get_alt_setting, uint64_t id,
+                    struct usb_redir_get_alt_setting_header *h)
+REPLAY_COUNT_PACKET(alt_setting_status, uint64_t id,
+                    struct usb_redir_alt_setting_status_header *h)
+REPLAY_COUNT_PACKET(start_iso_stream, uint64_t id,
+                    struct usb_redir_start_iso_stream_header *h)
+REPLAY_COUNT_PACKET(stop_iso_stream, uint64_t id,
+                    struct usb_redir_stop_iso_stream_header *h)
+REPLAY_COUNT_PACKET(iso_stream_status, uint64_t id,
+                    struct usb_redir_iso_stream_status_header *h)
+REPLAY_COUNT_PACKET(start_interrupt_receiving, uint64_t id,
+                    struct usb_redir_start_interrupt_receiving_header *h)
+REPLAY_COUNT_PACKET(stop_interrupt_receiving, uint64_t id,
+                    struct usb_redir_stop_interrupt_receiving_header *h)
+REPLAY_COUNT_PACKET(interrupt_receiving_status, uint64_t id,
+                    struct usb_redir_interrupt_receiving_status_header *h)
+REPLAY_COUNT_PACKET(alloc_bulk_streams, uint64_t id,
+                    struct usb_redir_alloc_bulk_streams_header *h)
+REPLAY_COUNT_PACKET(free_bulk_streams, uint64_t id,
+                    struct usb_redir_free_bulk_streams_header *h)
+REPLAY_COUNT_PACKET(bulk_streams_status, uint64_t id,
+                    struct usb_redir_bulk_streams_status_header *h)
+REPLAY_COUNT_PACKET(cancel_data_packet, uint64_t id)
+REPLAY_COUNT_PACKET(filter_reject)
+REPLAY_COUNT_PACKET(device_disconnect_ack)
+REPLAY_COUNT_PACKET(start_bulk_receiving, uint64_t id,
+                    struct usb_redir_start_bulk_receiving_header *h)
+REPLAY_COUNT_PACKET(stop_bulk_receiving, uint64_t id,
+                    struct usb_redir_stop_bulk_receiving_header *h)
+REPLAY_COUNT_PACKET(bulk_receiving_status, uint64_t id,
+                    struct usb_redir_bulk_receiving_status_header *h)
+
+static void replay_device_connect(void *priv,
+    struct usb_redir_device_connect_header *device_connect)
+{
+    struct replay *replay = priv;
+
+    replay->packets++;
+    replay->device_connect = *device_connect;
+    replay->have_device_connect = 1;
+}
+
+static void replay_interface_info(void *priv,
+    struct usb_redir_interface_info_header *interface_info)
+{
+    struct replay *replay = priv;
+
+    replay->packets++;
+    replay->interface_info = *interface_info;
+    replay->have_interface_info = 1;
+}
+
+/* Alt setting changes may bring other endpoints, keep them all */
+static void replay_ep_info(void *priv, struct usb_redir_ep_info_header *ep_info)
+{
+    struct replay *replay = priv;
+    int i;
+
+    replay->packets++;
+    for (i = 0; i < 32; i++) {
+        if (ep_info->type[i] == usb_redir_type_invalid) {
+            continue;
+        }
+        replay->ep_info.type[i] = ep_info->type[i];
+        replay->ep_info.interval[i] = ep_info->interval[i];
+        replay->ep_info.interface[i] = ep_info->interface[i];
+        replay->ep_info.max_packet_size[i] = ep_info->max_packet_size[i];
+    }
+}
+
+static void replay_filter_filter(void *priv,
+    struct usbredirfilter_rule *rules, int rules_count)
+{
+    struct replay *replay = priv;
+
+    replay->packets++;
+    usbredirfilter_free(rules);
+}
+
+#define REPLAY_COUNT_DATA_PACKET(name, header_type) \
+    static void replay_##name(void *priv, uint64_t id, header_type *h, \
+                              uint8_t *data, int data_len) \
+    { \
+        struct replay *replay = priv; \
+        replay->packets++; \
+        replay->data_packets++; \
+        replay->data_bytes += data_len; \
+        usbredirparser_free_packet_data(replay->parser, data); \
+    }
+
+REPLAY_COUNT_DATA_PACKET(control_packet,
+                         struct usb_redir_control_packet_header)
+REPLAY_COUNT_DATA_PACKET(bulk_packet, struct usb_redir_bulk_packet_header)
+REPLAY_COUNT_DATA_PACKET(iso_packet, struct usb_redir_iso_packet_header)
+REPLAY_COUNT_DATA_PACKET(interrupt_packet,
+                         struct usb_redir_interrupt_packet_header)
+REPLAY_COUNT_DATA_PACKET(buffered_bulk_packet,
+                         struct usb_redir_buffered_bulk_packet_header)
+
+static struct usbredirparser *create_parser(struct replay *replay, int side)
+{
+    struct usbredirparser *parser = usbredirparser_create();
+    uint32_t caps[USB_REDIR_CAPS_SIZE];
+    int flags = usbredirparser_fl_no_hello;
+
+    if (!parser) {
+        return NULL;
+    }
+
+    parser->priv = replay;
+    parser->log_func = replay_log;
+    parser->read_func = replay_read;
+    parser->write_func = replay_write;
+    parser->hello_func = replay_hello;
+    parser->device_connect_func = replay_device_connect;
+    parser->device_disconnect_func = replay_device_disconnect;
+    parser->reset_func = replay_reset;
+    parser->interface_info_func = replay_interface_info;
+    parser->ep_info_func = replay_ep_info;
+    parser->set_configuration_func = replay_set_configuration;
+    parser->get_configuration_func = replay_get_configuration;
+    parser->configuration_status_func = replay_configuration_status;
+    parser->set_alt_setting_func = replay_set_alt_setting;
+    parser->get_alt_setting_func = replay_get_alt_setting;
+    parser->alt_setting_status_func = replay_alt_setting_status;
+    parser->start_iso_stream_func = replay_start_iso_stream;
+    parser->stop_iso_stream_func = replay_stop_iso_stream;
+    parser->iso_stream_status_func = replay_iso_stream_status;
+    parser->start_interrupt_receiving_func = replay_start_interrupt_receiving;
+    parser->stop_interrupt_receiving_func = replay_stop_interrupt_receiving;
+    parser->interrupt_receiving_status_func =
+        replay_interrupt_receiving_status;
+    parser->alloc_bulk_streams_func = replay_alloc_bulk_streams;
+    parser->free_bulk_streams_func = replay_free_bulk_streams;
+    parser->bulk_streams_status_func = replay_bulk_streams_status;
+    parser->cancel_data_packet_func = replay_cancel_data_packet;
+    parser->control_packet_func = replay_control_packet;
+    parser->bulk_packet_func = replay_bulk_packet;
+    parser->iso_packet_func = replay_iso_packet;
+    parser->interrupt_packet_func = replay_interrupt_packet;
+    parser->filter_reject_func = replay_filter_reject;
+    parser->filter_filter_func = replay_filter_filter;
+    parser->device_disconnect_ack_func = replay_device_disconnect_ack;
+    parser->start_bulk_receiving_func = replay_start_bulk_receiving;
+    parser->stop_bulk_receiving_func = replay_stop_bulk_receiving;
+    parser->bulk_receiving_status_func = replay_bulk_receiving_status;
+    parser->buffered_bulk_packet_func = replay_buffered_bulk_packet;
+
+    /* Use the caps the recorded side announced, so that the negotiated
+       protocol (e.g. 32 vs 64 bits ids) matches the recording */
+    if (get_hello_caps(replay, side == 0 ? usbredirrecord_to_guest :
+                                           usbredirrecord_from_guest,
+                       caps) != 0) {
+        fprintf(stderr, "Warning: no %s hello found in the recording\n",
+                side_names[side]);
+        memset(caps, 0, sizeof(caps));
+    }
+    if (side == 0) {
+        flags |= usbredirparser_fl_usb_host;
+    }
+    usbredirparser_init(parser, REPLAY_VERSION, caps, USB_REDIR_CAPS_SIZE,
+                        flags);
+    return parser;
+}
+
+static void wait_until(uint64_t ns)
+{
+    struct timespec ts = {
+        .tv_sec = ns / 1000000000,
+        .tv_nsec = ns % 1000000000,
+    };
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+           EINTR);
+}
+
+/* Feed the byte stream the recorded side parsed into a parser: for the host
+   side that is the data read from the guest, for the guest side the data
+   written to the guest */
+static int replay_side(struct replay *replay, int side)
+{
+    int i, r, run, dir = side == 0 ? usbredirrecord_from_guest :
+                                     usbredirrecord_to_guest;
+    uint64_t begin, start, first_timestamp = 0, target = 0, now;
+    int have_first = 0;
+
+    replay->bytes = 0;
+    replay->packets = 0;
+    replay->data_packets = 0;
+    replay->data_bytes = 0;
+    replay->parse_errors = 0;
+    replay->max_lag_us = 0;
+
+    begin = start = get_time_ns();
+    for (run = 0; run < replay->repeat; run++) {
+        replay->parser = create_parser(replay, side);
+        if (!replay->parser) {
+            fprintf(stderr, "Error creating parser\n");
+            return -1;
+        }
+        for (i = 0; i < replay->chunk_count; i++) {
+            struct replay_chunk *chunk = &replay->chunks[i];
+
+            if (chunk->dir != dir) {
+                continue;
+            }
+            if (replay->realtime) {
+                if (!have_first) {
+                    first_timestamp = chunk->timestamp;
+                    have_first = 1;
+                }
+                target = start + (chunk->timestamp - first_timestamp) * 1000;
+                wait_until(target);
+            }
+
+            replay->read_data = chunk->data;
+            replay->read_left = chunk->len;
+            while (replay->read_left) {
+                r = usbredirparser_do_read(replay->parser);
+                if (r == usbredirparser_read_parse_error) {
+                    replay->parse_errors++;
+                } else if (r != 0) {
+                    fprintf(stderr, "Error replaying %s side: %d\n",
+                            side_names[side], r);
+                    usbredirparser_destroy(replay->parser);
+                    return -1;
+                }
+            }
+            replay->bytes += chunk->len;
+            if (usbredirparser_has_data_to_write(replay->parser)) {
+                usbredirparser_do_write(replay->parser);
+            }
+
+            if (replay->realtime) {
+                now = get_time_ns();
+                if (now > target &&
+                        (now - target) / 1000 > replay->max_lag_us) {
+                    replay->max_lag_us = (now - target) / 1000;
+                }
+            }
+        }
+        usbredirparser_destroy(replay->parser);
+        replay->parser = NULL;
+        /* With realtime replay, the next run starts where this one ended */
+        if (replay->realtime) {
+            start = get_time_ns();
+            have_first = 0;
+        }
+    }
+    replay->elapsed_ns = get_time_ns() - begin;
+    return 0;
+}
+
+/* Parse one direction of the recording once, without measuring anything.
+   For host replays this gets the device info from the guest side and the
+   number of packets of the host side. */
+static int scan_recording(struct replay *replay, int side)
+{
+    int i, r, dir = side == 0 ? usbredirrecord_from_guest :
+                                usbredirrecord_to_guest;
+
+    replay->packets = 0;
+    replay->parser = create_parser(replay, side);
+    if (!replay->parser) {
+        fprintf(stderr, "Error creating parser\n");
+        return -1;
+    }
+    for (i = 0; i < replay->chunk_count; i++) {
+        if (replay->chunks[i].dir != dir) {
+            continue;
+        }
+        replay->read_data = replay->chunks[i].data;
+        replay->read_left = replay->chunks[i].len;
+        while (replay->read_left) {
+            r = usbredirparser_do_read(replay->parser);
+            if (r != 0 && r != usbredirparser_read_parse_error) {
+                break;
+            }
+        }
+        if (usbredirparser_has_data_to_write(replay->parser)) {
+            usbredirparser_do_write(replay->parser);
+        }
+    }
+    usbredirparser_destroy(replay->parser);
+    replay->parser = NULL;
+    return 0;
+}
+
+static int replay_host_write(void *priv, uint8_t *data, int count)
+{
+    struct replay *replay = priv;
+
+    replay->written_bytes += count;
+    return count;
+}
+
+/* Build descriptors for a device with the recorded ids, interfaces and
+   endpoints into device_desc and config_desc and point config to them.
+   Endpoints of all alt settings end up in alt setting 0 of their interface,
+   so the guest's alt setting changes get rejected. Leaves config alone if
+   the recording does not describe the device. */
+static void build_descriptors(struct replay *replay, uint8_t *device_desc,
+    uint8_t *config_desc, struct fakeusb_device_config *config)
+{
+    struct usb_redir_device_connect_header *connect = &replay->device_connect;
+    struct usb_redir_interface_info_header *intf = &replay->interface_info;
+    struct usb_redir_ep_info_header *ep_info = &replay->ep_info;
+    int i, j, len, num_eps, ep_count = 0, super;
+
+    if (!replay->have_device_connect || !replay->have_interface_info ||
+            intf->interface_count > 32) {
+        return;
+    }
+
+    super = connect->speed == usb_redir_speed_super;
+    device_desc[0] = LIBUSB_DT_DEVICE_SIZE;
+    device_desc[1] = LIBUSB_DT_DEVICE;
+    device_desc[2] = 0x00;
+    device_desc[3] = super ? 0x03 : 0x02;
+    device_desc[4] = connect->device_class;
+    device_desc[5] = connect->device_subclass;
+    device_desc[6] = connect->device_protocol;
+    device_desc[7] = super ? 9 : 64;
+    device_desc[8] = connect->vendor_id;
+    device_desc[9] = connect->vendor_id >> 8;
+    device_desc[10] = connect->product_id;
+    device_desc[11] = connect->product_id >> 8;
+    device_desc[12] = connect->device_version_bcd;
+    device_desc[13] = connect->device_version_bcd >> 8;
+    device_desc[14] = 1;
+    device_desc[15] = 2;
+    device_desc[16] = 3;
+    device_desc[17] = 1;
+
+    len = 9;
+    for (i = 0; i < (int)intf->interface_count; i++) {
+        uint8_t *intf_desc = config_desc + len;
+
+        len += 9;
+        num_eps = 0;
+        for (j = 0; j < 32; j++) {
+            /* ep_info index to endpoint address */
+            uint8_t ep = ((j & 0x10) << 3) | (j & 0x0f);
+
+            if ((j & 0x0f) == 0 ||
+                    ep_info->type[j] == usb_redir_type_invalid ||
+                    ep_info->interface[j] != intf->interface[i]) {
+                continue;
+            }
+            config_desc[len + 0] = 7;
+            config_desc[len + 1] = LIBUSB_DT_ENDPOINT;
+            config_desc[len + 2] = ep;
+            config_desc[len + 3] = ep_info->type[j];
+            config_desc[len + 4] = ep_info->max_packet_size[j];
+            config_desc[len + 5] = ep_info->max_packet_size[j] >> 8;
+            config_desc[len + 6] = ep_info->interval[j];
+            if (!ep_info->max_packet_size[j]) {
+                config_desc[len + 4] = 64;
+            }
+            len += 7;
+            num_eps++;
+
+            /* The same timing fakeusb_device_config_init() uses */
+            config->endpoints[ep_count].address = ep;
+            config->endpoints[ep_count].latency_us = 125;
+            config->endpoints[ep_count].bytes_per_ms = 40000;
+            config->endpoints[ep_count].interval_us = -1;
+            config->endpoints[ep_count].short_len = -1;
+            ep_count++;
+        }
+        intf_desc[0] = 9;
+        intf_desc[1] = LIBUSB_DT_INTERFACE;
+        intf_desc[2] = intf->interface[i];
+        intf_desc[3] = 0;
+        intf_desc[4] = num_eps;
+        intf_desc[5] = intf->interface_class[i];
+        intf_desc[6] = intf->interface_subclass[i];
+        intf_desc[7] = intf->interface_protocol[i];
+        intf_desc[8] = 0;
+    }
+    if (ep_count < FAKEUSB_MAX_ENDPOINTS) {
+        config->endpoints[ep_count].address = 0;
+    }
+
+    config_desc[0] = 9;
+    config_desc[1] = LIBUSB_DT_CONFIG;
+    config_desc[2] = len;
+    config_desc[3] = len >> 8;
+    config_desc[4] = intf->interface_count;
+    config_desc[5] = 1;
+    config_desc[6] = 0;
+    config_desc[7] = 0x80;
+    config_desc[8] = 50;
+
+    config->device_desc = device_desc;
+    config->config_desc = config_desc;
+    if (connect->speed != usb_redir_speed_unknown) {
+        config->speed = LIBUSB_SPEED_LOW + connect->speed;
+    }
+}
+
+static void host_close(struct replay *replay)
+{
+    if (replay->usbhost) {
+        usbredirhost_close(replay->usbhost);
+        replay->usbhost = NULL;
+    }
+    if (replay->dev) {
+        libusb_unref_device(replay->dev);
+        replay->dev = NULL;
+    }
+    libusb_exit(replay->ctx);
+    replay->ctx = NULL;
+}
+
+static int host_open(struct replay *replay)
+{
+    uint8_t device_desc[LIBUSB_DT_DEVICE_SIZE];
+    uint8_t config_desc[9 + 32 * 9 + 32 * 7];
+    struct fakeusb_device_config config;
+    libusb_device_handle *handle;
+
+    fakeusb_device_config_init(&config);
+    build_descriptors(replay, device_desc, config_desc, &config);
+
+    if (libusb_init(&replay->ctx) != 0) {
+        fprintf(stderr, "Error initializing the simulated libusb\n");
+        return -1;
+    }
+    replay->dev = fakeusb_device_new(replay->ctx, &config);
+    if (!replay->dev || libusb_open(replay->dev, &handle) != 0) {
+        fprintf(stderr, "Error creating the simulated device\n");
+        host_close(replay);
+        return -1;
+    }
+    replay->usbhost = usbredirhost_open(replay->ctx, handle, replay_log,
+                                        replay_read, replay_host_write,
+                                        replay, REPLAY_VERSION,
+                                        replay->verbose, 0);
+    if (!replay->usbhost) {
+        fprintf(stderr, "Error opening usbredirhost\n");
+        host_close(replay);
+        return -1;
+    }
+    return 0;
+}
+
+/* Let the simulated device complete transfers for up to timeout_us and
+   write the replies */
+static void host_pump(struct replay *replay, uint64_t timeout_us)
+{
+    struct timeval tv = {
+        .tv_sec = timeout_us / 1000000,
+        .tv_usec = timeout_us % 1000000,
+    };
+
+    libusb_handle_events_timeout(replay->ctx, &tv);
+    while (usbredirhost_has_data_to_write(replay->usbhost)) {
+        usbredirhost_write_guest_data(replay->usbhost);
+    }
+}
+
+static void host_wait_until(struct replay *replay, uint64_t ns)
+{
+    uint64_t now;
+
+    while ((now = get_time_ns()) < ns) {
+        host_pump(replay, (ns - now) / 1000);
+    }
+}
+
+/* Feed the data read from the usbredir-guest into a usbredirhost, which
+   talks to a simulated device modelled after the recorded one */
+static int replay_host(struct replay *replay)
+{
+    int i, r, run, ep;
+    uint64_t start, first_timestamp = 0, target = 0, now, packets;
+    uint64_t drain_start, last_activity, before;
+    struct fakeusb_ep_stats stats;
+    int have_first;
+
+    memset(replay->ep_info.type, usb_redir_type_invalid,
+           sizeof(replay->ep_info.type));
+    if (scan_recording(replay, 1) != 0 || scan_recording(replay, 0) != 0) {
+        return -1;
+    }
+    if (!replay->have_device_connect || !replay->have_interface_info) {
+        fprintf(stderr, "Warning: the recording does not describe the "
+                "device, using the default simulated device\n");
+    }
+    packets = replay->packets;
+
+    replay->bytes = 0;
+    replay->packets = 0;
+    replay->data_packets = 0;
+    replay->data_bytes = 0;
+    replay->parse_errors = 0;
+    replay->max_lag_us = 0;
+    replay->elapsed_ns = 0;
+
+    for (run = 0; run < replay->repeat; run++) {
+        if (host_open(replay) != 0) {
+            return -1;
+        }
+        start = get_time_ns();
+        have_first = 0;
+        for (i = 0; i < replay->chunk_count; i++) {
+            struct replay_chunk *chunk = &replay->chunks[i];
+
+            if (chunk->dir != usbredirrecord_from_guest) {
+                continue;
+            }
+            if (replay->realtime) {
+                if (!have_first) {
+                    first_timestamp = chunk->timestamp;
+                    have_first = 1;
+                }
+                target = start + (chunk->timestamp - first_timestamp) * 1000;
+                host_wait_until(replay, target);
+            }
+
+            replay->read_data = chunk->data;
+            replay->read_left = chunk->len;
+            while (replay->read_left) {
+                r = usbredirhost_read_guest_data(replay->usbhost);
+                if (r == usbredirparser_read_parse_error) {
+                    replay->parse_errors++;
+                } else if (r != 0) {
+                    fprintf(stderr, "Error replaying host side: %d\n", r);
+                    host_close(replay);
+                    return -1;
+                }
+            }
+            replay->bytes += chunk->len;
+            host_pump(replay, 0);
+
+            if (replay->realtime) {
+                now = get_time_ns();
+                if (now > target &&
+                        (now - target) / 1000 > replay->max_lag_us) {
+                    replay->max_lag_us = (now - target) / 1000;
+                }
+            }
+        }
+
+        /* The run ends with the reply to the last packet */
+        drain_start = last_activity = get_time_ns();
+        do {
+            before = replay->written_bytes;
+            host_pump(replay, HOST_IDLE_TIMEOUT_US);
+            if (replay->written_bytes != before) {
+                last_activity = get_time_ns();
+            }
+        } while (replay->written_bytes != before &&
+                 last_activity - drain_start < HOST_DRAIN_TIMEOUT_NS);
+        replay->elapsed_ns += last_activity - start;
+
+        replay->packets += packets;
+        for (ep = 0; ep < 32; ep++) {
+            if (ep != 0x10 &&
+                    fakeusb_device_get_ep_stats(replay->dev,
+                        ((ep & 0x10) << 3) | (ep & 0x0f), &stats) == 0) {
+                replay->data_packets += stats.transfers;
+                replay->data_bytes += stats.bytes;
+            }
+        }
+        host_close(replay);
+    }
+    return 0;
+}
+
+static void print_result(struct replay *replay, int side, int first)
+{
+    double secs = replay->elapsed_ns / 1e9;
+    double pkts_per_sec = secs ? replay->packets / secs : 0;
+    double bytes_per_sec = secs ? replay->bytes / secs : 0;
+
+    const char *target = side == 0 && replay->host ? "usbredirhost" :
+                                                     "usbredirparser";
+
+    if (replay->json) {
+        printf("%s    {\"side\": \"%s\", \"target\": \"%s\", "
+               "\"runs\": %d, \"realtime\": %s, "
+               "\"bytes\": %" PRIu64 ", \"packets\": %" PRIu64 ", "
+               "\"data_packets\": %" PRIu64 ", \"data_bytes\": %" PRIu64 ", "
+               "\"parse_errors\": %" PRIu64 ", \"elapsed_ns\": %" PRIu64 ", "
+               "\"packets_per_sec\": %.0f, \"bytes_per_sec\": %.0f, "
+               "\"max_lag_us\": %" PRIu64 "}",
+               first ? "" : ",\n", side_names[side], target, replay->repeat,
+               replay->realtime ? "true" : "false", replay->bytes,
+               replay->packets, replay->data_packets, replay->data_bytes,
+               replay->parse_errors, replay->elapsed_ns, pkts_per_sec,
+               bytes_per_sec, replay->max_lag_us);
+        return;
+    }
+
+    printf("%s side (%s): %" PRIu64 " packets (%" PRIu64 " data packets, "
+           "%.1f MiB data) in %.3f s, %.0f packets/s, %.1f MiB/s",
+           side_names[side], target, replay->packets, replay->data_packets,
+           replay->data_bytes / 1048576.0, secs, pkts_per_sec,
+           bytes_per_sec / 1048576.0);
+    if (replay->realtime) {
+        printf(", max lag %" PRIu64 " us", replay->max_lag_us);
+    }
+    if (replay->parse_errors) {
+        printf(", %" PRIu64 " parse errors", replay->parse_errors);
+    }
+    printf("\n");
+}
+
+static const struct option longopts[] = {
+    { "side", required_argument, NULL, 's' },
+    { "realtime", no_argument, NULL, 'r' },
+    { "usbredirhost", no_argument, NULL, 'u' },
+    { "repeat", required_argument, NULL, 'n' },
+    { "json", no_argument, NULL, 'j' },
+    { "verbose", required_argument, NULL, 'v' },
+    { "help", no_argument, NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+};
+
+static void usage(int exit_code, char *argv0)
+{
+    fprintf(exit_code? stderr:stdout,
+        "Usage: %s [-s|--side host|guest|both] [-r|--realtime] [-u|--usbredirhost]\n"
+        "       [-n|--repeat <count>] [-j|--json] [-v|--verbose <0-5>] <recording>\n"
+        "\n"
+        "Replays a usbredirect --record recording into usbredirparser and\n"
+        "reports the parsing throughput. The host side parses the data read\n"
+        "from the usbredir-guest, the guest side the data written to it.\n"
+        "By default the recording is replayed as fast as possible, with\n"
+        "--realtime the original timing is kept and the maximum lag behind\n"
+        "it is reported.\n"
+        "\n"
+        "With --usbredirhost the host side is replayed into usbredirhost on a\n"
+        "simulated device with the recorded ids, interfaces and endpoints\n"
+        "instead, then data packets are the transfers of the device.\n",
+        argv0);
+    exit(exit_code);
+}
+
+int main(int argc, char *argv[])
+{
+    struct replay replay = {
+        .repeat = 1,
+    };
+    int o, side, first_side = 0, last_side = 1, ret = 0;
+    char *endptr;
+
+    while ((o = getopt_long(argc, argv, "s:run:jv:h", longopts, NULL)) != -1) {
+        switch (o) {
+        case 's':
+            if (!strcmp(optarg, "host")) {
+                first_side = last_side = 0;
+            } else if (!strcmp(optarg, "guest")) {
+                first_side = last_side = 1;
+            } else if (!strcmp(optarg, "both")) {
+                first_side = 0;
+                last_side = 1;
+            } else {
+                fprintf(stderr, "Invalid side: %s\n", optarg);
+                usage(1, argv[0]);
+            }
+            break;
+        case 'r':
+            replay.realtime = 1;
+            break;
+        case 'u':
+            replay.host = 1;
+            break;
+        case 'n':
+            replay.repeat = strtol(optarg, &endptr, 10);
+            if (*endptr != '\0' || replay.repeat < 1) {
+                fprintf(stderr, "Invalid value for --repeat: '%s'\n", optarg);
+                usage(1, argv[0]);
+            }
+            break;
+        case 'j':
+            replay.json = 1;
+            break;
+        case 'v':
+            replay.verbose = strtol(optarg, &endptr, 10);
+            if (*endptr != '\0') {
+                fprintf(stderr, "Invalid value for --verbose: '%s'\n", optarg);
+                usage(1, argv[0]);
+            }
+            break;
+        case '?':
+        case 'h':
+            usage(o == '?', argv[0]);
+            break;
+        }
+    }
+
+    if (optind + 1 != argc) {
+        usage(1, argv[0]);
+    }
+
+    if (load_recording(&replay, argv[optind]) != 0) {
+        exit(1);
+    }
+
+    if (replay.json) {
+        printf("{\n  \"recording\": \"%s\",\n  \"results\": [\n",
+               argv[optind]);
+    }
+    for (side = first_side; side <= last_side; side++) {
+        if (side == 0 && replay.host ? replay_host(&replay) != 0 :
+                                       replay_side(&replay, side) != 0) {
+            ret = 1;
+            break;
+        }
+        print_result(&replay, side, side == first_side);
+    }
+    if (replay.json) {
+        printf("\n  ]\n}\n");
+    }
+
+    free(replay.chunks);
+    free(replay.file_data);
+    return ret;
+}
@@ -0,0 +1,69 @@
+/* usbredirsched.c usbredir thread CPU and scheduling settings
+
+   Copyright 2026 Red Hat, Inc.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#define _GNU_SOURCE
+#include "config.h"
+
+#include <errno.h>
+#include <sched.h>
+#include "usbredirsched.h"
+
+int usbredirsched_pin(int cpu)
+{
+    cpu_set_t set;
+
+    if (cpu < 0 || cpu >= CPU_SETSIZE) {
+        return -EINVAL;
+    }
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+        return -errno;
+    }
+    return 0;
+}
+
+int usbredirsched_set_rt(int policy, int priority)
+{
+    struct sched_param param = { .sched_priority = priority };
+
+    if (sched_setscheduler(0, policy, &param) != 0) {
+        return -errno;
+    }
+    return 0;
+}
+
+int usbredirsched_assign_cpus(int *cpus, int n)
+{
+    cpu_set_t allowed;
+    int cpu, i = 0;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        return -errno;
+    }
+    if (CPU_COUNT(&allowed) == 0) {
+        return -EINVAL;
+    }
+    while (i < n) {
+        for (cpu = 0; cpu < CPU_SETSIZE && i < n; cpu++) {
+            if (CPU_ISSET(cpu, &allowed)) {
+                cpus[i++] = cpu;
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,36 @@
+/* usbredirsched.h usbredir thread CPU and scheduling settings
+
+   Copyright 2026 Red Hat, Inc.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+/* The --pin and --rt-priority settings of usbredirect, which its threads
+   apply to themselves once they run. On Linux both only affect the
+   calling thread, so they are not inherited by the threads created
+   before, and a failure only leaves that one thread as it was. */
+
+/* Pins the calling thread to cpu. Returns 0 on success or -errno. */
+int usbredirsched_pin(int cpu);
+
+/* Sets the real-time policy, SCHED_FIFO or SCHED_RR, and the priority of
+   the calling thread. Returns 0 on success or -errno, -EPERM without
+   CAP_SYS_NICE or an RLIMIT_RTPRIO which allows priority. */
+int usbredirsched_set_rt(int policy, int priority);
+
+/* Gives each of n workers a CPU to pin itself to, worker i the ith CPU
+   the process may run on, starting over when there are more workers than
+   CPUs. Returns 0 on success or -errno. */
+int usbredirsched_assign_cpus(int *cpus, int n);
@@ -0,0 +1,446 @@
+/* usbredirshm.c usbredir shared memory transport
+
+   Copyright 2026 Red Hat, Inc.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#define _GNU_SOURCE
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include "usbredirshm.h"
+
+#define RING_PAGE_SIZE 4096
+
+/* The indexes are free running, head - tail is the number of bytes in the
+   ring. Each one only gets written by one side, so keep them in separate
+   cache lines. */
+struct usbredirshm_ring {
+    _Alignas(64) atomic_uint head;      /* Written by the producer */
+    _Alignas(64) atomic_uint tail;      /* Written by the consumer */
+    /* Set by the producer when it found the ring full, the consumer rings
+       the producer's doorbell after freeing space when this is set */
+    _Alignas(64) atomic_uint need_space;
+    atomic_uint closed;                 /* Set by the producer on destroy */
+};
+
+struct usbredirshm {
+    int side;           /* 0 for the creator, 1 for the other side */
+    int mem_fd;
+    int doorbell[2];
+    uint8_t *map;
+    size_t map_size;
+    uint32_t mask;
+    struct usbredirshm_ring *rx;
+    struct usbredirshm_ring *tx;
+    uint8_t *rx_data;
+    uint8_t *tx_data;
+};
+
+static void ring_doorbell(struct usbredirshm *shm)
+{
+    uint64_t one = 1;
+    ssize_t r;
+
+    /* This can only fail when the counter would overflow, in which case the
+       doorbell is ringing already */
+    r = write(shm->doorbell[!shm->side], &one, sizeof(one));
+    (void)r;
+}
+
+static int shm_map(struct usbredirshm *shm, size_t size)
+{
+    const struct usbredirshm_header *header;
+    uint32_t ring_size;
+    int i;
+
+    shm->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    shm->mem_fd, 0);
+    if (shm->map == MAP_FAILED) {
+        shm->map = NULL;
+        return -errno;
+    }
+    shm->map_size = size;
+
+    /* The other side may have sent anything, check it all fits */
+    header = (const struct usbredirshm_header *)shm->map;
+    ring_size = header->ring_size;
+    if (size < sizeof(*header) ||
+            memcmp(header->magic, USBREDIRSHM_MAGIC, sizeof(header->magic)) ||
+            header->version != USBREDIRSHM_VERSION ||
+            ring_size == 0 || (ring_size & (ring_size - 1))) {
+        return -EPROTO;
+    }
+    for (i = 0; i < 2; i++) {
+        uint32_t offset = header->ring_offset[i];
+        if (offset % RING_PAGE_SIZE || offset < RING_PAGE_SIZE ||
+                (uint64_t)offset + RING_PAGE_SIZE + ring_size > size) {
+            return -EPROTO;
+        }
+    }
+    if (header->ring_offset[0] == header->ring_offset[1]) {
+        return -EPROTO;
+    }
+
+    shm->mask = ring_size - 1;
+    shm->tx = (struct usbredirshm_ring *)(shm->map +
+                                          header->ring_offset[shm->side]);
+    shm->rx = (struct usbredirshm_ring *)(shm->map +
+                                          header->ring_offset[!shm->side]);
+    shm->tx_data = (uint8_t *)shm->tx + RING_PAGE_SIZE;
+    shm->rx_data = (uint8_t *)shm->rx + RING_PAGE_SIZE;
+    return 0;
+}
+
+static struct usbredirshm *shm_new(int side)
+{
+    struct usbredirshm *shm = calloc(1, sizeof(*shm));
+
+    if (!shm) {
+        return NULL;
+    }
+    shm->side = side;
+    shm->mem_fd = shm->doorbell[0] = shm->doorbell[1] = -1;
+    return shm;
+}
+
+int usbredirshm_create(uint32_t ring_size, struct usbredirshm **shm_ret)
+{
+    struct usbredirshm_header *header;
+    struct usbredirshm *shm;
+    size_t size;
+    int i, ret;
+
+    if (ring_size < RING_PAGE_SIZE || (ring_size & (ring_size - 1)) ||
+            ring_size > 0x40000000) {
+        return -EINVAL;
+    }
+    shm = shm_new(0);
+    if (!shm) {
+        return -ENOMEM;
+    }
+
+    size = RING_PAGE_SIZE + 2 * ((size_t)RING_PAGE_SIZE + ring_size);
+    shm->mem_fd = memfd_create("usbredir-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (shm->mem_fd < 0 || ftruncate(shm->mem_fd, size) != 0 ||
+            fcntl(shm->mem_fd, F_ADD_SEALS,
+                  F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0) {
+        ret = -errno;
+        goto error;
+    }
+    for (i = 0; i < 2; i++) {
+        shm->doorbell[i] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (shm->doorbell[i] < 0) {
+            ret = -errno;
+            goto error;
+        }
+    }
+
+    /* Fill in the header before mapping checks it, the memfd is all zeros
+       so the rings start out empty */
+    header = mmap(NULL, sizeof(*header), PROT_READ | PROT_WRITE, MAP_SHARED,
+                  shm->mem_fd, 0);
+    if (header == MAP_FAILED) {
+        ret = -errno;
+        goto error;
+    }
+    memcpy(header->magic, USBREDIRSHM_MAGIC, sizeof(header->magic));
+    header->version = USBREDIRSHM_VERSION;
+    header->ring_size = ring_size;
+    header->ring_offset[0] = RING_PAGE_SIZE;
+    header->ring_offset[1] = 2 * RING_PAGE_SIZE + ring_size;
+    munmap(header, sizeof(*header));
+
+    ret = shm_map(shm, size);
+    if (ret < 0) {
+        goto error;
+    }
+    *shm_ret = shm;
+    return 0;
+
+error:
+    usbredirshm_destroy(shm);
+    return ret;
+}
+
+int usbredirshm_send_fds(struct usbredirshm *shm, int sock)
+{
+    int fds[3] = { shm->mem_fd, shm->doorbell[0], shm->doorbell[1] };
+    char control[CMSG_SPACE(sizeof(fds))];
+    uint8_t version = USBREDIRSHM_VERSION;
+    struct iovec iov = { &version, sizeof(version) };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    struct cmsghdr *cmsg;
+    ssize_t r;
+
+    memset(control, 0, sizeof(control));
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    do {
+        r = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    } while (r < 0 && errno == EINTR);
+    return r < 0 ? -errno : 0;
+}
+
+static void close_fds(const int *fds, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        close(fds[i]);
+    }
+}
+
+int usbredirshm_receive(int sock, struct usbredirshm **shm_ret)
+{
+    int fds[3];
+    char control[CMSG_SPACE(sizeof(fds))];
+    uint8_t version;
+    struct iovec iov = { &version, sizeof(version) };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    struct usbredirshm *shm;
+    struct cmsghdr *cmsg;
+    struct stat st;
+    ssize_t r;
+    int seals, ret;
+
+    for (;;) {
+        r = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        if (r >= 0 || (errno != EINTR && errno != EAGAIN)) {
+            break;
+        }
+        if (errno == EAGAIN) {
+            struct pollfd pfd = { .fd = sock, .events = POLLIN };
+            poll(&pfd, 1, -1);
+        }
+    }
+    if (r < 0) {
+        return -errno;
+    }
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (r == 0 || !cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+            cmsg->cmsg_type != SCM_RIGHTS) {
+        return -EPROTO;
+    }
+    if (cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+        /* Do not leak whatever we got */
+        close_fds((int *)CMSG_DATA(cmsg),
+                  (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+        return -EPROTO;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    if (version != USBREDIRSHM_VERSION) {
+        close_fds(fds, 3);
+        return -EPROTO;
+    }
+
+    shm = shm_new(1);
+    if (!shm) {
+        close_fds(fds, 3);
+        return -ENOMEM;
+    }
+    shm->mem_fd = fds[0];
+    shm->doorbell[0] = fds[1];
+    shm->doorbell[1] = fds[2];
+
+    /* Without the seal the other side could shrink the memfd under us,
+       turning our accesses into SIGBUS */
+    seals = fcntl(shm->mem_fd, F_GET_SEALS);
+    if (seals < 0 || !(seals & F_SEAL_SHRINK)) {
+        ret = -EPROTO;
+        goto error;
+    }
+    if (fstat(shm->mem_fd, &st) != 0) {
+        ret = -errno;
+        goto error;
+    }
+    ret = shm_map(shm, st.st_size);
+    if (ret < 0) {
+        goto error;
+    }
+    *shm_ret = shm;
+    return 0;
+
+error:
+    usbredirshm_destroy(shm);
+    return ret;
+}
+
+void usbredirshm_destroy(struct usbredirshm *shm)
+{
+    int i;
+
+    if (!shm) {
+        return;
+    }
+    if (shm->tx) {
+        atomic_store_explicit(&shm->tx->closed, 1, memory_order_release);
+        ring_doorbell(shm);
+    }
+    if (shm->map) {
+        munmap(shm->map, shm->map_size);
+    }
+    if (shm->mem_fd >= 0) {
+        close(shm->mem_fd);
+    }
+    for (i = 0; i < 2; i++) {
+        if (shm->doorbell[i] >= 0) {
+            close(shm->doorbell[i]);
+        }
+    }
+    free(shm);
+}
+
+int usbredirshm_get_fd(struct usbredirshm *shm)
+{
+    return shm->doorbell[shm->side];
+}
+
+void usbredirshm_ack(struct usbredirshm *shm)
+{
+    uint64_t value;
+    ssize_t r;
+
+    /* Fails with EAGAIN when the doorbell was not rung */
+    r = read(shm->doorbell[shm->side], &value, sizeof(value));
+    (void)r;
+}
+
+/* The other side may write anything into the indexes, a ring can never
+   hold more than ring_size bytes, anything else would make us copy outside
+   of the ring */
+static int ring_indexes_valid(struct usbredirshm *shm, uint32_t head,
+                              uint32_t tail)
+{
+    return (uint32_t)(head - tail) <= shm->mask + 1;
+}
+
+/* After updating its index each side checks the other side's index (or
+   flag) with a full barrier in between. This way either the other side sees
+   the update, or we see that the other side went to sleep before it and
+   ring its doorbell. */
+
+int usbredirshm_read(struct usbredirshm *shm, uint8_t *data, int count)
+{
+    struct usbredirshm_ring *ring = shm->rx;
+    uint32_t tail, head, avail, pos, n;
+
+    tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (head == tail) {
+        if (!atomic_load_explicit(&ring->closed, memory_order_acquire)) {
+            return 0;
+        }
+        /* closed gets set after the last write, check once more */
+        head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        if (head == tail) {
+            return -EPIPE;
+        }
+    }
+    if (!ring_indexes_valid(shm, head, tail)) {
+        return -EPROTO;
+    }
+
+    avail = head - tail;
+    if (count > avail) {
+        count = avail;
+    }
+    pos = tail & shm->mask;
+    n = shm->mask + 1 - pos;
+    if (n > count) {
+        n = count;
+    }
+    memcpy(data, shm->rx_data + pos, n);
+    memcpy(data + n, shm->rx_data, count - n);
+
+    atomic_store_explicit(&ring->tail, tail + count, memory_order_release);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&ring->need_space, memory_order_relaxed) &&
+            atomic_exchange_explicit(&ring->need_space, 0,
+                                     memory_order_relaxed)) {
+        ring_doorbell(shm);
+    }
+    return count;
+}
+
+int usbredirshm_write(struct usbredirshm *shm, const uint8_t *data, int count)
+{
+    struct usbredirshm_ring *ring = shm->tx;
+    uint32_t head, tail, space, pos, n;
+
+    if (atomic_load_explicit(&shm->rx->closed, memory_order_relaxed)) {
+        return -EPIPE;
+    }
+
+    head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (!ring_indexes_valid(shm, head, tail)) {
+        return -EPROTO;
+    }
+    space = shm->mask + 1 - (head - tail);
+    if (space == 0) {
+        atomic_store_explicit(&ring->need_space, 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        if (!ring_indexes_valid(shm, head, tail)) {
+            return -EPROTO;
+        }
+        space = shm->mask + 1 - (head - tail);
+        if (space == 0) {
+            return 0;
+        }
+    }
+
+    if (count > space) {
+        count = space;
+    }
+    pos = head & shm->mask;
+    n = shm->mask + 1 - pos;
+    if (n > count) {
+        n = count;
+    }
+    memcpy(shm->tx_data + pos, data, n);
+    memcpy(shm->tx_data, data + n, count - n);
+
+    atomic_store_explicit(&ring->head, head + count, memory_order_release);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&ring->tail, memory_order_relaxed) == head) {
+        ring_doorbell(shm);
+    }
+    return count;
+}
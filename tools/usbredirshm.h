@@ -0,0 +1,85 @@
+/* usbredirshm.h usbredir shared memory transport
+
+   Copyright 2026 Red Hat, Inc.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <stdint.h>
+
+/* A transport for two usbredir peers on the same machine. One side, the
+   creator, creates a memfd holding two single producer / single consumer
+   byte rings, one per direction, and two eventfds, one doorbell per side.
+   It passes the 3 fds to the other side with SCM_RIGHTS over a connected
+   Unix domain socket, which then stays open so that each side notices the
+   other side going away.
+
+   Both sides then write the usbredir protocol bytes into their tx ring and
+   read them from their rx ring without any system calls. A side's doorbell
+   only gets rung when its rx ring goes from empty to not empty, or when its
+   tx ring was full and the other side freed some space. So a side waits for
+   POLLIN on usbredirshm_get_fd() while it has nothing to read or no space to
+   write and calls usbredirshm_ack() when woken up.
+
+   The memfd layout is a usbredirshm_header, followed at ring_offset[0] and
+   ring_offset[1] by the rings the creator, resp. the other side, produce.
+   Each ring is a page with its indexes, see usbredirshm.c, followed by
+   ring_size data bytes. All fields are in host byte order, as both sides
+   run on the same machine. */
+
+#define USBREDIRSHM_MAGIC    "URSHMEM1"
+#define USBREDIRSHM_VERSION  1
+/* Must be a power of 2 */
+#define USBREDIRSHM_DEFAULT_RING_SIZE (4 * 1024 * 1024)
+
+struct usbredirshm_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t ring_size;
+    uint32_t ring_offset[2];
+};
+
+struct usbredirshm;
+
+/* Creates the memfd and doorbells, ring_size must be a power of 2.
+   Returns 0 on success or -errno. */
+int usbredirshm_create(uint32_t ring_size, struct usbredirshm **shm);
+
+/* Passes the fds of a created usbredirshm to the other side over the
+   Unix domain socket sock. Returns 0 on success or -errno. */
+int usbredirshm_send_fds(struct usbredirshm *shm, int sock);
+
+/* Receives and maps the fds sent by the creator with usbredirshm_send_fds(),
+   waiting for them when sock is non blocking. Returns 0 on success or
+   -errno. */
+int usbredirshm_receive(int sock, struct usbredirshm **shm);
+
+/* Marks the tx ring closed, rings the other side and unmaps everything */
+void usbredirshm_destroy(struct usbredirshm *shm);
+
+/* The doorbell to poll for POLLIN */
+int usbredirshm_get_fd(struct usbredirshm *shm);
+
+/* Resets the doorbell, call this before reading and writing after a
+   wake up, so that no ring gets lost */
+void usbredirshm_ack(struct usbredirshm *shm);
+
+/* These follow the usbredirparser read and write callbacks: they return the
+   number of bytes read or written, 0 when the rx ring is empty or the tx ring
+   is full, -EPIPE once the other side closed its end and -EPROTO when the
+   other side left the ring's indexes in an impossible state, after which
+   the connection must be given up. */
+int usbredirshm_read(struct usbredirshm *shm, uint8_t *data, int count);
+int usbredirshm_write(struct usbredirshm *shm, const uint8_t *data, int count);
@@ -0,0 +1,510 @@
+/* usbrediruring.c usbredirhost single threaded io_uring loop
+
+   Copyright 2026 Red Hat, Inc.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <liburing.h>
+#include "usbredirepoll.h"
+#include "usbrediruring.h"
+
+#define URING_ENTRIES 64
+#define URING_RECV_BUFS 32          /* must be a power of 2 */
+#define URING_RECV_BUF_SIZE (16 * 1024)
+#define URING_SEND_BUF_SIZE (256 * 1024)
+#define URING_BGID 0
+
+enum {
+    URING_OP_RECV = 1,
+    URING_OP_SEND,
+    URING_OP_POLL_USB,
+    URING_OP_POLL_FD,
+    URING_OP_POLL_REMOVE,
+};
+
+#define URING_DATA(op, fd) (((uint64_t)(op) << 32) | (uint32_t)(fd))
+#define URING_DATA_OP(data) ((int)((data) >> 32))
+#define URING_DATA_FD(data) ((int)(uint32_t)(data))
+
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+
+struct usbrediruring_fd {
+    int fd;
+    short events;               /* For the libusb fds */
+    usbrediruring_fd_func func; /* For the fds of the caller */
+    void *priv;
+};
+
+struct usbrediruring {
+    libusb_context *ctx;
+    struct usbredirhost *host;
+    int fd;
+    int error;
+    struct io_uring ring;
+    struct io_uring_buf_ring *buf_ring;
+    uint8_t *recv_bufs;
+    /* Received buffers usbredirhost has not consumed yet, in order */
+    struct {
+        uint16_t bid;
+        int len;
+    } recv_queue[URING_RECV_BUFS];
+    int recv_head;
+    int recv_count;
+    int recv_off;
+    bool recv_armed;
+    /* send_buf[send_fill] gets filled while the other one is being sent */
+    uint8_t *send_buf[2];
+    int send_len[2];
+    int send_fill;
+    int send_off;
+    bool send_busy;
+    /* The events libusb wants for each of its fds, to re-arm their polls */
+    struct usbrediruring_fd *usb_fds;
+    int usb_fd_count;
+    struct usbrediruring_fd *fds;
+    int fd_count;
+};
+
+static struct io_uring_sqe *get_sqe(struct usbrediruring *loop)
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&loop->ring);
+
+    if (!sqe) {
+        /* The submission queue is full, make room */
+        io_uring_submit(&loop->ring);
+        sqe = io_uring_get_sqe(&loop->ring);
+    }
+    return sqe;
+}
+
+static void return_buf(struct usbrediruring *loop, uint16_t bid)
+{
+    io_uring_buf_ring_add(loop->buf_ring,
+                          loop->recv_bufs + bid * URING_RECV_BUF_SIZE,
+                          URING_RECV_BUF_SIZE, bid,
+                          io_uring_buf_ring_mask(URING_RECV_BUFS), 0);
+    io_uring_buf_ring_advance(loop->buf_ring, 1);
+}
+
+static void prep_recv(struct usbrediruring *loop, int fd)
+{
+    struct io_uring_sqe *sqe = get_sqe(loop);
+
+    io_uring_prep_recv_multishot(sqe, fd, NULL, 0, 0);
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    io_uring_sqe_set_data64(sqe, URING_DATA(URING_OP_RECV, fd));
+}
+
+static void prep_poll(struct usbrediruring *loop, int op, int fd,
+    short events)
+{
+    struct io_uring_sqe *sqe = get_sqe(loop);
+
+    io_uring_prep_poll_multishot(sqe, fd, events);
+    io_uring_sqe_set_data64(sqe, URING_DATA(op, fd));
+}
+
+static void prep_send(struct usbrediruring *loop)
+{
+    int sending = !loop->send_fill;
+    struct io_uring_sqe *sqe = get_sqe(loop);
+
+    io_uring_prep_send(sqe, loop->fd,
+                       loop->send_buf[sending] + loop->send_off,
+                       loop->send_len[sending] - loop->send_off, MSG_NOSIGNAL);
+    io_uring_sqe_set_data64(sqe, URING_DATA(URING_OP_SEND, loop->fd));
+}
+
+/* Start sending what was gathered, unless a send is still in flight */
+static void start_send(struct usbrediruring *loop)
+{
+    if (loop->send_busy || loop->send_len[loop->send_fill] == 0) {
+        return;
+    }
+    loop->send_fill = !loop->send_fill;
+    loop->send_off = 0;
+    loop->send_busy = true;
+    prep_send(loop);
+}
+
+/* Multishot receive needs Linux 6.0, older kernels fail it with -EINVAL
+   while everything before that worked, so try it on a socketpair first */
+static int probe_recv_multishot(struct usbrediruring *loop)
+{
+    struct io_uring_cqe *cqe;
+    bool more = true;
+    int sv[2], ret = 0;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0) {
+        return -errno;
+    }
+    prep_recv(loop, sv[0]);
+    if (write(sv[1], "", 1) != 1) {
+        ret = -errno;
+    }
+    /* Ends the multishot receive after the byte was received */
+    shutdown(sv[1], SHUT_WR);
+    io_uring_submit(&loop->ring);
+
+    while (more) {
+        int r = io_uring_wait_cqe(&loop->ring, &cqe);
+        if (r < 0) {
+            ret = r;
+            break;
+        }
+        if (cqe->res < 0 && ret == 0) {
+            ret = cqe->res;
+        }
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+            return_buf(loop, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        }
+        more = cqe->flags & IORING_CQE_F_MORE;
+        io_uring_cqe_seen(&loop->ring, cqe);
+    }
+    close(sv[0]);
+    close(sv[1]);
+    return ret;
+}
+
+static struct usbrediruring_fd *find_fd(struct usbrediruring_fd *fds,
+    int count, int fd)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        if (fds[i].fd == fd) {
+            return &fds[i];
+        }
+    }
+    return NULL;
+}
+
+/* libusb's fds do not all poll for POLLIN, usbfs signals completed URBs
+   with POLLOUT, so poll for the events libusb asks for */
+static void LIBUSB_CALL pollfd_added_cb(int fd, short events, void *user_data)
+{
+    struct usbrediruring *loop = user_data;
+    struct usbrediruring_fd *fds;
+
+    fds = realloc(loop->usb_fds, (loop->usb_fd_count + 1) * sizeof(*fds));
+    if (!fds) {
+        loop->error = -ENOMEM;
+        return;
+    }
+    loop->usb_fds = fds;
+    fds[loop->usb_fd_count].fd = fd;
+    fds[loop->usb_fd_count].events = events;
+    loop->usb_fd_count++;
+    prep_poll(loop, URING_OP_POLL_USB, fd, events);
+}
+
+static void LIBUSB_CALL pollfd_removed_cb(int fd, void *user_data)
+{
+    struct usbrediruring *loop = user_data;
+    struct usbrediruring_fd *usb_fd;
+    struct io_uring_sqe *sqe;
+
+    usb_fd = find_fd(loop->usb_fds, loop->usb_fd_count, fd);
+    if (usb_fd) {
+        *usb_fd = loop->usb_fds[--loop->usb_fd_count];
+    }
+
+    sqe = get_sqe(loop);
+    io_uring_prep_poll_remove(sqe, URING_DATA(URING_OP_POLL_USB, fd));
+    io_uring_sqe_set_data64(sqe, URING_DATA(URING_OP_POLL_REMOVE, fd));
+}
+
+int usbrediruring_create(libusb_context *ctx, struct usbredirhost *host,
+    int fd, struct usbrediruring **loop_ret)
+{
+    const struct libusb_pollfd **pollfds;
+    struct usbrediruring *loop;
+    int i, ret;
+
+    loop = calloc(1, sizeof(*loop));
+    if (!loop) {
+        return -ENOMEM;
+    }
+    loop->ctx = ctx;
+    loop->host = host;
+    loop->fd = fd;
+    ret = io_uring_queue_init(URING_ENTRIES, &loop->ring, 0);
+    if (ret < 0) {
+        free(loop);
+        return ret;
+    }
+
+    loop->buf_ring = io_uring_setup_buf_ring(&loop->ring, URING_RECV_BUFS,
+                                             URING_BGID, 0, &ret);
+    if (!loop->buf_ring) {
+        goto error;
+    }
+    loop->recv_bufs = malloc(URING_RECV_BUFS * URING_RECV_BUF_SIZE);
+    loop->send_buf[0] = malloc(URING_SEND_BUF_SIZE);
+    loop->send_buf[1] = malloc(URING_SEND_BUF_SIZE);
+    if (!loop->recv_bufs || !loop->send_buf[0] || !loop->send_buf[1]) {
+        ret = -ENOMEM;
+        goto error;
+    }
+    for (i = 0; i < URING_RECV_BUFS; i++) {
+        return_buf(loop, i);
+    }
+
+    ret = probe_recv_multishot(loop);
+    if (ret < 0) {
+        goto error;
+    }
+
+    pollfds = libusb_get_pollfds(ctx);
+    if (!pollfds) {
+        ret = -ENOMEM;
+        goto error;
+    }
+    for (i = 0; pollfds[i]; i++) {
+        pollfd_added_cb(pollfds[i]->fd, pollfds[i]->events, loop);
+    }
+    libusb_free_pollfds(pollfds);
+    if (loop->error) {
+        ret = loop->error;
+        goto error;
+    }
+    libusb_set_pollfd_notifiers(ctx, pollfd_added_cb, pollfd_removed_cb,
+                                loop);
+    *loop_ret = loop;
+    return 0;
+
+error:
+    usbrediruring_destroy(loop);
+    return ret;
+}
+
+void usbrediruring_destroy(struct usbrediruring *loop)
+{
+    if (!loop) {
+        return;
+    }
+    libusb_set_pollfd_notifiers(loop->ctx, NULL, NULL, NULL);
+    if (loop->buf_ring) {
+        io_uring_free_buf_ring(&loop->ring, loop->buf_ring, URING_RECV_BUFS,
+                               URING_BGID);
+    }
+    io_uring_queue_exit(&loop->ring);
+    free(loop->recv_bufs);
+    free(loop->send_buf[0]);
+    free(loop->send_buf[1]);
+    free(loop->usb_fds);
+    free(loop->fds);
+    free(loop);
+}
+
+int usbrediruring_add_fd(struct usbrediruring *loop, int fd,
+    usbrediruring_fd_func func, void *priv)
+{
+    struct usbrediruring_fd *fds;
+
+    fds = realloc(loop->fds, (loop->fd_count + 1) * sizeof(*fds));
+    if (!fds) {
+        return -ENOMEM;
+    }
+    loop->fds = fds;
+    fds[loop->fd_count].fd = fd;
+    fds[loop->fd_count].events = POLLIN;
+    fds[loop->fd_count].func = func;
+    fds[loop->fd_count].priv = priv;
+    loop->fd_count++;
+    prep_poll(loop, URING_OP_POLL_FD, fd, POLLIN);
+    return 0;
+}
+
+int usbrediruring_read(struct usbrediruring *loop, uint8_t *data, int count)
+{
+    int nbytes = 0;
+
+    while (nbytes < count && loop->recv_count > 0) {
+        uint16_t bid = loop->recv_queue[loop->recv_head].bid;
+        int len = loop->recv_queue[loop->recv_head].len;
+        int n = MIN(count - nbytes, len - loop->recv_off);
+
+        memcpy(data + nbytes, loop->recv_bufs + bid * URING_RECV_BUF_SIZE +
+               loop->recv_off, n);
+        nbytes += n;
+        loop->recv_off += n;
+        if (loop->recv_off == len) {
+            return_buf(loop, bid);
+            loop->recv_head = (loop->recv_head + 1) % URING_RECV_BUFS;
+            loop->recv_count--;
+            loop->recv_off = 0;
+        }
+    }
+    return nbytes;
+}
+
+int usbrediruring_write(struct usbrediruring *loop, uint8_t *data, int count)
+{
+    int fill = loop->send_fill;
+    int nbytes = MIN(count, URING_SEND_BUF_SIZE - loop->send_len[fill]);
+
+    memcpy(loop->send_buf[fill] + loop->send_len[fill], data, nbytes);
+    loop->send_len[fill] += nbytes;
+    return nbytes;
+}
+
+/* Returns what an fd callback returned, errors go to loop->error */
+static int handle_cqe(struct usbrediruring *loop, struct io_uring_cqe *cqe,
+    bool *usb_ready)
+{
+    struct usbrediruring_fd *watch;
+    int fd = URING_DATA_FD(cqe->user_data);
+    bool more = cqe->flags & IORING_CQE_F_MORE;
+    int r = 0;
+
+    switch (URING_DATA_OP(cqe->user_data)) {
+    case URING_OP_RECV:
+        if (cqe->res > 0) {
+            int tail = (loop->recv_head + loop->recv_count) % URING_RECV_BUFS;
+
+            loop->recv_queue[tail].bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            loop->recv_queue[tail].len = cqe->res;
+            loop->recv_count++;
+        } else if (cqe->res == 0) {
+            /* The other side closed the connection */
+            loop->error = -ECONNRESET;
+        } else if (cqe->res != -ENOBUFS) {
+            loop->error = cqe->res;
+        }
+        /* Without more completions coming, including when usbredirhost has
+           not caught up with the buffers yet, re-arm it at the loop start */
+        if (!more) {
+            loop->recv_armed = false;
+        }
+        break;
+    case URING_OP_SEND:
+        if (cqe->res < 0) {
+            loop->error = cqe->res;
+            break;
+        }
+        loop->send_off += cqe->res;
+        if (loop->send_off < loop->send_len[!loop->send_fill]) {
+            prep_send(loop);
+        } else {
+            loop->send_len[!loop->send_fill] = 0;
+            loop->send_busy = false;
+        }
+        break;
+    case URING_OP_POLL_USB:
+        if (cqe->res == -ECANCELED) {
+            /* Removed through pollfd_removed_cb() */
+            break;
+        }
+        *usb_ready = true;
+        /* Gone once libusb removed the fd */
+        watch = find_fd(loop->usb_fds, loop->usb_fd_count, fd);
+        if (!more && watch) {
+            prep_poll(loop, URING_OP_POLL_USB, fd, watch->events);
+        }
+        break;
+    case URING_OP_POLL_FD:
+        watch = find_fd(loop->fds, loop->fd_count, fd);
+        if (!watch) {
+            break;
+        }
+        r = watch->func(watch->priv, fd, cqe->res > 0 ? cqe->res : 0);
+        if (!more) {
+            prep_poll(loop, URING_OP_POLL_FD, fd, POLLIN);
+        }
+        break;
+    }
+    return r;
+}
+
+int usbrediruring_iterate(struct usbrediruring *loop, int timeout)
+{
+    struct io_uring_cqe *cqes[URING_ENTRIES], *cqe;
+    struct __kernel_timespec ts, *tsp = NULL;
+    bool usb_ready = false;
+    int usb_timeout, ret, r = 0;
+    unsigned i, n;
+
+    if (loop->error) {
+        return loop->error;
+    }
+    /* Everything queued by the previous iteration goes out with the same
+       syscall that waits for the next completions */
+    start_send(loop);
+    if (!loop->recv_armed && loop->recv_count < URING_RECV_BUFS) {
+        prep_recv(loop, loop->fd);
+        loop->recv_armed = true;
+    }
+
+    usb_timeout = usbredirepoll_get_usb_timeout(loop->ctx);
+    if (usb_timeout >= 0 && (timeout < 0 || usb_timeout < timeout)) {
+        timeout = usb_timeout;
+    }
+    if (timeout >= 0) {
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (timeout % 1000) * 1000000;
+        tsp = &ts;
+    }
+    ret = io_uring_submit_and_wait_timeout(&loop->ring, &cqe, 1, tsp, NULL);
+    if (ret == -ETIME) {
+        usb_ready = true;
+    } else if (ret < 0 && ret != -EINTR) {
+        return ret;
+    }
+
+    n = io_uring_peek_batch_cqe(&loop->ring, cqes, URING_ENTRIES);
+    for (i = 0; i < n; i++) {
+        int cqe_r = handle_cqe(loop, cqes[i], &usb_ready);
+
+        if (!r) {
+            r = cqe_r;
+        }
+    }
+    io_uring_cq_advance(&loop->ring, n);
+    if (r || loop->error) {
+        return r ? r : loop->error;
+    }
+
+    if (loop->recv_count > 0 && usbredirhost_read_guest_data(loop->host) < 0) {
+        return -EPROTO;
+    }
+
+    if (usb_ready) {
+        struct timeval tv = { 0, 0 };
+
+        ret = libusb_handle_events_timeout_completed(loop->ctx, &tv, NULL);
+        if (ret && ret != LIBUSB_ERROR_INTERRUPTED) {
+            return -EIO;
+        }
+    }
+
+    /* Gather everything the read and the completions above queued */
+    if (usbredirhost_has_data_to_write(loop->host) != 0 &&
+            usbredirhost_write_guest_data(loop->host) < 0) {
+        return -EPROTO;
+    }
+    return loop->error;
+}
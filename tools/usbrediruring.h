@@ -0,0 +1,73 @@
+/* usbrediruring.h usbredirhost single threaded io_uring loop
+
+   Copyright 2026 Red Hat, Inc.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <stdint.h>
+#include <libusb.h>
+#include "usbredirhost.h"
+
+/* The loop of usbredirect --io-uring: like the one of usbredirepoll.h
+   everything runs on the thread calling usbrediruring_iterate(), but the
+   connection is read with a multishot receive into a ring of provided
+   buffers, which usbredirhost then reads from without any syscalls, and
+   usbredirhost's writes are gathered into a buffer which gets sent while
+   the next one is being filled. libusb's fds and the fds the caller adds
+   are watched with multishot polls on the same ring, so one
+   io_uring_enter() submits the sends and receives and waits for the next
+   batch of completions.
+
+   The connection must be a socket, and the read and write callbacks of
+   usbredirhost must call usbrediruring_read() and usbrediruring_write().
+   usbredirhost gets opened without locks and without a write flush
+   callback. The loop sets the pollfd notifiers of the libusb context, so
+   there can only be one loop per context. None of these functions lock,
+   they must all be called from the same thread. */
+
+struct usbrediruring;
+
+/* Called from usbrediruring_iterate() with the poll events of an fd added
+   with usbrediruring_add_fd(). Returns 0 to go on, anything else ends the
+   iteration and gets returned by usbrediruring_iterate(). */
+typedef int (*usbrediruring_fd_func)(void *priv, int fd, uint32_t events);
+
+/* Returns 0 on success or -errno, e.g. -EINVAL when the kernel lacks the
+   multishot receive of Linux 6.0 */
+int usbrediruring_create(libusb_context *ctx, struct usbredirhost *host,
+    int fd, struct usbrediruring **loop);
+
+/* Does not close the connection */
+void usbrediruring_destroy(struct usbrediruring *loop);
+
+/* Watches fd for POLLIN. Returns 0 on success or -errno. */
+int usbrediruring_add_fd(struct usbrediruring *loop, int fd,
+    usbrediruring_fd_func func, void *priv);
+
+/* For the usbredirhost read callback, copies from the received buffers */
+int usbrediruring_read(struct usbrediruring *loop, uint8_t *data, int count);
+
+/* For the usbredirhost write callback, gathers into the send buffer being
+   filled, returns 0 when it is full */
+int usbrediruring_write(struct usbrediruring *loop, uint8_t *data, int count);
+
+/* Like usbredirepoll_iterate(): waits at most timeout ms, -1 for no limit,
+   handles what completed and sends what got queued. Returns 0, what an fd
+   callback returned, or -ECONNRESET when the other side closed the
+   connection, -EPROTO when usbredirhost failed to read or write, -EIO when
+   handling the USB events failed and -errno when io_uring or a receive or
+   send failed. */
+int usbrediruring_iterate(struct usbrediruring *loop, int timeout);
@@ -0,0 +1,44 @@
+/* usbredirworker.c usbredirhost instances sharing a libusb context
+
+   Copyright 2026 Red Hat, Inc.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include "usbredirworker.h"
+
+int usbredirworker_handle_usb_events(libusb_context *ctx, int timeout,
+    struct usbredirhost **hosts, int n_hosts,
+    usbredirworker_write_failed_func write_failed_func, void *priv)
+{
+    struct timeval tv = { timeout / 1000, (timeout % 1000) * 1000 };
+    int i, r;
+
+    r = libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+    if (r == LIBUSB_ERROR_INTERRUPTED) {
+        r = 0;
+    }
+
+    /* Like in the epoll loop, write everything the completions queued */
+    for (i = 0; i < n_hosts; i++) {
+        if (!hosts[i] || usbredirhost_has_data_to_write(hosts[i]) == 0) {
+            continue;
+        }
+        if (usbredirhost_write_guest_data(hosts[i]) < 0) {
+            write_failed_func(priv, i);
+        }
+    }
+    return r;
+}
@@ -0,0 +1,40 @@
+/* usbredirworker.h usbredirhost instances sharing a libusb context
+
+   Copyright 2026 Red Hat, Inc.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <libusb.h>
+#include "usbredirhost.h"
+
+/* The core of a usbredirect --daemon worker: a thread which owns a libusb
+   context and the usbredirhost instances of all devices opened through it,
+   which get opened without locks and without a write flush callback. So
+   once the USB events are handled, everything the completions queued gets
+   written, for all devices at once. */
+
+/* Called for the host at index when writing to its usb-guest failed */
+typedef void (*usbredirworker_write_failed_func)(void *priv, int index);
+
+/* Waits at most timeout ms, 0 for not at all, for the USB events of ctx
+   and handles them, then writes what got queued for each of the n_hosts
+   hosts, NULL for devices without a session. A host whose write failed
+   gets reported through write_failed_func, the others still get written.
+   Returns 0 or the libusb error of handling the events, which also still
+   writes. */
+int usbredirworker_handle_usb_events(libusb_context *ctx, int timeout,
+    struct usbredirhost **hosts, int n_hosts,
+    usbredirworker_write_failed_func write_failed_func, void *priv);
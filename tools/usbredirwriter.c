@@ -0,0 +1,174 @@
+/* usbredirwriter.c usbredirhost writer thread
+
+   Copyright 2026 Red Hat, Inc.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "usbredirwriter.h"
+
+struct usbredirwriter {
+    usbredirwriter_start_func start_func;
+    usbredirwriter_failed_func failed_func;
+    void *priv;
+    /* Signalled by usbredirwriter_flush(), once until the thread reads it */
+    int event_fd;
+    int pending;
+    struct usbredirhost *host;
+    int fd;
+    pthread_t thread;
+    bool started;
+    int run;
+};
+
+static void signal_thread(struct usbredirwriter *writer)
+{
+    uint64_t one = 1;
+    ssize_t r;
+
+    /* Can only fail when the counter would overflow, the thread then
+       still has to read it */
+    r = write(writer->event_fd, &one, sizeof(one));
+    (void)r;
+}
+
+static void *writer_thread(void *arg)
+{
+    struct usbredirwriter *writer = arg;
+    bool blocked = false;
+    int error = 0;
+
+    if (writer->start_func) {
+        writer->start_func(writer->priv);
+    }
+
+    while (__atomic_load_n(&writer->run, __ATOMIC_ACQUIRE)) {
+        struct pollfd fds[2] = {
+            { .fd = writer->event_fd, .events = POLLIN },
+            { .fd = writer->fd, .events = POLLOUT },
+        };
+        uint64_t count;
+
+        if (poll(fds, blocked ? 2 : 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error = -errno;
+            break;
+        }
+        if (fds[0].revents & POLLIN) {
+            /* Reset the eventfd before clearing pending, a flush after that
+               signals it again, one before it gets written below */
+            if (read(writer->event_fd, &count, sizeof(count)) < 0 &&
+                    errno != EAGAIN) {
+                error = -errno;
+                break;
+            }
+            __atomic_store_n(&writer->pending, 0, __ATOMIC_RELEASE);
+        }
+        if (!__atomic_load_n(&writer->run, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        if (usbredirhost_write_guest_data(writer->host) < 0) {
+            error = -EPROTO;
+            break;
+        }
+        blocked = usbredirhost_has_data_to_write(writer->host) != 0;
+    }
+    /* Unless asked to stop */
+    if (error && __atomic_load_n(&writer->run, __ATOMIC_ACQUIRE)) {
+        writer->failed_func(writer->priv, error);
+    }
+    return NULL;
+}
+
+int usbredirwriter_create(usbredirwriter_start_func start_func,
+    usbredirwriter_failed_func failed_func, void *priv,
+    struct usbredirwriter **writer_ret)
+{
+    struct usbredirwriter *writer;
+
+    writer = calloc(1, sizeof(*writer));
+    if (!writer) {
+        return -ENOMEM;
+    }
+    writer->start_func = start_func;
+    writer->failed_func = failed_func;
+    writer->priv = priv;
+    writer->fd = -1;
+    writer->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (writer->event_fd < 0) {
+        int r = -errno;
+
+        free(writer);
+        return r;
+    }
+    *writer_ret = writer;
+    return 0;
+}
+
+void usbredirwriter_destroy(struct usbredirwriter *writer)
+{
+    if (!writer) {
+        return;
+    }
+    usbredirwriter_stop(writer);
+    close(writer->event_fd);
+    free(writer);
+}
+
+void usbredirwriter_flush(struct usbredirwriter *writer)
+{
+    if (__atomic_exchange_n(&writer->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+        signal_thread(writer);
+    }
+}
+
+int usbredirwriter_start(struct usbredirwriter *writer,
+    struct usbredirhost *host, int fd)
+{
+    int r;
+
+    if (writer->started) {
+        return 0;
+    }
+    writer->host = host;
+    writer->fd = fd;
+    __atomic_store_n(&writer->run, 1, __ATOMIC_RELEASE);
+    r = pthread_create(&writer->thread, NULL, writer_thread, writer);
+    if (r != 0) {
+        return -r;
+    }
+    writer->started = true;
+    return 0;
+}
+
+void usbredirwriter_stop(struct usbredirwriter *writer)
+{
+    if (!writer->started) {
+        return;
+    }
+    __atomic_store_n(&writer->run, 0, __ATOMIC_RELEASE);
+    signal_thread(writer);
+    pthread_join(writer->thread, NULL);
+    writer->started = false;
+}
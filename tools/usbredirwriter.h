@@ -0,0 +1,63 @@
+/* usbredirwriter.h usbredirhost writer thread
+
+   Copyright 2026 Red Hat, Inc.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include "usbredirhost.h"
+
+/* The thread of usbredirect --writer-thread: usbredirwriter_flush(), which
+   is meant as the write flush callback of a locked usbredirhost, only
+   signals an eventfd, so the libusb event thread goes back to handling
+   completions right away, and the writer thread writes everything which
+   got queued in the meantime in one go. When the connection does not take
+   more data it also waits for the connection to become writable, so the
+   caller only needs to watch for input. */
+
+struct usbredirwriter;
+
+/* Called on the writer thread once it runs, e.g. to set its scheduling */
+typedef void (*usbredirwriter_start_func)(void *priv);
+
+/* Called on the writer thread when it gives up, with -EPROTO when
+   usbredirhost failed to write and -errno when poll() failed. The thread
+   ends after this, usbredirwriter_stop() still needs to be called. */
+typedef void (*usbredirwriter_failed_func)(void *priv, int error);
+
+/* Creates the eventfd, the thread only gets started by
+   usbredirwriter_start(), so this can be done before the usbredirhost
+   which flushes through it gets opened. start_func may be NULL. Returns 0
+   on success or -errno. */
+int usbredirwriter_create(usbredirwriter_start_func start_func,
+    usbredirwriter_failed_func failed_func, void *priv,
+    struct usbredirwriter **writer);
+
+/* Stops the thread, does not close fd */
+void usbredirwriter_destroy(struct usbredirwriter *writer);
+
+/* For the usbredirhost write flush callback, may be called from any
+   thread, also before usbredirwriter_start(). Whatever got flushed before
+   the thread started gets written once it runs. */
+void usbredirwriter_flush(struct usbredirwriter *writer);
+
+/* Starts the thread writing the data host queued to the connection fd.
+   Returns 0 on success, also when it already runs, or -errno. */
+int usbredirwriter_start(struct usbredirwriter *writer,
+    struct usbredirhost *host, int fd);
+
+/* Stops the thread and waits for it to end, does nothing when it does not
+   run. It must not be called from start_func or failed_func. */
+void usbredirwriter_stop(struct usbredirwriter *writer);
@@ -0,0 +1,293 @@
+/* usbredirzerocopy.c usbredir MSG_ZEROCOPY sender
+
+   Copyright 2026 Red Hat, Inc.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#define _GNU_SOURCE
+#include "config.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#include "usbredirzerocopy.h"
+
+/* Older C libraries do not know these yet */
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+
+struct usbredirzerocopy_buf {
+    struct usbredirzerocopy_buf *next;
+    uint8_t *data;
+    int len;
+    int pos;
+    bool zerocopy;      /* Some of data was sent with MSG_ZEROCOPY */
+    uint32_t seq;       /* The last MSG_ZEROCOPY send of data */
+};
+
+/* A list with a pointer to the next pointer of its last element */
+struct usbredirzerocopy_list {
+    struct usbredirzerocopy_buf *head;
+    struct usbredirzerocopy_buf **tail;
+};
+
+struct usbredirzerocopy {
+    int fd;
+    int threshold;
+    int flags;
+    usbredirzerocopy_free_buffer free_buffer;
+    void *priv;
+    int error;
+    /* Buffers to send and buffers waiting for their completion */
+    struct usbredirzerocopy_list queue;
+    struct usbredirzerocopy_list sent;
+    uint64_t queued_bytes;
+    /* The kernel numbers the MSG_ZEROCOPY sends of a socket from 0 on, a
+       completion covers the range from ee_info to ee_data */
+    uint32_t next_seq;
+    uint32_t completed;     /* All sends before this one completed */
+    struct usbredirzerocopy_stats stats;
+};
+
+static void list_init(struct usbredirzerocopy_list *list)
+{
+    list->head = NULL;
+    list->tail = &list->head;
+}
+
+static void list_append(struct usbredirzerocopy_list *list,
+    struct usbredirzerocopy_buf *buf)
+{
+    buf->next = NULL;
+    *list->tail = buf;
+    list->tail = &buf->next;
+}
+
+static struct usbredirzerocopy_buf *list_pop(
+    struct usbredirzerocopy_list *list)
+{
+    struct usbredirzerocopy_buf *buf = list->head;
+
+    list->head = buf->next;
+    if (!list->head) {
+        list->tail = &list->head;
+    }
+    return buf;
+}
+
+static void free_buf(struct usbredirzerocopy *zc,
+    struct usbredirzerocopy_buf *buf)
+{
+    zc->free_buffer(zc->priv, buf->data);
+    free(buf);
+}
+
+int usbredirzerocopy_create(int fd, int threshold, int flags,
+    usbredirzerocopy_free_buffer free_buffer, void *priv,
+    struct usbredirzerocopy **zc_ret)
+{
+    struct usbredirzerocopy *zc;
+    int one = 1;
+
+    if (threshold > 0 &&
+            setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) != 0) {
+        return -errno;
+    }
+    zc = calloc(1, sizeof(*zc));
+    if (!zc) {
+        return -ENOMEM;
+    }
+    zc->fd = fd;
+    zc->threshold = threshold;
+    zc->flags = flags;
+    zc->free_buffer = free_buffer;
+    zc->priv = priv;
+    list_init(&zc->queue);
+    list_init(&zc->sent);
+    *zc_ret = zc;
+    return 0;
+}
+
+void usbredirzerocopy_destroy(struct usbredirzerocopy *zc)
+{
+    if (!zc) {
+        return;
+    }
+    while (zc->queue.head) {
+        free_buf(zc, list_pop(&zc->queue));
+    }
+    while (zc->sent.head) {
+        free_buf(zc, list_pop(&zc->sent));
+    }
+    free(zc);
+}
+
+int usbredirzerocopy_flush(struct usbredirzerocopy *zc)
+{
+    struct usbredirzerocopy_buf *buf;
+    bool zerocopy;
+    ssize_t r;
+
+    if (zc->error) {
+        return zc->error;
+    }
+    while ((buf = zc->queue.head)) {
+        zerocopy = zc->threshold > 0 && buf->len >= zc->threshold;
+retry:
+        r = send(zc->fd, buf->data + buf->pos, buf->len - buf->pos,
+                 MSG_DONTWAIT | MSG_NOSIGNAL | (zerocopy ? MSG_ZEROCOPY : 0));
+        if (r < 0) {
+            if (errno == EINTR) {
+                goto retry;
+            }
+            /* Out of pages the socket may pin, copy this one */
+            if (errno == ENOBUFS && zerocopy) {
+                zerocopy = false;
+                goto retry;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            zc->error = -errno;
+            return zc->error;
+        }
+        if (zerocopy) {
+            buf->zerocopy = true;
+            buf->seq = zc->next_seq++;
+            zc->stats.zerocopy_sends++;
+        } else {
+            zc->stats.copy_sends++;
+        }
+        buf->pos += r;
+        zc->queued_bytes -= r;
+        if (buf->pos < buf->len) {
+            /* The socket is full */
+            return 0;
+        }
+        list_pop(&zc->queue);
+        if (buf->zerocopy) {
+            list_append(&zc->sent, buf);
+        } else {
+            free_buf(zc, buf);
+        }
+    }
+    return 0;
+}
+
+int usbredirzerocopy_write(struct usbredirzerocopy *zc, uint8_t *data,
+    int count)
+{
+    struct usbredirzerocopy_buf *buf;
+
+    if (zc->error) {
+        return zc->error;
+    }
+    buf = calloc(1, sizeof(*buf));
+    if (!buf) {
+        return -ENOMEM;
+    }
+    buf->data = data;
+    buf->len = count;
+    list_append(&zc->queue, buf);
+    zc->queued_bytes += count;
+
+    /* data is ours now, a failed send shows up on the next call */
+    usbredirzerocopy_flush(zc);
+    return count;
+}
+
+int usbredirzerocopy_complete(struct usbredirzerocopy *zc)
+{
+    union {
+        char buf[CMSG_SPACE(sizeof(struct sock_extended_err) +
+                            sizeof(struct sockaddr_in6))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct sock_extended_err serr;
+    int count = 0;
+
+    for (;;) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        if (recvmsg(zc->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return -errno;
+        }
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+                cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (!(cmsg->cmsg_level == SOL_IP &&
+                  cmsg->cmsg_type == IP_RECVERR) &&
+                !(cmsg->cmsg_level == SOL_IPV6 &&
+                  cmsg->cmsg_type == IPV6_RECVERR)) {
+                continue;
+            }
+            memcpy(&serr, CMSG_DATA(cmsg), sizeof(serr));
+            if (serr.ee_origin != SO_EE_ORIGIN_ZEROCOPY ||
+                    serr.ee_errno != 0) {
+                continue;
+            }
+            if (serr.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                zc->stats.copied += serr.ee_data - serr.ee_info + 1;
+                if (!(zc->flags & usbredirzerocopy_fl_keep_on_copy)) {
+                    zc->threshold = 0;
+                }
+            }
+            /* TCP completes its sends in order, so this covers all sends
+               up to ee_data */
+            if ((int32_t)(serr.ee_data + 1 - zc->completed) > 0) {
+                zc->completed = serr.ee_data + 1;
+            }
+            count++;
+        }
+    }
+
+    while (zc->sent.head &&
+           (int32_t)(zc->sent.head->seq - zc->completed) < 0) {
+        free_buf(zc, list_pop(&zc->sent));
+    }
+    return count;
+}
+
+uint64_t usbredirzerocopy_get_buffered_size(struct usbredirzerocopy *zc)
+{
+    return zc->queued_bytes;
+}
+
+void usbredirzerocopy_get_stats(struct usbredirzerocopy *zc,
+    struct usbredirzerocopy_stats *stats)
+{
+    *stats = zc->stats;
+}
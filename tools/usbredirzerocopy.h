@@ -0,0 +1,89 @@
+/* usbredirzerocopy.h usbredir MSG_ZEROCOPY sender
+
+   Copyright 2026 Red Hat, Inc.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <stdint.h>
+
+/* Sends the write buffers of a usbredirparser or usbredirhost over a
+   connected TCP socket, the ones of at least a threshold size with
+   MSG_ZEROCOPY, so that the kernel sends them from the buffer instead of
+   copying them first.
+
+   The kernel then keeps using the buffer after send() returned, until it
+   reports on the socket's error queue that it is done with it. So this is
+   used with usbredirparser_fl_write_cb_owns_buffer, resp.
+   usbredirhost_fl_write_cb_owns_buffer: usbredirzerocopy_write() takes
+   every buffer the write callback gets and queues it, sends what the
+   socket takes and hands the buffers back to free_buffer once they are
+   sent, or for MSG_ZEROCOPY, once the kernel reported their completion.
+
+   Completions make the socket poll POLLERR, call usbredirzerocopy_complete()
+   for it. When the kernel had to copy the data anyway, like it does for
+   loopback connections, this stops using MSG_ZEROCOPY, as that is slower
+   than a plain send, unless usbredirzerocopy_fl_keep_on_copy is passed.
+
+   None of these functions lock, when using them from more than one thread
+   the caller must serialize the calls. */
+
+struct usbredirzerocopy;
+
+typedef void (*usbredirzerocopy_free_buffer)(void *priv, uint8_t *data);
+
+struct usbredirzerocopy_stats {
+    uint64_t zerocopy_sends;    /* send() calls with MSG_ZEROCOPY */
+    uint64_t copy_sends;        /* send() calls without it */
+    uint64_t copied;            /* MSG_ZEROCOPY sends the kernel copied */
+};
+
+enum {
+    usbredirzerocopy_fl_keep_on_copy = 0x01,
+};
+
+/* Sets SO_ZEROCOPY on the connected TCP socket fd. Buffers of at least
+   threshold bytes get sent with MSG_ZEROCOPY, with a threshold of 0 none
+   do and the socket is left alone. Returns 0 on success or -errno, e.g.
+   -ENOPROTOOPT when the kernel does not support MSG_ZEROCOPY. */
+int usbredirzerocopy_create(int fd, int threshold, int flags,
+    usbredirzerocopy_free_buffer free_buffer, void *priv,
+    struct usbredirzerocopy **zc);
+
+/* Frees the buffers which are still queued or waiting for their completion.
+   Does not close the socket. */
+void usbredirzerocopy_destroy(struct usbredirzerocopy *zc);
+
+/* For the usbredirparser write callback: takes over data, queues it and
+   sends as much of the queue as the socket takes. Returns count, or -errno
+   when an earlier send failed, in which case data was not taken. */
+int usbredirzerocopy_write(struct usbredirzerocopy *zc, uint8_t *data,
+    int count);
+
+/* Sends as much of the queue as the socket takes, call it when the socket
+   is writable. Returns 0 on success or -errno. */
+int usbredirzerocopy_flush(struct usbredirzerocopy *zc);
+
+/* Reads the completions from the socket's error queue and frees the
+   buffers the kernel is done with. Returns the number of completions
+   read, 0 when the POLLERR was not for one of them, or -errno. */
+int usbredirzerocopy_complete(struct usbredirzerocopy *zc);
+
+/* The number of queued bytes not sent yet, for
+   usbredirhost_set_buffered_output_size_cb() */
+uint64_t usbredirzerocopy_get_buffered_size(struct usbredirzerocopy *zc);
+
+void usbredirzerocopy_get_stats(struct usbredirzerocopy *zc,
+    struct usbredirzerocopy_stats *stats);
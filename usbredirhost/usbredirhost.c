@@ -24,11 +24,21 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
 #include <inttypes.h>
+#include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
 #include "usbredirhost.h"
+#include "usbredirtrace.h"
 
 #define MAX_ENDPOINTS        32
 #define MAX_INTERFACES       32 /* Max 32 endpoints and thus interfaces */
@@ -42,6 +52,12 @@
 #define INTERRUPT_TRANSFER_COUNT   5
 /* Special packet_idx value indicating a submitted transfer */
 #define SUBMITTED_IDX             -1
+/* Freed usbfs memory buffers kept for reuse, see usbredirhost_alloc_dev_mem */
+#define DEV_MEM_POOL_SIZE          8
+#define DEV_MEM_POOL_BYTES  (1024 * 1024)
+#define DEV_MEM_ALIGN           4096
+/* GET_DESCRIPTOR replies kept around, see usbredirhost_desc_cache_reply */
+#define DESC_CACHE_SIZE           32
 
 /* quirk flags */
 #define QUIRK_DO_NOT_RESET    0x01
@@ -72,12 +88,42 @@
 #define CLAMP(val, min, max) \
 	((val) < (min) ? (min) : ((val) > (max) ? (max) : (val)))
 
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+
+/* Latency histograms use 2^LATENCY_SUB_BITS linear sub-buckets per power of
+   two, covering 0 ns up to 2^LATENCY_MAX_BITS ns (about 18 minutes) */
+#define LATENCY_SUB_BITS            3
+#define LATENCY_MAX_BITS           40
+#define LATENCY_TYPE_COUNT          4 /* control, iso, bulk, interrupt */
+
+USBREDIR_TRACE_SEMAPHORE(submit);
+USBREDIR_TRACE_SEMAPHORE(complete);
+USBREDIR_TRACE_SEMAPHORE(cancel);
+USBREDIR_TRACE_SEMAPHORE(stall);
+USBREDIR_TRACE_SEMAPHORE(iso_drop);
+USBREDIR_TRACE_SEMAPHORE(stream_drop);
+
+/* pcap / usbmon capture format constants */
+#define CAPTURE_PCAP_MAGIC      0xa1b2c3d4
+#define CAPTURE_LINKTYPE_USBMON        220 /* LINKTYPE_USB_LINUX_MMAPPED */
+#define CAPTURE_PCAP_HDR_SIZE           16 /* Per record header */
+#define CAPTURE_USBMON_HDR_SIZE         64
+#define CAPTURE_ISO_DESC_SIZE           16
+#define CAPTURE_MAX_RING_SIZE    (1 << 20)
+#define CAPTURE_MAX_SNAPLEN      (1 << 24)
+
 struct usbredirtransfer {
     struct usbredirhost *host;        /* Back pointer to the the redirhost */
     struct libusb_transfer *transfer; /* Back pointer to the libusb transfer */
     uint64_t id;
     uint8_t cancelled;
+    uint8_t migrate; /* Keep it for usbredirhost_serialize, see there */
+    uint8_t locked; /* transfer->buffer is mlocked */
+    int dev_mem_size; /* Size of transfer->buffer if it is usbfs memory */
     int packet_idx;
+    uint64_t submit_time; /* Only set when latency stats are enabled */
     union {
         struct usb_redir_control_packet_header control_packet;
         struct usb_redir_bulk_packet_header bulk_packet;
@@ -103,6 +149,15 @@ struct usbredirhost_ep {
     struct usbredirtransfer *transfer[MAX_TRANSFER_COUNT];
 };
 
+struct usbredirhost_desc {
+    uint8_t requesttype;
+    uint16_t value;
+    uint16_t index;
+    bool complete; /* data is the whole descriptor, not only its start */
+    int len;
+    uint8_t *data;
+};
+
 struct usbredirhost {
     struct usbredirparser *parser;
 
@@ -128,12 +183,35 @@ struct usbredirhost {
     int reset;
     int disconnected;
     int read_status;
+    /* See usbredirhost_suspend, the flush_writes callback may check it from
+       another thread */
+    atomic_int suspended;
+    int migrated; /* See usbredirhost_serialize */
+    /* With usbredirhost_fl_write_cb_owns_buffer: the write buffers the
+       write callback took and did not give back yet, and a reference for
+       each of them plus one for the open usbredirhost, see
+       usbredirhost_free_write_buffer */
+    atomic_int write_buffers;
+    atomic_int refs;
     int cancels_pending;
     int wait_disconnect;
     int connect_pending;
+    bool mlock_warned;
+    int dev_mem_state; /* 0: not tried yet, 1: works, -1: not available */
+    struct {
+        unsigned char *buffer;
+        int size;
+    } dev_mem_pool[DEV_MEM_POOL_SIZE];
+    int dev_mem_pool_count;
+    int dev_mem_pool_bytes;
+    struct usbredirhost_desc desc_cache[DESC_CACHE_SIZE];
+    int desc_cache_count;
+    int desc_cache_next; /* The entry to replace once the cache is full */
     struct usbredirhost_ep endpoint[MAX_ENDPOINTS];
     uint8_t alt_setting[MAX_INTERFACES];
     struct usbredirtransfer transfers_head;
+    /* The pending transfers usbredirhost_serialize took back */
+    struct usbredirtransfer migrate_head;
     struct usbredirfilter_rule *filter_rules;
     int filter_rules_count;
     struct {
@@ -141,6 +219,76 @@ struct usbredirhost {
         uint64_t lower;
         bool dropping;
     } iso_threshold;
+    struct usbredirhost_latency *latency;
+    _Atomic(struct usbredirhost_capture *) capture;
+};
+
+struct usbredirhost_latency {
+    void *lock;
+    struct usbredirhost_latency_histogram
+        hist[LATENCY_TYPE_COUNT][usbredirhost_latency_stage_count];
+};
+
+/* The record header of the Linux usbmon binary interface, see
+   Documentation/usb/usbmon.rst in the Linux kernel sources */
+struct usbredirhost_usbmon_header {
+    uint64_t id;
+    uint8_t type;          /* 'S'ubmit, 'C'omplete or 'E'rror */
+    uint8_t xfer_type;     /* iso 0, interrupt 1, control 2, bulk 3 */
+    uint8_t epnum;
+    uint8_t devnum;
+    uint16_t busnum;
+    char flag_setup;
+    char flag_data;
+    int64_t ts_sec;
+    int32_t ts_usec;
+    int32_t status;
+    uint32_t length;
+    uint32_t len_cap;
+    union {
+        uint8_t setup[8];
+        struct {
+            int32_t error_count;
+            int32_t numdesc;
+        } iso;
+    } s;
+    int32_t interval;
+    int32_t start_frame;
+    uint32_t xfer_flags;
+    uint32_t ndesc;
+};
+
+struct usbredirhost_usbmon_iso_desc {
+    int32_t status;
+    uint32_t offset;
+    uint32_t len;
+    uint32_t pad;
+};
+
+/* A slot in the capture ring, data holds a complete pcap record: a pcap
+   record header, followed by the usbmon header, the iso descriptors (if
+   any) and the captured data */
+struct usbredirhost_capture_slot {
+    atomic_size_t seq;
+    unsigned int len;
+    uint8_t data[];
+};
+
+/* Bounded multi-producer single-consumer ring, as described by Dmitry Vyukov:
+   each slot has a sequence number, which tells producers when the slot is
+   free for position pos (seq == pos) and the consumer when it has been
+   filled (seq == pos + 1). Producers claim a position by a compare and swap
+   on head, the consumer owns tail. */
+struct usbredirhost_capture {
+    atomic_int enabled;
+    atomic_size_t head;
+    atomic_uint_fast64_t drops;
+    size_t tail;
+    size_t mask;
+    size_t slot_size;
+    unsigned int snaplen;
+    int header_written;
+    uint8_t *slots;
 };
 
 struct usbredirhost_dev_ids {
@@ -181,10 +329,27 @@ va_log(struct usbredirhost *host, int level, const char *fmt, ...)
 #ifdef ERROR /* defined on WIN32 */
 #undef ERROR
 #endif
-#define ERROR(...)   va_log(host, usbredirparser_error, __VA_ARGS__)
-#define WARNING(...) va_log(host, usbredirparser_warning, __VA_ARGS__)
-#define INFO(...)    va_log(host, usbredirparser_info, __VA_ARGS__)
-#define DEBUG(...)   va_log(host, usbredirparser_debug, __VA_ARGS__)
+/* Check the level before calling va_log, so that the arguments of messages
+   which won't get logged are not evaluated and nothing gets formatted */
+#define LOG(level, ...) \
+    do { \
+        if ((level) <= host->verbose) \
+            va_log(host, (level), __VA_ARGS__); \
+    } while (0)
+
+#define ERROR(...)   LOG(usbredirparser_error, __VA_ARGS__)
+#define WARNING(...) LOG(usbredirparser_warning, __VA_ARGS__)
+#define INFO(...)    LOG(usbredirparser_info, __VA_ARGS__)
+#ifdef DISABLE_DEBUG_LOG
+/* Still let the compiler see (and type check) the arguments */
+#define DEBUG(...) \
+    do { \
+        if (0) \
+            va_log(host, usbredirparser_debug, __VA_ARGS__); \
+    } while (0)
+#else
+#define DEBUG(...)   LOG(usbredirparser_debug, __VA_ARGS__)
+#endif
 
 static void usbredirhost_hello(void *priv, struct usb_redir_hello_header *h);
 static void usbredirhost_reset(void *priv);
@@ -237,6 +402,10 @@ static int usbredirhost_cancel_pending_urbs(struct usbredirhost *host,
                                             int notify_guest);
 static void usbredirhost_wait_for_cancel_completion(struct usbredirhost *host);
 static void usbredirhost_clear_device(struct usbredirhost *host);
+static void usbredirhost_free_migrated_transfers(struct usbredirhost *host);
+static void usbredirhost_resubmit_migrated_transfers(
+    struct usbredirhost *host);
+static void usbredirhost_free_dev_mem_pool(struct usbredirhost *host);
 
 static void usbredirhost_log(void *priv, int level, const char *msg)
 {
@@ -249,6 +418,10 @@ static int usbredirhost_read(void *priv, uint8_t *data, int count)
 {
     struct usbredirhost *host = priv;
 
+    if (atomic_load(&host->suspended)) {
+        return 0;
+    }
+
     if (host->read_status) {
         int ret = host->read_status;
         host->read_status = 0;
@@ -258,11 +431,383 @@ static int usbredirhost_read(void *priv, uint8_t *data, int count)
     return host->read_func(host->func_priv, data, count);
 }
 
+/* Called with the parser's write lock held, see usbredirhost_suspend */
 static int usbredirhost_write(void *priv, uint8_t *data, int count)
 {
     struct usbredirhost *host = priv;
+    int r;
+
+    if (atomic_load(&host->suspended)) {
+        return 0;
+    }
+
+    /* Before handing it over, the callback may give it back right away */
+    if (host->flags & usbredirhost_fl_write_cb_owns_buffer) {
+        atomic_fetch_add(&host->refs, 1);
+        atomic_fetch_add(&host->write_buffers, 1);
+    }
+    r = host->write_func(host->func_priv, data, count);
+    if ((host->flags & usbredirhost_fl_write_cb_owns_buffer) && r <= 0) {
+        atomic_fetch_sub(&host->write_buffers, 1);
+        atomic_fetch_sub(&host->refs, 1);
+    }
+    return r;
+}
+
+/**************************************************************************/
+
+static uint64_t usbredirhost_get_time(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER freq, count;
+
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return (uint64_t)((double)count.QuadPart * 1000000000.0 / freq.QuadPart);
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/* Returns 0 when latency stats are disabled, so that callers can pass the
+   result on unconditionally */
+static uint64_t usbredirhost_latency_time(struct usbredirhost *host)
+{
+    return host->latency ? usbredirhost_get_time() : 0;
+}
+
+static int usbredirhost_latency_bucket(uint64_t ns)
+{
+    int msb = LATENCY_SUB_BITS;
+
+    if (ns < (1 << LATENCY_SUB_BITS))
+        return ns;
+
+    while (msb < 63 && (ns >> (msb + 1)))
+        msb++;
+
+    if (msb >= LATENCY_MAX_BITS)
+        return USBREDIRHOST_LATENCY_BUCKETS - 1;
+
+    return ((msb - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS) +
+           ((ns >> (msb - LATENCY_SUB_BITS)) & ((1 << LATENCY_SUB_BITS) - 1));
+}
+
+/* Note caller must hold the latency lock */
+static void usbredirhost_latency_add_unlocked(struct usbredirhost *host,
+    uint8_t type, int stage, uint64_t start, uint64_t end)
+{
+    struct usbredirhost_latency_histogram *hist;
+    uint64_t ns = (end > start) ? end - start : 0;
+
+    hist = &host->latency->hist[type][stage];
+    if (hist->count == 0 || ns < hist->min_ns)
+        hist->min_ns = ns;
+    if (ns > hist->max_ns)
+        hist->max_ns = ns;
+    hist->count++;
+    hist->sum_ns += ns;
+    hist->bucket[usbredirhost_latency_bucket(ns)]++;
+}
+
+static void usbredirhost_latency_add(struct usbredirhost *host,
+    uint8_t type, int stage, uint64_t start, uint64_t end)
+{
+    struct usbredirhost_latency *latency = host->latency;
+
+    if (!latency || !start || type >= LATENCY_TYPE_COUNT)
+        return;
+
+    if (latency->lock)
+        host->parser->lock_func(latency->lock);
+    usbredirhost_latency_add_unlocked(host, type, stage, start, end);
+    if (latency->lock)
+        host->parser->unlock_func(latency->lock);
+}
+
+static uint8_t usbredirhost_latency_type(struct usbredirtransfer *transfer)
+{
+    /* The libusb and usb_redir transfer types match, except for streams */
+    if (transfer->transfer->type > LIBUSB_TRANSFER_TYPE_INTERRUPT)
+        return usb_redir_type_bulk;
+    return transfer->transfer->type;
+}
+
+/* Called just before handing a transfer to libusb, parse_time is the time
+   the guest packet which caused the transfer was parsed (or 0) */
+static void usbredirhost_latency_submit(struct usbredirhost *host,
+    struct usbredirtransfer *transfer, uint64_t parse_time)
+{
+    if (!host->latency)
+        return;
+
+    transfer->submit_time = usbredirhost_get_time();
+    usbredirhost_latency_add(host, usbredirhost_latency_type(transfer),
+                             usbredirhost_latency_stage_submit,
+                             parse_time, transfer->submit_time);
+}
+
+/* Called on entry of the completion handler, returns the completion time */
+static uint64_t usbredirhost_latency_complete(struct usbredirhost *host,
+    struct usbredirtransfer *transfer)
+{
+    uint64_t now;
+
+    if (!host->latency || !transfer->submit_time)
+        return 0;
+
+    now = usbredirhost_get_time();
+    usbredirhost_latency_add(host, usbredirhost_latency_type(transfer),
+                             usbredirhost_latency_stage_device,
+                             transfer->submit_time, now);
+    return now;
+}
+
+/* Called after queuing the reply for a transfer completed at complete_time */
+static void usbredirhost_latency_queued(struct usbredirhost *host,
+    uint8_t type, uint64_t complete_time)
+{
+    if (!complete_time)
+        return;
+
+    usbredirhost_latency_add(host, type, usbredirhost_latency_stage_queue,
+                             complete_time, usbredirhost_get_time());
+}
+
+/* Parser write tag callback, replies get tagged with the time they got
+   queued at */
+static uint64_t usbredirhost_latency_write_tag(void *priv, uint32_t type)
+{
+    switch (type) {
+    case usb_redir_control_packet:
+    case usb_redir_bulk_packet:
+    case usb_redir_iso_packet:
+    case usb_redir_interrupt_packet:
+    case usb_redir_buffered_bulk_packet:
+        return usbredirhost_get_time();
+    default:
+        return 0;
+    }
+}
+
+/* Parser written callback, called with the parser's lock held once the last
+   byte of a reply got written */
+static void usbredirhost_latency_written(void *priv, uint32_t type,
+    uint64_t queue_time)
+{
+    struct usbredirhost *host = priv;
+    uint8_t ep_type;
+
+    switch (type) {
+    case usb_redir_control_packet:
+        ep_type = usb_redir_type_control;
+        break;
+    case usb_redir_iso_packet:
+        ep_type = usb_redir_type_iso;
+        break;
+    case usb_redir_interrupt_packet:
+        ep_type = usb_redir_type_interrupt;
+        break;
+    default:
+        ep_type = usb_redir_type_bulk;
+        break;
+    }
+    usbredirhost_latency_add(host, ep_type, usbredirhost_latency_stage_write,
+                             queue_time, usbredirhost_get_time());
+}
+
+/**************************************************************************/
+
+static struct usbredirhost_capture_slot *usbredirhost_capture_slot(
+    struct usbredirhost_capture *cap, size_t pos)
+{
+    return (struct usbredirhost_capture_slot *)
+        (cap->slots + (pos & cap->mask) * cap->slot_size);
+}
+
+static void usbredirhost_capture_time(int64_t *sec, int32_t *usec)
+{
+#ifdef _WIN32
+    FILETIME ft;
+    ULARGE_INTEGER t;
+    uint64_t us;
+
+    GetSystemTimeAsFileTime(&ft);
+    t.LowPart = ft.dwLowDateTime;
+    t.HighPart = ft.dwHighDateTime;
+    /* 100 ns units since 1601-01-01 */
+    us = t.QuadPart / 10 - 11644473600000000ULL;
+    *sec = us / 1000000;
+    *usec = us % 1000000;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    *sec = ts.tv_sec;
+    *usec = ts.tv_nsec / 1000;
+#endif
+}
+
+/* usbmon reports Linux errno values, so these are hardcoded rather then
+   using the (possibly different) values of the platform we're running on */
+static int32_t usbredirhost_capture_status(int status)
+{
+    switch (status) {
+    case LIBUSB_TRANSFER_COMPLETED: return 0;
+    case LIBUSB_TRANSFER_TIMED_OUT: return -110; /* -ETIMEDOUT */
+    case LIBUSB_TRANSFER_CANCELLED: return -2;   /* -ENOENT */
+    case LIBUSB_TRANSFER_STALL:     return -32;  /* -EPIPE */
+    case LIBUSB_TRANSFER_NO_DEVICE: return -19;  /* -ENODEV */
+    case LIBUSB_TRANSFER_OVERFLOW:  return -75;  /* -EOVERFLOW */
+    default:                        return -71;  /* -EPROTO */
+    }
+}
+
+/* Add a record for transfer to the capture ring, event is 'S' for its
+   submission (this must be called before actually submitting it) or 'C' for
+   its completion. Can be called both from parser read callbacks as well as
+   from libusb packet completion callbacks, without holding the host lock. */
+static void usbredirhost_capture(struct usbredirhost *host,
+    struct libusb_transfer *transfer, char event)
+{
+    struct usbredirhost_capture *cap =
+        atomic_load_explicit(&host->capture, memory_order_acquire);
+    struct usbredirhost_usbmon_iso_desc desc;
+    struct usbredirhost_usbmon_header hdr;
+    struct usbredirhost_capture_slot *slot;
+    libusb_device *dev;
+    uint8_t *data = NULL, *out;
+    uint32_t rec[4];
+    unsigned int i, data_len = 0, cap_len, ndesc = 0, offset;
+    int in, control;
+    size_t pos, seq;
+
+    if (!cap || !atomic_load_explicit(&cap->enabled, memory_order_relaxed))
+        return;
+
+    memset(&hdr, 0, sizeof(hdr));
+    usbredirhost_capture_time(&hdr.ts_sec, &hdr.ts_usec);
+
+    control = transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL;
+    if (control)
+        in = transfer->buffer[0] & LIBUSB_ENDPOINT_IN;
+    else
+        in = transfer->endpoint & LIBUSB_ENDPOINT_IN;
+
+    /* usbmon uses the urb address as id, the libusb_transfer address is
+       similarly unique while the transfer is in flight */
+    hdr.id = (uintptr_t)transfer;
+    hdr.type = event;
+    hdr.epnum = transfer->endpoint | in;
+    dev = libusb_get_device(transfer->dev_handle);
+    hdr.devnum = libusb_get_device_address(dev);
+    hdr.busnum = libusb_get_bus_number(dev);
+    hdr.flag_setup = '-';
+
+    switch (transfer->type) {
+    case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
+        hdr.xfer_type = 0;
+        ndesc = MIN(transfer->num_iso_packets, MAX_PACKETS_PER_TRANSFER);
+        hdr.ndesc = ndesc;
+        hdr.s.iso.numdesc = ndesc;
+        break;
+    case LIBUSB_TRANSFER_TYPE_INTERRUPT:
+        hdr.xfer_type = 1;
+        break;
+    case LIBUSB_TRANSFER_TYPE_CONTROL:
+        hdr.xfer_type = 2;
+        break;
+    default:
+        hdr.xfer_type = 3;
+    }
+
+    data = transfer->buffer;
+    if (event == 'S') {
+        hdr.status = -115; /* -EINPROGRESS */
+        hdr.length = transfer->length;
+        if (control) {
+            hdr.flag_setup = 0;
+            memcpy(hdr.s.setup, transfer->buffer, LIBUSB_CONTROL_SETUP_SIZE);
+            data += LIBUSB_CONTROL_SETUP_SIZE;
+            hdr.length -= LIBUSB_CONTROL_SETUP_SIZE;
+        }
+        if (!in)
+            data_len = hdr.length;
+    } else {
+        hdr.status = usbredirhost_capture_status(transfer->status);
+        if (ndesc) {
+            /* iso transfers do not have an overall actual_length */
+            hdr.length = transfer->length;
+        } else {
+            hdr.length = transfer->actual_length;
+        }
+        if (control)
+            data += LIBUSB_CONTROL_SETUP_SIZE;
+        if (in)
+            data_len = hdr.length;
+    }
+    hdr.flag_data = data_len ? 0 : (in ? '<' : '>');
+    cap_len = MIN(data_len, cap->snaplen);
+    hdr.len_cap = cap_len;
+
+    /* Claim a slot */
+    pos = atomic_load_explicit(&cap->head, memory_order_relaxed);
+    for (;;) {
+        slot = usbredirhost_capture_slot(cap, pos);
+        seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if (seq == pos) {
+            if (atomic_compare_exchange_weak_explicit(&cap->head, &pos,
+                    pos + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if ((intptr_t)(seq - pos) < 0) {
+            /* Full */
+            atomic_fetch_add_explicit(&cap->drops, 1, memory_order_relaxed);
+            return;
+        } else {
+            pos = atomic_load_explicit(&cap->head, memory_order_relaxed);
+        }
+    }
+
+    rec[0] = hdr.ts_sec;
+    rec[1] = hdr.ts_usec;
+    rec[2] = CAPTURE_USBMON_HDR_SIZE + ndesc * CAPTURE_ISO_DESC_SIZE + cap_len;
+    rec[3] = CAPTURE_USBMON_HDR_SIZE + ndesc * CAPTURE_ISO_DESC_SIZE + data_len;
+
+    out = slot->data;
+    memcpy(out, rec, CAPTURE_PCAP_HDR_SIZE);
+    out += CAPTURE_PCAP_HDR_SIZE;
+    memcpy(out, &hdr, CAPTURE_USBMON_HDR_SIZE);
+    out += CAPTURE_USBMON_HDR_SIZE;
+    for (i = 0, offset = 0; i < ndesc; i++) {
+        struct libusb_iso_packet_descriptor *pkt = &transfer->iso_packet_desc[i];
 
-    return host->write_func(host->func_priv, data, count);
+        memset(&desc, 0, sizeof(desc));
+        desc.offset = offset;
+        if (event == 'S') {
+            desc.len = pkt->length;
+        } else {
+            desc.status = usbredirhost_capture_status(pkt->status);
+            desc.len = pkt->actual_length;
+            if (desc.status)
+                hdr.s.iso.error_count++;
+        }
+        offset += pkt->length;
+        memcpy(out, &desc, CAPTURE_ISO_DESC_SIZE);
+        out += CAPTURE_ISO_DESC_SIZE;
+    }
+    if (hdr.s.iso.error_count) {
+        memcpy(slot->data + CAPTURE_PCAP_HDR_SIZE +
+               offsetof(struct usbredirhost_usbmon_header, s),
+               &hdr.s, sizeof(hdr.s));
+    }
+    memcpy(out, data, cap_len);
+    slot->len = CAPTURE_PCAP_HDR_SIZE + rec[2];
+
+    /* And publish it */
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
 }
 
 /* Can be called both from parser read callbacks as well as from libusb
@@ -486,6 +1031,204 @@ static void usbredirhost_parse_config(struct usbredirhost *host)
     }
 }
 
+/* Guests read the same descriptors over and over while enumerating a
+   device, the descriptor cache answers these GET_DESCRIPTOR requests without
+   a round trip to the device. The device descriptor gets added when claiming
+   the device, other descriptors when the device returns them. */
+
+/* Standard descriptors of the device and class descriptors of interfaces,
+   such as HID report descriptors */
+static bool usbredirhost_desc_cacheable(
+    const struct usb_redir_control_packet_header *control_packet)
+{
+    return (control_packet->endpoint & LIBUSB_ENDPOINT_IN) &&
+           control_packet->request == LIBUSB_REQUEST_GET_DESCRIPTOR &&
+           (control_packet->requesttype ==
+                (LIBUSB_ENDPOINT_IN | LIBUSB_RECIPIENT_DEVICE) ||
+            control_packet->requesttype ==
+                (LIBUSB_ENDPOINT_IN | LIBUSB_RECIPIENT_INTERFACE));
+}
+
+/* Whether the len bytes the device returned for a request of length bytes
+   are the whole descriptor */
+static bool usbredirhost_desc_complete(
+    const struct usb_redir_control_packet_header *control_packet,
+    const uint8_t *data, int len, int length)
+{
+    if (len < length)
+        return true;
+
+    /* Class descriptors do not necessarily start with their length */
+    if (control_packet->requesttype & LIBUSB_RECIPIENT_INTERFACE)
+        return false;
+
+    switch (control_packet->value >> 8) {
+    case LIBUSB_DT_CONFIG:
+    case 0x07: /* Other speed configuration */
+    case LIBUSB_DT_BOS:
+        return len >= 4 && len >= (data[2] | data[3] << 8);
+    default:
+        return len >= 1 && len >= data[0];
+    }
+}
+
+/* Note caller must hold the host lock */
+static struct usbredirhost_desc *usbredirhost_desc_cache_find(
+    struct usbredirhost *host,
+    const struct usb_redir_control_packet_header *control_packet)
+{
+    int i;
+
+    for (i = 0; i < host->desc_cache_count; i++) {
+        struct usbredirhost_desc *desc = &host->desc_cache[i];
+
+        if (desc->requesttype == control_packet->requesttype &&
+                desc->value == control_packet->value &&
+                desc->index == control_packet->index)
+            return desc;
+    }
+    return NULL;
+}
+
+/* Note caller must hold the host lock */
+static void usbredirhost_desc_cache_store(struct usbredirhost *host,
+    const struct usb_redir_control_packet_header *control_packet,
+    const uint8_t *data, int len, bool complete)
+{
+    struct usbredirhost_desc *desc;
+    uint8_t *copy;
+
+    desc = usbredirhost_desc_cache_find(host, control_packet);
+    /* Keep what we have, unless this is more of the descriptor */
+    if (len <= 0 || (desc && (desc->complete || len <= desc->len)))
+        return;
+
+    copy = malloc(len);
+    if (!copy)
+        return;
+    memcpy(copy, data, len);
+
+    if (!desc) {
+        if (host->desc_cache_count < DESC_CACHE_SIZE) {
+            desc = &host->desc_cache[host->desc_cache_count++];
+        } else {
+            desc = &host->desc_cache[host->desc_cache_next];
+            host->desc_cache_next =
+                (host->desc_cache_next + 1) % DESC_CACHE_SIZE;
+        }
+        desc->requesttype = control_packet->requesttype;
+        desc->value = control_packet->value;
+        desc->index = control_packet->index;
+    }
+    free(desc->data);
+    desc->data = copy;
+    desc->len = len;
+    desc->complete = complete;
+}
+
+/* Note caller must hold the host lock, returns true if the request has been
+   answered from the cache */
+static bool usbredirhost_desc_cache_reply(struct usbredirhost *host,
+    uint64_t id, struct usb_redir_control_packet_header *control_packet)
+{
+    struct usbredirhost_desc *desc;
+    int len;
+
+    desc = usbredirhost_desc_cache_find(host, control_packet);
+    if (!desc || (!desc->complete && control_packet->length > desc->len))
+        return false;
+
+    len = MIN(control_packet->length, desc->len);
+    DEBUG("control ep %02X len %d id %"PRIu64" from descriptor cache",
+          control_packet->endpoint, len, id);
+    control_packet->status = usb_redir_success;
+    control_packet->length = len;
+    usbredirparser_send_control_packet(host->parser, id, control_packet,
+                                       desc->data, len);
+    return true;
+}
+
+/* Empty the cache, and with add_device add host->desc to it again. Called
+   from open/close and parser read callbacks */
+static void usbredirhost_desc_cache_reset(struct usbredirhost *host,
+                                          bool add_device)
+{
+    struct usb_redir_control_packet_header control_packet = {
+        .endpoint = LIBUSB_ENDPOINT_IN,
+        .request = LIBUSB_REQUEST_GET_DESCRIPTOR,
+        .requesttype = LIBUSB_ENDPOINT_IN | LIBUSB_RECIPIENT_DEVICE,
+        .value = LIBUSB_DT_DEVICE << 8,
+    };
+    uint8_t data[LIBUSB_DT_DEVICE_SIZE] = {
+        LIBUSB_DT_DEVICE_SIZE,
+        LIBUSB_DT_DEVICE,
+        host->desc.bcdUSB & 0xff,
+        host->desc.bcdUSB >> 8,
+        host->desc.bDeviceClass,
+        host->desc.bDeviceSubClass,
+        host->desc.bDeviceProtocol,
+        host->desc.bMaxPacketSize0,
+        host->desc.idVendor & 0xff,
+        host->desc.idVendor >> 8,
+        host->desc.idProduct & 0xff,
+        host->desc.idProduct >> 8,
+        host->desc.bcdDevice & 0xff,
+        host->desc.bcdDevice >> 8,
+        host->desc.iManufacturer,
+        host->desc.iProduct,
+        host->desc.iSerialNumber,
+        host->desc.bNumConfigurations,
+    };
+    int i;
+
+    LOCK(host);
+    for (i = 0; i < host->desc_cache_count; i++) {
+        free(host->desc_cache[i].data);
+        host->desc_cache[i].data = NULL;
+    }
+    host->desc_cache_count = 0;
+    host->desc_cache_next = 0;
+    if (add_device) {
+        usbredirhost_desc_cache_store(host, &control_packet, data,
+                                      sizeof(data), true);
+    }
+    UNLOCK(host);
+}
+
+/* Drop what may change with the alt setting of an interface: its class
+   descriptors, and interface and endpoint descriptors requested from the
+   device. The configuration descriptor lists all alt settings, so it stays.
+   Called from parser read callbacks. */
+static void usbredirhost_desc_cache_drop_interface(struct usbredirhost *host,
+                                                   uint8_t interface)
+{
+    int i = 0;
+
+    LOCK(host);
+    while (i < host->desc_cache_count) {
+        struct usbredirhost_desc *desc = &host->desc_cache[i];
+        bool drop;
+
+        if (desc->requesttype & LIBUSB_RECIPIENT_INTERFACE) {
+            drop = (desc->index & 0xff) == interface;
+        } else {
+            drop = (desc->value >> 8) == LIBUSB_DT_INTERFACE ||
+                   (desc->value >> 8) == LIBUSB_DT_ENDPOINT;
+        }
+        if (!drop) {
+            i++;
+            continue;
+        }
+        free(desc->data);
+        *desc = host->desc_cache[--host->desc_cache_count];
+        host->desc_cache[host->desc_cache_count].data = NULL;
+        if (host->desc_cache_next >= host->desc_cache_count) {
+            host->desc_cache_next = 0;
+        }
+    }
+    UNLOCK(host);
+}
+
 /* Called from open/close and parser read callbacks */
 static int usbredirhost_claim(struct usbredirhost *host, int initial_claim)
 {
@@ -499,8 +1242,11 @@ static int usbredirhost_claim(struct usbredirhost *host, int initial_claim)
     r = libusb_get_device_descriptor(host->dev, &host->desc);
     if (r < 0) {
         ERROR("could not get device descriptor: %s", libusb_error_name(r));
+        usbredirhost_desc_cache_reset(host, false);
         return libusb_status_or_error_to_redir_status(host, r);
     }
+    /* The configuration may have changed, its descriptors with it */
+    usbredirhost_desc_cache_reset(host, true);
 
     r = libusb_get_active_config_descriptor(host->dev, &host->config);
     if (r < 0 && r != LIBUSB_ERROR_NOT_FOUND) {
@@ -683,6 +1429,7 @@ struct usbredirhost *usbredirhost_open_full(
         libusb_close(usb_dev_handle);
         return NULL;
     }
+    atomic_init(&host->refs, 1);
 
     host->ctx = usb_ctx;
     host->log_func = log_func;
@@ -701,6 +1448,7 @@ struct usbredirhost *usbredirhost_open_full(
         usbredirhost_close(host);
         return NULL;
     }
+    usbredirparser_set_verbose(host->parser, verbose);
     host->parser->priv = host;
     host->parser->log_func = usbredirhost_log;
     host->parser->read_func = usbredirhost_read;
@@ -782,6 +1530,14 @@ struct usbredirhost *usbredirhost_open_full(
     return host;
 }
 
+/* The usbredirhost itself stays around for the write buffers the write
+   callback still holds when closing, see usbredirhost_free_write_buffer */
+static void usbredirhost_unref(struct usbredirhost *host)
+{
+    if (atomic_fetch_sub(&host->refs, 1) == 1)
+        free(host);
+}
+
 USBREDIR_VISIBLE
 void usbredirhost_close(struct usbredirhost *host)
 {
@@ -793,11 +1549,24 @@ void usbredirhost_close(struct usbredirhost *host)
     if (host->disconnect_lock) {
         host->parser->free_lock_func(host->disconnect_lock);
     }
+    if (host->latency && host->latency->lock) {
+        host->parser->free_lock_func(host->latency->lock);
+    }
+    if (atomic_load(&host->write_buffers)) {
+        DEBUG("closing with %d write buffers not given back yet",
+              atomic_load(&host->write_buffers));
+    }
     if (host->parser) {
         usbredirparser_destroy(host->parser);
+        host->parser = NULL;
+    }
+    free(host->latency);
+    if (host->capture) {
+        free(host->capture->slots);
+        free(host->capture);
     }
     free(host->filter_rules);
-    free(host);
+    usbredirhost_unref(host);
 }
 
 static int usbredirhost_reset_device(struct usbredirhost *host)
@@ -815,15 +1584,32 @@ static int usbredirhost_reset_device(struct usbredirhost *host)
         return r;
     }
 
+    /* Linux re-enumerates devices whose device or configuration descriptors
+       change with a reset, so only the other descriptors can have changed */
+    usbredirhost_desc_cache_reset(host, true);
     host->reset = 1;
     return 0;
 }
 
+static void usbredirhost_set_quirks(struct usbredirhost *host)
+{
+    int i;
+
+    for (i = 0; usbredirhost_reset_blacklist[i].vendor_id != -1; i++) {
+        if (host->desc.idVendor == usbredirhost_reset_blacklist[i].vendor_id &&
+            host->desc.idProduct ==
+                                usbredirhost_reset_blacklist[i].product_id) {
+            host->quirks |= QUIRK_DO_NOT_RESET;
+            break;
+        }
+    }
+}
+
 USBREDIR_VISIBLE
 int usbredirhost_set_device(struct usbredirhost *host,
                              libusb_device_handle *usb_dev_handle)
 {
-    int i, r, status;
+    int r, status;
 
     usbredirhost_clear_device(host);
 
@@ -839,14 +1625,7 @@ int usbredirhost_set_device(struct usbredirhost *host,
         return status;
     }
 
-    for (i = 0; usbredirhost_reset_blacklist[i].vendor_id != -1; i++) {
-        if (host->desc.idVendor == usbredirhost_reset_blacklist[i].vendor_id &&
-            host->desc.idProduct ==
-                                usbredirhost_reset_blacklist[i].product_id) {
-            host->quirks |= QUIRK_DO_NOT_RESET;
-            break;
-        }
-    }
+    usbredirhost_set_quirks(host);
 
     /* The first thing almost any usb-guest does is a (slow) device-reset
        so lets do that before hand */
@@ -868,13 +1647,21 @@ static void usbredirhost_clear_device(struct usbredirhost *host)
     if (usbredirhost_cancel_pending_urbs(host, 0))
         usbredirhost_wait_for_cancel_completion(host);
 
-    usbredirhost_release(host, 1);
+    LOCK(host);
+    usbredirhost_free_migrated_transfers(host);
+    UNLOCK(host);
+
+    /* After usbredirhost_serialize() the device gets handed over as is */
+    usbredirhost_release(host, !host->migrated);
+    host->migrated = 0;
 
     if (host->config) {
         libusb_free_config_descriptor(host->config);
         host->config = NULL;
     }
+    usbredirhost_desc_cache_reset(host, false);
     if (host->handle) {
+        usbredirhost_free_dev_mem_pool(host);
         libusb_close(host->handle);
         host->handle = NULL;
     }
@@ -908,7 +1695,36 @@ int usbredirhost_write_guest_data(struct usbredirhost *host)
 USBREDIR_VISIBLE
 void usbredirhost_free_write_buffer(struct usbredirhost *host, uint8_t *data)
 {
+    /* More buffers given back than handed out, one of them twice */
+    if (atomic_fetch_sub(&host->write_buffers, 1) <= 0)
+        abort();
+
+    /* This does not use the parser, which is gone after usbredirhost_close */
     usbredirparser_free_write_buffer(host->parser, data);
+    usbredirhost_unref(host);
+}
+
+USBREDIR_VISIBLE
+void usbredirhost_suspend(struct usbredirhost *host)
+{
+    atomic_store(&host->suspended, 1);
+    /* usbredirparser_do_write() calls our write callback with the parser's
+       lock held, taking it waits for a write which may have started before
+       suspended got set, later ones see it */
+    usbredirparser_get_bufferered_output_size(host->parser);
+    DEBUG("session suspended, %d packets queued",
+          usbredirparser_has_data_to_write(host->parser));
+}
+
+USBREDIR_VISIBLE
+void usbredirhost_resume(struct usbredirhost *host)
+{
+    DEBUG("session resumed, %d packets queued",
+          usbredirparser_has_data_to_write(host->parser));
+    atomic_store(&host->suspended, 0);
+    host->migrated = 0;
+    usbredirhost_resubmit_migrated_transfers(host);
+    FLUSH(host);
 }
 
 /**************************************************************************/
@@ -934,20 +1750,116 @@ static struct usbredirtransfer *usbredirhost_alloc_transfer(
     return redir_transfer;
 }
 
-static void usbredirhost_free_transfer(struct usbredirtransfer *transfer)
+/* Transfer buffers can be usbfs memory, from libusb_dev_mem_alloc(), which
+   the kernel uses for the URB as is, instead of copying the data from or to
+   it for every transfer. Getting and releasing it is an mmap / munmap, so
+   freed buffers are kept in a small pool for the next transfer of the same
+   size, which helps the bulk and control transfers which get a buffer of
+   their own each. Without usbfs memory, or when it runs out, buffers come
+   from malloc. The parser copies the data of the packets it sends, so a
+   buffer is only used by its transfer.
+
+   Note caller must hold the host lock */
+static unsigned char *usbredirhost_alloc_dev_mem(struct usbredirhost *host,
+    struct usbredirtransfer *transfer, int size)
 {
-    if (!transfer)
-        return;
+#if LIBUSBX_API_VERSION >= 0x01000105
+    unsigned char *buffer;
+    int i;
 
-    /* In certain cases this should really be a usbredirparser_free_packet_data
-       but since we use the same malloc impl. as usbredirparser this is ok. */
-    free(transfer->transfer->buffer);
-    libusb_free_transfer(transfer->transfer);
-    free(transfer);
-}
+    if (host->dev_mem_state < 0 || !host->handle || size <= 0)
+        return NULL;
 
-static void usbredirhost_add_transfer(struct usbredirhost *host,
-    struct usbredirtransfer *new_transfer)
+    size = (size + DEV_MEM_ALIGN - 1) & ~(DEV_MEM_ALIGN - 1);
+    for (i = 0; i < host->dev_mem_pool_count; i++) {
+        if (host->dev_mem_pool[i].size == size) {
+            buffer = host->dev_mem_pool[i].buffer;
+            host->dev_mem_pool_bytes -= size;
+            host->dev_mem_pool[i] =
+                host->dev_mem_pool[--host->dev_mem_pool_count];
+            transfer->dev_mem_size = size;
+            return buffer;
+        }
+    }
+
+    buffer = libusb_dev_mem_alloc(host->handle, size);
+    if (!buffer) {
+        /* Only give up on it if it never worked, otherwise the usbfs
+           memory limit was reached and this buffer comes from malloc */
+        if (host->dev_mem_state == 0) {
+            DEBUG("usbfs memory is not available, using malloc");
+            host->dev_mem_state = -1;
+        }
+        return NULL;
+    }
+    host->dev_mem_state = 1;
+    transfer->dev_mem_size = size;
+    return buffer;
+#else
+    return NULL;
+#endif
+}
+
+/* Note caller must hold the host lock */
+static void usbredirhost_free_dev_mem(struct usbredirhost *host,
+    unsigned char *buffer, int size)
+{
+#if LIBUSBX_API_VERSION >= 0x01000105
+    if (host->dev_mem_pool_count < DEV_MEM_POOL_SIZE &&
+            host->dev_mem_pool_bytes + size <= DEV_MEM_POOL_BYTES) {
+        host->dev_mem_pool[host->dev_mem_pool_count].buffer = buffer;
+        host->dev_mem_pool[host->dev_mem_pool_count].size = size;
+        host->dev_mem_pool_count++;
+        host->dev_mem_pool_bytes += size;
+        return;
+    }
+    libusb_dev_mem_free(host->handle, buffer, size);
+#endif
+}
+
+/* Called before closing the device handle, all transfers are gone then */
+static void usbredirhost_free_dev_mem_pool(struct usbredirhost *host)
+{
+#if LIBUSBX_API_VERSION >= 0x01000105
+    int i;
+
+    LOCK(host);
+    for (i = 0; i < host->dev_mem_pool_count; i++) {
+        libusb_dev_mem_free(host->handle, host->dev_mem_pool[i].buffer,
+                            host->dev_mem_pool[i].size);
+    }
+    host->dev_mem_pool_count = 0;
+    host->dev_mem_pool_bytes = 0;
+    host->dev_mem_state = 0;
+    UNLOCK(host);
+#endif
+}
+
+/* Note caller must hold the host lock if the transfer has a buffer */
+static void usbredirhost_free_transfer(struct usbredirtransfer *transfer)
+{
+    if (!transfer)
+        return;
+
+#ifdef HAVE_SYS_MMAN_H
+    if (transfer->locked)
+        munlock(transfer->transfer->buffer, transfer->transfer->length);
+#endif
+    if (transfer->dev_mem_size) {
+        usbredirhost_free_dev_mem(transfer->host, transfer->transfer->buffer,
+                                  transfer->dev_mem_size);
+    } else {
+        /* In certain cases this should really be a
+           usbredirparser_free_packet_data but since we use the same malloc
+           impl. as usbredirparser this is ok. */
+        free(transfer->transfer->buffer);
+    }
+    libusb_free_transfer(transfer->transfer);
+    free(transfer);
+}
+
+static void usbredirhost_add_transfer(struct usbredirhost *host,
+    struct usbredirtransfer *new_transfer)
 {
     struct usbredirtransfer *transfer = &host->transfers_head;
 
@@ -972,6 +1884,45 @@ static void usbredirhost_remove_and_free_transfer(
     usbredirhost_free_transfer(transfer);
 }
 
+/* Note caller must hold the host lock. During usbredirhost_serialize a
+   pending transfer which got cancelled before it moved any data gets kept,
+   so that it can be submitted again, instead of completing it to the
+   usb-guest. Returns true when it was kept. */
+static bool usbredirhost_migrate_transfer(struct usbredirtransfer *transfer)
+{
+    struct usbredirtransfer *last = &transfer->host->migrate_head;
+
+    if (!transfer->migrate ||
+            transfer->transfer->status != LIBUSB_TRANSFER_CANCELLED ||
+            transfer->transfer->actual_length != 0)
+        return false;
+
+    if (transfer->next)
+        transfer->next->prev = transfer->prev;
+    if (transfer->prev)
+        transfer->prev->next = transfer->next;
+
+    while (last->next) {
+        last = last->next;
+    }
+    transfer->prev = last;
+    transfer->next = NULL;
+    last->next = transfer;
+    return true;
+}
+
+/* Note caller must hold the host lock */
+static void usbredirhost_free_migrated_transfers(struct usbredirhost *host)
+{
+    struct usbredirtransfer *transfer, *next;
+
+    for (transfer = host->migrate_head.next; transfer; transfer = next) {
+        next = transfer->next;
+        usbredirhost_free_transfer(transfer);
+    }
+    host->migrate_head.next = NULL;
+}
+
 /**************************************************************************/
 
 /* Called from both parser read and packet complete callbacks */
@@ -1072,7 +2023,8 @@ static int usbredirhost_can_write_iso_package(struct usbredirhost *host)
 }
 
 static void usbredirhost_send_stream_data(struct usbredirhost *host,
-    uint64_t id, uint8_t ep, uint8_t status, uint8_t *data, int len)
+    uint64_t id, uint8_t ep, uint8_t status, uint8_t *data, int len,
+    uint64_t complete_time)
 {
     /* USB-2 is max 8000 packets / sec, if we've queued up more then 0.1 sec,
        assume our connection is not keeping up and start dropping packets. */
@@ -1084,6 +2036,10 @@ static void usbredirhost_send_stream_data(struct usbredirhost *host,
         }
         DEBUG("buffered complete ep %02X dropping packet status %d len %d",
               ep, status, len);
+        if (host->endpoint[EP2I(ep)].type == usb_redir_type_iso)
+            USBREDIR_TRACE(iso_drop, ep, id, len, status);
+        else
+            USBREDIR_TRACE(stream_drop, ep, id, len, status);
         return;
     }
 
@@ -1097,9 +2053,14 @@ static void usbredirhost_send_stream_data(struct usbredirhost *host,
             .length   = len,
         };
 
-        if (usbredirhost_can_write_iso_package(host))
+        if (usbredirhost_can_write_iso_package(host)) {
             usbredirparser_send_iso_packet(host->parser, id, &iso_packet,
                                            data, len);
+            usbredirhost_latency_queued(host, usb_redir_type_iso,
+                                        complete_time);
+        } else {
+            USBREDIR_TRACE(iso_drop, ep, id, len, status);
+        }
         break;
     }
     case usb_redir_type_bulk: {
@@ -1110,6 +2071,7 @@ static void usbredirhost_send_stream_data(struct usbredirhost *host,
         };
         usbredirparser_send_buffered_bulk_packet(host->parser, id,
                                                  &bulk_packet, data, len);
+        usbredirhost_latency_queued(host, usb_redir_type_bulk, complete_time);
         break;
     }
     case usb_redir_type_interrupt: {
@@ -1120,6 +2082,8 @@ static void usbredirhost_send_stream_data(struct usbredirhost *host,
         };
         usbredirparser_send_interrupt_packet(host->parser, id,
                                              &interrupt_packet, data, len);
+        usbredirhost_latency_queued(host, usb_redir_type_interrupt,
+                                    complete_time);
         break;
     }
     }
@@ -1133,7 +2097,11 @@ static int usbredirhost_submit_stream_transfer_unlocked(
 
     host->reset = 0;
 
+    usbredirhost_latency_submit(host, transfer, 0);
+    usbredirhost_capture(host, transfer->transfer, 'S');
     r = libusb_submit_transfer(transfer->transfer);
+    USBREDIR_TRACE(submit, transfer->transfer->endpoint, transfer->id,
+                   transfer->transfer->length, r);
     if (r < 0) {
         uint8_t ep = transfer->transfer->endpoint;
         if (r == LIBUSB_ERROR_NO_DEVICE) {
@@ -1200,6 +2168,62 @@ static void usbredirhost_set_iso_threshold(struct usbredirhost *host,
            host->iso_threshold.higher, host->iso_threshold.lower);
 }
 
+static unsigned char *usbredirhost_alloc_stream_buffer(
+    struct usbredirhost *host, struct usbredirtransfer *transfer, int size)
+{
+    unsigned char *buffer = usbredirhost_alloc_dev_mem(host, transfer, size);
+
+    if (buffer)
+        return buffer;
+#ifdef HAVE_SYS_MMAN_H
+    /* Locked buffers get pages of their own, as munlock of one buffer would
+       also unlock the pages it shares with another one */
+    if (host->flags & usbredirhost_fl_lock_stream_buffers) {
+        long page_size = sysconf(_SC_PAGESIZE);
+        void *aligned;
+
+        if (page_size <= 0)
+            page_size = 4096;
+        if (posix_memalign(&aligned, page_size,
+                           (size + page_size - 1) & ~(page_size - 1)) != 0)
+            return NULL;
+        return aligned;
+    }
+#endif
+    return malloc(size);
+}
+
+/* For usbredirhost_fl_lock_stream_buffers, called once the transfer's
+   buffer is filled in */
+static void usbredirhost_lock_stream_buffer(struct usbredirhost *host,
+    struct usbredirtransfer *transfer)
+{
+    struct libusb_transfer *libusb_transfer = transfer->transfer;
+
+    /* usbfs memory can not be paged out */
+    if (transfer->dev_mem_size)
+        return;
+
+    /* Touch every page, so that they are there before the stream starts,
+       also when they can not be locked */
+    memset(libusb_transfer->buffer, 0, libusb_transfer->length);
+#ifdef HAVE_SYS_MMAN_H
+    if (mlock(libusb_transfer->buffer, libusb_transfer->length) == 0) {
+        transfer->locked = 1;
+        return;
+    }
+    if (!host->mlock_warned) {
+        WARNING("could not lock stream buffers in memory: %s",
+                strerror(errno));
+    }
+#else
+    if (!host->mlock_warned) {
+        WARNING("locking stream buffers in memory is not supported");
+    }
+#endif
+    host->mlock_warned = true;
+}
+
 /* Called from both parser read and packet complete callbacks */
 static void usbredirhost_alloc_stream_unlocked(struct usbredirhost *host,
     uint64_t id, uint8_t ep, uint8_t type, uint8_t pkts_per_transfer,
@@ -1245,7 +2269,8 @@ static void usbredirhost_alloc_stream_unlocked(struct usbredirhost *host,
         }
 
         buf_size = pkt_size * pkts_per_transfer;
-        buffer = malloc(buf_size);
+        buffer = usbredirhost_alloc_stream_buffer(host,
+                     host->endpoint[EP2I(ep)].transfer[i], buf_size);
         if (!buffer) {
             goto alloc_error;
         }
@@ -1276,6 +2301,10 @@ static void usbredirhost_alloc_stream_unlocked(struct usbredirhost *host,
                 host->endpoint[EP2I(ep)].transfer[i], INTERRUPT_TIMEOUT);
             break;
         }
+        if (host->flags & usbredirhost_fl_lock_stream_buffers) {
+            usbredirhost_lock_stream_buffer(host,
+                                            host->endpoint[EP2I(ep)].transfer[i]);
+        }
     }
     host->endpoint[EP2I(ep)].out_idx = 0;
     host->endpoint[EP2I(ep)].drop_packets = 0;
@@ -1326,6 +2355,7 @@ static void usbredirhost_clear_stream_stall_unlocked(
 
     usbredirhost_cancel_stream_unlocked(host, ep);
     r = libusb_clear_halt(host->handle, ep);
+    USBREDIR_TRACE(stall, ep, id, 0, r);
     if (r < 0) {
         usbredirhost_send_stream_status(host, id, ep, usb_redir_stall);
         return;
@@ -1422,23 +2452,41 @@ static int usbredirhost_bInterfaceNumber_to_index(
     return -1;
 }
 
-static void usbredirhost_log_data(struct usbredirhost *host, const char *desc,
-    const uint8_t *data, int len)
+#ifndef DISABLE_DEBUG_LOG
+static void usbredirhost_do_log_data(struct usbredirhost *host,
+    const char *desc, const uint8_t *data, int len)
 {
-    if (usbredirparser_debug_data <= host->verbose) {
-        int i, j, n;
-
-        for (i = 0; i < len; i += j) {
-            char buf[128];
-
-            n = sprintf(buf, "%s", desc);
-            for (j = 0; j < 8 && i + j < len; j++){
-                 n += sprintf(buf + n, " %02X", data[i + j]);
-            }
-            va_log(host, usbredirparser_debug_data, "%s", buf);
+    static const char hex[] = "0123456789ABCDEF";
+    char buf[128];
+    int i, j, n, desc_len;
+
+    /* Leave room for 8 " XX" bytes and the terminating 0 */
+    desc_len = strlen(desc);
+    if (desc_len > (int)sizeof(buf) - 25)
+        desc_len = sizeof(buf) - 25;
+    memcpy(buf, desc, desc_len);
+
+    for (i = 0; i < len; i += j) {
+        n = desc_len;
+        for (j = 0; j < 8 && i + j < len; j++) {
+            buf[n++] = ' ';
+            buf[n++] = hex[data[i + j] >> 4];
+            buf[n++] = hex[data[i + j] & 0x0f];
         }
+        buf[n] = 0;
+        va_log(host, usbredirparser_debug_data, "%s", buf);
     }
 }
+#endif
+
+static inline void usbredirhost_log_data(struct usbredirhost *host,
+    const char *desc, const uint8_t *data, int len)
+{
+#ifndef DISABLE_DEBUG_LOG
+    if (usbredirparser_debug_data <= host->verbose)
+        usbredirhost_do_log_data(host, desc, data, len);
+#endif
+}
 
 /**************************************************************************/
 
@@ -1499,6 +2547,7 @@ static void LIBUSB_CALL usbredirhost_iso_packet_complete(
     uint8_t ep = libusb_transfer->endpoint;
     struct usbredirhost *host = transfer->host;
     int i, r, len, status;
+    uint64_t complete_time;
 
     LOCK(host);
     if (transfer->cancelled) {
@@ -1509,6 +2558,10 @@ static void LIBUSB_CALL usbredirhost_iso_packet_complete(
 
     /* Mark transfer completed (iow not submitted) */
     transfer->packet_idx = 0;
+    complete_time = usbredirhost_latency_complete(host, transfer);
+    USBREDIR_TRACE(complete, libusb_transfer->endpoint, transfer->id,
+                   libusb_transfer->actual_length, libusb_transfer->status);
+    usbredirhost_capture(host, libusb_transfer, 'C');
 
     /* Check overal transfer status */
     r = libusb_transfer->status;
@@ -1558,7 +2611,8 @@ static void LIBUSB_CALL usbredirhost_iso_packet_complete(
         }
         if (ep & LIBUSB_ENDPOINT_IN) {
             usbredirhost_send_stream_data(host, transfer->id, ep, status,
-                   libusb_get_iso_packet_buffer(libusb_transfer, i), len);
+                   libusb_get_iso_packet_buffer(libusb_transfer, i), len,
+                   complete_time);
             transfer->id++;
         } else {
             DEBUG("iso-in complete ep %02X pkt %d len %d id %"PRIu64,
@@ -1603,6 +2657,7 @@ static void LIBUSB_CALL usbredirhost_buffered_packet_complete(
     uint8_t ep = libusb_transfer->endpoint;
     struct usbredirhost *host = transfer->host;
     int r, len = libusb_transfer->actual_length;
+    uint64_t complete_time;
 
     LOCK(host);
 
@@ -1614,6 +2669,10 @@ static void LIBUSB_CALL usbredirhost_buffered_packet_complete(
 
     /* Mark transfer completed (iow not submitted) */
     transfer->packet_idx = 0;
+    complete_time = usbredirhost_latency_complete(host, transfer);
+    USBREDIR_TRACE(complete, libusb_transfer->endpoint, transfer->id,
+                   libusb_transfer->actual_length, libusb_transfer->status);
+    usbredirhost_capture(host, libusb_transfer, 'C');
 
     r = libusb_transfer->status;
     switch (r) {
@@ -1632,7 +2691,7 @@ static void LIBUSB_CALL usbredirhost_buffered_packet_complete(
 
     usbredirhost_send_stream_data(host, transfer->id, ep,
                            libusb_status_or_error_to_redir_status(host, r),
-                           transfer->transfer->buffer, len);
+                           transfer->transfer->buffer, len, complete_time);
     usbredirhost_log_data(host, "buffered data in:",
                           transfer->transfer->buffer, len);
 
@@ -1795,6 +2854,7 @@ static void usbredirhost_set_alt_setting(void *priv, uint64_t id,
     }
 
     host->alt_setting[i] = set_alt_setting->alt;
+    usbredirhost_desc_cache_drop_interface(host, set_alt_setting->interface);
     usbredirhost_parse_interface(host, i);
     usbredirhost_send_interface_n_ep_info(host);
 
@@ -2037,6 +3097,8 @@ static void usbredirhost_cancel_data_packet(void *priv, uint64_t id)
      * Note not finding the transfer is not an error, the transfer may have
      * completed by the time we receive the cancel.
      */
+    USBREDIR_TRACE(cancel, t ? t->transfer->endpoint : -1, id,
+                   t ? t->transfer->length : 0, t != NULL);
     if (t) {
         t->cancelled = 1;
         libusb_cancel_transfer(t->transfer);
@@ -2085,9 +3147,18 @@ static void LIBUSB_CALL usbredirhost_control_packet_complete(
     struct usb_redir_control_packet_header control_packet;
     struct usbredirtransfer *transfer = libusb_transfer->user_data;
     struct usbredirhost *host = transfer->host;
+    uint64_t complete_time;
 
     LOCK(host);
+    if (usbredirhost_migrate_transfer(transfer)) {
+        UNLOCK(host);
+        return;
+    }
 
+    complete_time = usbredirhost_latency_complete(host, transfer);
+    USBREDIR_TRACE(complete, libusb_transfer->endpoint, transfer->id,
+                   libusb_transfer->actual_length, libusb_transfer->status);
+    usbredirhost_capture(host, libusb_transfer, 'C');
     control_packet = transfer->control_packet;
     control_packet.status = libusb_status_or_error_to_redir_status(host,
                                                   libusb_transfer->status);
@@ -2098,6 +3169,15 @@ static void LIBUSB_CALL usbredirhost_control_packet_complete(
           control_packet.length, transfer->id);
 
     if (!transfer->cancelled) {
+        if (control_packet.status == usb_redir_success &&
+                usbredirhost_desc_cacheable(&control_packet)) {
+            uint8_t *data = libusb_transfer->buffer + LIBUSB_CONTROL_SETUP_SIZE;
+            int len = libusb_transfer->actual_length;
+
+            usbredirhost_desc_cache_store(host, &control_packet, data, len,
+                usbredirhost_desc_complete(&control_packet, data, len,
+                                           transfer->control_packet.length));
+        }
         if (control_packet.endpoint & LIBUSB_ENDPOINT_IN) {
             usbredirhost_log_data(host, "ctrl data in:",
                          libusb_transfer->buffer + LIBUSB_CONTROL_SETUP_SIZE,
@@ -2111,6 +3191,8 @@ static void LIBUSB_CALL usbredirhost_control_packet_complete(
             usbredirparser_send_control_packet(host->parser, transfer->id,
                                                &control_packet, NULL, 0);
         }
+        usbredirhost_latency_queued(host, usb_redir_type_control,
+                                    complete_time);
     }
 
     usbredirhost_remove_and_free_transfer(transfer);
@@ -2136,6 +3218,7 @@ static void usbredirhost_control_packet(void *priv, uint64_t id,
     uint8_t ep = control_packet->endpoint;
     struct usbredirtransfer *transfer;
     unsigned char *buffer;
+    uint64_t parse_time = usbredirhost_latency_time(host);
     int r;
 
     DEBUG("control submit ep %02X len %d id %"PRIu64, ep,
@@ -2159,6 +3242,20 @@ static void usbredirhost_control_packet(void *priv, uint64_t id,
         return;
     }
 
+    /* This does not touch the device, so it does not clear host->reset */
+    if (usbredirhost_desc_cacheable(control_packet)) {
+        bool cached;
+
+        LOCK(host);
+        cached = usbredirhost_desc_cache_reply(host, id, control_packet);
+        UNLOCK(host);
+        if (cached) {
+            usbredirparser_free_packet_data(host->parser, data);
+            FLUSH(host);
+            return;
+        }
+    }
+
     host->reset = 0;
 
     /* If it is a clear stall, we need to do an actual clear stall, rather then
@@ -2175,16 +3272,21 @@ static void usbredirhost_control_packet(void *priv, uint64_t id,
         return;
     }
 
-    buffer = malloc(LIBUSB_CONTROL_SETUP_SIZE + control_packet->length);
-    if (!buffer) {
-        ERROR("out of memory allocating transfer buffer, dropping packet");
+    transfer = usbredirhost_alloc_transfer(host, 0);
+    if (!transfer) {
         usbredirparser_free_packet_data(host->parser, data);
         return;
     }
 
-    transfer = usbredirhost_alloc_transfer(host, 0);
-    if (!transfer) {
-        free(buffer);
+    LOCK(host);
+    buffer = usbredirhost_alloc_dev_mem(host, transfer,
+                 LIBUSB_CONTROL_SETUP_SIZE + control_packet->length);
+    UNLOCK(host);
+    if (!buffer)
+        buffer = malloc(LIBUSB_CONTROL_SETUP_SIZE + control_packet->length);
+    if (!buffer) {
+        ERROR("out of memory allocating transfer buffer, dropping packet");
+        usbredirhost_free_transfer(transfer);
         usbredirparser_free_packet_data(host->parser, data);
         return;
     }
@@ -2210,10 +3312,15 @@ static void usbredirhost_control_packet(void *priv, uint64_t id,
 
     usbredirhost_add_transfer(host, transfer);
 
+    usbredirhost_latency_submit(host, transfer, parse_time);
+    usbredirhost_capture(host, transfer->transfer, 'S');
     r = libusb_submit_transfer(transfer->transfer);
+    /* Note transfer may already have completed and been freed here */
+    USBREDIR_TRACE(submit, ep, id, control_packet->length, r);
     if (r < 0) {
         ERROR("error submitting control transfer on ep %02X: %s",
               ep, libusb_error_name(r));
+        transfer->submit_time = 0;
         transfer->transfer->actual_length = 0;
         transfer->transfer->status = r;
         usbredirhost_control_packet_complete(transfer->transfer);
@@ -2226,9 +3333,18 @@ static void LIBUSB_CALL usbredirhost_bulk_packet_complete(
     struct usb_redir_bulk_packet_header bulk_packet;
     struct usbredirtransfer *transfer = libusb_transfer->user_data;
     struct usbredirhost *host = transfer->host;
+    uint64_t complete_time;
 
     LOCK(host);
+    if (usbredirhost_migrate_transfer(transfer)) {
+        UNLOCK(host);
+        return;
+    }
 
+    complete_time = usbredirhost_latency_complete(host, transfer);
+    USBREDIR_TRACE(complete, libusb_transfer->endpoint, transfer->id,
+                   libusb_transfer->actual_length, libusb_transfer->status);
+    usbredirhost_capture(host, libusb_transfer, 'C');
     bulk_packet = transfer->bulk_packet;
     bulk_packet.status = libusb_status_or_error_to_redir_status(host,
                                                   libusb_transfer->status);
@@ -2252,6 +3368,7 @@ static void LIBUSB_CALL usbredirhost_bulk_packet_complete(
             usbredirparser_send_bulk_packet(host->parser, transfer->id,
                                             &bulk_packet, NULL, 0);
         }
+        usbredirhost_latency_queued(host, usb_redir_type_bulk, complete_time);
     }
 
     usbredirhost_remove_and_free_transfer(transfer);
@@ -2277,6 +3394,7 @@ static void usbredirhost_bulk_packet(void *priv, uint64_t id,
     uint8_t ep = bulk_packet->endpoint;
     int len = (bulk_packet->length_high << 16) | bulk_packet->length;
     struct usbredirtransfer *transfer;
+    uint64_t parse_time = usbredirhost_latency_time(host);
     int r;
 
     DEBUG("bulk submit ep %02X len %d id %"PRIu64, ep, len, id);
@@ -2297,10 +3415,21 @@ static void usbredirhost_bulk_packet(void *priv, uint64_t id,
         return;
     }
 
+    transfer = usbredirhost_alloc_transfer(host, 0);
+    if (!transfer) {
+        free(data);
+        return;
+    }
+
     if (ep & LIBUSB_ENDPOINT_IN) {
-        data = malloc(len);
+        LOCK(host);
+        data = usbredirhost_alloc_dev_mem(host, transfer, len);
+        UNLOCK(host);
+        if (!data)
+            data = malloc(len);
         if (!data) {
             ERROR("out of memory allocating bulk buffer, dropping packet");
+            usbredirhost_free_transfer(transfer);
             return;
         }
     } else {
@@ -2309,12 +3438,6 @@ static void usbredirhost_bulk_packet(void *priv, uint64_t id,
            malloc-ed for us and expects us to free */
     }
 
-    transfer = usbredirhost_alloc_transfer(host, 0);
-    if (!transfer) {
-        free(data);
-        return;
-    }
-
     host->reset = 0;
 
     if (bulk_packet->stream_id) {
@@ -2338,13 +3461,18 @@ static void usbredirhost_bulk_packet(void *priv, uint64_t id,
 
     usbredirhost_add_transfer(host, transfer);
 
+    usbredirhost_latency_submit(host, transfer, parse_time);
+    usbredirhost_capture(host, transfer->transfer, 'S');
     r = libusb_submit_transfer(transfer->transfer);
+    /* Note transfer may already have completed and been freed here */
+    USBREDIR_TRACE(submit, ep, id, len, r);
     if (r < 0) {
 #if LIBUSBX_API_VERSION < 0x01000103
 error:
 #endif
         ERROR("error submitting bulk transfer on ep %02X: %s",
               ep, libusb_error_name(r));
+        transfer->submit_time = 0;
         transfer->transfer->actual_length = 0;
         transfer->transfer->status = r;
         usbredirhost_bulk_packet_complete(transfer->transfer);
@@ -2387,6 +3515,7 @@ static void usbredirhost_iso_packet(void *priv, uint64_t id,
 
     if (host->endpoint[EP2I(ep)].drop_packets) {
         host->endpoint[EP2I(ep)].drop_packets--;
+        USBREDIR_TRACE(iso_drop, ep, id, data_len, iso_packet->status);
         goto leave;
     }
 
@@ -2395,6 +3524,7 @@ static void usbredirhost_iso_packet(void *priv, uint64_t id,
     j = transfer->packet_idx;
     if (j == SUBMITTED_IDX) {
         DEBUG("overflow of iso out queue on ep: %02X, dropping packet", ep);
+        USBREDIR_TRACE(iso_drop, ep, id, data_len, iso_packet->status);
         /* Since we're interupting the stream anyways, drop enough packets to
            get back to our target buffer size */
         host->endpoint[EP2I(ep)].drop_packets =
@@ -2453,9 +3583,18 @@ static void LIBUSB_CALL usbredirhost_interrupt_out_packet_complete(
     struct usbredirtransfer *transfer = libusb_transfer->user_data;
     struct usb_redir_interrupt_packet_header interrupt_packet;
     struct usbredirhost *host = transfer->host;
+    uint64_t complete_time;
 
     LOCK(host);
+    if (usbredirhost_migrate_transfer(transfer)) {
+        UNLOCK(host);
+        return;
+    }
 
+    complete_time = usbredirhost_latency_complete(host, transfer);
+    USBREDIR_TRACE(complete, libusb_transfer->endpoint, transfer->id,
+                   libusb_transfer->actual_length, libusb_transfer->status);
+    usbredirhost_capture(host, libusb_transfer, 'C');
     interrupt_packet = transfer->interrupt_packet;
     interrupt_packet.status = libusb_status_or_error_to_redir_status(host,
                                                     libusb_transfer->status);
@@ -2468,6 +3607,8 @@ static void LIBUSB_CALL usbredirhost_interrupt_out_packet_complete(
     if (!transfer->cancelled) {
         usbredirparser_send_interrupt_packet(host->parser, transfer->id,
                                              &interrupt_packet, NULL, 0);
+        usbredirhost_latency_queued(host, usb_redir_type_interrupt,
+                                    complete_time);
     }
     usbredirhost_remove_and_free_transfer(transfer);
     UNLOCK(host);
@@ -2491,6 +3632,7 @@ static void usbredirhost_interrupt_packet(void *priv, uint64_t id,
     struct usbredirhost *host = priv;
     uint8_t ep = interrupt_packet->endpoint;
     struct usbredirtransfer *transfer;
+    uint64_t parse_time = usbredirhost_latency_time(host);
     int r;
 
     DEBUG("interrupt submit ep %02X len %d id %"PRIu64, ep,
@@ -2543,10 +3685,15 @@ static void usbredirhost_interrupt_packet(void *priv, uint64_t id,
 
     usbredirhost_add_transfer(host, transfer);
 
+    usbredirhost_latency_submit(host, transfer, parse_time);
+    usbredirhost_capture(host, transfer->transfer, 'S');
     r = libusb_submit_transfer(transfer->transfer);
+    /* Note transfer may already have completed and been freed here */
+    USBREDIR_TRACE(submit, ep, id, data_len, r);
     if (r < 0) {
         ERROR("error submitting interrupt transfer on ep %02X: %s",
               ep, libusb_error_name(r));
+        transfer->submit_time = 0;
         transfer->transfer->actual_length = 0;
         transfer->transfer->status = r;
         usbredirhost_interrupt_out_packet_complete(transfer->transfer);
@@ -2563,16 +3710,82 @@ void usbredirhost_get_guest_filter(struct usbredirhost *host,
     *rules_count_ret = host->filter_rules_count;
 }
 
+/* The descriptor info usbredirfilter_check needs */
+struct usbredirhost_filter_info {
+    uint8_t device_class;
+    uint8_t device_subclass;
+    uint8_t device_protocol;
+    uint16_t vendor_id;
+    uint16_t product_id;
+    uint16_t device_version_bcd;
+    int num_interfaces;
+    uint8_t interface_class[MAX_INTERFACES];
+    uint8_t interface_subclass[MAX_INTERFACES];
+    uint8_t interface_protocol[MAX_INTERFACES];
+};
+
+static void usbredirhost_filter_info_from_dev_desc(
+    struct usbredirhost_filter_info *info,
+    const struct libusb_device_descriptor *dev_desc)
+{
+    info->device_class = dev_desc->bDeviceClass;
+    info->device_subclass = dev_desc->bDeviceSubClass;
+    info->device_protocol = dev_desc->bDeviceProtocol;
+    info->vendor_id = dev_desc->idVendor;
+    info->product_id = dev_desc->idProduct;
+    info->device_version_bcd = dev_desc->bcdDevice;
+}
+
+static int usbredirhost_filter_info_same_device(
+    const struct usbredirhost_filter_info *a,
+    const struct usbredirhost_filter_info *b)
+{
+    return a->device_class == b->device_class &&
+           a->device_subclass == b->device_subclass &&
+           a->device_protocol == b->device_protocol &&
+           a->vendor_id == b->vendor_id &&
+           a->product_id == b->product_id &&
+           a->device_version_bcd == b->device_version_bcd;
+}
+
+/* Read the interface info from the active config, if there is no active
+   config num_interfaces is set to 0 */
+static int usbredirhost_get_filter_interfaces(libusb_device *dev,
+    struct usbredirhost_filter_info *info)
+{
+    struct libusb_config_descriptor *config = NULL;
+    int i, r;
+
+    info->num_interfaces = 0;
+    r = libusb_get_active_config_descriptor(dev, &config);
+    if (r < 0 && r != LIBUSB_ERROR_NOT_FOUND) {
+        if (r == LIBUSB_ERROR_NO_MEM)
+            return -ENOMEM;
+        return -EIO;
+    }
+    if (config == NULL) {
+        return 0;
+    }
+
+    info->num_interfaces = config->bNumInterfaces;
+    for (i = 0; i < info->num_interfaces; i++) {
+        const struct libusb_interface_descriptor *intf_desc =
+            config->interface[i].altsetting;
+        info->interface_class[i] = intf_desc->bInterfaceClass;
+        info->interface_subclass[i] = intf_desc->bInterfaceSubClass;
+        info->interface_protocol[i] = intf_desc->bInterfaceProtocol;
+    }
+    libusb_free_config_descriptor(config);
+    return 0;
+}
+
 USBREDIR_VISIBLE
 int usbredirhost_check_device_filter(const struct usbredirfilter_rule *rules,
     int rules_count, libusb_device *dev, int flags)
 {
-    int i, r, num_interfaces;
     struct libusb_device_descriptor dev_desc;
-    struct libusb_config_descriptor *config = NULL;
-    uint8_t interface_class[MAX_INTERFACES];
-    uint8_t interface_subclass[MAX_INTERFACES];
-    uint8_t interface_protocol[MAX_INTERFACES];
+    struct usbredirhost_filter_info info;
+    int r;
 
     r = libusb_get_device_descriptor(dev, &dev_desc);
     if (r < 0) {
@@ -2580,34 +3793,921 @@ int usbredirhost_check_device_filter(const struct usbredirfilter_rule *rules,
             return -ENOMEM;
         return -EIO;
     }
+    usbredirhost_filter_info_from_dev_desc(&info, &dev_desc);
 
-    r = libusb_get_active_config_descriptor(dev, &config);
-    if (r < 0 && r != LIBUSB_ERROR_NOT_FOUND) {
+    r = usbredirhost_get_filter_interfaces(dev, &info);
+    if (r < 0) {
+        return r;
+    }
+
+    return usbredirfilter_check(rules, rules_count, info.device_class,
+                info.device_subclass, info.device_protocol,
+                info.interface_class, info.interface_subclass,
+                info.interface_protocol, info.num_interfaces,
+                info.vendor_id, info.product_id,
+                info.device_version_bcd, flags);
+}
+
+/* The filter cache is a hash table of the filter info of devices, keyed by
+   bus number and device address */
+#define FILTER_CACHE_BUCKETS 64
+
+struct usbredirhost_filter_cache_entry {
+    struct usbredirhost_filter_cache_entry *next;
+    int key;
+    struct usbredirhost_filter_info info;
+};
+
+struct usbredirhost_filter_cache {
+    struct usbredirhost_filter_cache_entry *buckets[FILTER_CACHE_BUCKETS];
+};
+
+static int usbredirhost_filter_cache_key(libusb_device *dev)
+{
+    return (libusb_get_bus_number(dev) << 8) | libusb_get_device_address(dev);
+}
+
+static struct usbredirhost_filter_cache_entry **
+usbredirhost_filter_cache_find(struct usbredirhost_filter_cache *cache,
+    int key)
+{
+    struct usbredirhost_filter_cache_entry **entry;
+
+    entry = &cache->buckets[(key ^ (key >> 6)) % FILTER_CACHE_BUCKETS];
+    while (*entry && (*entry)->key != key) {
+        entry = &(*entry)->next;
+    }
+    return entry;
+}
+
+USBREDIR_VISIBLE
+struct usbredirhost_filter_cache *usbredirhost_filter_cache_new(void)
+{
+    return calloc(1, sizeof(struct usbredirhost_filter_cache));
+}
+
+USBREDIR_VISIBLE
+void usbredirhost_filter_cache_invalidate(
+    struct usbredirhost_filter_cache *cache, libusb_device *dev)
+{
+    struct usbredirhost_filter_cache_entry **entry, *next;
+    int i;
+
+    if (!cache)
+        return;
+
+    if (dev) {
+        entry = usbredirhost_filter_cache_find(cache,
+                                   usbredirhost_filter_cache_key(dev));
+        if (*entry) {
+            next = (*entry)->next;
+            free(*entry);
+            *entry = next;
+        }
+        return;
+    }
+
+    for (i = 0; i < FILTER_CACHE_BUCKETS; i++) {
+        while (cache->buckets[i]) {
+            next = cache->buckets[i]->next;
+            free(cache->buckets[i]);
+            cache->buckets[i] = next;
+        }
+    }
+}
+
+USBREDIR_VISIBLE
+void usbredirhost_filter_cache_free(struct usbredirhost_filter_cache *cache)
+{
+    usbredirhost_filter_cache_invalidate(cache, NULL);
+    free(cache);
+}
+
+/* Get the filter info of dev from the cache, or read and cache it. The device
+   descriptor is cached by libusb, so it is always re-read and an entry whose
+   device descriptor info does not match, e.g. because the address got
+   re-used without the cache being invalidated, gets refreshed. */
+static int usbredirhost_filter_cache_get(
+    struct usbredirhost_filter_cache *cache, libusb_device *dev,
+    struct usbredirhost_filter_info *info)
+{
+    struct libusb_device_descriptor dev_desc;
+    struct usbredirhost_filter_cache_entry **entry = NULL;
+    int r;
+
+    r = libusb_get_device_descriptor(dev, &dev_desc);
+    if (r < 0) {
         if (r == LIBUSB_ERROR_NO_MEM)
             return -ENOMEM;
         return -EIO;
     }
-    if (config == NULL) {
-        return usbredirfilter_check(rules, rules_count, dev_desc.bDeviceClass,
-                    dev_desc.bDeviceSubClass, dev_desc.bDeviceProtocol,
-                    NULL, NULL, NULL, 0,
-                    dev_desc.idVendor, dev_desc.idProduct,
-                    dev_desc.bcdDevice, flags);
+    usbredirhost_filter_info_from_dev_desc(info, &dev_desc);
+
+    if (cache) {
+        entry = usbredirhost_filter_cache_find(cache,
+                                   usbredirhost_filter_cache_key(dev));
+        if (*entry && usbredirhost_filter_info_same_device(&(*entry)->info,
+                                                           info)) {
+            *info = (*entry)->info;
+            return 0;
+        }
     }
 
-    num_interfaces = config->bNumInterfaces;
-    for (i = 0; i < num_interfaces; i++) {
-        const struct libusb_interface_descriptor *intf_desc =
-            config->interface[i].altsetting;
-        interface_class[i] = intf_desc->bInterfaceClass;
-        interface_subclass[i] = intf_desc->bInterfaceSubClass;
-        interface_protocol[i] = intf_desc->bInterfaceProtocol;
+    r = usbredirhost_get_filter_interfaces(dev, info);
+    if (r < 0) {
+        return r;
     }
-    libusb_free_config_descriptor(config);
 
-    return usbredirfilter_check(rules, rules_count, dev_desc.bDeviceClass,
-                dev_desc.bDeviceSubClass, dev_desc.bDeviceProtocol,
-                interface_class, interface_subclass, interface_protocol,
-                num_interfaces, dev_desc.idVendor, dev_desc.idProduct,
-                dev_desc.bcdDevice, flags);
+    if (cache) {
+        if (!*entry) {
+            *entry = calloc(1, sizeof(struct usbredirhost_filter_cache_entry));
+            if (!*entry) {
+                /* Not fatal, we have the info, just do not cache it */
+                return 0;
+            }
+            (*entry)->key = usbredirhost_filter_cache_key(dev);
+        }
+        (*entry)->info = *info;
+    }
+    return 0;
+}
+
+USBREDIR_VISIBLE
+int usbredirhost_check_device_filter_batch(
+    const struct usbredirfilter_compiled *compiled,
+    struct usbredirhost_filter_cache *cache,
+    libusb_device **devs, int devs_count, int flags, int *results)
+{
+    struct usbredirhost_filter_info info;
+    int i, r, allowed = 0;
+
+    if (!compiled || devs_count < 0)
+        return -EINVAL;
+
+    for (i = 0; i < devs_count; i++) {
+        r = usbredirhost_filter_cache_get(cache, devs[i], &info);
+        if (r == 0) {
+            r = usbredirfilter_check_compiled(compiled, info.device_class,
+                    info.device_subclass, info.device_protocol,
+                    info.interface_class, info.interface_subclass,
+                    info.interface_protocol, info.num_interfaces,
+                    info.vendor_id, info.product_id,
+                    info.device_version_bcd, flags);
+        }
+        results[i] = r;
+        if (r == 0)
+            allowed++;
+    }
+    return allowed;
+}
+
+/**************************************************************************/
+
+USBREDIR_VISIBLE
+int usbredirhost_enable_latency_stats(struct usbredirhost *host)
+{
+    if (host->latency)
+        return 0;
+
+    host->latency = calloc(1, sizeof(*host->latency));
+    if (!host->latency) {
+        ERROR("out of memory allocating latency stats");
+        return -ENOMEM;
+    }
+    if (host->parser->alloc_lock_func) {
+        host->latency->lock = host->parser->alloc_lock_func();
+    }
+    usbredirparser_set_write_tag_funcs(host->parser,
+                                       usbredirhost_latency_write_tag,
+                                       usbredirhost_latency_written);
+    return 0;
+}
+
+USBREDIR_VISIBLE
+void usbredirhost_reset_latency_stats(struct usbredirhost *host)
+{
+    struct usbredirhost_latency *latency = host->latency;
+
+    if (!latency)
+        return;
+
+    if (latency->lock)
+        host->parser->lock_func(latency->lock);
+    memset(latency->hist, 0, sizeof(latency->hist));
+    if (latency->lock)
+        host->parser->unlock_func(latency->lock);
+}
+
+USBREDIR_VISIBLE
+int usbredirhost_get_latency_histogram(struct usbredirhost *host,
+    uint8_t type, int stage, struct usbredirhost_latency_histogram *hist_ret)
+{
+    struct usbredirhost_latency *latency = host->latency;
+
+    if (!latency || type >= LATENCY_TYPE_COUNT || stage < 0 ||
+            stage >= usbredirhost_latency_stage_count)
+        return -EINVAL;
+
+    if (latency->lock)
+        host->parser->lock_func(latency->lock);
+    *hist_ret = latency->hist[type][stage];
+    if (latency->lock)
+        host->parser->unlock_func(latency->lock);
+
+    return 0;
+}
+
+USBREDIR_VISIBLE
+uint64_t usbredirhost_latency_bucket_value(int bucket)
+{
+    int group, msb;
+
+    if (bucket < (1 << LATENCY_SUB_BITS))
+        return bucket;
+
+    group = bucket >> LATENCY_SUB_BITS;
+    msb = group + LATENCY_SUB_BITS - 1;
+    return ((uint64_t)1 << msb) +
+           ((uint64_t)(bucket & ((1 << LATENCY_SUB_BITS) - 1)) <<
+            (msb - LATENCY_SUB_BITS));
+}
+
+USBREDIR_VISIBLE
+uint64_t usbredirhost_latency_percentile(
+    const struct usbredirhost_latency_histogram *hist, double percentile)
+{
+    uint64_t target, seen = 0;
+    int i;
+
+    if (hist->count == 0)
+        return 0;
+
+    target = (uint64_t)(hist->count * CLAMP(percentile, 0.0, 100.0) / 100.0);
+    if (target == 0)
+        target = 1;
+
+    for (i = 0; i < USBREDIRHOST_LATENCY_BUCKETS; i++) {
+        seen += hist->bucket[i];
+        if (seen >= target) {
+            uint64_t value = usbredirhost_latency_bucket_value(i);
+            return CLAMP(value, hist->min_ns, hist->max_ns);
+        }
+    }
+    return hist->max_ns;
+}
+
+USBREDIR_VISIBLE
+int usbredirhost_start_capture(struct usbredirhost *host,
+    unsigned int ring_size, unsigned int snaplen)
+{
+    struct usbredirhost_capture *cap = atomic_load(&host->capture);
+    size_t i, size = 1;
+
+    if (cap) {
+        atomic_store(&cap->enabled, 1);
+        return 0;
+    }
+
+    if (ring_size == 0 || ring_size > CAPTURE_MAX_RING_SIZE ||
+            snaplen > CAPTURE_MAX_SNAPLEN) {
+        return -EINVAL;
+    }
+    while (size < ring_size)
+        size <<= 1;
+
+    cap = calloc(1, sizeof(*cap));
+    if (!cap) {
+        return -ENOMEM;
+    }
+    cap->mask = size - 1;
+    cap->snaplen = snaplen;
+    /* Room for the largest possible record, rounded up to a cacheline */
+    cap->slot_size = sizeof(struct usbredirhost_capture_slot) +
+                     CAPTURE_PCAP_HDR_SIZE + CAPTURE_USBMON_HDR_SIZE +
+                     MAX_PACKETS_PER_TRANSFER * CAPTURE_ISO_DESC_SIZE +
+                     snaplen;
+    cap->slot_size = (cap->slot_size + 63) & ~(size_t)63;
+    cap->slots = calloc(size, cap->slot_size);
+    if (!cap->slots) {
+        free(cap);
+        return -ENOMEM;
+    }
+    for (i = 0; i < size; i++) {
+        atomic_init(&usbredirhost_capture_slot(cap, i)->seq, i);
+    }
+    atomic_init(&cap->head, 0);
+    atomic_init(&cap->drops, 0);
+    atomic_init(&cap->enabled, 1);
+
+    atomic_store_explicit(&host->capture, cap, memory_order_release);
+    return 0;
+}
+
+USBREDIR_VISIBLE
+void usbredirhost_stop_capture(struct usbredirhost *host)
+{
+    struct usbredirhost_capture *cap = atomic_load(&host->capture);
+
+    if (cap) {
+        atomic_store(&cap->enabled, 0);
+    }
+}
+
+USBREDIR_VISIBLE
+int usbredirhost_drain_capture(struct usbredirhost *host,
+    usbredirhost_capture_write write_func, void *priv)
+{
+    struct usbredirhost_capture *cap =
+        atomic_load_explicit(&host->capture, memory_order_acquire);
+    struct usbredirhost_capture_slot *slot;
+    int count = 0, len, r;
+    size_t i;
+
+    if (!cap) {
+        return -EINVAL;
+    }
+
+    if (!cap->header_written) {
+        uint32_t hdr[6];
+        uint16_t *version = (uint16_t *)&hdr[1];
+
+        hdr[0] = CAPTURE_PCAP_MAGIC;
+        version[0] = 2;
+        version[1] = 4;
+        hdr[2] = 0; /* thiszone */
+        hdr[3] = 0; /* sigfigs */
+        hdr[4] = cap->slot_size - sizeof(struct usbredirhost_capture_slot) -
+                 CAPTURE_PCAP_HDR_SIZE; /* snaplen */
+        hdr[5] = CAPTURE_LINKTYPE_USBMON;
+        if (write_func(priv, (uint8_t *)hdr, sizeof(hdr)) != sizeof(hdr)) {
+            return -EIO;
+        }
+        cap->header_written = 1;
+    }
+
+    for (i = 0; i <= cap->mask; i++) {
+        slot = usbredirhost_capture_slot(cap, cap->tail);
+        if (atomic_load_explicit(&slot->seq, memory_order_acquire) !=
+                cap->tail + 1) {
+            break;
+        }
+        len = slot->len;
+        r = write_func(priv, slot->data, len);
+        /* Hand the slot back to the producers */
+        atomic_store_explicit(&slot->seq, cap->tail + cap->mask + 1,
+                              memory_order_release);
+        cap->tail++;
+        if (r != len) {
+            return -EIO;
+        }
+        count++;
+    }
+    return count;
+}
+
+USBREDIR_VISIBLE
+uint64_t usbredirhost_get_capture_drops(struct usbredirhost *host)
+{
+    struct usbredirhost_capture *cap = atomic_load(&host->capture);
+
+    return cap ? atomic_load_explicit(&cap->drops, memory_order_relaxed) : 0;
+}
+
+/****** Serialization support ******/
+
+#define USBREDIRHOST_SERIALIZE_MAGIC 0x55524831
+
+/* Serialization format, like with usbredirparser_serialize() sending and
+   receiving endian are expected to be the same!
+    uint32 MAGIC: 0x55524831 ascii: URH1 (UsbRedirHost version 1)
+    uint32 len: length of the entire serialized state, including MAGIC
+    uint32 vendor_id
+    uint32 product_id
+    uint32 configuration: bConfigurationValue, 0 when unconfigured
+    uint32 restore_config
+    uint32 interface_count
+    uint32 alt_setting[interface_count]
+    uint32 stream_count: followed by stream_count times:
+        uint32 endpoint
+        uint32 type
+        uint32 pkts_per_transfer
+        uint32 transfer_count
+        uint32 pkt_size
+    uint32 pending_count: followed by pending_count times:
+        uint64 id
+        uint32 type
+        uint32 header_len
+        uint8  header[header_len]
+        uint32 data_len
+        uint8  data[data_len]: the data of OUT transfers
+    uint32 filter_len
+    uint8  filter[filter_len]: the usb-guest's filter as "," and "|"
+                               separated string, without 0 terminator
+    uint32 parser_state_len
+    uint8  parser_state[parser_state_len]: see usbredirparser_serialize()
+*/
+
+/* The header which the usb-guest sent for a pending transfer, returns the
+   header length, or 0 for transfers of other types. Only control, bulk and
+   interrupt OUT transfers are on the transfers lists. */
+static int usbredirhost_transfer_header(struct usbredirtransfer *transfer,
+    uint32_t *type, void **header)
+{
+    switch (transfer->transfer->type) {
+    case LIBUSB_TRANSFER_TYPE_CONTROL:
+        *type = usb_redir_type_control;
+        *header = &transfer->control_packet;
+        return sizeof(transfer->control_packet);
+    case LIBUSB_TRANSFER_TYPE_BULK:
+#if LIBUSBX_API_VERSION >= 0x01000103
+    case LIBUSB_TRANSFER_TYPE_BULK_STREAM:
+#endif
+        *type = usb_redir_type_bulk;
+        *header = &transfer->bulk_packet;
+        return sizeof(transfer->bulk_packet);
+    case LIBUSB_TRANSFER_TYPE_INTERRUPT:
+        *type = usb_redir_type_interrupt;
+        *header = &transfer->interrupt_packet;
+        return sizeof(transfer->interrupt_packet);
+    default:
+        *type = 0;
+        *header = NULL;
+        return 0;
+    }
+}
+
+/* The data which the usb-guest sent with a pending transfer, returns its
+   length, 0 for IN transfers */
+static int usbredirhost_transfer_out_data(struct usbredirtransfer *transfer,
+    uint8_t **data)
+{
+    struct libusb_transfer *libusb_transfer = transfer->transfer;
+
+    *data = NULL;
+    switch (libusb_transfer->type) {
+    case LIBUSB_TRANSFER_TYPE_CONTROL:
+        if (transfer->control_packet.endpoint & LIBUSB_ENDPOINT_IN)
+            return 0;
+        *data = libusb_transfer->buffer + LIBUSB_CONTROL_SETUP_SIZE;
+        return transfer->control_packet.length;
+    default:
+        if (libusb_transfer->endpoint & LIBUSB_ENDPOINT_IN)
+            return 0;
+        *data = libusb_transfer->buffer;
+        return libusb_transfer->length;
+    }
+}
+
+/* Submits a pending transfer again, as if the usb-guest sent it */
+static void usbredirhost_resubmit(struct usbredirhost *host, uint64_t id,
+    uint32_t type, void *header, const uint8_t *data, uint32_t data_len)
+{
+    uint8_t *copy = NULL;
+
+    if (data_len) {
+        copy = malloc(data_len);
+        if (!copy) {
+            /* Fails the transfer, as its data is missing */
+            ERROR("out of memory resubmitting transfer id %"PRIu64, id);
+            data_len = 0;
+        } else {
+            memcpy(copy, data, data_len);
+        }
+    }
+
+    switch (type) {
+    case usb_redir_type_control:
+        usbredirhost_control_packet(host, id, header, copy, data_len);
+        break;
+    case usb_redir_type_bulk:
+        usbredirhost_bulk_packet(host, id, header, copy, data_len);
+        break;
+    case usb_redir_type_interrupt:
+        usbredirhost_interrupt_packet(host, id, header, copy, data_len);
+        break;
+    }
+}
+
+/* After usbredirhost_serialize the session continues here after all */
+static void usbredirhost_resubmit_migrated_transfers(
+    struct usbredirhost *host)
+{
+    struct usbredirtransfer *transfer, *next;
+    uint32_t type;
+    void *header;
+    uint8_t *data;
+    int data_len;
+
+    LOCK(host);
+    transfer = host->migrate_head.next;
+    host->migrate_head.next = NULL;
+    UNLOCK(host);
+
+    for (; transfer; transfer = next) {
+        next = transfer->next;
+        usbredirhost_transfer_header(transfer, &type, &header);
+        data_len = usbredirhost_transfer_out_data(transfer, &data);
+        usbredirhost_resubmit(host, transfer->id, type, header,
+                              data, data_len);
+        LOCK(host);
+        usbredirhost_free_transfer(transfer);
+        UNLOCK(host);
+    }
+}
+
+static int usbredirhost_header_len(uint32_t type)
+{
+    switch (type) {
+    case usb_redir_type_control:
+        return sizeof(struct usb_redir_control_packet_header);
+    case usb_redir_type_bulk:
+        return sizeof(struct usb_redir_bulk_packet_header);
+    case usb_redir_type_interrupt:
+        return sizeof(struct usb_redir_interrupt_packet_header);
+    default:
+        return -1;
+    }
+}
+
+/* The size of the state gets calculated up front, so these can not fail */
+static void serialize_data(uint8_t **pos, const void *data, uint32_t len)
+{
+    memcpy(*pos, data, len);
+    *pos += len;
+}
+
+static void serialize_int(uint8_t **pos, uint32_t val)
+{
+    serialize_data(pos, &val, sizeof(uint32_t));
+}
+
+/* Returns a pointer to the next len bytes of the state, or NULL */
+static uint8_t *unserialize_data(struct usbredirhost *host,
+    uint8_t **pos, uint32_t *remain, uint32_t len)
+{
+    uint8_t *data = *pos;
+
+    if (*remain < len) {
+        ERROR("error buffer underrun while unserializing state");
+        return NULL;
+    }
+    *pos += len;
+    *remain -= len;
+    return data;
+}
+
+static int unserialize_int(struct usbredirhost *host,
+    uint8_t **pos, uint32_t *remain, uint32_t *val)
+{
+    uint8_t *data = unserialize_data(host, pos, remain, sizeof(uint32_t));
+
+    if (!data)
+        return -1;
+    memcpy(val, data, sizeof(uint32_t));
+    return 0;
+}
+
+USBREDIR_VISIBLE
+int usbredirhost_serialize(struct usbredirhost *host,
+                           uint8_t **state_dest, int *state_len)
+{
+    struct usbredirtransfer *transfer;
+    struct usbredirhost_ep *ep;
+    uint8_t *state = NULL, *pos, *parser_state = NULL;
+    uint32_t len, type, stream_count = 0, pending_count = 0;
+    int i, header_len, data_len, parser_state_len, interface_count;
+    int filter_len = 0, wait, ret = -1;
+    char *filter = NULL;
+    void *header;
+    uint8_t *data;
+
+    *state_dest = NULL;
+    *state_len = 0;
+
+    if (!atomic_load(&host->suspended)) {
+        ERROR("error serializing a usbredirhost which is not suspended");
+        return -1;
+    }
+
+    /* Take back the pending transfers, those which complete anyway get
+       queued for the usb-guest, see usbredirhost_migrate_transfer */
+    LOCK(host);
+    if (host->disconnected || host->wait_disconnect) {
+        ERROR("error serializing a usbredirhost without a connected device");
+        goto unlock;
+    }
+    for (transfer = host->transfers_head.next; transfer;
+            transfer = transfer->next) {
+        if (transfer->cancelled)
+            continue;
+        transfer->migrate = 1;
+        libusb_cancel_transfer(transfer->transfer);
+    }
+    wait = host->transfers_head.next != NULL;
+    UNLOCK(host);
+    if (wait)
+        usbredirhost_wait_for_cancel_completion(host);
+
+    /* Transfers complete with the lock held, so this gets a consistent
+       view of the kept transfers and of the packets queued for the
+       usb-guest */
+    LOCK(host);
+
+    if (host->filter_rules) {
+        filter = usbredirfilter_rules_to_string(host->filter_rules,
+                                                host->filter_rules_count,
+                                                ",", "|");
+        if (!filter) {
+            ERROR("error serializing the usb-guest's filter");
+            goto unlock;
+        }
+        filter_len = strlen(filter);
+    }
+
+    if (usbredirparser_serialize(host->parser, &parser_state,
+                                 &parser_state_len))
+        goto unlock;
+
+    interface_count = host->config ? host->config->bNumInterfaces : 0;
+    len = (11 + interface_count) * sizeof(uint32_t) +
+          filter_len + parser_state_len;
+    for (i = 0; i < MAX_ENDPOINTS; i++) {
+        if (host->endpoint[i].transfer_count) {
+            stream_count++;
+        }
+    }
+    len += stream_count * 5 * sizeof(uint32_t);
+    for (transfer = host->migrate_head.next; transfer;
+            transfer = transfer->next) {
+        header_len = usbredirhost_transfer_header(transfer, &type, &header);
+        data_len = usbredirhost_transfer_out_data(transfer, &data);
+        pending_count++;
+        len += sizeof(uint64_t) + 3 * sizeof(uint32_t) + header_len + data_len;
+    }
+
+    state = malloc(len);
+    if (!state) {
+        ERROR("Out of memory allocating serialization buffer");
+        goto unlock;
+    }
+    pos = state;
+
+    serialize_int(&pos, USBREDIRHOST_SERIALIZE_MAGIC);
+    serialize_int(&pos, len);
+    serialize_int(&pos, host->desc.idVendor);
+    serialize_int(&pos, host->desc.idProduct);
+    serialize_int(&pos, host->config ? host->config->bConfigurationValue : 0);
+    serialize_int(&pos, host->restore_config);
+    serialize_int(&pos, interface_count);
+    for (i = 0; i < interface_count; i++) {
+        serialize_int(&pos, host->alt_setting[i]);
+    }
+
+    serialize_int(&pos, stream_count);
+    for (i = 0; i < MAX_ENDPOINTS; i++) {
+        ep = &host->endpoint[i];
+        if (!ep->transfer_count)
+            continue;
+        serialize_int(&pos, I2EP(i));
+        serialize_int(&pos, ep->type);
+        serialize_int(&pos, ep->pkts_per_transfer);
+        serialize_int(&pos, ep->transfer_count);
+        serialize_int(&pos, ep->transfer[0]->transfer->length /
+                            ep->pkts_per_transfer);
+    }
+
+    serialize_int(&pos, pending_count);
+    for (transfer = host->migrate_head.next; transfer;
+            transfer = transfer->next) {
+        header_len = usbredirhost_transfer_header(transfer, &type, &header);
+        data_len = usbredirhost_transfer_out_data(transfer, &data);
+        serialize_data(&pos, &transfer->id, sizeof(uint64_t));
+        serialize_int(&pos, type);
+        serialize_int(&pos, header_len);
+        serialize_data(&pos, header, header_len);
+        serialize_int(&pos, data_len);
+        serialize_data(&pos, data, data_len);
+    }
+
+    serialize_int(&pos, filter_len);
+    serialize_data(&pos, filter, filter_len);
+    serialize_int(&pos, parser_state_len);
+    serialize_data(&pos, parser_state, parser_state_len);
+
+    DEBUG("serialized %u bytes of state, %u streams, %u pending transfers",
+          len, stream_count, pending_count);
+    host->migrated = 1;
+    *state_dest = state;
+    *state_len = len;
+    ret = 0;
+unlock:
+    UNLOCK(host);
+    free(parser_state);
+    usbredirfilter_free(filter);
+    return ret;
+}
+
+USBREDIR_VISIBLE
+int usbredirhost_unserialize(struct usbredirhost *host,
+    libusb_device_handle *usb_dev_handle, uint8_t *state, int len)
+{
+    struct usbredirfilter_rule *rules = NULL;
+    uint32_t i, j, val, remain = len, vendor_id, product_id, configuration;
+    uint32_t restore_config, interface_count, stream_count, pending_count;
+    uint32_t streams[MAX_ENDPOINTS][5], type, header_len, filter_len;
+    uint8_t alt_setting[MAX_INTERFACES], *pos = state, *pending, *data;
+    uint64_t id;
+    int r, rules_count = 0;
+
+    if (host->dev) {
+        ERROR("unserialization must use a usbredirhost without a device");
+        goto error_close;
+    }
+
+    if (unserialize_int(host, &pos, &remain, &val))
+        goto error_close;
+    if (val != USBREDIRHOST_SERIALIZE_MAGIC) {
+        ERROR("error unserialize magic mismatch");
+        goto error_close;
+    }
+    if (unserialize_int(host, &pos, &remain, &val))
+        goto error_close;
+    if (val != (uint32_t)len) {
+        ERROR("error unserialize length mismatch");
+        goto error_close;
+    }
+
+    if (unserialize_int(host, &pos, &remain, &vendor_id) ||
+        unserialize_int(host, &pos, &remain, &product_id) ||
+        unserialize_int(host, &pos, &remain, &configuration) ||
+        unserialize_int(host, &pos, &remain, &restore_config) ||
+        unserialize_int(host, &pos, &remain, &interface_count))
+        goto error_close;
+    if (interface_count > MAX_INTERFACES) {
+        ERROR("error unserialize interface count %u invalid",
+              interface_count);
+        goto error_close;
+    }
+    for (i = 0; i < interface_count; i++) {
+        if (unserialize_int(host, &pos, &remain, &val))
+            goto error_close;
+        alt_setting[i] = val;
+    }
+
+    if (unserialize_int(host, &pos, &remain, &stream_count))
+        goto error_close;
+    if (stream_count > MAX_ENDPOINTS) {
+        ERROR("error unserialize stream count %u invalid", stream_count);
+        goto error_close;
+    }
+    for (i = 0; i < stream_count; i++) {
+        for (j = 0; j < 5; j++) {
+            if (unserialize_int(host, &pos, &remain, &streams[i][j]))
+                goto error_close;
+        }
+    }
+
+    /* Check the pending transfers now, they get submitted again once the
+       parser state has been restored */
+    if (unserialize_int(host, &pos, &remain, &pending_count))
+        goto error_close;
+    pending = pos;
+    for (i = 0; i < pending_count; i++) {
+        if (!unserialize_data(host, &pos, &remain, sizeof(uint64_t)) ||
+            unserialize_int(host, &pos, &remain, &type) ||
+            unserialize_int(host, &pos, &remain, &header_len))
+            goto error_close;
+        if (usbredirhost_header_len(type) != (int)header_len) {
+            ERROR("error unserialize pending transfer type %u invalid", type);
+            goto error_close;
+        }
+        if (!unserialize_data(host, &pos, &remain, header_len) ||
+            unserialize_int(host, &pos, &remain, &val) ||
+            !unserialize_data(host, &pos, &remain, val))
+            goto error_close;
+    }
+
+    if (unserialize_int(host, &pos, &remain, &filter_len))
+        goto error_close;
+    data = unserialize_data(host, &pos, &remain, filter_len);
+    if (!data)
+        goto error_close;
+    if (filter_len) {
+        r = usbredirfilter_buf_to_rules((char *)data, filter_len, ",", "|",
+                                        &rules, &rules_count, NULL);
+        if (r) {
+            ERROR("error unserialize filter: %s", strerror(-r));
+            goto error_close;
+        }
+    }
+
+    if (unserialize_int(host, &pos, &remain, &val))
+        goto error_close;
+    data = unserialize_data(host, &pos, &remain, val);
+    if (!data)
+        goto error_close;
+    if (remain) {
+        ERROR("error unserialize %u bytes of trailing data", remain);
+        goto error_close;
+    }
+    if (usbredirparser_unserialize(host->parser, data, val))
+        goto error_close;
+
+    free(host->filter_rules);
+    host->filter_rules = rules;
+    host->filter_rules_count = rules_count;
+    rules = NULL;
+
+    /* Claim the device as it was left, without resetting it */
+    host->dev = libusb_get_device(usb_dev_handle);
+    host->handle = usb_dev_handle;
+    if (usbredirhost_claim(host, 0) != usb_redir_success)
+        goto error_clear;
+    host->restore_config = restore_config;
+    usbredirhost_set_quirks(host);
+
+    if (host->desc.idVendor != vendor_id ||
+            host->desc.idProduct != product_id) {
+        ERROR("error unserialize device %04x:%04x does not match %04x:%04x",
+              host->desc.idVendor, host->desc.idProduct,
+              vendor_id, product_id);
+        goto error_clear;
+    }
+    if ((host->config ? host->config->bConfigurationValue : 0) !=
+            configuration ||
+            (host->config ? host->config->bNumInterfaces : 0) !=
+            interface_count) {
+        ERROR("error unserialize device configuration changed");
+        goto error_clear;
+    }
+    for (i = 0; i < interface_count; i++) {
+        if (alt_setting[i] == 0)
+            continue;
+        if (alt_setting[i] >= host->config->interface[i].num_altsetting) {
+            ERROR("error unserialize alt setting %d invalid",
+                  alt_setting[i]);
+            goto error_clear;
+        }
+        r = libusb_set_interface_alt_setting(host->handle,
+                host->config->interface[i].altsetting[0].bInterfaceNumber,
+                alt_setting[i]);
+        if (r < 0) {
+            ERROR("could not set alt setting for interface %d to %d: %s",
+                  host->config->interface[i].altsetting[0].bInterfaceNumber,
+                  alt_setting[i], libusb_error_name(r));
+            goto error_clear;
+        }
+        host->alt_setting[i] = alt_setting[i];
+    }
+    usbredirhost_parse_config(host);
+
+    LOCK(host);
+    host->connect_pending = 0;
+    host->disconnected = 0; /* The usb-guest already knows the device */
+
+    /* On failure these send a stall stream status to the usb-guest */
+    for (i = 0; i < stream_count; i++) {
+        usbredirhost_alloc_stream_unlocked(host, 0, streams[i][0],
+                                           streams[i][1], streams[i][2],
+                                           streams[i][4], streams[i][3], 0);
+    }
+
+    UNLOCK(host);
+
+    /* After the completions the old host queued, which are part of the
+       parser state */
+    pos = pending;
+    for (i = 0; i < pending_count; i++) {
+        union {
+            struct usb_redir_control_packet_header control_packet;
+            struct usb_redir_bulk_packet_header bulk_packet;
+            struct usb_redir_interrupt_packet_header interrupt_packet;
+        } header;
+
+        memcpy(&id, pos, sizeof(uint64_t));
+        pos += sizeof(uint64_t);
+        memcpy(&type, pos, sizeof(uint32_t));
+        pos += sizeof(uint32_t);
+        memcpy(&header_len, pos, sizeof(uint32_t));
+        pos += sizeof(uint32_t);
+        memcpy(&header, pos, header_len);
+        pos += header_len;
+        memcpy(&val, pos, sizeof(uint32_t));
+        pos += sizeof(uint32_t);
+        usbredirhost_resubmit(host, id, type, &header, pos, val);
+        pos += val;
+    }
+
+    DEBUG("unserialized %d bytes of state, %u streams, %u pending transfers",
+          len, stream_count, pending_count);
+    FLUSH(host);
+    return 0;
+
+error_close:
+    free(rules);
+    libusb_close(usb_dev_handle);
+    return -1;
+error_clear:
+    usbredirhost_clear_device(host);
+    return -1;
 }
@@ -62,6 +62,11 @@ typedef uint64_t (*usbredirhost_buffered_output_size)(void *priv);
 
 enum {
     usbredirhost_fl_write_cb_owns_buffer = 0x01, /* See usbredirparser.h */
+    /* Prefault and mlock the buffers of iso, bulk and interrupt streams, so
+       that streaming does not stall on page faults. Where mlock is not
+       permitted (see RLIMIT_MEMLOCK) or not available the buffers only get
+       prefaulted, and a warning is logged once. */
+    usbredirhost_fl_lock_stream_buffers = 0x02,
 };
 
 struct usbredirhost *usbredirhost_open(
@@ -160,9 +165,83 @@ int usbredirhost_write_guest_data(struct usbredirhost *host);
 
 /* When passing the usbredirhost_fl_write_cb_owns_buffer flag to
    usbredirhost_open, this function must be called to free the data buffer
-   passed to write_guest_data_func when done with this buffer. */
+   passed to write_guest_data_func when done with this buffer.
+   Each buffer the write callback took (by returning count) must be freed
+   exactly once, giving back more buffers than were handed out calls abort().
+   Buffers which are still in use when closing the usbredirhost, e.g. by a
+   MSG_ZEROCOPY send, may be freed after usbredirhost_close(), the
+   usbredirhost's own memory gets freed together with the last of them.
+   This may be called from any thread. */
 void usbredirhost_free_write_buffer(struct usbredirhost *host, uint8_t *data);
 
+/* Session resumption
+
+   Call usbredirhost_suspend() instead of closing the usbredirhost when the
+   connection to the usb-guest went away, but the usb-guest may come back and
+   continue the session, e.g. after a network hiccup, or from another process
+   which took over its usbredirparser state with usbredirparser_serialize() /
+   usbredirparser_unserialize(). The device stays claimed, in its current
+   configuration and alt settings, and does not get reset. Transfers keep
+   running and their completions get queued for the usb-guest, stream data
+   gets dropped once the queue gets long, like with a slow connection.
+
+   While suspended the read and write callbacks do not get called, neither
+   from usbredirhost_read_guest_data / usbredirhost_write_guest_data, nor
+   from the flush_writes callback, which other threads may still call. So
+   once usbredirhost_suspend() returns, it waits for a write another thread
+   is doing, the application can replace its connection.
+
+   usbredirhost_resume() then continues the session over the new connection:
+   both sides continue their data streams where they left off, there is no
+   new hello. There is no resync either: the rest of a packet which was
+   partly written goes out first, and a partly read packet gets completed
+   with the first bytes read from the new connection. Data which was written
+   to the old connection but did not arrive is lost. So this only works out
+   when the other side continues at exactly the same offsets, e.g. when both
+   ends of a local connection get handed over, not after a network error.
+   usbredirhost does not check that the new connection goes to the same
+   usb-guest, the application has to, e.g. with a session id in the version
+   string passed to usbredirhost_open which the usb-guest sends back.
+   To start over with a new usb-guest, close the usbredirhost instead. */
+void usbredirhost_suspend(struct usbredirhost *host);
+void usbredirhost_resume(struct usbredirhost *host);
+
+/* Serialization, to hand a redirected device over to another process, e.g.
+   when the process talking to the usb-guest gets migrated or upgraded,
+   without resetting the device.
+
+   usbredirhost_serialize() stores the state of a suspended usbredirhost:
+   the configuration and alt settings of the device, the iso, interrupt
+   receiving and bulk receiving streams with their parameters, the pending
+   transfers, the usb-guest's filter and the usbredirparser state. It
+   allocates a large enough buffer for this itself and stores this in
+   state_dest, and its size in state_len. The buffer should be free-ed by
+   the caller using free().
+   To get the pending control, bulk and interrupt OUT transfers into the
+   state it cancels them, and waits for that, handling libusb events.
+   Those which had not moved any data yet get stored with their header and
+   OUT data, the others complete to the usb-guest as usual.
+   Closing the usbredirhost after this releases the device without resetting
+   it or re-attaching kernel drivers, so that the other process can claim
+   it. usbredirhost_resume() continues the session on this side instead,
+   submitting the stored transfers again.
+
+   usbredirhost_unserialize() continues the session with a usbredirhost
+   which was opened without a device and has not read or written any guest
+   data yet, and usb_dev_handle, which must be a handle for the same device.
+   Like usbredirhost_set_device() it takes over usb_dev_handle, also on
+   failure. It claims the device, restores its alt settings and restarts
+   the streams, whose packet ids start over at 0. The stored transfers get
+   submitted again, with their original ids, and complete to the usb-guest
+   after what the old process had queued. There is no new hello or
+   device_connect. On failure the usbredirhost must be closed.
+
+   Return value: 0 on success, -1 on error. */
+int usbredirhost_serialize(struct usbredirhost *host,
+                           uint8_t **state_dest, int *state_len);
+int usbredirhost_unserialize(struct usbredirhost *host,
+    libusb_device_handle *usb_dev_handle, uint8_t *state, int len);
+
 /* Get the *usbredir-guest's* filter, if any. If there is no filter,
    rules is set to NULL and rules_count to 0. */
 void usbredirhost_get_guest_filter(struct usbredirhost *host,
@@ -178,6 +257,154 @@ void usbredirhost_get_guest_filter(struct usbredirhost *host,
 int usbredirhost_check_device_filter(const struct usbredirfilter_rule *rules,
     int rules_count, libusb_device *dev, int flags);
 
+/* Device filter cache
+
+   A cache of the descriptor info which usbredirhost_check_device_filter_batch
+   needs per device, keyed by bus number and device address, so that checking
+   all devices of a machine again after a hotplug event does not need to read
+   and parse the active config descriptor of each of them.
+
+   Entries must be invalidated when the device they are for goes away, or
+   when its active configuration may have changed, e.g. after it has been
+   redirected, by calling usbredirhost_filter_cache_invalidate from a libusb
+   hotplug callback or after each libusb_get_device_list() call when hotplug
+   is not available. Invalidating a device which is not in the cache is
+   harmless. As an extra safety net an entry whose device descriptor info
+   does not match the device is refreshed.
+
+   The cache is not thread-safe, calls using the same cache must be
+   serialized by the caller. */
+struct usbredirhost_filter_cache;
+
+/* Returns a new, empty, cache or NULL when out of memory */
+struct usbredirhost_filter_cache *usbredirhost_filter_cache_new(void);
+
+/* Drop the cached info for dev, or for all devices when dev is NULL */
+void usbredirhost_filter_cache_invalidate(
+    struct usbredirhost_filter_cache *cache, libusb_device *dev);
+
+void usbredirhost_filter_cache_free(struct usbredirhost_filter_cache *cache);
+
+/* Check devs_count devices against a compiled filter rule set, storing the
+   result for devs[i] in results[i]. The results are what
+   usbredirhost_check_device_filter would return for the device. cache may
+   be NULL, in which case the descriptors of all devices are read.
+
+   Return value: the number of devices which are allowed, or -EINVAL when
+       compiled is NULL or devs_count is negative. */
+int usbredirhost_check_device_filter_batch(
+    const struct usbredirfilter_compiled *compiled,
+    struct usbredirhost_filter_cache *cache,
+    libusb_device **devs, int devs_count, int flags, int *results);
+
+/* Latency statistics
+
+   When enabled, usbredirhost timestamps the data packets it handles and
+   records how long they spend in each of the below stages of their lifecycle
+   in a histogram per endpoint type (usb_redir_type_control, _iso, _bulk and
+   _interrupt):
+
+   submit: from the usb-guest's packet being parsed until the transfer for it
+           is submitted to libusb (not recorded for iso / interrupt / bulk
+           receiving streams, as these are not submitted per guest packet)
+   device: from submitting a transfer until libusb reports its completion
+   queue:  from the transfer completion until the reply for the usb-guest is
+           queued for writing
+   write:  from the reply being queued until the write callback has written
+           its last byte, including the time spent behind packets queued
+           before it
+
+   The histograms are HDR-style: values are in nanoseconds, and there are
+   8 linear buckets per power of 2, giving a maximum relative error of 12.5%,
+   for values up to 2^40 ns, larger values are counted in the last bucket.
+   Use usbredirhost_latency_bucket_value to get the lower bound of a bucket. */
+enum {
+    usbredirhost_latency_stage_submit,
+    usbredirhost_latency_stage_device,
+    usbredirhost_latency_stage_queue,
+    usbredirhost_latency_stage_write,
+    usbredirhost_latency_stage_count,
+};
+
+#define USBREDIRHOST_LATENCY_BUCKETS 304
+
+struct usbredirhost_latency_histogram {
+    uint64_t count;
+    uint64_t min_ns;
+    uint64_t max_ns;
+    uint64_t sum_ns;
+    uint64_t bucket[USBREDIRHOST_LATENCY_BUCKETS];
+};
+
+/* Start collecting latency stats, this should be called directly after
+   usbredirhost_open. Collecting stats costs a few clock reads per packet,
+   when not enabled usbredirhost does not read the clock at all.
+   Returns 0 on success or -ENOMEM. */
+int usbredirhost_enable_latency_stats(struct usbredirhost *host);
+
+/* Clear all histograms (stats stay enabled) */
+void usbredirhost_reset_latency_stats(struct usbredirhost *host);
+
+/* Get a copy of the histogram for endpoint type type and stage stage.
+   Returns 0 on success, or -EINVAL if stats are not enabled or type or stage
+   are out of range. */
+int usbredirhost_get_latency_histogram(struct usbredirhost *host,
+    uint8_t type, int stage, struct usbredirhost_latency_histogram *hist_ret);
+
+/* Returns the lower bound in ns of values counted in bucket */
+uint64_t usbredirhost_latency_bucket_value(int bucket);
+
+/* Returns the value in ns below which percentile (0.0 - 100.0) percent of
+   the values in hist fall, or 0 for an empty histogram */
+uint64_t usbredirhost_latency_percentile(
+    const struct usbredirhost_latency_histogram *hist, double percentile);
+
+/* Packet capture
+
+   When enabled, usbredirhost records every transfer submission and
+   completion in the Linux usbmon binary format, as read by Wireshark and
+   tcpdump (pcap link-type LINKTYPE_USB_LINUX_MMAPPED). The records are put
+   in a lock-free ring buffer from the thread submitting / completing the
+   transfer, the ring gets emptied into a pcap file by the application
+   calling usbredirhost_drain_capture, typically from a separate writer
+   thread. When the ring is full records are dropped (and counted) rather
+   than blocking the USB traffic.
+
+   Data payloads are truncated to snaplen bytes. Each ring slot is sized for
+   a maximum size record, so the ring takes roughly
+   ring_size * (snaplen + 600) bytes of memory. */
+
+/* Start capturing, ring_size is the number of records the ring can hold
+   (rounded up to a power of 2). The ring is allocated on the first call
+   only, later calls resume a capture paused by usbredirhost_stop_capture
+   and their ring_size and snaplen are ignored.
+   Returns 0 on success, -EINVAL on invalid parameters or -ENOMEM. */
+int usbredirhost_start_capture(struct usbredirhost *host,
+    unsigned int ring_size, unsigned int snaplen);
+
+/* Pause capturing, records already in the ring can still be drained */
+void usbredirhost_stop_capture(struct usbredirhost *host);
+
+/* Called by usbredirhost_drain_capture to write count bytes of pcap data,
+   this should return count on success, any other value is treated as an
+   error. */
+typedef int (*usbredirhost_capture_write)(void *priv, const uint8_t *data,
+                                          int count);
+
+/* Write the records currently in the ring using write_func, the first call
+   also writes the pcap file header. Only one thread may call this function
+   at a time, but it may run concurrently with the USB traffic and with
+   usbredirhost_start_capture / usbredirhost_stop_capture. At most one
+   ring's worth of records is written per call, so that this returns under
+   sustained traffic.
+   Returns the number of records written, -EINVAL if capturing was never
+   started or -EIO if write_func failed (the record is lost in that case). */
+int usbredirhost_drain_capture(struct usbredirhost *host,
+    usbredirhost_capture_write write_func, void *priv);
+
+/* Returns the number of records dropped because the ring was full */
+uint64_t usbredirhost_get_capture_drops(struct usbredirhost *host);
+
 #ifdef __cplusplus
 }
 #endif
@@ -23,88 +23,213 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
-
-#ifdef WIN32
-#include "strtok_r.h"
-#define strtok_r  glibc_strtok_r
-#endif
+#include <limits.h>
 
 #include "usbredirfilter.h"
 
-USBREDIR_VISIBLE
-int usbredirfilter_string_to_rules(
-    const char *filter_str, const char *token_sep, const char *rule_sep,
-    struct usbredirfilter_rule **rules_ret, int *rules_count_ret)
+enum {
+    CHAR_OTHER,
+    CHAR_TOKEN_SEP,
+    CHAR_RULE_SEP,
+};
+
+/* Parse a number from [p, end) like strtol(p, &endptr, 0) followed by a
+   check that all of it got parsed does, including the conversion of the
+   long result to int, so that the results match those of the strtok / strtol
+   based parser this replaces. Returns 0 on success. */
+static int usbredirfilter_parse_int(const char *p, const char *end,
+                                    int *value_ret)
 {
-    char *rule, *rule_saveptr, *token, *token_saveptr, *ep;
-    struct usbredirfilter_rule *rules = NULL;
-    int i, rules_count, *values, ret = 0;
-    char *buf = NULL;
-    const char *r;
+    unsigned long acc = 0, limit;
+    int neg = 0, base = 10, digits = 0, overflow = 0, d;
+    long value;
 
-    if (strlen(token_sep) == 0 || strlen(rule_sep) == 0) {
-        return -EINVAL;
+    while (p < end && (*p == ' ' || (*p >= '\t' && *p <= '\r'))) {
+        p++;
+    }
+    if (p < end && (*p == '+' || *p == '-')) {
+        neg = (*p == '-');
+        p++;
+    }
+    if (p < end && *p == '0') {
+        if (end - p > 2 && (p[1] == 'x' || p[1] == 'X') &&
+                ((p[2] >= '0' && p[2] <= '9') ||
+                 ((p[2] | 0x20) >= 'a' && (p[2] | 0x20) <= 'f'))) {
+            base = 16;
+            p += 2;
+        } else {
+            base = 8;
+        }
+    }
+
+    limit = neg ? (unsigned long)LONG_MAX + 1 : (unsigned long)LONG_MAX;
+    for (; p < end; p++) {
+        if (*p >= '0' && *p <= '9') {
+            d = *p - '0';
+        } else if ((*p | 0x20) >= 'a' && (*p | 0x20) <= 'f') {
+            d = (*p | 0x20) - 'a' + 10;
+        } else {
+            break;
+        }
+        if (d >= base)
+            break;
+        digits++;
+        if (acc > (limit - d) / base) {
+            overflow = 1;
+        } else {
+            acc = acc * base + d;
+        }
     }
+    if (!digits || p != end)
+        return -1;
+
+    if (overflow)
+        value = neg ? LONG_MIN : LONG_MAX;
+    else
+        value = neg ? (long)(0UL - acc) : (long)acc;
+    *value_ret = (int)value;
+    return 0;
+}
+
+USBREDIR_VISIBLE
+int usbredirfilter_buf_to_rules(
+    const char *buf, int len, const char *token_sep, const char *rule_sep,
+    struct usbredirfilter_rule **rules_ret, int *rules_count_ret,
+    int *error_pos_ret)
+{
+    uint8_t chars[256] = { 0, };
+    struct usbredirfilter_rule *rules, *shrunk;
+    int token_pos[5], values[5];
+    int pos = 0, field, max_rules, rules_count = 0, error_pos = 0;
+    const char *p;
 
     *rules_ret = NULL;
     *rules_count_ret = 0;
+    if (error_pos_ret)
+        *error_pos_ret = -1;
 
-    /* Figure out how much rules there are in the file, so we know how
-       much memory we must allocate for the rules array.
-       Note this will come up with a slightly too large number if there are
-       empty rule strings in the set. */
-    r = filter_str;
-    rules_count = 0;
-    for (;;) {
-        r += strspn(r, rule_sep);
-        if (!*r) {
-            break;
-        }
-        rules_count++;
-        r += strcspn(r, rule_sep);
+    if (len < 0 || !*token_sep || !*rule_sep) {
+        return -EINVAL;
+    }
+
+    for (p = token_sep; *p; p++) {
+        chars[(uint8_t)*p] = CHAR_TOKEN_SEP;
+    }
+    for (p = rule_sep; *p; p++) {
+        chars[(uint8_t)*p] = CHAR_RULE_SEP;
     }
 
-    rules = calloc(rules_count, sizeof(struct usbredirfilter_rule));
+    /* A rule takes at least 9 characters plus a separator, so this is an
+       upper bound on the number of rules, the array gets shrunk at the end */
+    max_rules = len / 10 + 1;
+    rules = malloc(max_rules * sizeof(struct usbredirfilter_rule));
     if (!rules)
         return -ENOMEM;
 
-    /* Make a copy since strtok mangles the string */
-    buf = strdup(filter_str);
-    if (!buf) {
-        ret = -ENOMEM;
-        goto leave;
-    }
+    while (pos < len) {
+        if (chars[(uint8_t)buf[pos]] == CHAR_RULE_SEP) {
+            pos++;
+            continue;
+        }
 
-    /* And actually parse the string */
-    rules_count = 0;
-    rule = strtok_r(buf, rule_sep, &rule_saveptr);
-    while (rule) {
-        /* We treat the filter rule as an array of ints for easier parsing */
-        values = (int *)&rules[rules_count];
-        token = strtok_r(rule, token_sep, &token_saveptr);
-        for (i = 0; i < 5 && token; i++) {
-            values[i] = strtol(token, &ep, 0);
-            if (*ep)
-                break;
-            token = strtok_r(NULL, token_sep, &token_saveptr);
+        /* Parse a rule, treating the rule as an array of ints */
+        field = 0;
+        while (pos < len && chars[(uint8_t)buf[pos]] != CHAR_RULE_SEP) {
+            int token_start;
+
+            if (chars[(uint8_t)buf[pos]] == CHAR_TOKEN_SEP) {
+                pos++;
+                continue;
+            }
+            token_start = pos;
+            while (pos < len && chars[(uint8_t)buf[pos]] == CHAR_OTHER) {
+                pos++;
+            }
+            if (field == 5 ||
+                    usbredirfilter_parse_int(buf + token_start, buf + pos,
+                                             &values[field])) {
+                error_pos = token_start;
+                goto error;
+            }
+            token_pos[field++] = token_start;
         }
-        if (i != 5 || token != NULL ||
-                usbredirfilter_verify(&rules[rules_count], 1)) {
-            ret = -EINVAL;
-            goto leave;
+        if (field != 5) {
+            error_pos = pos;
+            goto error;
+        }
+
+        if (values[0] < -1 || values[0] > 255) {
+            error_pos = token_pos[0];
+            goto error;
         }
+        for (field = 1; field < 4; field++) {
+            if (values[field] < -1 || values[field] > 65535) {
+                error_pos = token_pos[field];
+                goto error;
+            }
+        }
+        if (rules_count == max_rules) { /* Cannot happen, see max_rules */
+            error_pos = pos;
+            goto error;
+        }
+        rules[rules_count].device_class = values[0];
+        rules[rules_count].vendor_id = values[1];
+        rules[rules_count].product_id = values[2];
+        rules[rules_count].device_version_bcd = values[3];
+        rules[rules_count].allow = values[4];
         rules_count++;
-        rule = strtok_r(NULL, rule_sep, &rule_saveptr);
+    }
+
+    if (rules_count < max_rules) {
+        shrunk = realloc(rules, (rules_count ? rules_count : 1) *
+                                sizeof(struct usbredirfilter_rule));
+        if (shrunk)
+            rules = shrunk;
     }
 
     *rules_ret = rules;
     *rules_count_ret = rules_count;
+    return 0;
 
-leave:
-    if (ret)
-        free(rules);
-    free(buf);
-    return ret;
+error:
+    free(rules);
+    if (error_pos_ret)
+        *error_pos_ret = error_pos;
+    return -EINVAL;
+}
+
+USBREDIR_VISIBLE
+int usbredirfilter_string_to_rules(
+    const char *filter_str, const char *token_sep, const char *rule_sep,
+    struct usbredirfilter_rule **rules_ret, int *rules_count_ret)
+{
+    size_t len = strlen(filter_str);
+
+    if (len > INT_MAX) {
+        *rules_ret = NULL;
+        *rules_count_ret = 0;
+        return -EINVAL;
+    }
+    return usbredirfilter_buf_to_rules(filter_str, len, token_sep, rule_sep,
+                                       rules_ret, rules_count_ret, NULL);
+}
+
+static const char usbredirfilter_hex[] = "0123456789abcdef";
+
+/* Write a -1 or the 0x prefixed value with the given amount of hex digits */
+static char *usbredirfilter_put_value(char *p, int value, int digits)
+{
+    if (value == -1) {
+        *p++ = '-';
+        *p++ = '1';
+        return p;
+    }
+    *p++ = '0';
+    *p++ = 'x';
+    while (digits--) {
+        *p++ = usbredirfilter_hex[(value >> (digits * 4)) & 0x0f];
+    }
+    return p;
 }
 
 USBREDIR_VISIBLE
@@ -128,34 +253,250 @@ char *usbredirfilter_rules_to_string(const struct usbredirfilter_rule *rules,
 
     p = str;
     for (i = 0; i < rules_count; i++) {
-        if (rules[i].device_class != -1)
-            p += sprintf(p, "0x%02x%c", rules[i].device_class, *token_sep);
-        else
-            p += sprintf(p, "-1%c", *token_sep);
+        p = usbredirfilter_put_value(p, rules[i].device_class, 2);
+        *p++ = *token_sep;
+        p = usbredirfilter_put_value(p, rules[i].vendor_id, 4);
+        *p++ = *token_sep;
+        p = usbredirfilter_put_value(p, rules[i].product_id, 4);
+        *p++ = *token_sep;
+        p = usbredirfilter_put_value(p, rules[i].device_version_bcd, 4);
+        *p++ = *token_sep;
+        *p++ = rules[i].allow ? '1' : '0';
+        if (i < rules_count - 1) {
+            *p++ = *rule_sep;
+        }
+    }
+    *p = '\0';
 
-        if (rules[i].vendor_id != -1)
-            p += sprintf(p, "0x%04x%c", rules[i].vendor_id, *token_sep);
-        else
-            p += sprintf(p, "-1%c", *token_sep);
+    return str;
+}
 
-        if (rules[i].product_id != -1)
-            p += sprintf(p, "0x%04x%c", rules[i].product_id, *token_sep);
-        else
-            p += sprintf(p, "-1%c", *token_sep);
+/* A compiled rule set indexes the rules by their (class, vendor, product)
+   key, with wildcards being a key value of their own. A lookup probes the
+   up to 8 keys which can match a device and takes the lowest rule index
+   found, which keeps the first match semantics of usbredirfilter_check().
+   For small rule sets trying the rules one by one is faster, these are only
+   copied. */
+#define COMPILED_LINEAR_MAX  16
+#define COMPILED_ANY_CLASS   0x100
+#define COMPILED_ANY_ID      0x10000
+#define COMPILED_KEY(c, v, p) \
+    (((uint64_t)(c) << 34) | ((uint64_t)(v) << 17) | (uint64_t)(p))
+
+struct usbredirfilter_compiled_rule {
+    int index;
+    int device_version_bcd;
+    int allow;
+};
+
+struct usbredirfilter_compiled_bucket {
+    uint64_t key;           /* UINT64_MAX for an empty bucket */
+    int first;              /* index into rules */
+    int count;
+};
+
+struct usbredirfilter_compiled {
+    /* Small rule sets, NULL when indexed */
+    struct usbredirfilter_rule *linear;
+    int linear_count;
+    /* The rules sorted by key and then by their original index */
+    struct usbredirfilter_compiled_rule *rules;
+    struct usbredirfilter_compiled_bucket *buckets;
+    uint32_t bucket_mask;
+    int bucket_shift;
+    /* Bit n set if some rule has key shape n: bit 0 any class, bit 1 any
+       vendor, bit 2 any product */
+    uint8_t shapes;
+};
+
+struct usbredirfilter_compile_entry {
+    uint64_t key;
+    int index;
+};
+
+static uint64_t usbredirfilter_rule_key(const struct usbredirfilter_rule *rule)
+{
+    return COMPILED_KEY(
+        rule->device_class == -1 ? COMPILED_ANY_CLASS : rule->device_class,
+        rule->vendor_id == -1 ? COMPILED_ANY_ID : rule->vendor_id,
+        rule->product_id == -1 ? COMPILED_ANY_ID : rule->product_id);
+}
 
-        if (rules[i].device_version_bcd != -1)
-            p += sprintf(p, "0x%04x%c", rules[i].device_version_bcd, *token_sep);
-        else
-            p += sprintf(p, "-1%c", *token_sep);
+static uint32_t usbredirfilter_key_hash(
+    const struct usbredirfilter_compiled *compiled, uint64_t key)
+{
+    return (key * 0x9e3779b97f4a7c15ull) >> compiled->bucket_shift;
+}
 
-        p += sprintf(p, "%d", rules[i].allow ? 1:0);
-        if (i < rules_count - 1) {
-            p += sprintf(p, "%c", *rule_sep);
+static int usbredirfilter_compile_entry_cmp(const void *a, const void *b)
+{
+    const struct usbredirfilter_compile_entry *x = a, *y = b;
+
+    if (x->key != y->key)
+        return x->key < y->key ? -1 : 1;
+    return x->index - y->index;
+}
+
+USBREDIR_VISIBLE
+int usbredirfilter_compile(const struct usbredirfilter_rule *rules,
+    int rules_count, struct usbredirfilter_compiled **compiled_ret)
+{
+    struct usbredirfilter_compiled *compiled;
+    struct usbredirfilter_compile_entry *entries = NULL;
+    uint32_t buckets = 1, h;
+    int i, j, bits = 0, ret = -ENOMEM;
+
+    *compiled_ret = NULL;
+
+    if (rules_count < 0 || usbredirfilter_verify(rules, rules_count))
+        return -EINVAL;
+    if (rules_count > (1 << 28))
+        return -ENOMEM;
+
+    /* Keep the load factor below 0.5, counting keys with duplicates */
+    while (buckets < 2 * (uint32_t)rules_count || buckets < 2) {
+        buckets <<= 1;
+        bits++;
+    }
+
+    compiled = calloc(1, sizeof(*compiled));
+    if (!compiled)
+        return -ENOMEM;
+
+    if (rules_count <= COMPILED_LINEAR_MAX) {
+        compiled->linear = malloc((rules_count ? rules_count : 1) *
+                                  sizeof(*rules));
+        if (!compiled->linear)
+            goto leave;
+        if (rules_count)
+            memcpy(compiled->linear, rules, rules_count * sizeof(*rules));
+        compiled->linear_count = rules_count;
+        *compiled_ret = compiled;
+        return 0;
+    }
+
+    compiled->bucket_mask = buckets - 1;
+    compiled->bucket_shift = 64 - bits;
+    compiled->rules = calloc(rules_count ? rules_count : 1,
+                             sizeof(*compiled->rules));
+    compiled->buckets = malloc(buckets * sizeof(*compiled->buckets));
+    entries = calloc(rules_count ? rules_count : 1, sizeof(*entries));
+    if (!compiled->rules || !compiled->buckets || !entries)
+        goto leave;
+
+    for (i = 0; i < rules_count; i++) {
+        entries[i].key = usbredirfilter_rule_key(&rules[i]);
+        entries[i].index = i;
+        compiled->shapes |= 1 << ((rules[i].device_class == -1) |
+                                  (rules[i].vendor_id == -1) << 1 |
+                                  (rules[i].product_id == -1) << 2);
+    }
+    qsort(entries, rules_count, sizeof(*entries),
+          usbredirfilter_compile_entry_cmp);
+
+    for (h = 0; h < buckets; h++) {
+        compiled->buckets[h].key = UINT64_MAX;
+    }
+    for (i = 0; i < rules_count; i = j) {
+        for (j = i; j < rules_count && entries[j].key == entries[i].key; j++) {
+            const struct usbredirfilter_rule *rule = &rules[entries[j].index];
+
+            compiled->rules[j].index = entries[j].index;
+            compiled->rules[j].device_version_bcd = rule->device_version_bcd;
+            compiled->rules[j].allow = rule->allow;
+        }
+        h = usbredirfilter_key_hash(compiled, entries[i].key);
+        while (compiled->buckets[h].key != UINT64_MAX) {
+            h = (h + 1) & compiled->bucket_mask;
         }
+        compiled->buckets[h].key = entries[i].key;
+        compiled->buckets[h].first = i;
+        compiled->buckets[h].count = j - i;
     }
-    *p = '\0';
 
-    return str;
+    *compiled_ret = compiled;
+    compiled = NULL;
+    ret = 0;
+leave:
+    free(entries);
+    usbredirfilter_free_compiled(compiled);
+    return ret;
+}
+
+USBREDIR_VISIBLE
+void usbredirfilter_free_compiled(struct usbredirfilter_compiled *compiled)
+{
+    if (!compiled)
+        return;
+    free(compiled->linear);
+    free(compiled->rules);
+    free(compiled->buckets);
+    free(compiled);
+}
+
+static const struct usbredirfilter_compiled_bucket *usbredirfilter_lookup(
+    const struct usbredirfilter_compiled *compiled, uint64_t key)
+{
+    uint32_t h = usbredirfilter_key_hash(compiled, key);
+
+    while (compiled->buckets[h].key != key) {
+        if (compiled->buckets[h].key == UINT64_MAX)
+            return NULL;
+        h = (h + 1) & compiled->bucket_mask;
+    }
+    return &compiled->buckets[h];
+}
+
+static int usbredirfilter_check1(const struct usbredirfilter_rule *rules,
+    int rules_count, uint8_t device_class, uint16_t vendor_id,
+    uint16_t product_id, uint16_t device_version_bcd, int default_allow);
+
+static int usbredirfilter_check1_compiled(
+    const struct usbredirfilter_compiled *compiled, uint8_t device_class,
+    uint16_t vendor_id, uint16_t product_id, uint16_t device_version_bcd,
+    int default_allow)
+{
+    const struct usbredirfilter_compiled_rule *match = NULL;
+    int shape, i;
+
+    if (compiled->linear)
+        return usbredirfilter_check1(compiled->linear, compiled->linear_count,
+                                     device_class, vendor_id, product_id,
+                                     device_version_bcd, default_allow);
+
+    for (shape = 0; shape < 8; shape++) {
+        const struct usbredirfilter_compiled_bucket *bucket;
+
+        if (!(compiled->shapes & (1 << shape)))
+            continue;
+
+        bucket = usbredirfilter_lookup(compiled, COMPILED_KEY(
+            (shape & 1) ? COMPILED_ANY_CLASS : device_class,
+            (shape & 2) ? COMPILED_ANY_ID : vendor_id,
+            (shape & 4) ? COMPILED_ANY_ID : product_id));
+        if (!bucket)
+            continue;
+
+        /* The rules of a bucket are in rule order, so the first one
+           matching the version is the only candidate from this bucket */
+        for (i = bucket->first; i < bucket->first + bucket->count; i++) {
+            const struct usbredirfilter_compiled_rule *rule =
+                &compiled->rules[i];
+
+            if (match && rule->index > match->index)
+                break;
+            if (rule->device_version_bcd == -1 ||
+                    rule->device_version_bcd == device_version_bcd) {
+                match = rule;
+                break;
+            }
+        }
+    }
+
+    if (match)
+        return match->allow ? 0 : -EPERM;
+
+    return default_allow ? 0 : -ENOENT;
 }
 
 static int usbredirfilter_check1(const struct usbredirfilter_rule *rules,
@@ -181,9 +522,11 @@ static int usbredirfilter_check1(const struct usbredirfilter_rule *rules,
     return default_allow ? 0 : -ENOENT;
 }
 
-USBREDIR_VISIBLE
-int usbredirfilter_check(
+/* The passes of usbredirfilter_check(), using either the rules as is or a
+   compiled rule set */
+static int usbredirfilter_check_passes(
     const struct usbredirfilter_rule *rules, int rules_count,
+    const struct usbredirfilter_compiled *compiled,
     uint8_t device_class, uint8_t device_subclass, uint8_t device_protocol,
     uint8_t *interface_class, uint8_t *interface_subclass,
     uint8_t *interface_protocol, int interface_count,
@@ -192,12 +535,14 @@ int usbredirfilter_check(
 {
     int i, rc, num_skipped=0;
 
-    if (usbredirfilter_verify(rules, rules_count))
-        return -EINVAL;
-
     /* Check the device_class */
     if (device_class != 0x00 && device_class != 0xef) {
-        rc = usbredirfilter_check1(rules, rules_count, device_class,
+        if (compiled)
+            rc = usbredirfilter_check1_compiled(compiled, device_class,
+                                   vendor_id, product_id, device_version_bcd,
+                                   flags & usbredirfilter_fl_default_allow);
+        else
+            rc = usbredirfilter_check1(rules, rules_count, device_class,
                                    vendor_id, product_id, device_version_bcd,
                                    flags & usbredirfilter_fl_default_allow);
         if (rc)
@@ -212,7 +557,12 @@ int usbredirfilter_check(
             num_skipped++;
             continue;
         }
-        rc = usbredirfilter_check1(rules, rules_count, interface_class[i],
+        if (compiled)
+            rc = usbredirfilter_check1_compiled(compiled, interface_class[i],
+                                   vendor_id, product_id, device_version_bcd,
+                                   flags & usbredirfilter_fl_default_allow);
+        else
+            rc = usbredirfilter_check1(rules, rules_count, interface_class[i],
                                    vendor_id, product_id, device_version_bcd,
                                    flags & usbredirfilter_fl_default_allow);
         if (rc)
@@ -224,7 +574,7 @@ int usbredirfilter_check(
      * skipping (usbredirfilter_fl_dont_skip_non_boot_hid)
      */
     if (interface_count > 0 && num_skipped == interface_count) {
-        rc = usbredirfilter_check(rules, rules_count,
+        rc = usbredirfilter_check_passes(rules, rules_count, compiled,
                                   device_class, device_subclass, device_protocol,
                                   interface_class, interface_subclass,
                                   interface_protocol, interface_count,
@@ -236,6 +586,46 @@ int usbredirfilter_check(
     return 0;
 }
 
+USBREDIR_VISIBLE
+int usbredirfilter_check(
+    const struct usbredirfilter_rule *rules, int rules_count,
+    uint8_t device_class, uint8_t device_subclass, uint8_t device_protocol,
+    uint8_t *interface_class, uint8_t *interface_subclass,
+    uint8_t *interface_protocol, int interface_count,
+    uint16_t vendor_id, uint16_t product_id, uint16_t device_version_bcd,
+    int flags)
+{
+    if (usbredirfilter_verify(rules, rules_count))
+        return -EINVAL;
+
+    return usbredirfilter_check_passes(rules, rules_count, NULL,
+                                       device_class, device_subclass,
+                                       device_protocol, interface_class,
+                                       interface_subclass, interface_protocol,
+                                       interface_count, vendor_id, product_id,
+                                       device_version_bcd, flags);
+}
+
+USBREDIR_VISIBLE
+int usbredirfilter_check_compiled(
+    const struct usbredirfilter_compiled *compiled,
+    uint8_t device_class, uint8_t device_subclass, uint8_t device_protocol,
+    uint8_t *interface_class, uint8_t *interface_subclass,
+    uint8_t *interface_protocol, int interface_count,
+    uint16_t vendor_id, uint16_t product_id, uint16_t device_version_bcd,
+    int flags)
+{
+    if (!compiled)
+        return -EINVAL;
+
+    return usbredirfilter_check_passes(NULL, 0, compiled,
+                                       device_class, device_subclass,
+                                       device_protocol, interface_class,
+                                       interface_subclass, interface_protocol,
+                                       interface_count, vendor_id, product_id,
+                                       device_version_bcd, flags);
+}
+
 USBREDIR_VISIBLE
 int usbredirfilter_verify(
     const struct usbredirfilter_rule *rules, int rules_count)
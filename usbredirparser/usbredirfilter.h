@@ -61,6 +61,23 @@ int usbredirfilter_string_to_rules(
     const char *filter_str, const char *token_sep, const char *rule_sep,
     struct usbredirfilter_rule **rules_ret, int *rules_count_ret);
 
+/* Like usbredirfilter_string_to_rules(), but parse the len bytes at buf,
+   which do not need to be 0 terminated, in a single pass without copying
+   them first.
+
+   When error_pos_ret is not NULL it is set to the offset in buf of the
+   offending token when -EINVAL gets returned because of a parsing error, or
+   to the offset of the end of the rule when a rule has too few fields. It is
+   set to -1 for all other return values.
+
+   Return value: 0 on success, -ENOMEM when allocating the rules array fails,
+       or -EINVAL when there is a parsing error or an invalid argument.
+*/
+int usbredirfilter_buf_to_rules(
+    const char *buf, int len, const char *token_sep, const char *rule_sep,
+    struct usbredirfilter_rule **rules_ret, int *rules_count_ret,
+    int *error_pos_ret);
+
 /* Convert a set of rules back to a string suitable for passing to
    usbredirfilter_string_to_rules(); The returned string must be
    usbredirfilter_free()-ed by the caller when it is done with it.
@@ -122,6 +139,43 @@ int usbredirfilter_check(
     uint16_t vendor_id, uint16_t product_id, uint16_t device_version_bcd,
     int flags);
 
+/* A rule set compiled for fast checking, see usbredirfilter_compile() */
+struct usbredirfilter_compiled;
+
+/* Verify a set of rules and compile them into an index for checking many
+   devices against the same rules. The rules are copied, so the rules array
+   may be freed afterwards.
+
+   Checking a device with usbredirfilter_check_compiled() gives exactly the
+   same result as usbredirfilter_check() with the original rules, but does
+   not verify the rules again and looks up the matching rules by the device's
+   vendor id, product id and class instead of trying them one by one, which
+   makes a difference with large rule sets.
+
+   On success the compiled rule set gets returned in compiled_ret and must be
+   freed with usbredirfilter_free_compiled() when the caller is done with it.
+
+   Return value: 0 on success, -EINVAL when some rules fail verification,
+       or -ENOMEM when allocating memory fails.
+*/
+int usbredirfilter_compile(const struct usbredirfilter_rule *rules,
+    int rules_count, struct usbredirfilter_compiled **compiled_ret);
+
+/* Like usbredirfilter_check(), using a compiled rule set.
+
+   Return value: see usbredirfilter_check()
+*/
+int usbredirfilter_check_compiled(
+    const struct usbredirfilter_compiled *compiled,
+    uint8_t device_class, uint8_t device_subclass, uint8_t device_protocol,
+    uint8_t *interface_class, uint8_t *interface_subclass,
+    uint8_t *interface_protocol, int interface_count,
+    uint16_t vendor_id, uint16_t product_id, uint16_t device_version_bcd,
+    int flags);
+
+/* Free a compiled rule set, passing NULL is allowed */
+void usbredirfilter_free_compiled(struct usbredirfilter_compiled *compiled);
+
 /* Sanity check the passed in rules
 
    Return value: 0 on success, -EINVAL when some values are out of bound. */
@@ -21,6 +21,8 @@
 #include "config.h"
 
 #include <assert.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -30,6 +32,7 @@
 #include "usbredirproto-compat.h"
 #include "usbredirparser.h"
 #include "usbredirfilter.h"
+#include "usbredirtrace.h"
 
 /* Put *some* upper limit on bulk transfer sizes */
 #define MAX_BULK_TRANSFER_SIZE (128u * 1024u * 1024u)
@@ -39,6 +42,10 @@
  */
 #define MAX_PACKET_SIZE (1024u + MAX_BULK_TRANSFER_SIZE)
 
+USBREDIR_TRACE_SEMAPHORE(parse);
+USBREDIR_TRACE_SEMAPHORE(queue);
+USBREDIR_TRACE_SEMAPHORE(write);
+
 /* Locking convenience macros */
 #define LOCK(parser) \
     do { \
@@ -56,6 +63,9 @@ struct usbredirparser_buf {
     uint8_t *buf;
     int pos;
     int len;
+    bool adopted; /* buf points into adopted_state, see unserialize_adopt */
+    uint32_t type;
+    uint64_t tag; /* See usbredirparser_set_write_tag_funcs, 0: none */
 
     struct usbredirparser_buf *next;
 };
@@ -63,6 +73,7 @@ struct usbredirparser_buf {
 struct usbredirparser_priv {
     struct usbredirparser callb;
     int flags;
+    int verbose;
 
     int have_peer_caps;
     uint32_t our_caps[USB_REDIR_CAPS_SIZE];
@@ -85,6 +96,10 @@ struct usbredirparser_priv {
     int write_buf_count;
     struct usbredirparser_buf *write_buf;
     uint64_t write_buf_total_size;
+    usbredirparser_write_tag write_tag_func;
+    usbredirparser_written written_func;
+    uint8_t *adopted_state;
+    int adopted_refs; /* The number of write buffers in adopted_state */
 };
 
 static void
@@ -107,10 +122,27 @@ va_log(struct usbredirparser_priv *parser, int verbose, const char *fmt, ...)
     parser->callb.log_func(parser->callb.priv, verbose, buf);
 }
 
-#define ERROR(...)   va_log(parser, usbredirparser_error, __VA_ARGS__)
-#define WARNING(...) va_log(parser, usbredirparser_warning, __VA_ARGS__)
-#define INFO(...)    va_log(parser, usbredirparser_info, __VA_ARGS__)
-#define DEBUG(...)    va_log(parser, usbredirparser_debug, __VA_ARGS__)
+/* Check the level before calling va_log, so that the arguments of messages
+   which won't get logged are not evaluated and nothing gets formatted */
+#define LOG(level, ...) \
+    do { \
+        if ((level) <= parser->verbose) \
+            va_log(parser, (level), __VA_ARGS__); \
+    } while (0)
+
+#define ERROR(...)   LOG(usbredirparser_error, __VA_ARGS__)
+#define WARNING(...) LOG(usbredirparser_warning, __VA_ARGS__)
+#define INFO(...)    LOG(usbredirparser_info, __VA_ARGS__)
+#ifdef DISABLE_DEBUG_LOG
+/* Still let the compiler see (and type check) the arguments */
+#define DEBUG(...) \
+    do { \
+        if (0) \
+            va_log(parser, usbredirparser_debug, __VA_ARGS__); \
+    } while (0)
+#else
+#define DEBUG(...)   LOG(usbredirparser_debug, __VA_ARGS__)
+#endif
 
 static inline void
 usbredirparser_assert_invariants(const struct usbredirparser_priv *parser)
@@ -144,6 +176,20 @@ usbredirparser_assert_invariants(const struct usbredirparser_priv *parser)
 #endif
 }
 
+/* Frees the data of a write buffer, with the lock held if there is one */
+static void usbredirparser_free_wbuf_data(struct usbredirparser_priv *parser,
+    struct usbredirparser_buf *wbuf)
+{
+    if (!wbuf->adopted) {
+        free(wbuf->buf);
+        return;
+    }
+    if (--parser->adopted_refs == 0) {
+        free(parser->adopted_state);
+        parser->adopted_state = NULL;
+    }
+}
+
 #if 0 /* Can be enabled and called from random place to test serialization */
 static void serialize_test(struct usbredirparser *parser_pub)
 {
@@ -159,7 +205,7 @@ static void serialize_test(struct usbredirparser *parser_pub)
     wbuf = parser->write_buf;
     while (wbuf) {
         next_wbuf = wbuf->next;
-        free(wbuf->buf);
+        usbredirparser_free_wbuf_data(parser, wbuf);
         free(wbuf);
         wbuf = next_wbuf;
     }
@@ -184,7 +230,39 @@ static int usbredirparser_caps_get_cap(struct usbredirparser_priv *parser,
 USBREDIR_VISIBLE
 struct usbredirparser *usbredirparser_create(void)
 {
-    return calloc(1, sizeof(struct usbredirparser_priv));
+    struct usbredirparser_priv *parser;
+
+    parser = calloc(1, sizeof(struct usbredirparser_priv));
+    if (!parser)
+        return NULL;
+
+    /* Pass everything to log_func by default, as older versions did */
+    parser->verbose = usbredirparser_debug_data;
+
+    return (struct usbredirparser *)parser;
+}
+
+USBREDIR_VISIBLE
+void usbredirparser_set_verbose(struct usbredirparser *parser_pub, int verbose)
+{
+    struct usbredirparser_priv *parser =
+        (struct usbredirparser_priv *)parser_pub;
+
+    parser->verbose = verbose;
+}
+
+USBREDIR_VISIBLE
+void usbredirparser_set_write_tag_funcs(struct usbredirparser *parser_pub,
+    usbredirparser_write_tag write_tag_func,
+    usbredirparser_written written_func)
+{
+    struct usbredirparser_priv *parser =
+        (struct usbredirparser_priv *)parser_pub;
+
+    LOCK(parser);
+    parser->write_tag_func = written_func ? write_tag_func : NULL;
+    parser->written_func = written_func;
+    UNLOCK(parser);
 }
 
 static void usbredirparser_verify_caps(struct usbredirparser_priv *parser,
@@ -242,7 +320,7 @@ void usbredirparser_destroy(struct usbredirparser *parser_pub)
     wbuf = parser->write_buf;
     while (wbuf) {
         next_wbuf = wbuf->next;
-        free(wbuf->buf);
+        usbredirparser_free_wbuf_data(parser, wbuf);
         free(wbuf);
         wbuf = next_wbuf;
     }
@@ -837,6 +915,72 @@ static int usbredirparser_verify_type_header(
     return 1; /* Verify ok */
 }
 
+#ifdef ENABLE_USDT
+/* Get the probe arguments for the packet with the passed in (wire format)
+   header and type header. ep and status are only meaningful for data
+   packets, for other packet types they are set to -1. */
+static void usbredirparser_trace_args(struct usbredirparser *parser_pub,
+    const void *header, const uint8_t *type_header, int send,
+    int *ep, uint64_t *id, int *len, int *status, uint32_t *type)
+{
+    const struct usb_redir_header *h = header;
+    int type_header_len;
+
+    *type = h->type;
+    *ep = -1;
+    *status = -1;
+    /* Our hello may have been queued before we knew which id size to use */
+    if (h->type == usb_redir_hello)
+        *id = 0;
+    else if (usbredirparser_using_32bits_ids(parser_pub))
+        *id = ((const struct usb_redir_header_32bit_id *)header)->id;
+    else
+        *id = h->id;
+
+    type_header_len =
+        usbredirparser_get_type_header_len(parser_pub, h->type, send);
+    *len = (type_header_len < 0) ? 0 : (int)h->length - type_header_len;
+
+    switch (h->type) {
+    case usb_redir_control_packet: {
+        const struct usb_redir_control_packet_header *c =
+            (const struct usb_redir_control_packet_header *)type_header;
+        *ep = c->endpoint;
+        *status = c->status;
+        break;
+    }
+    case usb_redir_bulk_packet: {
+        const struct usb_redir_bulk_packet_header *b =
+            (const struct usb_redir_bulk_packet_header *)type_header;
+        *ep = b->endpoint;
+        *status = b->status;
+        break;
+    }
+    case usb_redir_iso_packet: {
+        const struct usb_redir_iso_packet_header *i =
+            (const struct usb_redir_iso_packet_header *)type_header;
+        *ep = i->endpoint;
+        *status = i->status;
+        break;
+    }
+    case usb_redir_interrupt_packet: {
+        const struct usb_redir_interrupt_packet_header *i =
+            (const struct usb_redir_interrupt_packet_header *)type_header;
+        *ep = i->endpoint;
+        *status = i->status;
+        break;
+    }
+    case usb_redir_buffered_bulk_packet: {
+        const struct usb_redir_buffered_bulk_packet_header *b =
+            (const struct usb_redir_buffered_bulk_packet_header *)type_header;
+        *ep = b->endpoint;
+        *status = b->status;
+        break;
+    }
+    }
+}
+#endif
+
 static void usbredirparser_call_type_func(struct usbredirparser *parser_pub,
     bool *data_ownership_transferred)
 {
@@ -947,12 +1091,15 @@ static void usbredirparser_call_type_func(struct usbredirparser *parser_pub,
         break;
     case usb_redir_filter_filter: {
         struct usbredirfilter_rule *rules;
-        int r, count;
+        int r, count, error_pos;
 
-        r = usbredirfilter_string_to_rules((char *)parser->data, ",", "|",
-                                           &rules, &count);
+        /* The data is 0 terminated, see usbredirparser_verify_type_header */
+        r = usbredirfilter_buf_to_rules((char *)parser->data,
+                                        strlen((char *)parser->data), ",", "|",
+                                        &rules, &count, &error_pos);
         if (r) {
-            ERROR("error parsing filter (%d), ignoring filter message", r);
+            ERROR("error parsing filter (%d) at offset %d, ignoring filter message",
+                  r, error_pos);
             break;
         }
         parser->callb.filter_filter_func(parser->callb.priv, rules, count);
@@ -1118,6 +1265,19 @@ int usbredirparser_do_read(struct usbredirparser *parser_pub)
                          parser->data, parser->data_len, 0);
                 data_ownership_transferred = false;
                 if (r) {
+#ifdef ENABLE_USDT
+                    if (USBREDIR_TRACE_ENABLED(parse)) {
+                        int trace_ep, trace_len, trace_status;
+                        uint64_t trace_id;
+                        uint32_t trace_type;
+
+                        usbredirparser_trace_args(parser_pub, &parser->header,
+                            parser->type_header, 0, &trace_ep, &trace_id,
+                            &trace_len, &trace_status, &trace_type);
+                        USBREDIR_TRACE_PACKET(parse, trace_ep, trace_id,
+                            trace_len, trace_status, trace_type);
+                    }
+#endif
                     usbredirparser_call_type_func(parser_pub,
                                                   &data_ownership_transferred);
                 }
@@ -1180,9 +1340,26 @@ int usbredirparser_do_write(struct usbredirparser *parser_pub)
 
         wbuf->pos += w;
         if (wbuf->pos == wbuf->len) {
+#ifdef ENABLE_USDT
+            if (USBREDIR_TRACE_ENABLED(write)) {
+                int trace_ep, trace_len, trace_status;
+                uint64_t trace_id;
+                uint32_t trace_type;
+
+                usbredirparser_trace_args(parser_pub, wbuf->buf,
+                    wbuf->buf + usbredirparser_get_header_len(parser_pub), 1,
+                    &trace_ep, &trace_id, &trace_len, &trace_status,
+                    &trace_type);
+                USBREDIR_TRACE_PACKET(write, trace_ep, trace_id, trace_len,
+                                      trace_status, trace_type);
+            }
+#endif
+            if (wbuf->tag && parser->written_func)
+                parser->written_func(parser->callb.priv, wbuf->type,
+                                     wbuf->tag);
             parser->write_buf = wbuf->next;
             if (!(parser->flags & usbredirparser_fl_write_cb_owns_buffer))
-                free(wbuf->buf);
+                usbredirparser_free_wbuf_data(parser, wbuf);
 
             parser->write_buf_total_size -= wbuf->len;
             parser->write_buf_count--;
@@ -1256,7 +1433,24 @@ static void usbredirparser_queue(struct usbredirparser *parser_pub,
     memcpy(type_header_out, type_header_in, type_header_len);
     memcpy(data_out, data_in, data_len);
 
+#ifdef ENABLE_USDT
+    if (USBREDIR_TRACE_ENABLED(queue)) {
+        int trace_ep, trace_len, trace_status;
+        uint64_t trace_id;
+        uint32_t trace_type;
+
+        usbredirparser_trace_args(parser_pub, header, type_header_out, 1,
+            &trace_ep, &trace_id, &trace_len, &trace_status, &trace_type);
+        USBREDIR_TRACE_PACKET(queue, trace_ep, trace_id, trace_len,
+                              trace_status, trace_type);
+    }
+#endif
+
     LOCK(parser);
+    if (parser->write_tag_func) {
+        new_wbuf->type = type;
+        new_wbuf->tag = parser->write_tag_func(parser->callb.priv, type);
+    }
     if (!parser->write_buf) {
         parser->write_buf = new_wbuf;
     } else {
@@ -1560,7 +1754,10 @@ void usbredirparser_send_buffered_bulk_packet(struct usbredirparser *parser,
 
 /****** Serialization support ******/
 
-#define USBREDIRPARSER_SERIALIZE_BUF_SIZE     65536
+/* Pieces of state up to this size get gathered for the serialization sink,
+   larger ones, like most write buffers, get passed by reference */
+#define USBREDIRPARSER_SERIALIZE_GATHER_MAX     512
+#define USBREDIRPARSER_SERIALIZE_GATHER_SIZE   4096
 
 /* Serialization format, send and receiving endian are expected to be the same!
     uint32 MAGIC: 0x55525031 ascii: URP1 (UsbRedirParser version 1)
@@ -1581,86 +1778,235 @@ void usbredirparser_send_buffered_bulk_packet(struct usbredirparser *parser,
         uint8  write_buf_data[write_buf_len]
 */
 
-static int serialize_alloc(struct usbredirparser_priv *parser,
-                           uint8_t **state, uint8_t **pos,
-                           uint32_t *remain, uint32_t needed)
+/* Writes the state either into a buffer of the right size, or to a sink */
+struct usbredirparser_serializer {
+    struct usbredirparser_priv *parser;
+    uint8_t *pos;
+    usbredirparser_serialize_sink sink;
+    void *sink_priv;
+    int gathered;
+    uint8_t gather[USBREDIRPARSER_SERIALIZE_GATHER_SIZE];
+};
+
+/* The exact size of the serialized state, following the format above */
+static uint64_t serialize_size(struct usbredirparser_priv *parser)
 {
-    uint8_t *old_state = *state;
-    uint32_t used, size;
+    uint64_t size = 9 * sizeof(uint32_t);
 
-    if (*remain >= needed)
-        return 0;
+    size += USB_REDIR_CAPS_SIZE * sizeof(int32_t);
+    if (parser->have_peer_caps)
+        size += USB_REDIR_CAPS_SIZE * sizeof(int32_t);
+    size += parser->header_read + parser->type_header_read + parser->data_read;
+    /* Only the first write buffer can have been written partially */
+    size += parser->write_buf_count * sizeof(uint32_t);
+    size += parser->write_buf_total_size;
+    if (parser->write_buf)
+        size -= parser->write_buf->pos;
 
-    used = *pos - *state;
-    size = (used + needed + USBREDIRPARSER_SERIALIZE_BUF_SIZE - 1) &
-           ~(USBREDIRPARSER_SERIALIZE_BUF_SIZE - 1);
+    return size;
+}
 
-    *state = realloc(*state, size);
-    if (!*state) {
-        free(old_state);
-        ERROR("Out of memory allocating serialization buffer");
+static int serialize_flush(struct usbredirparser_serializer *s)
+{
+    struct usbredirparser_priv *parser = s->parser;
+    int gathered = s->gathered;
+
+    if (!gathered)
+        return 0;
+
+    s->gathered = 0;
+    if (s->sink(s->sink_priv, s->gather, gathered) != 0) {
+        ERROR("error passing serialized state to the sink");
         return -1;
     }
+    return 0;
+}
+
+static int serialize_bytes(struct usbredirparser_serializer *s,
+                           const void *data, uint32_t len)
+{
+    struct usbredirparser_priv *parser = s->parser;
+
+    if (len == 0)
+        return 0;
 
-    *pos = *state + used;
-    *remain = size - used;
+    if (s->pos) {
+        memcpy(s->pos, data, len);
+        s->pos += len;
+        return 0;
+    }
 
+    if (len > USBREDIRPARSER_SERIALIZE_GATHER_MAX) {
+        if (serialize_flush(s))
+            return -1;
+        if (s->sink(s->sink_priv, data, len) != 0) {
+            ERROR("error passing serialized state to the sink");
+            return -1;
+        }
+        return 0;
+    }
+
+    if (s->gathered + len > sizeof(s->gather) && serialize_flush(s))
+        return -1;
+    memcpy(s->gather + s->gathered, data, len);
+    s->gathered += len;
     return 0;
 }
 
-static int serialize_int(struct usbredirparser_priv *parser,
-                         uint8_t **state, uint8_t **pos, uint32_t *remain,
+static int serialize_int(struct usbredirparser_serializer *s,
                          uint32_t val, const char *desc)
 {
+    struct usbredirparser_priv *parser = s->parser;
+
     DEBUG("serializing int %08x : %s", val, desc);
 
-    if (serialize_alloc(parser, state, pos, remain, sizeof(uint32_t)))
+    return serialize_bytes(s, &val, sizeof(uint32_t));
+}
+
+static int serialize_data(struct usbredirparser_serializer *s,
+                          const uint8_t *data, uint32_t len, const char *desc)
+{
+    struct usbredirparser_priv *parser = s->parser;
+
+    DEBUG("serializing %d bytes of %s data", len, desc);
+    if (len >= 8)
+        DEBUG("First 8 bytes of %s: %02x %02x %02x %02x %02x %02x %02x %02x",
+              desc, data[0], data[1], data[2], data[3],
+                    data[4], data[5], data[6], data[7]);
+
+    if (serialize_bytes(s, &len, sizeof(uint32_t)))
         return -1;
 
-    memcpy(*pos, &val, sizeof(uint32_t));
-    *pos += sizeof(uint32_t);
-    *remain -= sizeof(uint32_t);
+    return serialize_bytes(s, data, len);
+}
 
-    return 0;
+/* Called with the lock held, len must be serialize_size() */
+static int serialize_state(struct usbredirparser_serializer *s, uint32_t len)
+{
+    struct usbredirparser_priv *parser = s->parser;
+    struct usbredirparser_buf *wbuf;
+
+    if (serialize_int(s, USBREDIRPARSER_SERIALIZE_MAGIC, "magic"))
+        return -1;
+
+    if (serialize_int(s, len, "length"))
+        return -1;
+
+    if (serialize_data(s, (uint8_t *)parser->our_caps,
+                       USB_REDIR_CAPS_SIZE * sizeof(int32_t), "our_caps"))
+        return -1;
+
+    if (parser->have_peer_caps) {
+        if (serialize_data(s, (uint8_t *)parser->peer_caps,
+                           USB_REDIR_CAPS_SIZE * sizeof(int32_t), "peer_caps"))
+            return -1;
+    } else {
+        if (serialize_int(s, 0, "peer_caps_len"))
+            return -1;
+    }
+
+    if (serialize_int(s, parser->to_skip, "skip"))
+        return -1;
+
+    if (serialize_data(s, (uint8_t *)&parser->header, parser->header_read,
+                       "header"))
+        return -1;
+
+    if (serialize_data(s, parser->type_header, parser->type_header_read,
+                       "type_header"))
+        return -1;
+
+    if (serialize_data(s, parser->data, parser->data_read, "packet-data"))
+        return -1;
+
+    if (serialize_int(s, parser->write_buf_count, "write_buf_count"))
+        return -1;
+
+    for (wbuf = parser->write_buf; wbuf; wbuf = wbuf->next) {
+        if (serialize_data(s, wbuf->buf + wbuf->pos, wbuf->len - wbuf->pos,
+                           "write-buf"))
+            return -1;
+    }
+
+    return s->sink ? serialize_flush(s) : 0;
 }
 
-static int unserialize_int(struct usbredirparser_priv *parser,
-                           uint8_t **pos, uint32_t *remain, uint32_t *val,
-                           const char *desc)
+USBREDIR_VISIBLE
+int usbredirparser_serialize(struct usbredirparser *parser_pub,
+                             uint8_t **state_dest, int *state_len)
 {
-    if (*remain < sizeof(uint32_t)) {
-        ERROR("error buffer underrun while unserializing state");
+    struct usbredirparser_priv *parser =
+        (struct usbredirparser_priv *)parser_pub;
+    struct usbredirparser_serializer s = { .parser = parser };
+    uint8_t *state;
+    uint64_t len;
+
+    *state_dest = NULL;
+    *state_len = 0;
+
+    LOCK(parser);
+    len = serialize_size(parser);
+    if (len > INT_MAX) {
+        ERROR("error serialized state of %" PRIu64 " bytes is too large", len);
+        UNLOCK(parser);
         return -1;
     }
-    memcpy(val, *pos, sizeof(uint32_t));
-    *pos += sizeof(uint32_t);
-    *remain -= sizeof(uint32_t);
+    state = malloc(len);
+    if (!state) {
+        ERROR("Out of memory allocating serialization buffer");
+        UNLOCK(parser);
+        return -1;
+    }
+    s.pos = state;
+    serialize_state(&s, len);
+    assert(s.pos == state + len);
+    UNLOCK(parser);
 
-    DEBUG("unserialized int %08x : %s", *val, desc);
+    *state_dest = state;
+    *state_len = len;
 
     return 0;
 }
 
-static int serialize_data(struct usbredirparser_priv *parser,
-                          uint8_t **state, uint8_t **pos, uint32_t *remain,
-                          uint8_t *data, uint32_t len, const char *desc)
+USBREDIR_VISIBLE
+int usbredirparser_serialize_to_sink(struct usbredirparser *parser_pub,
+    usbredirparser_serialize_sink sink, void *priv)
 {
-    DEBUG("serializing %d bytes of %s data", len, desc);
-    if (len >= 8)
-        DEBUG("First 8 bytes of %s: %02x %02x %02x %02x %02x %02x %02x %02x",
-              desc, data[0], data[1], data[2], data[3],
-                    data[4], data[5], data[6], data[7]);
+    struct usbredirparser_priv *parser =
+        (struct usbredirparser_priv *)parser_pub;
+    struct usbredirparser_serializer s = {
+        .parser = parser,
+        .sink = sink,
+        .sink_priv = priv,
+    };
+    uint64_t len;
+    int ret = -1;
 
-    if (serialize_alloc(parser, state, pos, remain, sizeof(uint32_t) + len))
-        return -1;
+    LOCK(parser);
+    len = serialize_size(parser);
+    if (len > INT_MAX) {
+        ERROR("error serialized state of %" PRIu64 " bytes is too large", len);
+    } else {
+        ret = serialize_state(&s, len);
+    }
+    UNLOCK(parser);
 
-    memcpy(*pos, &len, sizeof(uint32_t));
+    return ret;
+}
+
+static int unserialize_int(struct usbredirparser_priv *parser,
+                           uint8_t **pos, uint32_t *remain, uint32_t *val,
+                           const char *desc)
+{
+    if (*remain < sizeof(uint32_t)) {
+        ERROR("error buffer underrun while unserializing state");
+        return -1;
+    }
+    memcpy(val, *pos, sizeof(uint32_t));
     *pos += sizeof(uint32_t);
     *remain -= sizeof(uint32_t);
 
-    memcpy(*pos, data, len);
-    *pos += len;
-    *remain -= len;
+    DEBUG("unserialized int %08x : %s", *val, desc);
 
     return 0;
 }
@@ -1713,97 +2059,53 @@ static int unserialize_data(struct usbredirparser_priv *parser,
     return 0;
 }
 
-USBREDIR_VISIBLE
-int usbredirparser_serialize(struct usbredirparser *parser_pub,
-                             uint8_t **state_dest, int *state_len)
+/* Like unserialize_data(), but returns a pointer into the state instead of
+   copying the data */
+static int unserialize_data_ref(struct usbredirparser_priv *parser,
+                                uint8_t **pos, uint32_t *remain,
+                                uint8_t **data, uint32_t *len_out,
+                                const char *desc)
 {
-    struct usbredirparser_priv *parser =
-        (struct usbredirparser_priv *)parser_pub;
-    struct usbredirparser_buf *wbuf;
-    uint8_t *state = NULL, *pos = NULL;
-    uint32_t write_buf_count = 0, len, remain = 0;
-    ptrdiff_t write_buf_count_pos;
-
-    *state_dest = NULL;
-    *state_len = 0;
-
-    if (serialize_int(parser, &state, &pos, &remain,
-                                   USBREDIRPARSER_SERIALIZE_MAGIC, "magic"))
-        return -1;
-
-    /* To be replaced with length later */
-    if (serialize_int(parser, &state, &pos, &remain, 0, "length"))
-        return -1;
+    uint32_t len;
 
-    if (serialize_data(parser, &state, &pos, &remain,
-                       (uint8_t *)parser->our_caps,
-                       USB_REDIR_CAPS_SIZE * sizeof(int32_t), "our_caps"))
+    if (*remain < sizeof(uint32_t)) {
+        ERROR("error buffer underrun while unserializing state");
         return -1;
-
-    if (parser->have_peer_caps) {
-        if (serialize_data(parser, &state, &pos, &remain,
-                           (uint8_t *)parser->peer_caps,
-                           USB_REDIR_CAPS_SIZE * sizeof(int32_t), "peer_caps"))
-            return -1;
-    } else {
-        if (serialize_int(parser, &state, &pos, &remain, 0, "peer_caps_len"))
-            return -1;
     }
+    memcpy(&len, *pos, sizeof(uint32_t));
+    *pos += sizeof(uint32_t);
+    *remain -= sizeof(uint32_t);
 
-    if (serialize_int(parser, &state, &pos, &remain, parser->to_skip, "skip"))
-        return -1;
-
-    if (serialize_data(parser, &state, &pos, &remain,
-                       (uint8_t *)&parser->header, parser->header_read,
-                       "header"))
-        return -1;
-
-    if (serialize_data(parser, &state, &pos, &remain,
-                       parser->type_header, parser->type_header_read,
-                       "type_header"))
-        return -1;
-
-    if (serialize_data(parser, &state, &pos, &remain,
-                       parser->data, parser->data_read, "packet-data"))
-        return -1;
-
-    write_buf_count_pos = pos - state;
-    /* To be replaced with write_buf_count later */
-    if (serialize_int(parser, &state, &pos, &remain, 0, "write_buf_count"))
+    if (*remain < len) {
+        ERROR("error buffer underrun while unserializing state");
         return -1;
-
-    wbuf = parser->write_buf;
-    while (wbuf) {
-        if (serialize_data(parser, &state, &pos, &remain,
-                           wbuf->buf + wbuf->pos, wbuf->len - wbuf->pos,
-                           "write-buf"))
-            return -1;
-        write_buf_count++;
-        wbuf = wbuf->next;
     }
-    /* Patch in write_buf_count */
-    memcpy(state + write_buf_count_pos, &write_buf_count, sizeof(int32_t));
-
-    /* Patch in length */
-    len = pos - state;
-    memcpy(state + sizeof(int32_t), &len, sizeof(int32_t));
+    *data = *pos;
+    *pos += len;
+    *remain -= len;
+    *len_out = len;
 
-    *state_dest = state;
-    *state_len = len;
+    DEBUG("unserialized %d bytes of %s data in place", len, desc);
 
     return 0;
 }
 
-USBREDIR_VISIBLE
-int usbredirparser_unserialize(struct usbredirparser *parser_pub,
-                               uint8_t *state, int len)
+/* With adopt the write buffers point into state, unless the write callback
+   owns them, then they must be free-able one by one */
+static int usbredirparser_unserialize_state(struct usbredirparser *parser_pub,
+                                            uint8_t *state, int len,
+                                            bool adopt)
 {
     struct usbredirparser_priv *parser =
         (struct usbredirparser_priv *)parser_pub;
     struct usbredirparser_buf *wbuf, **next;
     uint32_t orig_caps[USB_REDIR_CAPS_SIZE];
-    uint8_t *data;
+    uint8_t *data, *state_start = state;
     uint32_t i, l, header_len, remain = len;
+    int r;
+
+    if (parser->flags & usbredirparser_fl_write_cb_owns_buffer)
+        adopt = false;
 
     usbredirparser_assert_invariants(parser);
     if (unserialize_int(parser, &state, &remain, &i, "magic")) {
@@ -1829,7 +2131,7 @@ int usbredirparser_unserialize(struct usbredirparser *parser_pub,
         struct usbredirparser_buf *wbuf = parser->write_buf;
         while (wbuf) {
             struct usbredirparser_buf *next_wbuf = wbuf->next;
-            free(wbuf->buf);
+            usbredirparser_free_wbuf_data(parser, wbuf);
             free(wbuf);
             wbuf = next_wbuf;
         }
@@ -1975,13 +2277,19 @@ int usbredirparser_unserialize(struct usbredirparser *parser_pub,
         uint8_t *buf = NULL;
 
         l = 0;
-        if (unserialize_data(parser, &state, &remain, &buf, &l, "wbuf")) {
+        if (adopt)
+            r = unserialize_data_ref(parser, &state, &remain, &buf, &l,
+                                     "wbuf");
+        else
+            r = unserialize_data(parser, &state, &remain, &buf, &l, "wbuf");
+        if (r) {
             usbredirparser_assert_invariants(parser);
             return -1;
         }
 
         if (l == 0) {
-            free(buf);
+            if (!adopt)
+                free(buf);
             ERROR("write buffer %d is empty", i);
             usbredirparser_assert_invariants(parser);
             return -1;
@@ -1989,13 +2297,19 @@ int usbredirparser_unserialize(struct usbredirparser *parser_pub,
 
         wbuf = calloc(1, sizeof(*wbuf));
         if (!wbuf) {
-            free(buf);
+            if (!adopt)
+                free(buf);
             ERROR("Out of memory allocating unserialize buffer");
             usbredirparser_assert_invariants(parser);
             return -1;
         }
         wbuf->buf = buf;
         wbuf->len = l;
+        if (adopt) {
+            wbuf->adopted = true;
+            parser->adopted_state = state_start;
+            parser->adopted_refs++;
+        }
         *next = wbuf;
         next = &wbuf->next;
         parser->write_buf_total_size += wbuf->len;
@@ -2012,3 +2326,25 @@ int usbredirparser_unserialize(struct usbredirparser *parser_pub,
     usbredirparser_assert_invariants(parser);
     return 0;
 }
+
+USBREDIR_VISIBLE
+int usbredirparser_unserialize(struct usbredirparser *parser_pub,
+                               uint8_t *state, int len)
+{
+    return usbredirparser_unserialize_state(parser_pub, state, len, false);
+}
+
+USBREDIR_VISIBLE
+int usbredirparser_unserialize_adopt(struct usbredirparser *parser_pub,
+                                     uint8_t *state, int len)
+{
+    struct usbredirparser_priv *parser =
+        (struct usbredirparser_priv *)parser_pub;
+    int ret;
+
+    ret = usbredirparser_unserialize_state(parser_pub, state, len, true);
+    /* Unless write buffers point into it, state is not needed anymore */
+    if (parser->adopted_state != state)
+        free(state);
+    return ret;
+}
@@ -202,6 +202,14 @@ struct usbredirparser {
    usbredirparser_init */
 struct usbredirparser *usbredirparser_create(void);
 
+/* Only log messages with a level <= verbose (see usbredirparser_log), other
+   messages are dropped before formatting them, so this should be used
+   instead of filtering in the log_func callback. The default is
+   usbredirparser_debug_data, passing all messages to log_func.
+   Note: debug messages are never logged if usbredir was build with
+   the debug-log option disabled. */
+void usbredirparser_set_verbose(struct usbredirparser *parser, int verbose);
+
 /* Set capability cap in the USB_REDIR_CAPS_SIZE sized caps array,
    this is a helper function to set capabilities in the caps array
    passed to usbredirparser_init(). */
@@ -250,6 +258,23 @@ int usbredirparser_has_data_to_write(struct usbredirparser *parser);
  * https://gitlab.freedesktop.org/spice/usbredir/-/issues/19 */ 
 uint64_t usbredirparser_get_bufferered_output_size(struct usbredirparser *parser_pub);
 
+/* Write notifications, e.g. to measure how long packets wait to be written.
+   When set, write_tag_func gets called for each packet being queued, with
+   its type (usb_redir_*), and the tag it returns gets stored with the
+   packet. Once usbredirparser_do_write has written the last byte of a
+   packet with a non 0 tag, it calls written_func with its type and tag.
+   Both get called with the parser's lock held, so they must not call back
+   into the parser. Packets which get dropped instead of written, and
+   packets queued before this was called or restored by
+   usbredirparser_unserialize, are not reported.
+   Pass NULL for both to stop. */
+typedef uint64_t (*usbredirparser_write_tag)(void *priv, uint32_t type);
+typedef void (*usbredirparser_written)(void *priv, uint32_t type,
+                                       uint64_t tag);
+void usbredirparser_set_write_tag_funcs(struct usbredirparser *parser,
+    usbredirparser_write_tag write_tag_func,
+    usbredirparser_written written_func);
+
 /* Call this when usbredirparser_has_data_to_write returns > 0
    returns 0 on success, -1 if a write error happened.
    If a write error happened, this function will retry writing any queued data
@@ -376,6 +401,24 @@ void usbredirparser_send_buffered_bulk_packet(struct usbredirparser *parser,
 int usbredirparser_serialize(struct usbredirparser *parser,
                              uint8_t **state_dest, int *state_len);
 
+/* Called by usbredirparser_serialize_to_sink() with consecutive pieces of
+   the serialized state. It gets called with the parser's lock held, so it
+   must not call other usbredirparser functions.
+
+   Return value: 0 to continue, -1 to abort the serialization. */
+typedef int (*usbredirparser_serialize_sink)(void *priv, const uint8_t *data,
+                                             int len);
+
+/* Like usbredirparser_serialize(), but instead of allocating a buffer and
+   copying everything into it, this passes the state to sink, the queued
+   write buffers by reference. Small pieces of the state get gathered into
+   larger ones first. The state is the same as the one of
+   usbredirparser_serialize(), its length is in the first piece.
+
+   Return value: 0 on success, -1 on error (sink failed). */
+int usbredirparser_serialize_to_sink(struct usbredirparser *parser,
+    usbredirparser_serialize_sink sink, void *priv);
+
 /* This function sets the current usbredirparser state from a serialized state.
    This function assumes that the parser has just been initialized with the
    usbredirparser_fl_no_hello flag.
@@ -385,6 +428,15 @@ int usbredirparser_serialize(struct usbredirparser *parser,
 int usbredirparser_unserialize(struct usbredirparser *parser_pub,
                                uint8_t *state, int len);
 
+/* Like usbredirparser_unserialize(), but this takes over state, which must
+   have been allocated with malloc(), also on error. Instead of copying the
+   queued write buffers out of state, they get written from state, which gets
+   freed once all of them have been written. When the parser was initialized
+   with usbredirparser_fl_write_cb_owns_buffer the write buffers must be
+   free-able one by one, so then they get copied anyway. */
+int usbredirparser_unserialize_adopt(struct usbredirparser *parser_pub,
+                                     uint8_t *state, int len);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,53 @@
+/* usbredirtrace.h USDT probe helpers, internal header, not installed
+
+   Copyright 2026 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+/* All probes live in the "usbredir" provider, see docs/tracing.md for the
+   list of probes and their arguments. When built without USDT support the
+   probes compile to nothing; with USDT support an unattached probe is a
+   single nop instruction, but note that the arguments still get evaluated.
+   Wrap argument preparation which is not free in
+   if (USBREDIR_TRACE_ENABLED(name)), which reads the probe's semaphore,
+   that tracers increment while attached.
+
+   Every probe needs its semaphore, define these with
+   USBREDIR_TRACE_SEMAPHORE(name); once at file scope of the .c file using
+   the probe. */
+#ifdef ENABLE_USDT
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define USBREDIR_TRACE(name, ep, id, len, status) \
+    DTRACE_PROBE4(usbredir, name, ep, id, len, status)
+#define USBREDIR_TRACE_PACKET(name, ep, id, len, status, type) \
+    DTRACE_PROBE5(usbredir, name, ep, id, len, status, type)
+#define USBREDIR_TRACE_ENABLED(name) \
+    __builtin_expect(usbredir_##name##_semaphore, 0)
+#define USBREDIR_TRACE_SEMAPHORE(name) \
+    __extension__ unsigned short usbredir_##name##_semaphore \
+    __attribute__((unused)) __attribute__((section(".probes"))) \
+    __attribute__((visibility("hidden")))
+#else
+#define USBREDIR_TRACE(name, ep, id, len, status) \
+    do { } while (0)
+#define USBREDIR_TRACE_PACKET(name, ep, id, len, status, type) \
+    do { } while (0)
+#define USBREDIR_TRACE_ENABLED(name) 0
+#define USBREDIR_TRACE_SEMAPHORE(name) \
+    struct usbredir_##name##_semaphore
+#endif
@@ -24,6 +24,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <string.h>
 #include <getopt.h>
 #include <inttypes.h>
@@ -32,12 +33,17 @@
 #include <poll.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <time.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/time.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <sys/un.h>
 #include "usbredirparser.h"
+#ifdef HAVE_SHM_TRANSPORT
+#include "usbredirshm.h"
+#endif
 
 /* Macros to go from an endpoint address to an index for our ep array */
 #define EP2I(ep_address) (((ep_address & 0x80) >> 3) | (ep_address & 0x0f))
@@ -74,6 +80,12 @@ static void usbredirtestclient_iso_packet(void *priv, uint64_t id,
 static void usbredirtestclient_interrupt_packet(void *priv, uint64_t id,
     struct usb_redir_interrupt_packet_header *interrupt_packet,
     uint8_t *data, int data_len);
+static void usbredirtestclient_bulk_receiving_status(void *priv, uint64_t id,
+    struct usb_redir_bulk_receiving_status_header *bulk_receiving_status);
+static void usbredirtestclient_buffered_bulk_packet(void *priv, uint64_t id,
+    struct usb_redir_buffered_bulk_packet_header *buffered_bulk_packet,
+    uint8_t *data, int data_len);
+static void usbredirtestclient_load_start(void);
 
 /* id's for all the test commands we send */
 enum {
@@ -85,14 +97,65 @@ enum {
    first_cmdline_id
 };
 
+/* Load generator mode, see usage() for the load specs */
+#define LOAD_MAX_SPECS 32
+#define LOAD_MAX_INFLIGHT 256
+/* Requests in flight are identified by their spec and slot */
+#define LOAD_ID(spec, slot) \
+    (first_cmdline_id + (spec) * LOAD_MAX_INFLIGHT + (slot))
+
+enum {
+    load_control,
+    load_bulk,
+    load_interrupt,
+    load_iso,
+    load_bulk_receiving,
+    load_alt,
+};
+
+static const char * const load_type_names[] = {
+    "control", "bulk", "interrupt", "iso", "bulk-receiving", "alt"
+};
+
+struct load_spec {
+    int type;
+    uint8_t ep;
+    /* requests in flight, for streams no_urbs / no_transfers */
+    int inflight;
+    /* request length, for iso streams pkts_per_urb */
+    uint32_t length;
+    uint8_t interface;
+    uint8_t alt;
+    uint64_t submit_time[LOAD_MAX_INFLIGHT];
+    /* results */
+    uint64_t completed;
+    uint64_t bytes;
+    uint64_t errors;
+    uint32_t *rtt_us;
+    size_t rtt_count;
+    size_t rtt_size;
+};
+
+static struct load_spec load_specs[LOAD_MAX_SPECS];
+static int load_spec_count;
+static double load_duration = 10.0;
+static uint64_t load_start_time, load_stop_time;
+static uint8_t *load_out_data;
+
 static int verbose = usbredirparser_info; /* 3 */
 static int client_fd, running = 1;
 static struct usbredirparser *parser;
 static int id = first_cmdline_id;
+#ifdef HAVE_SHM_TRANSPORT
+/* With shm:<path> client_fd is only used to receive the rings */
+static struct usbredirshm *shm;
+#endif
 
 static const struct option longopts[] = {
     { "port", required_argument, NULL, 'p' },
     { "verbose", required_argument, NULL, 'v' },
+    { "load", required_argument, NULL, 'l' },
+    { "duration", required_argument, NULL, 'd' },
     { "help", no_argument, NULL, 'h' },
     { NULL, 0, NULL, 0 }
 };
@@ -105,7 +168,20 @@ static void usbredirtestclient_log(void *priv, int level, const char *msg)
 
 static int usbredirtestclient_read(void *priv, uint8_t *data, int count)
 {
-    int r = read(client_fd, data, count);
+    int r;
+
+#ifdef HAVE_SHM_TRANSPORT
+    if (shm) {
+        r = usbredirshm_read(shm, data, count);
+        if (r == -EPIPE) { /* Server disconnected */
+            close(client_fd);
+            client_fd = -1;
+            return 0;
+        }
+        return r;
+    }
+#endif
+    r = read(client_fd, data, count);
     if (r < 0) {
         if (errno == EAGAIN)
             return 0;
@@ -120,7 +196,20 @@ static int usbredirtestclient_read(void *priv, uint8_t *data, int count)
 
 static int usbredirtestclient_write(void *priv, uint8_t *data, int count)
 {
-    int r = write(client_fd, data, count);
+    int r;
+
+#ifdef HAVE_SHM_TRANSPORT
+    if (shm) {
+        r = usbredirshm_write(shm, data, count);
+        if (r == -EPIPE) { /* Server disconnected */
+            close(client_fd);
+            client_fd = -1;
+            return 0;
+        }
+        return r;
+    }
+#endif
+    r = write(client_fd, data, count);
     if (r < 0) {
         if (errno == EAGAIN)
             return 0;
@@ -134,6 +223,14 @@ static int usbredirtestclient_write(void *priv, uint8_t *data, int count)
     return r;
 }
 
+static uint64_t get_time_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 static void usbredirtestclient_hello(void *priv,
     struct usb_redir_hello_header *h)
 {
@@ -146,27 +243,189 @@ static void usbredirtestclient_hello(void *priv,
 static void usage(int exit_code, char *argv0)
 {
     fprintf(exit_code? stderr:stdout,
-        "Usage: %s [-p|--port <port>] [-v|--verbose <0-3>] <server>\n",
+        "Usage: %s [-p|--port <port>] [-v|--verbose <0-3>]\n"
+        "       [-l|--load <spec> ...] [-d|--duration <secs>] <server>\n"
+        "\n"
+#ifdef HAVE_SHM_TRANSPORT
+        "<server> is a host name or address, or shm:<path> to use the shared\n"
+        "memory rings of usbredirect --as shm:<path>.\n"
+        "\n"
+#endif
+        "Without --load this sends a few test commands and then reads\n"
+        "control requests to send from stdin. With --load it generates load\n"
+        "on the device for --duration seconds (default 10) and then prints a\n"
+        "performance report. --load may be given multiple times, specs:\n"
+        "  control:<inflight>\n"
+        "      GET_DESCRIPTOR device requests, keeping <inflight> in flight\n"
+        "  bulk:<ep>:<inflight>:<length>\n"
+        "      bulk requests of <length> bytes to / from <ep>\n"
+        "  interrupt:<ep>[:<inflight>:<length>]\n"
+        "      interrupt receiving for an IN <ep>, requests for an OUT <ep>\n"
+        "  iso:<ep>:<pkts_per_urb>:<no_urbs>\n"
+        "      an iso stream from an IN <ep>\n"
+        "  bulk-receiving:<ep>:<bytes_per_transfer>:<no_transfers>\n"
+        "      bulk receiving from an IN <ep>\n"
+        "  alt:<interface>:<alt>\n"
+        "      select an alt setting before starting, e.g. for iso streams\n"
+        "Endpoints are given as address, e.g. 0x81.\n",
         argv0);
     exit(exit_code);
 }
 
+static int parse_load_spec(char *arg)
+{
+    struct load_spec *spec;
+    long val[3];
+    int i, count = 0, type;
+    char *str, *endptr;
+
+    if (load_spec_count == LOAD_MAX_SPECS) {
+        fprintf(stderr, "Too many load specs, max %d\n", LOAD_MAX_SPECS);
+        return -1;
+    }
+    spec = &load_specs[load_spec_count];
+
+    str = strchr(arg, ':');
+    if (!str) {
+        return -1;
+    }
+    *str++ = '\0';
+    for (type = 0; type <= load_alt; type++) {
+        if (!strcmp(arg, load_type_names[type]))
+            break;
+    }
+    if (type > load_alt) {
+        return -1;
+    }
+    while (count < 3) {
+        val[count++] = strtol(str, &endptr, 0);
+        if (endptr == str || val[count - 1] < 0) {
+            return -1;
+        }
+        if (*endptr == '\0')
+            break;
+        if (*endptr != ':') {
+            return -1;
+        }
+        str = endptr + 1;
+    }
+    if (*endptr != '\0') {
+        return -1;
+    }
+
+    spec->type = type;
+    switch (type) {
+    case load_control:
+        if (count != 1)
+            return -1;
+        spec->ep = 0x80;
+        spec->inflight = val[0];
+        break;
+    case load_interrupt:
+        if (count == 1 && (val[0] & 0x80)) {
+            spec->ep = val[0];
+            break;
+        }
+        /* fall through - interrupt OUT works like bulk OUT */
+    case load_bulk:
+        if (count != 3)
+            return -1;
+        spec->ep = val[0];
+        spec->inflight = val[1];
+        spec->length = val[2];
+        break;
+    case load_iso:
+    case load_bulk_receiving:
+        if (count != 3 || !(val[0] & 0x80))
+            return -1;
+        spec->ep = val[0];
+        spec->length = val[1];
+        spec->inflight = val[2];
+        break;
+    case load_alt:
+        if (count != 2)
+            return -1;
+        spec->interface = val[0];
+        spec->alt = val[1];
+        break;
+    }
+
+    if ((spec->ep & 0x7f) > 0x0f) {
+        return -1;
+    }
+    /* Everything but alt settings and interrupt receiving needs at least
+       one request / urb of some length */
+    if (spec->type != load_alt &&
+            !(spec->type == load_interrupt && (spec->ep & 0x80)) &&
+            (spec->inflight == 0 ||
+             (spec->type != load_control && spec->length == 0))) {
+        return -1;
+    }
+    if ((spec->type == load_control || spec->type == load_bulk ||
+         spec->type == load_interrupt) &&
+            spec->inflight > LOAD_MAX_INFLIGHT) {
+        fprintf(stderr, "At most %d requests can be in flight\n",
+                LOAD_MAX_INFLIGHT);
+        return -1;
+    }
+    for (i = 0; i < load_spec_count; i++) {
+        if (load_specs[i].type != load_alt && spec->type != load_alt &&
+                load_specs[i].ep == spec->ep) {
+            fprintf(stderr, "Multiple load specs for endpoint %02X\n",
+                    spec->ep);
+            return -1;
+        }
+    }
+    load_spec_count++;
+    return 0;
+}
+
 static void run_main_loop(void)
 {
     fd_set readfds, writefds;
+    struct timeval tv, *timeout;
     int n, nfds;
 
     while (running && client_fd != -1) {
+        timeout = NULL;
+        if (load_start_time) {
+            uint64_t now = get_time_ns();
+            uint64_t end = load_start_time + load_duration * 1000000000;
+
+            if (now >= end) {
+                break;
+            }
+            tv.tv_sec = (end - now) / 1000000000;
+            tv.tv_usec = ((end - now) % 1000000000) / 1000;
+            timeout = &tv;
+        }
+
         FD_ZERO(&readfds);
         FD_ZERO(&writefds);
 
         FD_SET(client_fd, &readfds);
+        nfds = client_fd + 1;
+#ifdef HAVE_SHM_TRANSPORT
+        /* The doorbell only rings for new data or when a full ring has
+           space again, so write what is queued before waiting for it */
+        if (shm) {
+            int fd = usbredirshm_get_fd(shm);
+
+            if (usbredirparser_has_data_to_write(parser) &&
+                    usbredirparser_do_write(parser)) {
+                break;
+            }
+            FD_SET(fd, &readfds);
+            if (fd >= nfds) {
+                nfds = fd + 1;
+            }
+        } else
+#endif
         if (usbredirparser_has_data_to_write(parser)) {
             FD_SET(client_fd, &writefds);
         }
-        nfds = client_fd + 1;
 
-        n = select(nfds, &readfds, &writefds, NULL, NULL);
+        n = select(nfds, &readfds, &writefds, NULL, timeout);
         if (n == -1) {
             if (errno == EINTR) {
                 continue;
@@ -175,6 +434,24 @@ static void run_main_loop(void)
             break;
         }
 
+#ifdef HAVE_SHM_TRANSPORT
+        if (shm) {
+            /* Nothing comes over the socket after the rings */
+            if (FD_ISSET(client_fd, &readfds)) {
+                break;
+            }
+            usbredirshm_ack(shm);
+            if (usbredirparser_do_read(parser)) {
+                break;
+            }
+            if (usbredirparser_has_data_to_write(parser) &&
+                    usbredirparser_do_write(parser)) {
+                break;
+            }
+            continue;
+        }
+#endif
+
         if (FD_ISSET(client_fd, &readfds)) {
             if (usbredirparser_do_read(parser)) {
                 break;
@@ -186,12 +463,99 @@ static void run_main_loop(void)
             }
         }
     }
+    if (load_start_time && !load_stop_time) {
+        load_stop_time = get_time_ns();
+    }
     if (client_fd != -1) { /* Broken out of the loop because of an error ? */
         close(client_fd);
         client_fd = -1;
     }
+#ifdef HAVE_SHM_TRANSPORT
+    usbredirshm_destroy(shm);
+    shm = NULL;
+#endif
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void usbredirtestclient_load_report(void)
+{
+    double secs;
+    int i;
+
+    if (!load_start_time) {
+        printf("load: the device never became ready, no results\n");
+        return;
+    }
+    secs = (load_stop_time - load_start_time) / 1e9;
+
+    printf("\n%-16s %4s %10s %12s %10s %10s %8s %8s %8s %8s\n",
+           "type", "ep", "transfers", "bytes", "xfers/s", "MB/s",
+           "p50 us", "p90 us", "p99 us", "errors");
+    for (i = 0; i < load_spec_count; i++) {
+        struct load_spec *spec = &load_specs[i];
+
+        if (spec->type == load_alt) {
+            continue;
+        }
+        printf("%-16s   %02X %10"PRIu64" %12"PRIu64" %10.1f %10.2f",
+               load_type_names[spec->type], spec->ep, spec->completed,
+               spec->bytes, spec->completed / secs,
+               spec->bytes / secs / 1000000);
+        if (spec->rtt_count) {
+            qsort(spec->rtt_us, spec->rtt_count, sizeof(uint32_t), cmp_u32);
+            printf(" %8u %8u %8u",
+                   spec->rtt_us[spec->rtt_count / 2],
+                   spec->rtt_us[spec->rtt_count * 9 / 10],
+                   spec->rtt_us[spec->rtt_count * 99 / 100]);
+        } else {
+            printf(" %8s %8s %8s", "-", "-", "-");
+        }
+        printf(" %8"PRIu64"\n", spec->errors);
+    }
+    printf("duration: %.2f s\n", secs);
 }
 
+#ifdef HAVE_SHM_TRANSPORT
+/* Connects to usbredirect --as shm:<path> and receives the rings, a path
+   starting with @ is an abstract socket name */
+static void connect_shm(const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    socklen_t addr_len = sizeof(addr);
+    int r;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        exit(1);
+    }
+    strcpy(addr.sun_path, path);
+    if (path[0] == '@') {
+        addr.sun_path[0] = '\0';
+        addr_len = offsetof(struct sockaddr_un, sun_path) + strlen(path);
+    }
+
+    client_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (client_fd == -1 ||
+            connect(client_fd, (struct sockaddr *)&addr, addr_len) != 0) {
+        fprintf(stderr, "Could not connect to: %s: %s\n", path,
+                strerror(errno));
+        exit(1);
+    }
+    r = usbredirshm_receive(client_fd, &shm);
+    if (r != 0) {
+        fprintf(stderr, "Could not set up the shared memory: %s\n",
+                strerror(-r));
+        exit(1);
+    }
+}
+#endif
+
 static void quit_handler(int sig)
 {
     running = 0;
@@ -207,7 +571,7 @@ int main(int argc, char *argv[])
     int port = 4000;
     uint32_t caps[USB_REDIR_CAPS_SIZE] = { 0, };
 
-    while ((o = getopt_long(argc, argv, "hp:", longopts, NULL)) != -1) {
+    while ((o = getopt_long(argc, argv, "hp:v:l:d:", longopts, NULL)) != -1) {
         switch (o) {
         case 'p':
             port = strtol(optarg, &endptr, 10);
@@ -223,6 +587,19 @@ int main(int argc, char *argv[])
                 usage(1, argv[0]);
             }
             break;
+        case 'l':
+            if (parse_load_spec(optarg) != 0) {
+                fprintf(stderr, "Invalid load spec: '%s'\n", optarg);
+                usage(1, argv[0]);
+            }
+            break;
+        case 'd':
+            load_duration = strtod(optarg, &endptr);
+            if (*endptr != '\0' || load_duration <= 0) {
+                fprintf(stderr, "Invalid value for --duration: '%s'\n", optarg);
+                usage(1, argv[0]);
+            }
+            break;
         case '?':
         case 'h':
             usage(o == '?', argv[0]);
@@ -247,6 +624,13 @@ int main(int argc, char *argv[])
     sigaction(SIGTERM, &act, NULL);
     sigaction(SIGQUIT, &act, NULL);
 
+#ifdef HAVE_SHM_TRANSPORT
+    if (strncmp(server, "shm:", 4) == 0) {
+        connect_shm(server + 4);
+        goto connected;
+    }
+#endif
+
     memset(&hints, 0, sizeof(hints));
     hints.ai_flags = AI_ADDRCONFIG;
 #ifdef  AI_NUMERICSERV
@@ -279,6 +663,10 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
+#ifdef HAVE_SHM_TRANSPORT
+connected:
+#endif
+
     flags = fcntl(client_fd, F_GETFL);
     if (flags == -1) {
         perror("fcntl F_GETFL");
@@ -294,6 +682,7 @@ int main(int argc, char *argv[])
     if (!parser) {
         exit(1);
     }
+    usbredirparser_set_verbose(parser, verbose);
     parser->log_func = usbredirtestclient_log;
     parser->read_func = usbredirtestclient_read;
     parser->write_func = usbredirtestclient_write;
@@ -311,17 +700,244 @@ int main(int argc, char *argv[])
     parser->bulk_packet_func = usbredirtestclient_bulk_packet;
     parser->iso_packet_func = usbredirtestclient_iso_packet;
     parser->interrupt_packet_func = usbredirtestclient_interrupt_packet;
+    parser->bulk_receiving_status_func = usbredirtestclient_bulk_receiving_status;
+    parser->buffered_bulk_packet_func = usbredirtestclient_buffered_bulk_packet;
 
     usbredirparser_caps_set_cap(caps, usb_redir_cap_ep_info_max_packet_size);
     usbredirparser_caps_set_cap(caps, usb_redir_cap_64bits_ids);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_32bits_bulk_length);
+    usbredirparser_caps_set_cap(caps, usb_redir_cap_bulk_receiving);
 
     usbredirparser_init(parser, TESTCLIENT_VERSION, caps, USB_REDIR_CAPS_SIZE, 0);
 
     run_main_loop();
 
+    if (load_spec_count) {
+        usbredirtestclient_load_report();
+    }
+
     exit(0);
 }
 
+static struct load_spec *load_find_spec(int type, uint8_t ep)
+{
+    int i;
+
+    for (i = 0; i < load_spec_count; i++) {
+        if (load_specs[i].type == type && load_specs[i].ep == ep)
+            return &load_specs[i];
+    }
+    return NULL;
+}
+
+static void load_submit(int i, int slot)
+{
+    struct load_spec *spec = &load_specs[i];
+    uint64_t load_id = LOAD_ID(i, slot);
+
+    spec->submit_time[slot] = get_time_ns();
+    switch (spec->type) {
+    case load_control: {
+        struct usb_redir_control_packet_header control_packet = {
+            .endpoint = 0x80,
+            .request = 0x06, /* GET_DESCRIPTOR */
+            .requesttype = 0x80,
+            .value = 0x01 << 8, /* DT_DEVICE */
+            .index = 0,
+            .length = 18,
+        };
+        usbredirparser_send_control_packet(parser, load_id, &control_packet,
+                                           NULL, 0);
+        break;
+    }
+    case load_bulk: {
+        struct usb_redir_bulk_packet_header bulk_packet = {
+            .endpoint = spec->ep,
+            .length = spec->length & 0xffff,
+            .length_high = spec->length >> 16,
+            .stream_id = 0,
+        };
+        usbredirparser_send_bulk_packet(parser, load_id, &bulk_packet,
+            (spec->ep & 0x80) ? NULL : load_out_data,
+            (spec->ep & 0x80) ? 0 : spec->length);
+        break;
+    }
+    case load_interrupt: {
+        struct usb_redir_interrupt_packet_header interrupt_packet = {
+            .endpoint = spec->ep,
+            .length = spec->length,
+        };
+        usbredirparser_send_interrupt_packet(parser, load_id,
+            &interrupt_packet, load_out_data, spec->length);
+        break;
+    }
+    }
+}
+
+/* Account a completed request and submit the next one on its slot */
+static void load_complete(uint64_t id, uint8_t status, uint32_t len)
+{
+    struct load_spec *spec;
+    uint64_t now = get_time_ns();
+    int i, slot;
+
+    if (id < LOAD_ID(0, 0) || id >= LOAD_ID(load_spec_count, 0)) {
+        fprintf(stderr, "load: unexpected packet id: %"PRIu64"\n", id);
+        return;
+    }
+    i = (id - LOAD_ID(0, 0)) / LOAD_MAX_INFLIGHT;
+    slot = (id - LOAD_ID(0, 0)) % LOAD_MAX_INFLIGHT;
+    spec = &load_specs[i];
+
+    if (status == usb_redir_success) {
+        spec->completed++;
+        spec->bytes += len;
+        if (spec->rtt_count == spec->rtt_size) {
+            size_t size = spec->rtt_size ? spec->rtt_size * 2 : 4096;
+            uint32_t *rtt_us = realloc(spec->rtt_us, size * sizeof(uint32_t));
+            if (rtt_us) {
+                spec->rtt_us = rtt_us;
+                spec->rtt_size = size;
+            }
+        }
+        if (spec->rtt_count < spec->rtt_size) {
+            spec->rtt_us[spec->rtt_count++] =
+                (now - spec->submit_time[slot]) / 1000;
+        }
+    } else {
+        spec->errors++;
+    }
+
+    if (running && !load_stop_time) {
+        load_submit(i, slot);
+    }
+}
+
+/* Account a packet received from a stream */
+static void load_stream_packet(int type, uint8_t ep, uint8_t status, int len)
+{
+    struct load_spec *spec = load_find_spec(type, ep);
+
+    if (!spec || load_stop_time) {
+        return;
+    }
+    if (status == usb_redir_success) {
+        spec->completed++;
+        spec->bytes += len;
+    } else {
+        spec->errors++;
+    }
+}
+
+static void load_stream_status(int type, uint8_t ep, uint8_t status)
+{
+    struct load_spec *spec = load_find_spec(type, ep);
+
+    if (!spec || status == usb_redir_success) {
+        return;
+    }
+    fprintf(stderr, "load: %s stream on endpoint %02X failed, status: %d\n",
+            load_type_names[type], ep, status);
+    spec->errors++;
+}
+
+static void usbredirtestclient_load_start(void)
+{
+    uint32_t max_length = 0;
+    int i, slot;
+
+    for (i = 0; i < load_spec_count; i++) {
+        struct load_spec *spec = &load_specs[i];
+
+        if (spec->length > 0xffff && spec->type == load_bulk &&
+                !usbredirparser_peer_has_cap(parser,
+                                        usb_redir_cap_32bits_bulk_length)) {
+            fprintf(stderr, "load: the server does not support bulk "
+                    "transfers larger then 65535 bytes\n");
+            running = 0;
+            return;
+        }
+        if (spec->type == load_bulk_receiving &&
+                !usbredirparser_peer_has_cap(parser,
+                                        usb_redir_cap_bulk_receiving)) {
+            fprintf(stderr, "load: the server does not support bulk "
+                    "receiving\n");
+            running = 0;
+            return;
+        }
+        if ((spec->type == load_bulk || spec->type == load_interrupt) &&
+                spec->length > max_length) {
+            max_length = spec->length;
+        }
+    }
+
+    load_out_data = calloc(1, max_length ? max_length : 1);
+    if (!load_out_data) {
+        fprintf(stderr, "Out of memory!\n");
+        running = 0;
+        return;
+    }
+
+    /* Alt settings first, the server handles packets in order */
+    for (i = 0; i < load_spec_count; i++) {
+        struct load_spec *spec = &load_specs[i];
+        struct usb_redir_set_alt_setting_header set_alt = {
+            .interface = spec->interface,
+            .alt = spec->alt,
+        };
+
+        if (spec->type == load_alt) {
+            usbredirparser_send_set_alt_setting(parser, LOAD_ID(i, 0),
+                                                &set_alt);
+        }
+    }
+
+    printf("load: running for %.1f seconds\n", load_duration);
+    load_start_time = get_time_ns();
+    for (i = 0; i < load_spec_count; i++) {
+        struct load_spec *spec = &load_specs[i];
+
+        switch (spec->type) {
+        case load_control:
+        case load_bulk:
+        case load_interrupt:
+            if (spec->type == load_interrupt && (spec->ep & 0x80)) {
+                struct usb_redir_start_interrupt_receiving_header start = {
+                    .endpoint = spec->ep,
+                };
+                usbredirparser_send_start_interrupt_receiving(parser,
+                    LOAD_ID(i, 0), &start);
+                break;
+            }
+            for (slot = 0; slot < spec->inflight; slot++) {
+                load_submit(i, slot);
+            }
+            break;
+        case load_iso: {
+            struct usb_redir_start_iso_stream_header start = {
+                .endpoint = spec->ep,
+                .pkts_per_urb = spec->length,
+                .no_urbs = spec->inflight,
+            };
+            usbredirparser_send_start_iso_stream(parser, LOAD_ID(i, 0),
+                                                 &start);
+            break;
+        }
+        case load_bulk_receiving: {
+            struct usb_redir_start_bulk_receiving_header start = {
+                .stream_id = 0,
+                .endpoint = spec->ep,
+                .bytes_per_transfer = spec->length,
+                .no_transfers = spec->inflight,
+            };
+            usbredirparser_send_start_bulk_receiving(parser, LOAD_ID(i, 0),
+                                                     &start);
+            break;
+        }
+        }
+    }
+}
+
 static void usbredirtestclient_cmdline_help(void)
 {
     printf("Available commands:\n"
@@ -478,7 +1094,10 @@ static void usbredirtestclient_device_connect(void *priv,
 
 static void usbredirtestclient_device_disconnect(void *priv)
 {
-    printf("device disconnected");
+    if (load_start_time && !load_stop_time) {
+        load_stop_time = get_time_ns();
+    }
+    printf("device disconnected\n");
     close(client_fd);
     client_fd = -1;
 }
@@ -553,10 +1172,24 @@ static void usbredirtestclient_alt_setting_status(void *priv, uint64_t id,
         printf("Set alt: %d, interface: %d, status: %d\n",
                alt_setting_status->alt, alt_setting_status->interface,
                alt_setting_status->status);
-        /* Auto tests done, go interactive */
-        usbredirtestclient_cmdline_parse();
+        /* Auto tests done, go interactive or start generating load */
+        if (load_spec_count) {
+            usbredirtestclient_load_start();
+        } else {
+            usbredirtestclient_cmdline_parse();
+        }
         break;
     default:
+        if (load_spec_count) {
+            if (alt_setting_status->status != usb_redir_success) {
+                fprintf(stderr, "load: set alt %d on interface %d failed, "
+                        "status: %d\n", alt_setting_status->alt,
+                        alt_setting_status->interface,
+                        alt_setting_status->status);
+                running = 0;
+            }
+            break;
+        }
         fprintf(stderr, "Unexpected alt status packet, id: %"PRIu64"\n", id);
     }
 }
@@ -564,11 +1197,22 @@ static void usbredirtestclient_alt_setting_status(void *priv, uint64_t id,
 static void usbredirtestclient_iso_stream_status(void *priv, uint64_t id,
     struct usb_redir_iso_stream_status_header *iso_stream_status)
 {
+    load_stream_status(load_iso, iso_stream_status->endpoint,
+                       iso_stream_status->status);
 }
 
 static void usbredirtestclient_interrupt_receiving_status(void *priv, uint64_t id,
     struct usb_redir_interrupt_receiving_status_header *interrupt_receiving_status)
 {
+    load_stream_status(load_interrupt, interrupt_receiving_status->endpoint,
+                       interrupt_receiving_status->status);
+}
+
+static void usbredirtestclient_bulk_receiving_status(void *priv, uint64_t id,
+    struct usb_redir_bulk_receiving_status_header *bulk_receiving_status)
+{
+    load_stream_status(load_bulk_receiving, bulk_receiving_status->endpoint,
+                       bulk_receiving_status->status);
 }
 
 static void usbredirtestclient_bulk_streams_status(void *priv, uint64_t id,
@@ -581,6 +1225,13 @@ static void usbredirtestclient_control_packet(void *priv, uint64_t id,
     uint8_t *data, int data_len)
 {
     int i;
+
+    if (load_spec_count) {
+        load_complete(id, control_packet->status, data_len);
+        usbredirparser_free_packet_data(parser, data);
+        return;
+    }
+
     printf("Control packet id: %"PRIu64", status: %d", id,
            control_packet->status);
 
@@ -601,16 +1252,45 @@ static void usbredirtestclient_bulk_packet(void *priv, uint64_t id,
     struct usb_redir_bulk_packet_header *bulk_packet,
     uint8_t *data, int data_len)
 {
+    if (load_spec_count) {
+        load_complete(id, bulk_packet->status,
+                      (uint32_t)bulk_packet->length_high << 16 |
+                      bulk_packet->length);
+    }
+    usbredirparser_free_packet_data(parser, data);
 }
 
 static void usbredirtestclient_iso_packet(void *priv, uint64_t id,
     struct usb_redir_iso_packet_header *iso_packet,
     uint8_t *data, int data_len)
 {
+    load_stream_packet(load_iso, iso_packet->endpoint, iso_packet->status,
+                       data_len);
+    usbredirparser_free_packet_data(parser, data);
 }
 
 static void usbredirtestclient_interrupt_packet(void *priv, uint64_t id,
     struct usb_redir_interrupt_packet_header *interrupt_packet,
     uint8_t *data, int data_len)
 {
+    if (!(interrupt_packet->endpoint & 0x80)) {
+        /* Completion of an interrupt OUT request */
+        if (load_spec_count) {
+            load_complete(id, interrupt_packet->status,
+                          interrupt_packet->length);
+        }
+    } else {
+        load_stream_packet(load_interrupt, interrupt_packet->endpoint,
+                           interrupt_packet->status, data_len);
+    }
+    usbredirparser_free_packet_data(parser, data);
+}
+
+static void usbredirtestclient_buffered_bulk_packet(void *priv, uint64_t id,
+    struct usb_redir_buffered_bulk_packet_header *buffered_bulk_packet,
+    uint8_t *data, int data_len)
+{
+    load_stream_packet(load_bulk_receiving, buffered_bulk_packet->endpoint,
+                       buffered_bulk_packet->status, data_len);
+    usbredirparser_free_packet_data(parser, data);
 }